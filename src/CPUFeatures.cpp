@@ -0,0 +1,76 @@
+/*
+    Copyright 2016-2019 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include "CPUFeatures.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CPUFEATURES_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+
+namespace CPUFeatures
+{
+
+#ifdef CPUFEATURES_X86
+
+// ECX of CPUID leaf 1
+u32 ReadFeatureFlags()
+{
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuid(regs, 1);
+    return (u32)regs[2];
+#else
+    u32 eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return ecx;
+#endif
+}
+
+u32 FeatureFlags()
+{
+    // initialized once, on first use (thread-safe)
+    static const u32 flags = ReadFeatureFlags();
+    return flags;
+}
+
+bool HasSSE41()
+{
+    return (FeatureFlags() & (1 << 19)) != 0;
+}
+
+bool HasPCLMULQDQ()
+{
+    // SSE2 is implied by any CPU that has it
+    return (FeatureFlags() & (1 << 1)) != 0;
+}
+
+#else
+
+bool HasSSE41() { return false; }
+bool HasPCLMULQDQ() { return false; }
+
+#endif
+
+}
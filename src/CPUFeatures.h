@@ -0,0 +1,35 @@
+/*
+    Copyright 2016-2019 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef CPUFEATURES_H
+#define CPUFEATURES_H
+
+#include "types.h"
+
+// runtime detection of the x86 instruction set extensions the SIMD paths use
+// the SIMD code is compiled regardless of the compiler's arch flags, and is
+// only run if the CPU supports it. always false on other architectures
+namespace CPUFeatures
+{
+
+bool HasSSE41();
+bool HasPCLMULQDQ();
+
+}
+
+#endif // CPUFEATURES_H
@@ -16,54 +16,379 @@
     with melonDS. If not, see http://www.gnu.org/licenses/.
 */
 
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
 #include "CRC32.h"
+#include "Platform.h"
 
-// http://www.codeproject.com/KB/recipes/crc32_large.aspx
+// standard CRC32 (zlib, PNG, etc), reflected polynomial 0xEDB88320
+// the internal functions work on the raw CRC register, ie. before/after the final inversion
 
-u32 crctable[256];
-bool tableinited = false;
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CRC32_PCLMUL
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#include "CPUFeatures.h"
+#ifdef _MSC_VER
+#define CRC32_TARGET_PCLMUL
+#else
+#define CRC32_TARGET_PCLMUL __attribute__((target("sse2,pclmul")))
+#endif
+#endif
 
-u32 _reflect(u32 refl, char ch)
+#if defined(__ARM_FEATURE_CRC32)
+#define CRC32_ARM
+#include <arm_acle.h>
+#endif
+
+
+const u32 kPoly = 0xEDB88320;
+
+// slice-by-16: table N gives the CRC of a byte followed by N zero bytes
+u32 crctable[16][256];
+
+// x^(2^n) mod P, for CRC combination
+u32 x2ntable[32];
+
+// the tables are built on first use, several threads may get there at once
+std::once_flag initflag;
+
+u32 CRC32_Slice16(u32 crc, u8* data, u32 len);
+u32 (*CRC32_Func)(u32 crc, u8* data, u32 len) = CRC32_Slice16;
+
+
+void _inittable()
 {
-    u32 value = 0;
+    for (int i = 0; i < 0x100; i++)
+    {
+        u32 crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ ((crc & 1) ? kPoly : 0);
 
-    for(int i = 1; i < (ch + 1); i++)
+        crctable[0][i] = crc;
+    }
+
+    for (int i = 0; i < 0x100; i++)
     {
-        if (refl & 1)
-            value |= 1 << (ch - i);
-        refl >>= 1;
+        for (int t = 1; t < 16; t++)
+        {
+            u32 prev = crctable[t-1][i];
+            crctable[t][i] = (prev >> 8) ^ crctable[0][prev & 0xFF];
+        }
     }
+}
 
-	return value;
+// multiplies a and b modulo P, in the reflected domain
+u32 _multmodp(u32 a, u32 b)
+{
+    u32 m = 1U << 31;
+    u32 p = 0;
+
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+
+        m >>= 1;
+        b = (b & 1) ? ((b >> 1) ^ kPoly) : (b >> 1);
+    }
+
+    return p;
 }
 
-void _inittable()
+// x^(n * 2^k) mod P
+u32 _x2nmodp(u32 n, u32 k)
 {
-	u32 polynomial = 0x04C11DB7;
+    u32 p = 1U << 31; // x^0
 
-	for (int i = 0; i < 0x100; i++)
+    while (n)
     {
-        crctable[i] = _reflect(i, 8) << 24;
+        if (n & 1)
+            p = _multmodp(x2ntable[k & 31], p);
 
-        for (int j = 0; j < 8; j++)
-            crctable[i] = (crctable[i] << 1) ^ (crctable[i] & (1 << 31) ? polynomial : 0);
+        n >>= 1;
+        k++;
+    }
+
+    return p;
+}
+
+void _initx2n()
+{
+    u32 p = 1U << 30; // x^1
+    x2ntable[0] = p;
+
+    for (int n = 1; n < 32; n++)
+        x2ntable[n] = p = _multmodp(p, p);
+}
+
+
+u32 CRC32_Slice16(u32 crc, u8* data, u32 len)
+{
+    while (len >= 16)
+    {
+        u32 a = crc ^ *(u32*)&data[0];
+        u32 b = *(u32*)&data[4];
+        u32 c = *(u32*)&data[8];
+        u32 d = *(u32*)&data[12];
+
+        crc = crctable[15][a & 0xFF] ^ crctable[14][(a >> 8) & 0xFF] ^ crctable[13][(a >> 16) & 0xFF] ^ crctable[12][a >> 24] ^
+              crctable[11][b & 0xFF] ^ crctable[10][(b >> 8) & 0xFF] ^ crctable[9][(b >> 16) & 0xFF]  ^ crctable[8][b >> 24] ^
+              crctable[7][c & 0xFF]  ^ crctable[6][(c >> 8) & 0xFF]  ^ crctable[5][(c >> 16) & 0xFF]  ^ crctable[4][c >> 24] ^
+              crctable[3][d & 0xFF]  ^ crctable[2][(d >> 8) & 0xFF]  ^ crctable[1][(d >> 16) & 0xFF]  ^ crctable[0][d >> 24];
+
+        data += 16;
+        len -= 16;
+    }
+
+    while (len--)
+        crc = (crc >> 8) ^ crctable[0][(crc ^ *data++) & 0xFF];
+
+    return crc;
+}
+
+#ifdef CRC32_PCLMUL
+
+// folding with carry-less multiplies, as described in Intel's "Fast CRC Computation
+// for Generic Polynomials Using PCLMULQDQ Instruction" (Gopal et al, 2009)
+// the constants are the bit-reflected x^n mod P values given at the end of the paper
+CRC32_TARGET_PCLMUL
+u32 CRC32_PCLMULQDQ(u32 crc, u8* data, u32 len)
+{
+    if (len < 64)
+        return CRC32_Slice16(crc, data, len);
+
+    const __m128i k1k2 = _mm_setr_epi32(0x54442BD4, 0x1, 0xC6E41596, 0x1);
+    const __m128i k3k4 = _mm_setr_epi32(0x751997D0, 0x1, 0xCCAA009E, 0x0);
+    const __m128i k5k0 = _mm_setr_epi32(0x63CD6124, 0x1, 0x0, 0x0);
+    const __m128i poly = _mm_setr_epi32(0xDB710641, 0x1, 0xF7011641, 0x1);
+    const __m128i mask = _mm_setr_epi32(-1, 0, -1, 0);
+
+    u32 rest = len & 0xF;
+    len -= rest;
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((__m128i*)&data[0x00]);
+    x2 = _mm_loadu_si128((__m128i*)&data[0x10]);
+    x3 = _mm_loadu_si128((__m128i*)&data[0x20]);
+    x4 = _mm_loadu_si128((__m128i*)&data[0x30]);
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+    data += 64;
+    len -= 64;
+
+    // fold 4x128 bits at a time
+    x0 = k1k2;
+    while (len >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((__m128i*)&data[0x00]));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((__m128i*)&data[0x10]));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((__m128i*)&data[0x20]));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((__m128i*)&data[0x30]));
+
+        data += 64;
+        len -= 64;
+    }
+
+    // fold down to 128 bits
+    x0 = k3k4;
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
 
-        crctable[i] = _reflect(crctable[i],  32);
+    while (len >= 16)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((__m128i*)data)), x5);
+
+        data += 16;
+        len -= 16;
     }
+
+    // 128 bits -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x0 = k5k0;
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = poly;
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = (u32)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+
+    return CRC32_Slice16(crc, data, rest);
 }
 
-u32 CRC32(u8 *data, int len)
+#endif // CRC32_PCLMUL
+
+#ifdef CRC32_ARM
+
+u32 CRC32_ARMv8(u32 crc, u8* data, u32 len)
 {
-    if (!tableinited)
+    while (len && ((uintptr_t)data & 7))
+    {
+        crc = __crc32b(crc, *data++);
+        len--;
+    }
+
+    while (len >= 8)
     {
-        _inittable();
-        tableinited = true;
+        crc = __crc32d(crc, *(u64*)data);
+        data += 8;
+        len -= 8;
     }
 
-	u32 crc = 0xFFFFFFFF;
+    while (len--)
+        crc = __crc32b(crc, *data++);
+
+    return crc;
+}
+
+#endif // CRC32_ARM
+
+void _init()
+{
+    _inittable();
+    _initx2n();
+
+#if defined(CRC32_ARM)
+    CRC32_Func = CRC32_ARMv8;
+#elif defined(CRC32_PCLMUL)
+    if (CPUFeatures::HasPCLMULQDQ())
+        CRC32_Func = CRC32_PCLMULQDQ;
+#endif
+}
+
+
+u32 CRC32(u8* data, int len, u32 start)
+{
+    std::call_once(initflag, _init);
+    if (len <= 0) return start;
+
+    return CRC32_Func(start ^ 0xFFFFFFFF, data, (u32)len) ^ 0xFFFFFFFF;
+}
+
+u32 CRC32_Combine(u32 crc1, u32 crc2, u32 len2)
+{
+    std::call_once(initflag, _init);
+
+    return _multmodp(_x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+u32 CRC32_Zeros(u32 crc, u32 len)
+{
+    std::call_once(initflag, _init);
+
+    return _multmodp(_x2nmodp(len, 3), crc ^ 0xFFFFFFFF) ^ 0xFFFFFFFF;
+}
+
+
+// parallel CRC: the buffer is split in chunks which are hashed by several threads,
+// then the chunk CRCs are combined in order
+const u32 kParallelChunkSize = 0x100000;
+const int kMaxThreads = 16;
+
+std::atomic<bool> ParallelBusy(false);
+u8* ParallelData;
+u32 ParallelLen;
+u32 ParallelNumChunks;
+u32* ParallelCRCs;
+std::atomic<u32> ParallelNextChunk;
+
+void ParallelWork()
+{
+    for (;;)
+    {
+        u32 chunk = ParallelNextChunk.fetch_add(1);
+        if (chunk >= ParallelNumChunks) break;
+
+        u32 offset = chunk * kParallelChunkSize;
+        u32 len = ParallelLen - offset;
+        if (len > kParallelChunkSize) len = kParallelChunkSize;
+
+        ParallelCRCs[chunk] = CRC32(&ParallelData[offset], len);
+    }
+}
+
+u32 CRC32_Parallel(u8* data, u32 len, int numthreads, u32 start)
+{
+    std::call_once(initflag, _init);
+
+    if (numthreads > kMaxThreads) numthreads = kMaxThreads;
+    if (numthreads < 2 || len < (kParallelChunkSize * 2))
+        return CRC32(data, len, start);
+
+    // only one parallel job at a time, other callers just get the single-threaded version
+    if (ParallelBusy.exchange(true))
+        return CRC32(data, len, start);
+
+    ParallelData = data;
+    ParallelLen = len;
+    ParallelNumChunks = (len + kParallelChunkSize - 1) / kParallelChunkSize;
+    ParallelCRCs = new u32[ParallelNumChunks];
+    ParallelNextChunk = 0;
+
+    if ((u32)numthreads > ParallelNumChunks) numthreads = ParallelNumChunks;
+
+    void* threads[kMaxThreads];
+    for (int i = 1; i < numthreads; i++)
+        threads[i] = Platform::Thread_Create(ParallelWork);
+
+    ParallelWork();
+
+    for (int i = 1; i < numthreads; i++)
+    {
+        Platform::Thread_Wait(threads[i]);
+        Platform::Thread_Free(threads[i]);
+    }
+
+    u32 crc = start;
+    for (u32 i = 0; i < ParallelNumChunks; i++)
+    {
+        u32 chunklen = len - (i * kParallelChunkSize);
+        if (chunklen > kParallelChunkSize) chunklen = kParallelChunkSize;
+
+        crc = CRC32_Combine(crc, ParallelCRCs[i], chunklen);
+    }
 
-	while (len--)
-        crc = (crc >> 8) ^ crctable[(crc & 0xFF) ^ *data++];
+    delete[] ParallelCRCs;
+    ParallelBusy = false;
 
-	return (crc ^ 0xFFFFFFFF);
+    return crc;
 }
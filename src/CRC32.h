@@ -21,6 +21,17 @@
 
 #include "types.h"
 
-u32 CRC32(u8* data, int len);
+// 'start' is the CRC of the preceding data, to compute the CRC of a buffer in several steps
+// uses PCLMULQDQ or the ARMv8 CRC instructions when available, slice-by-16 otherwise
+u32 CRC32(u8* data, int len, u32 start=0);
+
+// CRC of A followed by B, given CRC(A), CRC(B) and the length of B
+u32 CRC32_Combine(u32 crc1, u32 crc2, u32 len2);
+
+// CRC of the data followed by 'len' zero bytes, without going through them
+u32 CRC32_Zeros(u32 crc, u32 len);
+
+// same result as CRC32(), with the work split between several threads for large buffers
+u32 CRC32_Parallel(u8* data, u32 len, int numthreads, u32 start=0);
 
 #endif // CRC32_H
@@ -28,20 +28,32 @@ namespace Config
 
 const char* kConfigFile = "melonDS.ini";
 
+int Threaded2D;
+
 int _3DRenderer;
 int Threaded3D;
+int Soft_ScaleFactor;
 
 int GL_ScaleFactor;
 int GL_Antialias;
 
+int AudioBufferSize;
+int AudioExactFIFO;
+
 ConfigEntry ConfigFile[] =
 {
+    {"Threaded2D", 0, &Threaded2D, 0, NULL, 0},
+
     {"3DRenderer", 0, &_3DRenderer, 1, NULL, 0},
-    {"Threaded3D", 0, &Threaded3D, 1, NULL, 0},
+    {"Threaded3D", 0, &Threaded3D, 1, NULL, 0}, // 0=off, 1=render thread, 2+=number of scanline bands
+    {"Soft_ScaleFactor", 0, &Soft_ScaleFactor, 1, NULL, 0}, // only used with the OpenGL display
 
     {"GL_ScaleFactor", 0, &GL_ScaleFactor, 1, NULL, 0},
     {"GL_Antialias", 0, &GL_Antialias, 0, NULL, 0},
 
+    {"AudioBufferSize", 0, &AudioBufferSize, 2048, NULL, 0}, // in stereo samples, rounded up to a power of two
+    {"AudioExactFIFO", 0, &AudioExactFIFO, 0, NULL, 0}, // always fetch sound data through the channel FIFOs
+
     {"", -1, NULL, 0, NULL, 0}
 };
 
@@ -40,12 +40,18 @@ bool HasConfigFile(const char* fileName);
 void Load();
 void Save();
 
+extern int Threaded2D;
+
 extern int _3DRenderer;
 extern int Threaded3D;
+extern int Soft_ScaleFactor;
 
 extern int GL_ScaleFactor;
 extern int GL_Antialias;
 
+extern int AudioBufferSize;
+extern int AudioExactFIFO;
+
 }
 
 #endif // CONFIG_H
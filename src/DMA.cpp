@@ -264,7 +264,36 @@ void DMA::Run9()
             }*/
         }
 
-        while (IterCount > 0 && !Stall)
+        if (IsGXFIFODMA && SrcAddrInc == 1)
+        {
+            // GXFIFO DMA from main RAM: hand the geometry engine whole blocks of words
+            // instead of sending each of them through the bus
+            // the block is cut where the per-word loop would have stopped
+            u64 unitcycles9 = unitcycles << NDS::ARM9ClockShift;
+
+            while (IterCount > 0 && !Stall && (CurSrcAddr >> 24) == 0x02)
+            {
+                // word reads ignore the low address bits, like ARM9Read32() does
+                u32 srcoffset = CurSrcAddr & (MAIN_RAM_SIZE - 1) & ~3;
+                u32 num = IterCount;
+                u32 ramleft = (MAIN_RAM_SIZE - srcoffset) >> 2;
+                if (num > ramleft) num = ramleft;
+                u64 timeleft = ((NDS::ARM9Target - NDS::ARM9Timestamp) + unitcycles9 - 1) / unitcycles9;
+                if (num > timeleft) num = (u32)timeleft;
+                if (num == 0) break;
+
+                num = GPU3D::WriteToGXFIFOBlock((u32*)&NDS::MainRAM[srcoffset], num);
+
+                NDS::ARM9Timestamp += num * unitcycles9;
+                CurSrcAddr += num << 2;
+                IterCount -= num;
+                RemCount -= num;
+
+                if (NDS::ARM9Timestamp >= NDS::ARM9Target) break;
+            }
+        }
+
+        while (IterCount > 0 && !Stall && NDS::ARM9Timestamp < NDS::ARM9Target)
         {
             NDS::ARM9Timestamp += (unitcycles << NDS::ARM9ClockShift);
 
@@ -20,6 +20,8 @@
 #include <string.h>
 #include "NDS.h"
 #include "GPU.h"
+#include "Config.h"
+#include "Platform.h"
 u64 vbltime;
 
 namespace GPU
@@ -35,6 +37,15 @@ u16 TotalScanlines;
 
 bool RunFIFO;
 
+// frame skipping
+// skipped frames are fully emulated, only the displayed output isn't rendered
+// FrameSkip: 0 = render every frame, N = render one frame out of N+1, -1 = never render
+int FrameSkip;
+int FrameSkipCount;
+bool SkipFrame, SkipNextFrame;
+bool Skipped3D;
+bool SpritesReadyA;
+
 u16 DispStat[2], VMatch[2];
 
 u8 Palette[2*1024];
@@ -72,10 +83,34 @@ u32 VRAMMap_TexPal[8];
 
 u32 VRAMMap_ARM7[2];
 
-u8* VRAMPtr_ABG[0x20];
-u8* VRAMPtr_AOBJ[0x10];
-u8* VRAMPtr_BBG[0x8];
-u8* VRAMPtr_BOBJ[0x8];
+u8 VRAMFlat_ABG[512*1024];
+u8 VRAMFlat_AOBJ[256*1024];
+u8 VRAMFlat_BBG[128*1024];
+u8 VRAMFlat_BOBJ[128*1024];
+u8 VRAMFlat_Texture[512*1024];
+u8 VRAMFlat_TexPal[128*1024];
+
+u32 VRAMAlias_ABG[0x20];
+u32 VRAMAlias_AOBJ[0x10];
+u32 VRAMAlias_BBG[0x8];
+u32 VRAMAlias_BOBJ[0x8];
+
+// mapping each flattened block was last built from
+u32 VRAMFlatMap_ABG[0x20];
+u32 VRAMFlatMap_AOBJ[0x10];
+u32 VRAMFlatMap_BBG[0x8];
+u32 VRAMFlatMap_BOBJ[0x8];
+u32 VRAMFlatMap_Texture[0x20];
+u32 VRAMFlatMap_TexPal[0x8];
+
+u32 VRAMGen_ABG[0x20];
+u32 VRAMGen_AOBJ[0x10];
+u32 VRAMGen_BBG[0x8];
+u32 VRAMGen_BOBJ[0x8];
+u32 PaletteGen[4];
+u32 OAMGen[2];
+u32 VRAMGen_Texture[0x20];
+u32 VRAMGen_TexPal[0x8];
 
 int FrontBuffer;
 u32* Framebuffer[2][2];
@@ -84,6 +119,38 @@ bool Accelerated;
 GPU2D* GPU2D_A;
 GPU2D* GPU2D_B;
 
+// deferred 2D rendering
+//
+// the 2D engines are rendered on worker threads, trailing the emulation by a
+// few scanlines. registers are latched per scanline at HBlank; VRAM, palette
+// and OAM aren't, so writes to those while lines are pending make the workers
+// catch up first. display capture and the display FIFO need their results in
+// order, frames using them are rendered synchronously.
+
+#define DEFERRED2D_BATCH 16
+
+GPU2D* GPU2D_DeferredA;
+GPU2D* GPU2D_DeferredB;
+
+bool Deferred2D;
+bool Deferred2DPending;
+
+GPU2D::LineRegs Deferred2DRegs[2][192];
+u32 Deferred2DLines[192];
+u32 Deferred2DNumQueued;
+u32 Deferred2DNumSubmitted;
+u32 Deferred2DBatchStart, Deferred2DBatchEnd;
+bool Deferred2DBusy;
+
+void* Render2DThread[2];
+bool Render2DThreadRunning;
+void* Sema_Render2DStart[2];
+void* Sema_Render2DDone[2];
+
+void Render2DThreadFuncA();
+void Render2DThreadFuncB();
+void EndDeferred2D();
+
 
 bool Init()
 {
@@ -91,6 +158,20 @@ bool Init()
     GPU2D_B = new GPU2D(1);
     if (!GPU3D::Init()) return false;
 
+    GPU2D_DeferredA = new GPU2D(0);
+    GPU2D_DeferredB = new GPU2D(1);
+
+    for (int i = 0; i < 2; i++)
+    {
+        Sema_Render2DStart[i] = Platform::Semaphore_Create();
+        Sema_Render2DDone[i] = Platform::Semaphore_Create();
+    }
+
+    Deferred2D = false;
+    Deferred2DPending = false;
+    Deferred2DBusy = false;
+    Render2DThreadRunning = false;
+
     FrontBuffer = 0;
     Framebuffer[0][0] = NULL; Framebuffer[0][1] = NULL;
     Framebuffer[1][0] = NULL; Framebuffer[1][1] = NULL;
@@ -102,8 +183,18 @@ bool Init()
 
 void DeInit()
 {
+    StopRender2DThreads();
+
+    for (int i = 0; i < 2; i++)
+    {
+        Platform::Semaphore_Free(Sema_Render2DStart[i]);
+        Platform::Semaphore_Free(Sema_Render2DDone[i]);
+    }
+
     delete GPU2D_A;
     delete GPU2D_B;
+    delete GPU2D_DeferredA;
+    delete GPU2D_DeferredB;
     GPU3D::DeInit();
 
     if (Framebuffer[0][0]) delete[] Framebuffer[0][0];
@@ -114,6 +205,8 @@ void DeInit()
 
 void Reset()
 {
+    if (Deferred2D) EndDeferred2D();
+
     VCount = 0;
     NextVCount = -1;
     TotalScanlines = 0;
@@ -157,10 +250,13 @@ void Reset()
     VRAMMap_ARM7[0] = 0;
     VRAMMap_ARM7[1] = 0;
 
-    memset(VRAMPtr_ABG, 0, sizeof(VRAMPtr_ABG));
-    memset(VRAMPtr_AOBJ, 0, sizeof(VRAMPtr_AOBJ));
-    memset(VRAMPtr_BBG, 0, sizeof(VRAMPtr_BBG));
-    memset(VRAMPtr_BOBJ, 0, sizeof(VRAMPtr_BOBJ));
+    SyncFlatVRAM(true);
+    InvalidateGens();
+
+    FrameSkipCount = 0;
+    SkipFrame = false;
+    SkipNextFrame = false;
+    Skipped3D = false;
 
     int fbsize;
     if (Accelerated) fbsize = (256*3 + 1) * 192;
@@ -180,9 +276,14 @@ void Reset()
     GPU2D_B->Reset();
     GPU3D::Reset();
 
+    GPU2D_DeferredA->Reset();
+    GPU2D_DeferredB->Reset();
+
     int backbuf = FrontBuffer ? 0 : 1;
     GPU2D_A->SetFramebuffer(Framebuffer[backbuf][1]);
     GPU2D_B->SetFramebuffer(Framebuffer[backbuf][0]);
+
+    SetupRender2DThreads();
 }
 
 void Stop()
@@ -198,6 +299,8 @@ void Stop()
 
 void DoSavestate(Savestate* file)
 {
+    if (Deferred2D) EndDeferred2D();
+
     file->Section("GPUG");
 
     file->Var16(&VCount);
@@ -245,14 +348,8 @@ void DoSavestate(Savestate* file)
 
     if (!file->Saving)
     {
-        for (int i = 0; i < 0x20; i++)
-            VRAMPtr_ABG[i] = GetUniqueBankPtr(VRAMMap_ABG[i], i << 14);
-        for (int i = 0; i < 0x10; i++)
-            VRAMPtr_AOBJ[i] = GetUniqueBankPtr(VRAMMap_AOBJ[i], i << 14);
-        for (int i = 0; i < 0x8; i++)
-            VRAMPtr_BBG[i] = GetUniqueBankPtr(VRAMMap_BBG[i], i << 14);
-        for (int i = 0; i < 0x8; i++)
-            VRAMPtr_BOBJ[i] = GetUniqueBankPtr(VRAMMap_BOBJ[i], i << 14);
+        SyncFlatVRAM(true);
+        InvalidateGens();
     }
 
     GPU2D_A->DoSavestate(file);
@@ -260,6 +357,19 @@ void DoSavestate(Savestate* file)
     GPU3D::DoSavestate(file);
 }
 
+void InvalidateGens()
+{
+    // generations are only ever incremented, so that stale cache entries can't match again
+    for (int i = 0; i < 0x20; i++) VRAMGen_ABG[i]++;
+    for (int i = 0; i < 0x10; i++) VRAMGen_AOBJ[i]++;
+    for (int i = 0; i < 0x8; i++)  VRAMGen_BBG[i]++;
+    for (int i = 0; i < 0x8; i++)  VRAMGen_BOBJ[i]++;
+    for (int i = 0; i < 4; i++)    PaletteGen[i]++;
+    for (int i = 0; i < 2; i++)    OAMGen[i]++;
+    for (int i = 0; i < 0x20; i++) VRAMGen_Texture[i]++;
+    for (int i = 0; i < 0x8; i++)  VRAMGen_TexPal[i]++;
+}
+
 void AssignFramebuffers()
 {
     int backbuf = FrontBuffer ? 0 : 1;
@@ -299,11 +409,159 @@ void SetDisplaySettings(bool accel)
 
     GPU2D_A->SetDisplaySettings(accel);
     GPU2D_B->SetDisplaySettings(accel);
+    GPU2D_DeferredA->SetDisplaySettings(accel);
+    GPU2D_DeferredB->SetDisplaySettings(accel);
 
     Accelerated = accel;
 }
 
 
+void Render2DThreadFunc(u32 num)
+{
+    GPU2D* gpu = num ? GPU2D_DeferredB : GPU2D_DeferredA;
+
+    for (;;)
+    {
+        Platform::Semaphore_Wait(Sema_Render2DStart[num]);
+        if (!Render2DThreadRunning) return;
+
+        for (u32 i = Deferred2DBatchStart; i < Deferred2DBatchEnd; i++)
+        {
+            u32 line = Deferred2DLines[i];
+            GPU2D::LineRegs* regs = &Deferred2DRegs[num][i];
+
+            gpu->LoadLineRegs(regs);
+            gpu->DrawScanline(line, regs->VCount);
+
+            // sprites are pre-rendered one scanline in advance
+            if (line < 191)
+                gpu->DrawSprites(line+1);
+        }
+
+        Platform::Semaphore_Post(Sema_Render2DDone[num]);
+    }
+}
+
+void Render2DThreadFuncA() { Render2DThreadFunc(0); }
+void Render2DThreadFuncB() { Render2DThreadFunc(1); }
+
+void StopRender2DThreads()
+{
+    if (Render2DThreadRunning)
+    {
+        if (Deferred2D) EndDeferred2D();
+
+        Render2DThreadRunning = false;
+        for (int i = 0; i < 2; i++)
+        {
+            Platform::Semaphore_Post(Sema_Render2DStart[i]);
+            Platform::Thread_Wait(Render2DThread[i]);
+            Platform::Thread_Free(Render2DThread[i]);
+        }
+    }
+}
+
+void SetupRender2DThreads()
+{
+    if (Config::Threaded2D)
+    {
+        if (!Render2DThreadRunning)
+        {
+            Platform::Semaphore_Reset(Sema_Render2DStart[0]);
+            Platform::Semaphore_Reset(Sema_Render2DStart[1]);
+            Platform::Semaphore_Reset(Sema_Render2DDone[0]);
+            Platform::Semaphore_Reset(Sema_Render2DDone[1]);
+
+            Render2DThreadRunning = true;
+            Render2DThread[0] = Platform::Thread_Create(Render2DThreadFuncA);
+            Render2DThread[1] = Platform::Thread_Create(Render2DThreadFuncB);
+        }
+    }
+    else
+    {
+        StopRender2DThreads();
+    }
+}
+
+bool CanDefer2D()
+{
+    if (Accelerated) return false;
+
+    // those need the lines to be rendered in order with the emulation
+    if (RunFIFO || GPU2D_A->UsesFIFO()) return false;
+    if (GPU2D_A->UsesCapture()) return false;
+
+    return true;
+}
+
+void SubmitDeferred2D()
+{
+    Deferred2DBatchStart = Deferred2DNumSubmitted;
+    Deferred2DBatchEnd = Deferred2DNumQueued;
+    Deferred2DNumSubmitted = Deferred2DNumQueued;
+
+    Deferred2DBusy = true;
+    Platform::Semaphore_Post(Sema_Render2DStart[0]);
+    Platform::Semaphore_Post(Sema_Render2DStart[1]);
+}
+
+void WaitDeferred2D()
+{
+    if (!Deferred2DBusy) return;
+
+    Platform::Semaphore_Wait(Sema_Render2DDone[0]);
+    Platform::Semaphore_Wait(Sema_Render2DDone[1]);
+    Deferred2DBusy = false;
+}
+
+void SyncDeferred2D()
+{
+    WaitDeferred2D();
+    if (Deferred2DNumSubmitted < Deferred2DNumQueued)
+    {
+        SubmitDeferred2D();
+        WaitDeferred2D();
+    }
+
+    Deferred2DPending = false;
+}
+
+void BeginDeferred2D()
+{
+    GPU2D_DeferredA->CopyRenderState(GPU2D_A);
+    GPU2D_DeferredB->CopyRenderState(GPU2D_B);
+
+    Deferred2DNumQueued = 0;
+    Deferred2DNumSubmitted = 0;
+    Deferred2D = true;
+}
+
+void EndDeferred2D()
+{
+    SyncDeferred2D();
+
+    GPU2D_A->CopyRenderState(GPU2D_DeferredA);
+    GPU2D_B->CopyRenderState(GPU2D_DeferredB);
+    Deferred2D = false;
+}
+
+void QueueDeferred2D(u32 line)
+{
+    u32 n = Deferred2DNumQueued++;
+
+    Deferred2DLines[n] = line;
+    GPU2D_A->SaveLineRegs(&Deferred2DRegs[0][n]);
+    GPU2D_B->SaveLineRegs(&Deferred2DRegs[1][n]);
+    Deferred2DPending = true;
+
+    if ((Deferred2DNumQueued - Deferred2DNumSubmitted) >= DEFERRED2D_BATCH)
+    {
+        WaitDeferred2D();
+        SubmitDeferred2D();
+    }
+}
+
+
 // VRAM mapping notes
 //
 // mirroring:
@@ -351,14 +609,113 @@ u8* GetUniqueBankPtr(u32 mask, u32 offset)
     return &VRAM[num][offset & VRAMMask[num]];
 }
 
+void RebuildFlatVRAM(u8* flat, u32 mask, u32 offset)
+{
+    // offset: address of the 16K block within the view
+    u8* dst = &flat[offset];
+
+    u8* src = GetUniqueBankPtr(mask, offset);
+    if (src)
+    {
+        memcpy(dst, src, 0x4000);
+        return;
+    }
+
+    memset(dst, 0, 0x4000);
+    for (int num = 0; num < 9; num++)
+    {
+        if (!(mask & (1<<num))) continue;
+
+        src = &VRAM[num][offset & VRAMMask[num]];
+        for (int i = 0; i < 0x4000; i+=4)
+            *(u32*)&dst[i] |= *(u32*)&src[i];
+    }
+}
+
+u32 GetFlatVRAMAlias(u32* map, u32 n, u32 block)
+{
+    u32 ret = 0;
+    for (u32 i = 0; i < n; i++)
+    {
+        if (i == block) continue;
+
+        u32 shared = map[i] & map[block];
+        for (int num = 0; num < 9; num++)
+        {
+            if (!(shared & (1<<num))) continue;
+
+            if (((i << 14) & VRAMMask[num]) == ((block << 14) & VRAMMask[num]))
+            {
+                ret |= (1<<i);
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+void UpdateFlatVRAMAlias(u8* flat, u32* map, u32* gen, u32 alias, u32 addr, u32 len)
+{
+    // a write landed in bank memory that is also visible from the given blocks
+    for (u32 i = 0; alias; i++, alias >>= 1)
+    {
+        if (!(alias & 1)) continue;
+
+        u32 offset = (i << 14) | addr;
+        for (u32 j = 0; j < len; j++)
+        {
+            u8 val = 0;
+            for (int num = 0; num < 9; num++)
+            {
+                if (map[i] & (1<<num))
+                    val |= VRAM[num][(offset + j) & VRAMMask[num]];
+            }
+            flat[offset + j] = val;
+        }
+
+        gen[i]++;
+    }
+}
+
+void SyncFlatVRAMView(u8* flat, u32* map, u32* builtmap, u32* alias, u32* gen, u32 n, bool force)
+{
+    bool changed = false;
+    for (u32 i = 0; i < n; i++)
+    {
+        if (map[i] == builtmap[i] && !force) continue;
+
+        RebuildFlatVRAM(flat, map[i], i << 14);
+        builtmap[i] = map[i];
+        if (gen) gen[i]++;
+        changed = true;
+    }
+
+    if (changed && alias)
+    {
+        for (u32 i = 0; i < n; i++)
+            alias[i] = GetFlatVRAMAlias(map, n, i);
+    }
+}
+
+void SyncFlatVRAM(bool force)
+{
+    // brings the flattened views in line with the current mapping
+    // called after every mapping change, or with force=true after bank contents were replaced
+    SyncFlatVRAMView(VRAMFlat_ABG, VRAMMap_ABG, VRAMFlatMap_ABG, VRAMAlias_ABG, VRAMGen_ABG, 0x20, force);
+    SyncFlatVRAMView(VRAMFlat_AOBJ, VRAMMap_AOBJ, VRAMFlatMap_AOBJ, VRAMAlias_AOBJ, VRAMGen_AOBJ, 0x10, force);
+    SyncFlatVRAMView(VRAMFlat_BBG, VRAMMap_BBG, VRAMFlatMap_BBG, VRAMAlias_BBG, VRAMGen_BBG, 0x8, force);
+    SyncFlatVRAMView(VRAMFlat_BOBJ, VRAMMap_BOBJ, VRAMFlatMap_BOBJ, VRAMAlias_BOBJ, VRAMGen_BOBJ, 0x8, force);
+
+    // texture slots are 128K, the texture palette ones 16K
+    u32 texmap[0x20];
+    for (int i = 0; i < 0x20; i++) texmap[i] = VRAMMap_Texture[i >> 3];
+    SyncFlatVRAMView(VRAMFlat_Texture, texmap, VRAMFlatMap_Texture, NULL, VRAMGen_Texture, 0x20, force);
+    SyncFlatVRAMView(VRAMFlat_TexPal, VRAMMap_TexPal, VRAMFlatMap_TexPal, NULL, VRAMGen_TexPal, 0x8, force);
+}
+
 #define MAP_RANGE(map, base, n)    for (int i = 0; i < n; i++) VRAMMap_##map[(base)+i] |= bankmask;
 #define UNMAP_RANGE(map, base, n)  for (int i = 0; i < n; i++) VRAMMap_##map[(base)+i] &= ~bankmask;
 
-#define MAP_RANGE_PTR(map, base, n) \
-    for (int i = 0; i < n; i++) { VRAMMap_##map[(base)+i] |= bankmask; VRAMPtr_##map[(base)+i] = GetUniqueBankPtr(VRAMMap_##map[(base)+i], ((base)+i)<<14); }
-#define UNMAP_RANGE_PTR(map, base, n) \
-    for (int i = 0; i < n; i++) { VRAMMap_##map[(base)+i] &= ~bankmask; VRAMPtr_##map[(base)+i] = GetUniqueBankPtr(VRAMMap_##map[(base)+i], ((base)+i)<<14); }
-
 void MapVRAM_AB(u32 bank, u8 cnt)
 {
     u8 oldcnt = VRAMCNT[bank];
@@ -366,6 +723,8 @@ void MapVRAM_AB(u32 bank, u8 cnt)
 
     if (oldcnt == cnt) return;
 
+    if (Deferred2DPending) SyncDeferred2D();
+
     u8 oldofs = (oldcnt >> 3) & 0x3;
     u8 ofs = (cnt >> 3) & 0x3;
     u32 bankmask = 1 << bank;
@@ -379,12 +738,12 @@ void MapVRAM_AB(u32 bank, u8 cnt)
             break;
 
         case 1: // ABG
-            UNMAP_RANGE_PTR(ABG, oldofs<<3, 8);
+            UNMAP_RANGE(ABG, oldofs<<3, 8);
             break;
 
         case 2: // AOBJ
             oldofs &= 0x1;
-            UNMAP_RANGE_PTR(AOBJ, oldofs<<3, 8);
+            UNMAP_RANGE(AOBJ, oldofs<<3, 8);
             break;
 
         case 3: // texture
@@ -402,12 +761,12 @@ void MapVRAM_AB(u32 bank, u8 cnt)
             break;
 
         case 1: // ABG
-            MAP_RANGE_PTR(ABG, ofs<<3, 8);
+            MAP_RANGE(ABG, ofs<<3, 8);
             break;
 
         case 2: // AOBJ
             ofs &= 0x1;
-            MAP_RANGE_PTR(AOBJ, ofs<<3, 8);
+            MAP_RANGE(AOBJ, ofs<<3, 8);
             break;
 
         case 3: // texture
@@ -415,6 +774,8 @@ void MapVRAM_AB(u32 bank, u8 cnt)
             break;
         }
     }
+
+    SyncFlatVRAM(false);
 }
 
 void MapVRAM_CD(u32 bank, u8 cnt)
@@ -426,6 +787,8 @@ void MapVRAM_CD(u32 bank, u8 cnt)
 
     if (oldcnt == cnt) return;
 
+    if (Deferred2DPending) SyncDeferred2D();
+
     u8 oldofs = (oldcnt >> 3) & 0x7;
     u8 ofs = (cnt >> 3) & 0x7;
     u32 bankmask = 1 << bank;
@@ -439,7 +802,7 @@ void MapVRAM_CD(u32 bank, u8 cnt)
             break;
 
         case 1: // ABG
-            UNMAP_RANGE_PTR(ABG, oldofs<<3, 8);
+            UNMAP_RANGE(ABG, oldofs<<3, 8);
             break;
 
         case 2: // ARM7 VRAM
@@ -454,11 +817,11 @@ void MapVRAM_CD(u32 bank, u8 cnt)
         case 4: // BBG/BOBJ
             if (bank == 2)
             {
-                UNMAP_RANGE_PTR(BBG, 0, 8);
+                UNMAP_RANGE(BBG, 0, 8);
             }
             else
             {
-                UNMAP_RANGE_PTR(BOBJ, 0, 8);
+                UNMAP_RANGE(BOBJ, 0, 8);
             }
             break;
         }
@@ -473,7 +836,7 @@ void MapVRAM_CD(u32 bank, u8 cnt)
             break;
 
         case 1: // ABG
-            MAP_RANGE_PTR(ABG, ofs<<3, 8);
+            MAP_RANGE(ABG, ofs<<3, 8);
             break;
 
         case 2: // ARM7 VRAM
@@ -489,15 +852,17 @@ void MapVRAM_CD(u32 bank, u8 cnt)
         case 4: // BBG/BOBJ
             if (bank == 2)
             {
-                MAP_RANGE_PTR(BBG, 0, 8);
+                MAP_RANGE(BBG, 0, 8);
             }
             else
             {
-                MAP_RANGE_PTR(BOBJ, 0, 8);
+                MAP_RANGE(BOBJ, 0, 8);
             }
             break;
         }
     }
+
+    SyncFlatVRAM(false);
 }
 
 void MapVRAM_E(u32 bank, u8 cnt)
@@ -507,6 +872,8 @@ void MapVRAM_E(u32 bank, u8 cnt)
 
     if (oldcnt == cnt) return;
 
+    if (Deferred2DPending) SyncDeferred2D();
+
     u32 bankmask = 1 << bank;
 
     if (oldcnt & (1<<7))
@@ -518,11 +885,11 @@ void MapVRAM_E(u32 bank, u8 cnt)
             break;
 
         case 1: // ABG
-            UNMAP_RANGE_PTR(ABG, 0, 4);
+            UNMAP_RANGE(ABG, 0, 4);
             break;
 
         case 2: // AOBJ
-            UNMAP_RANGE_PTR(AOBJ, 0, 4);
+            UNMAP_RANGE(AOBJ, 0, 4);
             break;
 
         case 3: // texture palette
@@ -546,11 +913,11 @@ void MapVRAM_E(u32 bank, u8 cnt)
             break;
 
         case 1: // ABG
-            MAP_RANGE_PTR(ABG, 0, 4);
+            MAP_RANGE(ABG, 0, 4);
             break;
 
         case 2: // AOBJ
-            MAP_RANGE_PTR(AOBJ, 0, 4);
+            MAP_RANGE(AOBJ, 0, 4);
             break;
 
         case 3: // texture palette
@@ -564,6 +931,8 @@ void MapVRAM_E(u32 bank, u8 cnt)
             break;
         }
     }
+
+    SyncFlatVRAM(false);
 }
 
 void MapVRAM_FG(u32 bank, u8 cnt)
@@ -573,6 +942,8 @@ void MapVRAM_FG(u32 bank, u8 cnt)
 
     if (oldcnt == cnt) return;
 
+    if (Deferred2DPending) SyncDeferred2D();
+
     u8 oldofs = (oldcnt >> 3) & 0x7;
     u8 ofs = (cnt >> 3) & 0x7;
     u32 bankmask = 1 << bank;
@@ -590,8 +961,6 @@ void MapVRAM_FG(u32 bank, u8 cnt)
                 u32 base = (oldofs & 0x1) + ((oldofs & 0x2) << 1);
                 VRAMMap_ABG[base] &= ~bankmask;
                 VRAMMap_ABG[base + 2] &= ~bankmask;
-                VRAMPtr_ABG[base] = GetUniqueBankPtr(VRAMMap_ABG[base], base << 14);
-                VRAMPtr_ABG[base + 2] = GetUniqueBankPtr(VRAMMap_ABG[base + 2], (base + 2) << 14);
             }
             break;
 
@@ -600,8 +969,6 @@ void MapVRAM_FG(u32 bank, u8 cnt)
                 u32 base = (oldofs & 0x1) + ((oldofs & 0x2) << 1);
                 VRAMMap_AOBJ[base] &= ~bankmask;
                 VRAMMap_AOBJ[base + 2] &= ~bankmask;
-                VRAMPtr_AOBJ[base] = GetUniqueBankPtr(VRAMMap_AOBJ[base], base << 14);
-                VRAMPtr_AOBJ[base + 2] = GetUniqueBankPtr(VRAMMap_AOBJ[base + 2], (base + 2) << 14);
             }
             break;
 
@@ -635,8 +1002,6 @@ void MapVRAM_FG(u32 bank, u8 cnt)
                 u32 base = (ofs & 0x1) + ((ofs & 0x2) << 1);
                 VRAMMap_ABG[base] |= bankmask;
                 VRAMMap_ABG[base + 2] |= bankmask;
-                VRAMPtr_ABG[base] = GetUniqueBankPtr(VRAMMap_ABG[base], base << 14);
-                VRAMPtr_ABG[base + 2] = GetUniqueBankPtr(VRAMMap_ABG[base + 2], (base + 2) << 14);
             }
             break;
 
@@ -645,8 +1010,6 @@ void MapVRAM_FG(u32 bank, u8 cnt)
                 u32 base = (ofs & 0x1) + ((ofs & 0x2) << 1);
                 VRAMMap_AOBJ[base] |= bankmask;
                 VRAMMap_AOBJ[base + 2] |= bankmask;
-                VRAMPtr_AOBJ[base] = GetUniqueBankPtr(VRAMMap_AOBJ[base], base << 14);
-                VRAMPtr_AOBJ[base + 2] = GetUniqueBankPtr(VRAMMap_AOBJ[base + 2], (base + 2) << 14);
             }
             break;
 
@@ -666,6 +1029,8 @@ void MapVRAM_FG(u32 bank, u8 cnt)
             break;
         }
     }
+
+    SyncFlatVRAM(false);
 }
 
 void MapVRAM_H(u32 bank, u8 cnt)
@@ -675,6 +1040,8 @@ void MapVRAM_H(u32 bank, u8 cnt)
 
     if (oldcnt == cnt) return;
 
+    if (Deferred2DPending) SyncDeferred2D();
+
     u32 bankmask = 1 << bank;
 
     if (oldcnt & (1<<7))
@@ -690,10 +1057,6 @@ void MapVRAM_H(u32 bank, u8 cnt)
             VRAMMap_BBG[1] &= ~bankmask;
             VRAMMap_BBG[4] &= ~bankmask;
             VRAMMap_BBG[5] &= ~bankmask;
-            VRAMPtr_BBG[0] = GetUniqueBankPtr(VRAMMap_BBG[0], 0 << 14);
-            VRAMPtr_BBG[1] = GetUniqueBankPtr(VRAMMap_BBG[1], 1 << 14);
-            VRAMPtr_BBG[4] = GetUniqueBankPtr(VRAMMap_BBG[4], 4 << 14);
-            VRAMPtr_BBG[5] = GetUniqueBankPtr(VRAMMap_BBG[5], 5 << 14);
             break;
 
         case 2: // BBG ext palette
@@ -717,10 +1080,6 @@ void MapVRAM_H(u32 bank, u8 cnt)
             VRAMMap_BBG[1] |= bankmask;
             VRAMMap_BBG[4] |= bankmask;
             VRAMMap_BBG[5] |= bankmask;
-            VRAMPtr_BBG[0] = GetUniqueBankPtr(VRAMMap_BBG[0], 0 << 14);
-            VRAMPtr_BBG[1] = GetUniqueBankPtr(VRAMMap_BBG[1], 1 << 14);
-            VRAMPtr_BBG[4] = GetUniqueBankPtr(VRAMMap_BBG[4], 4 << 14);
-            VRAMPtr_BBG[5] = GetUniqueBankPtr(VRAMMap_BBG[5], 5 << 14);
             break;
 
         case 2: // BBG ext palette
@@ -730,6 +1089,8 @@ void MapVRAM_H(u32 bank, u8 cnt)
             break;
         }
     }
+
+    SyncFlatVRAM(false);
 }
 
 void MapVRAM_I(u32 bank, u8 cnt)
@@ -739,6 +1100,8 @@ void MapVRAM_I(u32 bank, u8 cnt)
 
     if (oldcnt == cnt) return;
 
+    if (Deferred2DPending) SyncDeferred2D();
+
     u32 bankmask = 1 << bank;
 
     if (oldcnt & (1<<7))
@@ -754,14 +1117,10 @@ void MapVRAM_I(u32 bank, u8 cnt)
             VRAMMap_BBG[3] &= ~bankmask;
             VRAMMap_BBG[6] &= ~bankmask;
             VRAMMap_BBG[7] &= ~bankmask;
-            VRAMPtr_BBG[2] = GetUniqueBankPtr(VRAMMap_BBG[2], 2 << 14);
-            VRAMPtr_BBG[3] = GetUniqueBankPtr(VRAMMap_BBG[3], 3 << 14);
-            VRAMPtr_BBG[6] = GetUniqueBankPtr(VRAMMap_BBG[6], 6 << 14);
-            VRAMPtr_BBG[7] = GetUniqueBankPtr(VRAMMap_BBG[7], 7 << 14);
             break;
 
         case 2: // BOBJ
-            UNMAP_RANGE_PTR(BOBJ, 0, 8);
+            UNMAP_RANGE(BOBJ, 0, 8);
             break;
 
         case 3: // BOBJ ext palette
@@ -784,14 +1143,10 @@ void MapVRAM_I(u32 bank, u8 cnt)
             VRAMMap_BBG[3] |= bankmask;
             VRAMMap_BBG[6] |= bankmask;
             VRAMMap_BBG[7] |= bankmask;
-            VRAMPtr_BBG[2] = GetUniqueBankPtr(VRAMMap_BBG[2], 2 << 14);
-            VRAMPtr_BBG[3] = GetUniqueBankPtr(VRAMMap_BBG[3], 3 << 14);
-            VRAMPtr_BBG[6] = GetUniqueBankPtr(VRAMMap_BBG[6], 6 << 14);
-            VRAMPtr_BBG[7] = GetUniqueBankPtr(VRAMMap_BBG[7], 7 << 14);
             break;
 
         case 2: // BOBJ
-            MAP_RANGE_PTR(BOBJ, 0, 8);
+            MAP_RANGE(BOBJ, 0, 8);
             break;
 
         case 3: // BOBJ ext palette
@@ -800,6 +1155,8 @@ void MapVRAM_I(u32 bank, u8 cnt)
             break;
         }
     }
+
+    SyncFlatVRAM(false);
 }
 
 
@@ -846,6 +1203,56 @@ void DisplayFIFO(u32 x)
         GPU2D_A->SampleFIFO(253, 3); // sample the remaining pixels
 }
 
+void SetFrameSkip(int skip)
+{
+    if (skip == FrameSkip) return;
+
+    FrameSkip = skip;
+    FrameSkipCount = 0;
+}
+
+void SkipScanline(u32 line)
+{
+    // display capture needs engine A's output even when nothing is displayed
+    if (GPU2D_A->UsesCapture())
+    {
+        if (Skipped3D)
+        {
+            // render the 3D frame late, and consume the lines we went past
+            GPU3D::VCount215();
+            Skipped3D = false;
+
+            if (!Accelerated)
+            {
+                for (u32 i = 0; i < line; i++)
+                    GPU3D::GetLine(i);
+            }
+        }
+
+        if (!SpritesReadyA)
+            GPU2D_A->DrawSprites(line);
+
+        GPU2D_A->DrawScanline(line, VCount);
+
+        if (line < 191)
+            GPU2D_A->DrawSprites(line+1);
+        SpritesReadyA = true;
+    }
+    else
+    {
+        // keep the 3D renderer's line count in sync if it did render
+        // DrawScanline() doesn't fetch the 3D line either for lines outside of the
+        // drawing range (VCount changed) or past the end of the frame
+        if (!Skipped3D && !Accelerated && line < 192 && VCount <= 192)
+            GPU3D::GetLine(line);
+
+        GPU2D_A->SkipScanline(VCount);
+        SpritesReadyA = false;
+    }
+
+    GPU2D_B->SkipScanline(VCount);
+}
+
 void StartFrame()
 {
     // only run the display FIFO if needed:
@@ -853,6 +1260,19 @@ void StartFrame()
     // * if we have display FIFO DMA
     RunFIFO = GPU2D_A->UsesFIFO() || NDS::DMAsInMode(0, 0x04);
 
+    // decide one frame ahead, as the 3D frame is rendered during the previous one
+    SkipFrame = SkipNextFrame;
+    if (FrameSkip < 0)
+        SkipNextFrame = true;
+    else if (FrameSkip == 0)
+        SkipNextFrame = false;
+    else
+    {
+        FrameSkipCount++;
+        if (FrameSkipCount > FrameSkip) FrameSkipCount = 0;
+        SkipNextFrame = (FrameSkipCount != 0);
+    }
+
     TotalScanlines = 0;
     StartScanline(0);
 }
@@ -864,31 +1284,63 @@ void StartHBlank(u32 line)
 
     if (VCount < 192)
     {
-        // draw
-        // note: this should start 48 cycles after the scanline start
-        if (line < 192)
+        if (SkipFrame)
         {
-            GPU2D_A->DrawScanline(line);
-            GPU2D_B->DrawScanline(line);
+            if (line < 192)
+                SkipScanline(line);
         }
-
-        // sprites are pre-rendered one scanline in advance
-        if (line < 191)
+        else
         {
-            GPU2D_A->DrawSprites(line+1);
-            GPU2D_B->DrawSprites(line+1);
+            if (line == 0 && Render2DThreadRunning && CanDefer2D())
+                BeginDeferred2D();
+            else if (Deferred2D && !CanDefer2D())
+                EndDeferred2D();
+
+            if (Deferred2D)
+            {
+                if (line < 192)
+                    QueueDeferred2D(line);
+            }
+            else
+            {
+                // draw
+                // note: this should start 48 cycles after the scanline start
+                if (line < 192)
+                {
+                    GPU2D_A->DrawScanline(line, VCount);
+                    GPU2D_B->DrawScanline(line, VCount);
+                }
+
+                // sprites are pre-rendered one scanline in advance
+                if (line < 191)
+                {
+                    GPU2D_A->DrawSprites(line+1);
+                    GPU2D_B->DrawSprites(line+1);
+                }
+            }
         }
 
         NDS::CheckDMAs(0, 0x02);
     }
     else if (VCount == 215)
     {
-        GPU3D::VCount215();
+        // the 3D frame rendered here is displayed next frame
+        if (SkipNextFrame)
+            Skipped3D = true;
+        else
+        {
+            Skipped3D = false;
+            GPU3D::VCount215();
+        }
     }
     else if (VCount == 262)
     {
-        GPU2D_A->DrawSprites(0);
-        GPU2D_B->DrawSprites(0);
+        if (!SkipNextFrame)
+        {
+            GPU2D_A->DrawSprites(0);
+            GPU2D_B->DrawSprites(0);
+        }
+        SpritesReadyA = !SkipNextFrame;
     }
 
     if (DispStat[0] & (1<<4)) NDS::SetIRQ(0, NDS::IRQ_HBlank);
@@ -902,14 +1354,22 @@ void StartHBlank(u32 line)
 
 void FinishFrame(u32 lines)
 {
-    FrontBuffer = FrontBuffer ? 0 : 1;
-    AssignFramebuffers();
+    // skipped frames leave the last rendered one on display
+    if (!SkipFrame)
+    {
+        FrontBuffer = FrontBuffer ? 0 : 1;
+        AssignFramebuffers();
+    }
 
     TotalScanlines = lines;
 }
 
 void StartScanline(u32 line)
 {
+    // all the deferred lines need to be done by VBlank
+    if (Deferred2D && line >= 192)
+        EndDeferred2D();
+
     if (line == 0)
         VCount = 0;
     else if (NextVCount != -1)
@@ -989,7 +1449,8 @@ void StartScanline(u32 line)
         }
         else if (VCount == 144)
         {
-            GPU3D::VCount144();
+            if (!Skipped3D)
+                GPU3D::VCount144();
         }
     }
 
@@ -61,17 +61,44 @@ extern u32 VRAMMap_Texture[4];
 extern u32 VRAMMap_TexPal[8];
 extern u32 VRAMMap_ARM7[2];
 
-extern u8* VRAMPtr_ABG[0x20];
-extern u8* VRAMPtr_AOBJ[0x10];
-extern u8* VRAMPtr_BBG[0x8];
-extern u8* VRAMPtr_BOBJ[0x8];
+// flattened views: each view's banks ORed together, as seen by the renderers
+// rebuilt per 16K block on mapping changes, kept coherent by the view writes
+extern u8 VRAMFlat_ABG[512*1024];
+extern u8 VRAMFlat_AOBJ[256*1024];
+extern u8 VRAMFlat_BBG[128*1024];
+extern u8 VRAMFlat_BOBJ[128*1024];
+extern u8 VRAMFlat_Texture[512*1024];
+extern u8 VRAMFlat_TexPal[128*1024];
+
+// for each 16K block: other blocks of the same view showing the same bank memory
+extern u32 VRAMAlias_ABG[0x20];
+extern u32 VRAMAlias_AOBJ[0x10];
+extern u32 VRAMAlias_BBG[0x8];
+extern u32 VRAMAlias_BOBJ[0x8];
+
+// write generations, per 16K page of the 2D views and per palette block
+// bumped on every write or mapping change, for renderer-side caches
+extern u32 VRAMGen_ABG[0x20];
+extern u32 VRAMGen_AOBJ[0x10];
+extern u32 VRAMGen_BBG[0x8];
+extern u32 VRAMGen_BOBJ[0x8];
+extern u32 PaletteGen[4];
+extern u32 OAMGen[2];
+
+// same for the texture (16K pages) and texture palette views
+// those can't be written while mapped, so these only change with the mapping
+extern u32 VRAMGen_Texture[0x20];
+extern u32 VRAMGen_TexPal[0x8];
 
 extern int FrontBuffer;
 extern u32* Framebuffer[2][2];
+extern bool Accelerated;
 
 extern GPU2D* GPU2D_A;
 extern GPU2D* GPU2D_B;
 
+extern bool Deferred2DPending;
+
 
 bool Init();
 void DeInit();
@@ -81,9 +108,20 @@ void Stop();
 void DoSavestate(Savestate* file);
 
 void SetDisplaySettings(bool accel);
+void SetFrameSkip(int skip);
+
+void SetupRender2DThreads();
+void StopRender2DThreads();
+void SyncDeferred2D();
+
+void InvalidateGens();
+
+void SyncFlatVRAM(bool force);
+void UpdateFlatVRAMAlias(u8* flat, u32* map, u32* gen, u32 alias, u32 addr, u32 len);
 
 
 u8* GetUniqueBankPtr(u32 mask, u32 offset);
+void RebuildFlatVRAM(u8* flat, u32 mask, u32 offset);
 
 void MapVRAM_AB(u32 bank, u8 cnt);
 void MapVRAM_CD(u32 bank, u8 cnt);
@@ -161,6 +199,8 @@ T ReadVRAM_LCDC(u32 addr)
 template<typename T>
 void WriteVRAM_LCDC(u32 addr, T val)
 {
+    if (Deferred2DPending) SyncDeferred2D();
+
     int bank;
 
     switch (addr & 0xFF8FC000)
@@ -225,27 +265,17 @@ void WriteVRAM_LCDC(u32 addr, T val)
 template<typename T>
 T ReadVRAM_ABG(u32 addr)
 {
-    u8* ptr = VRAMPtr_ABG[(addr >> 14) & 0x1F];
-    if (ptr) return *(T*)&ptr[addr & 0x3FFF];
-
-    T ret = 0;
-    u32 mask = VRAMMap_ABG[(addr >> 14) & 0x1F];
-
-    if (mask & (1<<0)) ret |= *(T*)&VRAM_A[addr & 0x1FFFF];
-    if (mask & (1<<1)) ret |= *(T*)&VRAM_B[addr & 0x1FFFF];
-    if (mask & (1<<2)) ret |= *(T*)&VRAM_C[addr & 0x1FFFF];
-    if (mask & (1<<3)) ret |= *(T*)&VRAM_D[addr & 0x1FFFF];
-    if (mask & (1<<4)) ret |= *(T*)&VRAM_E[addr & 0xFFFF];
-    if (mask & (1<<5)) ret |= *(T*)&VRAM_F[addr & 0x3FFF];
-    if (mask & (1<<6)) ret |= *(T*)&VRAM_G[addr & 0x3FFF];
-
-    return ret;
+    return *(T*)&VRAMFlat_ABG[addr & 0x7FFFF];
 }
 
 template<typename T>
 void WriteVRAM_ABG(u32 addr, T val)
 {
+    if (Deferred2DPending) SyncDeferred2D();
+
     u32 mask = VRAMMap_ABG[(addr >> 14) & 0x1F];
+    if (!mask) return;
+    VRAMGen_ABG[(addr >> 14) & 0x1F]++;
 
     if (mask & (1<<0)) *(T*)&VRAM_A[addr & 0x1FFFF] = val;
     if (mask & (1<<1)) *(T*)&VRAM_B[addr & 0x1FFFF] = val;
@@ -254,89 +284,86 @@ void WriteVRAM_ABG(u32 addr, T val)
     if (mask & (1<<4)) *(T*)&VRAM_E[addr & 0xFFFF] = val;
     if (mask & (1<<5)) *(T*)&VRAM_F[addr & 0x3FFF] = val;
     if (mask & (1<<6)) *(T*)&VRAM_G[addr & 0x3FFF] = val;
+
+    *(T*)&VRAMFlat_ABG[addr & 0x7FFFF] = val;
+    if (VRAMAlias_ABG[(addr >> 14) & 0x1F])
+        UpdateFlatVRAMAlias(VRAMFlat_ABG, VRAMMap_ABG, VRAMGen_ABG, VRAMAlias_ABG[(addr >> 14) & 0x1F], addr & 0x3FFF, sizeof(T));
 }
 
 
 template<typename T>
 T ReadVRAM_AOBJ(u32 addr)
 {
-    u8* ptr = VRAMPtr_AOBJ[(addr >> 14) & 0xF];
-    if (ptr) return *(T*)&ptr[addr & 0x3FFF];
-
-    T ret = 0;
-    u32 mask = VRAMMap_AOBJ[(addr >> 14) & 0xF];
-
-    if (mask & (1<<0)) ret |= *(T*)&VRAM_A[addr & 0x1FFFF];
-    if (mask & (1<<1)) ret |= *(T*)&VRAM_B[addr & 0x1FFFF];
-    if (mask & (1<<4)) ret |= *(T*)&VRAM_E[addr & 0xFFFF];
-    if (mask & (1<<5)) ret |= *(T*)&VRAM_F[addr & 0x3FFF];
-    if (mask & (1<<6)) ret |= *(T*)&VRAM_G[addr & 0x3FFF];
-
-    return ret;
+    return *(T*)&VRAMFlat_AOBJ[addr & 0x3FFFF];
 }
 
 template<typename T>
 void WriteVRAM_AOBJ(u32 addr, T val)
 {
+    if (Deferred2DPending) SyncDeferred2D();
+
     u32 mask = VRAMMap_AOBJ[(addr >> 14) & 0xF];
+    if (!mask) return;
+    VRAMGen_AOBJ[(addr >> 14) & 0xF]++;
 
     if (mask & (1<<0)) *(T*)&VRAM_A[addr & 0x1FFFF] = val;
     if (mask & (1<<1)) *(T*)&VRAM_B[addr & 0x1FFFF] = val;
     if (mask & (1<<4)) *(T*)&VRAM_E[addr & 0xFFFF] = val;
     if (mask & (1<<5)) *(T*)&VRAM_F[addr & 0x3FFF] = val;
     if (mask & (1<<6)) *(T*)&VRAM_G[addr & 0x3FFF] = val;
+
+    *(T*)&VRAMFlat_AOBJ[addr & 0x3FFFF] = val;
+    if (VRAMAlias_AOBJ[(addr >> 14) & 0xF])
+        UpdateFlatVRAMAlias(VRAMFlat_AOBJ, VRAMMap_AOBJ, VRAMGen_AOBJ, VRAMAlias_AOBJ[(addr >> 14) & 0xF], addr & 0x3FFF, sizeof(T));
 }
 
 
 template<typename T>
 T ReadVRAM_BBG(u32 addr)
 {
-    u8* ptr = VRAMPtr_BBG[(addr >> 14) & 0x7];
-    if (ptr) return *(T*)&ptr[addr & 0x3FFF];
-
-    T ret = 0;
-    u32 mask = VRAMMap_BBG[(addr >> 14) & 0x7];
-
-    if (mask & (1<<2)) ret |= *(T*)&VRAM_C[addr & 0x1FFFF];
-    if (mask & (1<<7)) ret |= *(T*)&VRAM_H[addr & 0x7FFF];
-    if (mask & (1<<8)) ret |= *(T*)&VRAM_I[addr & 0x3FFF];
-
-    return ret;
+    return *(T*)&VRAMFlat_BBG[addr & 0x1FFFF];
 }
 
 template<typename T>
 void WriteVRAM_BBG(u32 addr, T val)
 {
+    if (Deferred2DPending) SyncDeferred2D();
+
     u32 mask = VRAMMap_BBG[(addr >> 14) & 0x7];
+    if (!mask) return;
+    VRAMGen_BBG[(addr >> 14) & 0x7]++;
 
     if (mask & (1<<2)) *(T*)&VRAM_C[addr & 0x1FFFF] = val;
     if (mask & (1<<7)) *(T*)&VRAM_H[addr & 0x7FFF] = val;
     if (mask & (1<<8)) *(T*)&VRAM_I[addr & 0x3FFF] = val;
+
+    *(T*)&VRAMFlat_BBG[addr & 0x1FFFF] = val;
+    if (VRAMAlias_BBG[(addr >> 14) & 0x7])
+        UpdateFlatVRAMAlias(VRAMFlat_BBG, VRAMMap_BBG, VRAMGen_BBG, VRAMAlias_BBG[(addr >> 14) & 0x7], addr & 0x3FFF, sizeof(T));
 }
 
 
 template<typename T>
 T ReadVRAM_BOBJ(u32 addr)
 {
-    u8* ptr = VRAMPtr_BOBJ[(addr >> 14) & 0x7];
-    if (ptr) return *(T*)&ptr[addr & 0x3FFF];
-
-    T ret = 0;
-    u32 mask = VRAMMap_BOBJ[(addr >> 14) & 0x7];
-
-    if (mask & (1<<3)) ret |= *(T*)&VRAM_D[addr & 0x1FFFF];
-    if (mask & (1<<8)) ret |= *(T*)&VRAM_I[addr & 0x3FFF];
-
-    return ret;
+    return *(T*)&VRAMFlat_BOBJ[addr & 0x1FFFF];
 }
 
 template<typename T>
 void WriteVRAM_BOBJ(u32 addr, T val)
 {
+    if (Deferred2DPending) SyncDeferred2D();
+
     u32 mask = VRAMMap_BOBJ[(addr >> 14) & 0x7];
+    if (!mask) return;
+    VRAMGen_BOBJ[(addr >> 14) & 0x7]++;
 
     if (mask & (1<<3)) *(T*)&VRAM_D[addr & 0x1FFFF] = val;
     if (mask & (1<<8)) *(T*)&VRAM_I[addr & 0x3FFF] = val;
+
+    *(T*)&VRAMFlat_BOBJ[addr & 0x1FFFF] = val;
+    if (VRAMAlias_BOBJ[(addr >> 14) & 0x7])
+        UpdateFlatVRAMAlias(VRAMFlat_BOBJ, VRAMMap_BOBJ, VRAMGen_BOBJ, VRAMAlias_BOBJ[(addr >> 14) & 0x7], addr & 0x3FFF, sizeof(T));
 }
 
 
@@ -384,28 +411,13 @@ T ReadVRAM_OBJ(u32 addr)
 template<typename T>
 T ReadVRAM_Texture(u32 addr)
 {
-    T ret = 0;
-    u32 mask = VRAMMap_Texture[(addr >> 17) & 0x3];
-
-    if (mask & (1<<0)) ret |= *(T*)&VRAM_A[addr & 0x1FFFF];
-    if (mask & (1<<1)) ret |= *(T*)&VRAM_B[addr & 0x1FFFF];
-    if (mask & (1<<2)) ret |= *(T*)&VRAM_C[addr & 0x1FFFF];
-    if (mask & (1<<3)) ret |= *(T*)&VRAM_D[addr & 0x1FFFF];
-
-    return ret;
+    return *(T*)&VRAMFlat_Texture[addr & 0x7FFFF];
 }
 
 template<typename T>
 T ReadVRAM_TexPal(u32 addr)
 {
-    T ret = 0;
-    u32 mask = VRAMMap_TexPal[(addr >> 14) & 0x7];
-
-    if (mask & (1<<4)) ret |= *(T*)&VRAM_E[addr & 0xFFFF];
-    if (mask & (1<<5)) ret |= *(T*)&VRAM_F[addr & 0x3FFF];
-    if (mask & (1<<6)) ret |= *(T*)&VRAM_G[addr & 0x3FFF];
-
-    return ret;
+    return *(T*)&VRAMFlat_TexPal[addr & 0x1FFFF];
 }
 
 
@@ -21,6 +21,16 @@
 #include "NDS.h"
 #include "GPU.h"
 
+// GPU2D_NO_SIMD is for the differential test, which builds a scalar-only copy
+#if defined(GPU2D_NO_SIMD)
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define GPU2D_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define GPU2D_NEON
+#include <arm_neon.h>
+#endif
+
 
 // notes on color conversion
 //
@@ -81,6 +91,168 @@
 // TODO: find which parts of DISPCNT are latched. for example, not possible to change video mode midframe.
 
 
+// SIMD versions of the per-pixel color operations
+// they work on 4 pixels at a time, with each 6-bit component widened to 16 bits.
+// effect factors never exceed 16 (32 for 3D blending), so products fit in 16 bits
+// and results are bit-exact with ColorBlend4/ColorBlend5/ColorBrightnessUp/Down.
+
+#ifdef GPU2D_SSE2
+
+static inline __m128i ColorBrightnessUp_SSE2(__m128i val, __m128i factor)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(0x3F);
+
+    val = _mm_and_si128(val, _mm_set1_epi32(0x003F3F3F));
+    __m128i lo = _mm_unpacklo_epi8(val, zero);
+    __m128i hi = _mm_unpackhi_epi8(val, zero);
+
+    lo = _mm_add_epi16(lo, _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(max, lo), factor), 4));
+    hi = _mm_add_epi16(hi, _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(max, hi), factor), 4));
+
+    return _mm_or_si128(_mm_packus_epi16(lo, hi), _mm_set1_epi32(0xFF000000));
+}
+
+static inline __m128i ColorBrightnessDown_SSE2(__m128i val, __m128i factor)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    val = _mm_and_si128(val, _mm_set1_epi32(0x003F3F3F));
+    __m128i lo = _mm_unpacklo_epi8(val, zero);
+    __m128i hi = _mm_unpackhi_epi8(val, zero);
+
+    lo = _mm_sub_epi16(lo, _mm_srli_epi16(_mm_mullo_epi16(lo, factor), 4));
+    hi = _mm_sub_epi16(hi, _mm_srli_epi16(_mm_mullo_epi16(hi, factor), 4));
+
+    return _mm_or_si128(_mm_packus_epi16(lo, hi), _mm_set1_epi32(0xFF000000));
+}
+
+// per-pixel factors (32-bit lanes) -> each pixel's factor repeated over its 4 components
+static inline void SpreadFactor_SSE2(__m128i factor, __m128i* lo, __m128i* hi)
+{
+    factor = _mm_packs_epi32(factor, factor);
+    factor = _mm_unpacklo_epi16(factor, factor);
+    *lo = _mm_unpacklo_epi32(factor, factor);
+    *hi = _mm_unpackhi_epi32(factor, factor);
+}
+
+static inline __m128i ColorBlend4_SSE2(__m128i val1, __m128i val2, __m128i eva, __m128i evb)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(0x3F);
+    const __m128i mask = _mm_set1_epi32(0x003F3F3F);
+
+    val1 = _mm_and_si128(val1, mask);
+    val2 = _mm_and_si128(val2, mask);
+
+    __m128i evalo, evahi, evblo, evbhi;
+    SpreadFactor_SSE2(eva, &evalo, &evahi);
+    SpreadFactor_SSE2(evb, &evblo, &evbhi);
+
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(val1, zero), evalo),
+                               _mm_mullo_epi16(_mm_unpacklo_epi8(val2, zero), evblo));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(val1, zero), evahi),
+                               _mm_mullo_epi16(_mm_unpackhi_epi8(val2, zero), evbhi));
+
+    lo = _mm_min_epi16(_mm_srli_epi16(lo, 4), max);
+    hi = _mm_min_epi16(_mm_srli_epi16(hi, 4), max);
+
+    return _mm_or_si128(_mm_packus_epi16(lo, hi), _mm_set1_epi32(0xFF000000));
+}
+
+static inline __m128i ColorBlend5_SSE2(__m128i val1, __m128i val2)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(0x3F);
+    const __m128i mask = _mm_set1_epi32(0x003F3F3F);
+
+    __m128i eva = _mm_add_epi32(_mm_and_si128(_mm_srli_epi32(val1, 24), _mm_set1_epi32(0x1F)), _mm_set1_epi32(1));
+    __m128i evb = _mm_sub_epi32(_mm_set1_epi32(32), eva);
+
+    // +1 rounding applies when eva <= 16
+    __m128i round = _mm_and_si128(_mm_cmplt_epi32(eva, _mm_set1_epi32(17)), _mm_set1_epi32(1));
+    __m128i roundlo, roundhi;
+    SpreadFactor_SSE2(round, &roundlo, &roundhi);
+
+    __m128i c1 = _mm_and_si128(val1, mask);
+    __m128i c2 = _mm_and_si128(val2, mask);
+
+    __m128i evalo, evahi, evblo, evbhi;
+    SpreadFactor_SSE2(eva, &evalo, &evahi);
+    SpreadFactor_SSE2(evb, &evblo, &evbhi);
+
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(c1, zero), evalo),
+                               _mm_mullo_epi16(_mm_unpacklo_epi8(c2, zero), evblo));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(c1, zero), evahi),
+                               _mm_mullo_epi16(_mm_unpackhi_epi8(c2, zero), evbhi));
+
+    lo = _mm_min_epi16(_mm_add_epi16(_mm_srli_epi16(lo, 5), roundlo), max);
+    hi = _mm_min_epi16(_mm_add_epi16(_mm_srli_epi16(hi, 5), roundhi), max);
+
+    __m128i ret = _mm_or_si128(_mm_packus_epi16(lo, hi), _mm_set1_epi32(0xFF000000));
+
+    // full alpha: the 3D pixel is returned as-is
+    __m128i opaque = _mm_cmpeq_epi32(eva, _mm_set1_epi32(32));
+    return _mm_or_si128(_mm_and_si128(opaque, val1), _mm_andnot_si128(opaque, ret));
+}
+
+static inline __m128i ConvertToBGRA_SSE2(__m128i c)
+{
+    __m128i r = _mm_and_si128(_mm_slli_epi32(c, 18), _mm_set1_epi32(0xFC0000));
+    __m128i g = _mm_and_si128(_mm_slli_epi32(c, 2), _mm_set1_epi32(0xFC00));
+    __m128i b = _mm_and_si128(_mm_srli_epi32(c, 14), _mm_set1_epi32(0xFC));
+    c = _mm_or_si128(_mm_or_si128(r, g), b);
+
+    __m128i low = _mm_srli_epi32(_mm_and_si128(c, _mm_set1_epi32(0xC0C0C0)), 6);
+    return _mm_or_si128(_mm_or_si128(c, low), _mm_set1_epi32(0xFF000000));
+}
+
+#endif // GPU2D_SSE2
+
+#ifdef GPU2D_NEON
+
+static inline uint32x4_t ColorBrightnessUp_NEON(uint32x4_t val, uint16x8_t factor)
+{
+    const uint16x8_t max = vdupq_n_u16(0x3F);
+
+    uint8x16_t c = vreinterpretq_u8_u32(vandq_u32(val, vdupq_n_u32(0x003F3F3F)));
+    uint16x8_t lo = vmovl_u8(vget_low_u8(c));
+    uint16x8_t hi = vmovl_u8(vget_high_u8(c));
+
+    lo = vaddq_u16(lo, vshrq_n_u16(vmulq_u16(vsubq_u16(max, lo), factor), 4));
+    hi = vaddq_u16(hi, vshrq_n_u16(vmulq_u16(vsubq_u16(max, hi), factor), 4));
+
+    c = vcombine_u8(vmovn_u16(lo), vmovn_u16(hi));
+    return vorrq_u32(vreinterpretq_u32_u8(c), vdupq_n_u32(0xFF000000));
+}
+
+static inline uint32x4_t ColorBrightnessDown_NEON(uint32x4_t val, uint16x8_t factor)
+{
+    uint8x16_t c = vreinterpretq_u8_u32(vandq_u32(val, vdupq_n_u32(0x003F3F3F)));
+    uint16x8_t lo = vmovl_u8(vget_low_u8(c));
+    uint16x8_t hi = vmovl_u8(vget_high_u8(c));
+
+    lo = vsubq_u16(lo, vshrq_n_u16(vmulq_u16(lo, factor), 4));
+    hi = vsubq_u16(hi, vshrq_n_u16(vmulq_u16(hi, factor), 4));
+
+    c = vcombine_u8(vmovn_u16(lo), vmovn_u16(hi));
+    return vorrq_u32(vreinterpretq_u32_u8(c), vdupq_n_u32(0xFF000000));
+}
+
+static inline uint32x4_t ConvertToBGRA_NEON(uint32x4_t c)
+{
+    uint32x4_t r = vandq_u32(vshlq_n_u32(c, 18), vdupq_n_u32(0xFC0000));
+    uint32x4_t g = vandq_u32(vshlq_n_u32(c, 2), vdupq_n_u32(0xFC00));
+    uint32x4_t b = vandq_u32(vshrq_n_u32(c, 14), vdupq_n_u32(0xFC));
+    c = vorrq_u32(vorrq_u32(r, g), b);
+
+    uint32x4_t low = vshrq_n_u32(vandq_u32(c, vdupq_n_u32(0xC0C0C0)), 6);
+    return vorrq_u32(vorrq_u32(c, low), vdupq_n_u32(0xFF000000));
+}
+
+#endif // GPU2D_NEON
+
+
 GPU2D::GPU2D(u32 num)
 {
     Num = num;
@@ -94,6 +266,14 @@ GPU2D::GPU2D(u32 num)
             MosaicTable[m][x] = offset;
         }
     }
+
+    // pixels only covered by the backdrop read the second layer from here
+    memset(BGOBJLine, 0, sizeof(BGOBJLine));
+
+    for (int i = 0; i < 1024; i++)
+        TileCache[i].Key = 0xFFFFFFFF;
+    BGExtPalGen = 0;
+    SpriteListGen = 0;
 }
 
 GPU2D::~GPU2D()
@@ -110,6 +290,7 @@ void GPU2D::Reset()
     memset(BGYRef, 0, 2*4);
     memset(BGXRefInternal, 0, 2*4);
     memset(BGYRefInternal, 0, 2*4);
+    BGRefReload = 0;
     memset(BGRotA, 0, 2*2);
     memset(BGRotB, 0, 2*2);
     memset(BGRotC, 0, 2*2);
@@ -153,6 +334,8 @@ void GPU2D::Reset()
     BGExtPalStatus[2] = 0;
     BGExtPalStatus[3] = 0;
     OBJExtPalStatus = 0;
+    ExtPalDirty = 0;
+    BGExtPalGen++;
 }
 
 void GPU2D::DoSavestate(Savestate* file)
@@ -221,6 +404,7 @@ void GPU2D::DoSavestate(Savestate* file)
         BGExtPalStatus[2] = 0;
         BGExtPalStatus[3] = 0;
         OBJExtPalStatus = 0;
+        BGExtPalGen++;
 
         CurBGXMosaicTable = MosaicTable[BGMosaicSize[0]];
         CurOBJXMosaicTable = MosaicTable[OBJMosaicSize[0]];
@@ -446,21 +630,37 @@ void GPU2D::Write16(u32 addr, u16 val)
     case 0x026: BGRotD[0] = val; return;
     case 0x028:
         BGXRef[0] = (BGXRef[0] & 0xFFFF0000) | val;
-        if (GPU::VCount < 192) BGXRefInternal[0] = BGXRef[0];
+        if (GPU::VCount < 192)
+        {
+            BGXRefInternal[0] = BGXRef[0];
+            BGRefReload |= 0x1;
+        }
         return;
     case 0x02A:
         if (val & 0x0800) val |= 0xF000;
         BGXRef[0] = (BGXRef[0] & 0xFFFF) | (val << 16);
-        if (GPU::VCount < 192) BGXRefInternal[0] = BGXRef[0];
+        if (GPU::VCount < 192)
+        {
+            BGXRefInternal[0] = BGXRef[0];
+            BGRefReload |= 0x1;
+        }
         return;
     case 0x02C:
         BGYRef[0] = (BGYRef[0] & 0xFFFF0000) | val;
-        if (GPU::VCount < 192) BGYRefInternal[0] = BGYRef[0];
+        if (GPU::VCount < 192)
+        {
+            BGYRefInternal[0] = BGYRef[0];
+            BGRefReload |= 0x2;
+        }
         return;
     case 0x02E:
         if (val & 0x0800) val |= 0xF000;
         BGYRef[0] = (BGYRef[0] & 0xFFFF) | (val << 16);
-        if (GPU::VCount < 192) BGYRefInternal[0] = BGYRef[0];
+        if (GPU::VCount < 192)
+        {
+            BGYRefInternal[0] = BGYRef[0];
+            BGRefReload |= 0x2;
+        }
         return;
 
     case 0x030: BGRotA[1] = val; return;
@@ -469,21 +669,37 @@ void GPU2D::Write16(u32 addr, u16 val)
     case 0x036: BGRotD[1] = val; return;
     case 0x038:
         BGXRef[1] = (BGXRef[1] & 0xFFFF0000) | val;
-        if (GPU::VCount < 192) BGXRefInternal[1] = BGXRef[1];
+        if (GPU::VCount < 192)
+        {
+            BGXRefInternal[1] = BGXRef[1];
+            BGRefReload |= 0x4;
+        }
         return;
     case 0x03A:
         if (val & 0x0800) val |= 0xF000;
         BGXRef[1] = (BGXRef[1] & 0xFFFF) | (val << 16);
-        if (GPU::VCount < 192) BGXRefInternal[1] = BGXRef[1];
+        if (GPU::VCount < 192)
+        {
+            BGXRefInternal[1] = BGXRef[1];
+            BGRefReload |= 0x4;
+        }
         return;
     case 0x03C:
         BGYRef[1] = (BGYRef[1] & 0xFFFF0000) | val;
-        if (GPU::VCount < 192) BGYRefInternal[1] = BGYRef[1];
+        if (GPU::VCount < 192)
+        {
+            BGYRefInternal[1] = BGYRef[1];
+            BGRefReload |= 0x8;
+        }
         return;
     case 0x03E:
         if (val & 0x0800) val |= 0xF000;
         BGYRef[1] = (BGYRef[1] & 0xFFFF) | (val << 16);
-        if (GPU::VCount < 192) BGYRefInternal[1] = BGYRef[1];
+        if (GPU::VCount < 192)
+        {
+            BGYRefInternal[1] = BGYRef[1];
+            BGRefReload |= 0x8;
+        }
         return;
 
     case 0x040:
@@ -564,23 +780,39 @@ void GPU2D::Write32(u32 addr, u32 val)
     case 0x028:
         if (val & 0x08000000) val |= 0xF0000000;
         BGXRef[0] = val;
-        if (GPU::VCount < 192) BGXRefInternal[0] = BGXRef[0];
+        if (GPU::VCount < 192)
+        {
+            BGXRefInternal[0] = BGXRef[0];
+            BGRefReload |= 0x1;
+        }
         return;
     case 0x02C:
         if (val & 0x08000000) val |= 0xF0000000;
         BGYRef[0] = val;
-        if (GPU::VCount < 192) BGYRefInternal[0] = BGYRef[0];
+        if (GPU::VCount < 192)
+        {
+            BGYRefInternal[0] = BGYRef[0];
+            BGRefReload |= 0x2;
+        }
         return;
 
     case 0x038:
         if (val & 0x08000000) val |= 0xF0000000;
         BGXRef[1] = val;
-        if (GPU::VCount < 192) BGXRefInternal[1] = BGXRef[1];
+        if (GPU::VCount < 192)
+        {
+            BGXRefInternal[1] = BGXRef[1];
+            BGRefReload |= 0x4;
+        }
         return;
     case 0x03C:
         if (val & 0x08000000) val |= 0xF0000000;
         BGYRef[1] = val;
-        if (GPU::VCount < 192) BGYRefInternal[1] = BGYRef[1];
+        if (GPU::VCount < 192)
+        {
+            BGYRefInternal[1] = BGYRef[1];
+            BGRefReload |= 0x8;
+        }
         return;
 
     case 0x064:
@@ -730,6 +962,93 @@ u32 GPU2D::ColorComposite(int i, u32 val1, u32 val2)
     }
 }
 
+void GPU2D::ColorCompositeLine()
+{
+    int i = 0;
+
+#ifdef GPU2D_SSE2
+    // same decisions as ColorComposite(), evaluated as lane masks
+    // every effect is computed and the right one selected per pixel
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i blendcnt = _mm_set1_epi32(BlendCnt);
+    const __m128i evaglobal = _mm_set1_epi32(EVA);
+    const __m128i evbglobal = _mm_set1_epi32(EVB);
+    const __m128i evy = _mm_set1_epi16(EVY);
+    const u32 bldeffect = (BlendCnt >> 6) & 0x3;
+
+    for (; i < 256; i+=4)
+    {
+        __m128i val1 = _mm_loadu_si128((__m128i*)&BGOBJLine[i]);
+        __m128i val2 = _mm_loadu_si128((__m128i*)&BGOBJLine[256+i]);
+
+        __m128i flag1 = _mm_srli_epi32(val1, 24);
+        __m128i flag2 = _mm_srli_epi32(val2, 24);
+
+        __m128i f1sprite = _mm_cmpeq_epi32(_mm_and_si128(flag1, _mm_set1_epi32(0x80)), _mm_set1_epi32(0x80));
+        __m128i f1bitmap = _mm_cmpeq_epi32(_mm_and_si128(flag1, _mm_set1_epi32(0x40)), _mm_set1_epi32(0x40));
+        __m128i f2sprite = _mm_cmpeq_epi32(_mm_and_si128(flag2, _mm_set1_epi32(0x80)), _mm_set1_epi32(0x80));
+        __m128i f2bitmap = _mm_cmpeq_epi32(_mm_and_si128(flag2, _mm_set1_epi32(0x40)), _mm_set1_epi32(0x40));
+
+        __m128i target2 = _mm_slli_epi32(flag2, 8);
+        target2 = _mm_or_si128(_mm_and_si128(f2bitmap, _mm_set1_epi32(0x0100)), _mm_andnot_si128(f2bitmap, target2));
+        target2 = _mm_or_si128(_mm_and_si128(f2sprite, _mm_set1_epi32(0x1000)), _mm_andnot_si128(f2sprite, target2));
+        __m128i is2nd = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(target2, blendcnt), zero), _mm_set1_epi32(-1));
+
+        // sprite blending, 3D layer blending
+        __m128i spriteblend = _mm_and_si128(f1sprite, is2nd);
+        __m128i blend3d = _mm_andnot_si128(f1sprite, _mm_and_si128(f1bitmap, is2nd));
+
+        // regular color effects
+        __m128i target1 = flag1;
+        target1 = _mm_or_si128(_mm_and_si128(f1bitmap, _mm_set1_epi32(0x01)), _mm_andnot_si128(f1bitmap, target1));
+        target1 = _mm_or_si128(_mm_and_si128(f1sprite, _mm_set1_epi32(0x10)), _mm_andnot_si128(f1sprite, target1));
+        __m128i is1st = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(target1, blendcnt), zero), _mm_set1_epi32(-1));
+
+        __m128i winmask = _mm_cvtsi32_si128(*(u32*)&WindowMask[i]);
+        winmask = _mm_unpacklo_epi16(_mm_unpacklo_epi8(winmask, zero), zero);
+        __m128i winfx = _mm_cmpeq_epi32(_mm_and_si128(winmask, _mm_set1_epi32(0x20)), _mm_set1_epi32(0x20));
+
+        __m128i effect = _mm_andnot_si128(_mm_or_si128(spriteblend, blend3d), _mm_and_si128(is1st, winfx));
+
+        __m128i blend = spriteblend;
+        __m128i bright = zero;
+        if (bldeffect == 1)
+            blend = _mm_or_si128(blend, _mm_and_si128(effect, is2nd));
+        else if (bldeffect >= 2)
+            bright = effect;
+
+        // bitmap sprites carry their own alpha
+        __m128i spritealpha = _mm_and_si128(spriteblend, f1bitmap);
+        __m128i alpha = _mm_and_si128(flag1, _mm_set1_epi32(0x1F));
+        __m128i eva = _mm_or_si128(_mm_and_si128(spritealpha, alpha), _mm_andnot_si128(spritealpha, evaglobal));
+        __m128i evb = _mm_or_si128(_mm_and_si128(spritealpha, _mm_sub_epi32(_mm_set1_epi32(16), alpha)),
+                                   _mm_andnot_si128(spritealpha, evbglobal));
+
+        __m128i ret = val1;
+        if (_mm_movemask_epi8(blend))
+            ret = _mm_or_si128(_mm_and_si128(blend, ColorBlend4_SSE2(val1, val2, eva, evb)), _mm_andnot_si128(blend, ret));
+        if (_mm_movemask_epi8(bright))
+        {
+            __m128i res = (bldeffect == 2) ? ColorBrightnessUp_SSE2(val1, evy) : ColorBrightnessDown_SSE2(val1, evy);
+            ret = _mm_or_si128(_mm_and_si128(bright, res), _mm_andnot_si128(bright, ret));
+        }
+        if (_mm_movemask_epi8(blend3d))
+            ret = _mm_or_si128(_mm_and_si128(blend3d, ColorBlend5_SSE2(val1, val2)), _mm_andnot_si128(blend3d, ret));
+
+        _mm_storeu_si128((__m128i*)&BGOBJLine[i], ret);
+    }
+#endif
+
+    for (; i < 256; i++)
+    {
+        u32 val1 = BGOBJLine[i];
+        u32 val2 = BGOBJLine[256+i];
+
+        BGOBJLine[i] = ColorComposite(i, val1, val2);
+    }
+}
+
 
 void GPU2D::UpdateMosaicCounters(u32 line)
 {
@@ -749,13 +1068,13 @@ void GPU2D::UpdateMosaicCounters(u32 line)
 }
 
 
-void GPU2D::DrawScanline(u32 line)
+void GPU2D::DrawScanline(u32 line, u32 vcount)
 {
     int stride = Accelerated ? (256*3 + 1) : 256;
     u32* dst = &Framebuffer[stride * line];
 
     int n3dline = line;
-    line = GPU::VCount;
+    line = vcount;
 
     bool forceblank = false;
 
@@ -889,7 +1208,17 @@ void GPU2D::DrawScanline(u32 line)
             u32 factor = MasterBrightness & 0x1F;
             if (factor > 16) factor = 16;
 
-            for (int i = 0; i < 256; i++)
+            int i = 0;
+#if defined(GPU2D_SSE2)
+            __m128i vfactor = _mm_set1_epi16(factor);
+            for (; i < 256; i+=4)
+                _mm_storeu_si128((__m128i*)&dst[i], ColorBrightnessUp_SSE2(_mm_loadu_si128((__m128i*)&dst[i]), vfactor));
+#elif defined(GPU2D_NEON)
+            uint16x8_t vfactor = vdupq_n_u16(factor);
+            for (; i < 256; i+=4)
+                vst1q_u32(&dst[i], ColorBrightnessUp_NEON(vld1q_u32(&dst[i]), vfactor));
+#endif
+            for (; i < 256; i++)
             {
                 dst[i] = ColorBrightnessUp(dst[i], factor);
             }
@@ -900,7 +1229,17 @@ void GPU2D::DrawScanline(u32 line)
             u32 factor = MasterBrightness & 0x1F;
             if (factor > 16) factor = 16;
 
-            for (int i = 0; i < 256; i++)
+            int i = 0;
+#if defined(GPU2D_SSE2)
+            __m128i vfactor = _mm_set1_epi16(factor);
+            for (; i < 256; i+=4)
+                _mm_storeu_si128((__m128i*)&dst[i], ColorBrightnessDown_SSE2(_mm_loadu_si128((__m128i*)&dst[i]), vfactor));
+#elif defined(GPU2D_NEON)
+            uint16x8_t vfactor = vdupq_n_u16(factor);
+            for (; i < 256; i+=4)
+                vst1q_u32(&dst[i], ColorBrightnessDown_NEON(vld1q_u32(&dst[i]), vfactor));
+#endif
+            for (; i < 256; i++)
             {
                 dst[i] = ColorBrightnessDown(dst[i], factor);
             }
@@ -910,7 +1249,20 @@ void GPU2D::DrawScanline(u32 line)
     // convert to 32-bit BGRA
     // note: 32-bit RGBA would be more straightforward, but
     // BGRA seems to be more compatible (Direct2D soft, cairo...)
-    for (int i = 0; i < 256; i+=2)
+    int i = 0;
+#if defined(GPU2D_SSE2)
+    for (; i < 256; i+=4)
+        _mm_storeu_si128((__m128i*)&dst[i], ConvertToBGRA_SSE2(_mm_loadu_si128((__m128i*)&dst[i])));
+#elif defined(GPU2D_NEON)
+    for (; i < 256; i+=4)
+        vst1q_u32(&dst[i], ConvertToBGRA_NEON(vld1q_u32(&dst[i])));
+#endif
+    ConvertLineToBGRA(dst, i);
+}
+
+void GPU2D::ConvertLineToBGRA(u32* dst, int start)
+{
+    for (int i = start; i < 256; i+=2)
     {
         u64 c = *(u64*)&dst[i];
 
@@ -923,6 +1275,40 @@ void GPU2D::DrawScanline(u32 line)
     }
 }
 
+void GPU2D::SkipScanline(u32 vcount)
+{
+    // the scanline isn't rendered, but the state carried over
+    // to the next scanline still has to advance like it would
+
+    if (vcount > 192) return;
+    if (Num && !Enabled) return;
+
+    if (!(DispCnt & (1<<7)))
+    {
+        u32 bgmode = DispCnt & 0x7;
+
+        // BG3 is affine/extended in modes 1-5
+        if ((DispCnt & 0x0800) && (bgmode >= 1) && (bgmode <= 5))
+        {
+            BGXRefInternal[1] += BGRotB[1];
+            BGYRefInternal[1] += BGRotD[1];
+        }
+
+        // BG2 is affine/extended/large in modes 2, 4, 5 and 6
+        if ((DispCnt & 0x0400) && (bgmode == 2 || (bgmode >= 4 && bgmode <= 6)))
+        {
+            BGXRefInternal[0] += BGRotB[0];
+            BGYRefInternal[0] += BGRotD[0];
+        }
+
+        // window X state, as CalculateWindowMask() would leave it
+        if (DispCnt & (1<<14)) AdvanceWindowX(&Win1Active, Win1Coords[0], Win1Coords[1]);
+        if (DispCnt & (1<<13)) AdvanceWindowX(&Win0Active, Win0Coords[0], Win0Coords[1]);
+    }
+
+    UpdateMosaicCounters(vcount);
+}
+
 void GPU2D::VBlank()
 {
     CaptureCnt &= ~(1<<31);
@@ -948,7 +1334,7 @@ void GPU2D::VBlankEnd()
 
     if (Accelerated)
     {
-        if ((Num == 0) && (CaptureCnt & (1<<31)) && (((CaptureCnt >> 29) & 0x3) != 1))
+        if ((Num == 0) && (CaptureCnt & (1<<31)) && (((CaptureCnt >> 29) & 0x3) != 1) && (GPU3D::Renderer != 0))
         {
             GPU3D::GLRenderer::PrepareCaptureFrame();
         }
@@ -956,6 +1342,133 @@ void GPU2D::VBlankEnd()
 }
 
 
+// deferred rendering
+//
+// the registers that affect rendering are latched at HBlank and replayed
+// into a separate GPU2D instance on the render thread. the state that is
+// updated while drawing (affine reference points, mosaic counters, window
+// X state, sprite line) is owned by whichever instance is drawing and gets
+// handed over with CopyRenderState().
+
+void GPU2D::SaveLineRegs(LineRegs* regs)
+{
+    regs->Framebuffer = Framebuffer;
+    regs->Enabled = Enabled;
+    regs->VCount = GPU::VCount;
+
+    regs->DispCnt = DispCnt;
+    memcpy(regs->BGCnt, BGCnt, 4*2);
+    memcpy(regs->BGXPos, BGXPos, 4*2);
+    memcpy(regs->BGYPos, BGYPos, 4*2);
+
+    memcpy(regs->BGXRef, BGXRef, 2*4);
+    memcpy(regs->BGYRef, BGYRef, 2*4);
+    regs->BGRefReload = BGRefReload;
+    memcpy(regs->BGRotA, BGRotA, 2*2);
+    memcpy(regs->BGRotB, BGRotB, 2*2);
+    memcpy(regs->BGRotC, BGRotC, 2*2);
+    memcpy(regs->BGRotD, BGRotD, 2*2);
+
+    memcpy(regs->Win0Coords, Win0Coords, 4);
+    memcpy(regs->Win1Coords, Win1Coords, 4);
+    memcpy(regs->WinCnt, WinCnt, 4);
+    regs->Win0Active = Win0Active & 0x1;
+    regs->Win1Active = Win1Active & 0x1;
+
+    memcpy(regs->BGMosaicSize, BGMosaicSize, 2);
+    memcpy(regs->OBJMosaicSize, OBJMosaicSize, 2);
+
+    regs->BlendCnt = BlendCnt;
+    regs->EVA = EVA;
+    regs->EVB = EVB;
+    regs->EVY = EVY;
+
+    regs->MasterBrightness = MasterBrightness;
+
+    regs->ExtPalDirty = ExtPalDirty;
+
+    BGRefReload = 0;
+    ExtPalDirty = 0;
+}
+
+void GPU2D::LoadLineRegs(LineRegs* regs)
+{
+    Framebuffer = regs->Framebuffer;
+    Enabled = regs->Enabled;
+
+    DispCnt = regs->DispCnt;
+    memcpy(BGCnt, regs->BGCnt, 4*2);
+    memcpy(BGXPos, regs->BGXPos, 4*2);
+    memcpy(BGYPos, regs->BGYPos, 4*2);
+
+    memcpy(BGXRef, regs->BGXRef, 2*4);
+    memcpy(BGYRef, regs->BGYRef, 2*4);
+    if (regs->BGRefReload & 0x1) BGXRefInternal[0] = BGXRef[0];
+    if (regs->BGRefReload & 0x2) BGYRefInternal[0] = BGYRef[0];
+    if (regs->BGRefReload & 0x4) BGXRefInternal[1] = BGXRef[1];
+    if (regs->BGRefReload & 0x8) BGYRefInternal[1] = BGYRef[1];
+    memcpy(BGRotA, regs->BGRotA, 2*2);
+    memcpy(BGRotB, regs->BGRotB, 2*2);
+    memcpy(BGRotC, regs->BGRotC, 2*2);
+    memcpy(BGRotD, regs->BGRotD, 2*2);
+
+    memcpy(Win0Coords, regs->Win0Coords, 4);
+    memcpy(Win1Coords, regs->Win1Coords, 4);
+    memcpy(WinCnt, regs->WinCnt, 4);
+    Win0Active = (Win0Active & 0x2) | regs->Win0Active;
+    Win1Active = (Win1Active & 0x2) | regs->Win1Active;
+
+    memcpy(BGMosaicSize, regs->BGMosaicSize, 2);
+    memcpy(OBJMosaicSize, regs->OBJMosaicSize, 2);
+    CurBGXMosaicTable = MosaicTable[BGMosaicSize[0]];
+    CurOBJXMosaicTable = MosaicTable[OBJMosaicSize[0]];
+
+    BlendCnt = regs->BlendCnt;
+    EVA = regs->EVA;
+    EVB = regs->EVB;
+    EVY = regs->EVY;
+
+    MasterBrightness = regs->MasterBrightness;
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (regs->ExtPalDirty & (1<<i))
+            BGExtPalStatus[i] = 0;
+    }
+    if (regs->ExtPalDirty & 0xF)
+        BGExtPalGen++;
+    if (regs->ExtPalDirty & 0x10)
+        OBJExtPalStatus = 0;
+}
+
+void GPU2D::CopyRenderState(GPU2D* src)
+{
+    memcpy(BGXRefInternal, src->BGXRefInternal, 2*4);
+    memcpy(BGYRefInternal, src->BGYRefInternal, 2*4);
+
+    // window Y state is maintained by CheckWindows() on the emulation side
+    Win0Active = (Win0Active & 0x1) | (src->Win0Active & 0x2);
+    Win1Active = (Win1Active & 0x1) | (src->Win1Active & 0x2);
+
+    BGMosaicY = src->BGMosaicY;
+    BGMosaicYMax = src->BGMosaicYMax;
+    OBJMosaicY = src->OBJMosaicY;
+    OBJMosaicYCount = src->OBJMosaicYCount;
+
+    NumSprites = src->NumSprites;
+    memcpy(OBJLine, src->OBJLine, 256*4);
+    memcpy(OBJWindow, src->OBJWindow, 256);
+    memcpy(OBJIndex, src->OBJIndex, 256);
+
+    BGExtPalStatus[0] = 0;
+    BGExtPalStatus[1] = 0;
+    BGExtPalStatus[2] = 0;
+    BGExtPalStatus[3] = 0;
+    OBJExtPalStatus = 0;
+    BGExtPalGen++;
+}
+
+
 void GPU2D::DoCapture(u32 line, u32 width)
 {
     u32 dstvram = (CaptureCnt >> 16) & 0x3;
@@ -1191,11 +1704,14 @@ void GPU2D::BGExtPalDirty(u32 base)
 {
     BGExtPalStatus[base] = 0;
     BGExtPalStatus[base+1] = 0;
+    ExtPalDirty |= (0x3 << base);
+    BGExtPalGen++;
 }
 
 void GPU2D::OBJExtPalDirty()
 {
     OBJExtPalStatus = 0;
+    ExtPalDirty |= 0x10;
 }
 
 
@@ -1235,6 +1751,58 @@ u16* GPU2D::GetBGExtPal(u32 slot, u32 pal)
     return dst;
 }
 
+// tile cache key:
+// bit 0-13: tile address in BG VRAM, in 32-byte units
+// bit 14: 256-color
+// bit 15: horizontal flip (baked into the decoded pixels)
+// bit 16-19: palette number
+// bit 20-22: palette source (0 = standard, 4+slot = extended)
+#define TILE_8BPP  (1<<14)
+#define TILE_HFLIP (1<<15)
+
+u16* GPU2D::GetDecodedTile(u32 tileaddr, u32 flags, u16* pal, u32 palgen)
+{
+    u32 key = ((tileaddr >> 5) & 0x3FFF) | flags;
+    u32 vramgen = Num ? GPU::VRAMGen_BBG[(tileaddr >> 14) & 0x7] : GPU::VRAMGen_ABG[(tileaddr >> 14) & 0x1F];
+
+    TileCacheEntry* entry = &TileCache[(key ^ (key >> 10)) & 0x3FF];
+    if (entry->Key == key && entry->VRAMGen == vramgen && entry->PalGen == palgen)
+        return entry->Pixels;
+
+    u16* dst = entry->Pixels;
+    for (int y = 0; y < 8; y++)
+    {
+        u8 row[8];
+        if (flags & TILE_8BPP)
+        {
+            u32 pix0 = GPU::ReadVRAM_BG<u32>(tileaddr + (y << 3));
+            u32 pix1 = GPU::ReadVRAM_BG<u32>(tileaddr + (y << 3) + 4);
+            for (int x = 0; x < 4; x++)
+            {
+                row[x]   = pix0 >> (x << 3);
+                row[x+4] = pix1 >> (x << 3);
+            }
+        }
+        else
+        {
+            u32 pix = GPU::ReadVRAM_BG<u32>(tileaddr + (y << 2));
+            for (int x = 0; x < 8; x++)
+                row[x] = (pix >> (x << 2)) & 0xF;
+        }
+
+        for (int x = 0; x < 8; x++)
+        {
+            u8 color = row[(flags & TILE_HFLIP) ? (7-x) : x];
+            *dst++ = color ? (pal[color] | 0x8000) : 0;
+        }
+    }
+
+    entry->Key = key;
+    entry->VRAMGen = vramgen;
+    entry->PalGen = palgen;
+    return entry->Pixels;
+}
+
 u16* GPU2D::GetOBJExtPal()
 {
     u16* dst = OBJExtPalCache;
@@ -1285,7 +1853,18 @@ void GPU2D::CalculateWindowMask(u32 line)
     if (DispCnt & (1<<15))
     {
         // OBJ window
-        for (int i = 0; i < 256; i++)
+        int i = 0;
+#ifdef GPU2D_SSE2
+        const __m128i wincnt = _mm_set1_epi8(WinCnt[3]);
+        for (; i < 256; i+=16)
+        {
+            __m128i outside = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)&OBJWindow[i]), _mm_setzero_si128());
+            __m128i mask = _mm_loadu_si128((__m128i*)&WindowMask[i]);
+            mask = _mm_or_si128(_mm_and_si128(outside, mask), _mm_andnot_si128(outside, wincnt));
+            _mm_storeu_si128((__m128i*)&WindowMask[i], mask);
+        }
+#endif
+        for (; i < 256; i++)
         {
             if (OBJWindow[i])
                 WindowMask[i] = WinCnt[3];
@@ -1295,32 +1874,42 @@ void GPU2D::CalculateWindowMask(u32 line)
     if (DispCnt & (1<<14))
     {
         // window 1
-        u8 x1 = Win1Coords[0];
-        u8 x2 = Win1Coords[1];
-
-        for (int i = 0; i < 256; i++)
-        {
-            if (i == x2)      Win1Active &= ~0x2;
-            else if (i == x1) Win1Active |=  0x2;
-
-            if (Win1Active == 0x3) WindowMask[i] = WinCnt[1];
-        }
+        ApplyWindowX(WinCnt[1], &Win1Active, Win1Coords[0], Win1Coords[1]);
     }
 
     if (DispCnt & (1<<13))
     {
         // window 0
-        u8 x1 = Win0Coords[0];
-        u8 x2 = Win0Coords[1];
+        ApplyWindowX(WinCnt[0], &Win0Active, Win0Coords[0], Win0Coords[1]);
+    }
+}
 
-        for (int i = 0; i < 256; i++)
-        {
-            if (i == x2)      Win0Active &= ~0x2;
-            else if (i == x1) Win0Active |=  0x2;
+void GPU2D::ApplyWindowX(u8 wincnt, u32* active, u8 x1, u8 x2)
+{
+    // the X state is set at x1 and cleared at x2 (which wins if both are equal)
+    // so it only changes at those two points, and the mask can be filled in spans
+    // the state is kept across scanlines, like the hardware does
 
-            if (Win0Active == 0x3) WindowMask[i] = WinCnt[0];
-        }
+    if (*active & 0x1)
+    {
+        u32 first = (x1 < x2) ? x1 : x2;
+        if (*active & 0x2)
+            memset(&WindowMask[0], wincnt, first);
+
+        if (x1 < x2)
+            memset(&WindowMask[x1], wincnt, x2 - x1);
+        else if (x1 > x2)
+            memset(&WindowMask[x1], wincnt, 256 - x1);
     }
+
+    AdvanceWindowX(active, x1, x2);
+}
+
+void GPU2D::AdvanceWindowX(u32* active, u8 x1, u8 x2)
+{
+    // X state as of the end of the line, the last of x1/x2 to be reached wins
+    if (x1 > x2) *active |= 0x2;
+    else         *active &= ~0x2;
 }
 
 
@@ -1484,13 +2073,7 @@ void GPU2D::DrawScanline_BGOBJ(u32 line)
 
     if (!Accelerated)
     {
-        for (int i = 0; i < 256; i++)
-        {
-            u32 val1 = BGOBJLine[i];
-            u32 val2 = BGOBJLine[256+i];
-
-            BGOBJLine[i] = ColorComposite(i, val1, val2);
-        }
+        ColorCompositeLine();
     }
     else
     {
@@ -1657,7 +2240,8 @@ void GPU2D::DrawBG_3D()
     {
         for (; i < iend; i++)
         {
-            u32 c = _3DLine[xoff];
+            // xoff goes past 0x1FF when the layer is scrolled left
+            u32 c = _3DLine[xoff & 0xFF];
             xoff++;
 
             if ((c >> 24) == 0) continue;
@@ -1723,6 +2307,56 @@ void GPU2D::DrawBG_Text(u32 line, u32 bgnum)
     u8 color;
     u32 lastxpos;
 
+    if (!mosaic)
+    {
+        // go through the decoded tile cache, one tile row per 8 pixels
+        u32 palgen = (extpal && (bgcnt & 0x0080)) ? BGExtPalGen : GPU::PaletteGen[Num ? 2 : 0];
+        u32 tiley = yoff & 0x7;
+        u32 xpos = xoff;
+
+        for (int i = 0; i < 256;)
+        {
+            curtile = GPU::ReadVRAM_BG<u16>(tilemapaddr + ((xpos & 0xF8) >> 2) + ((xpos & widexmask) << 3));
+
+            u32 flags = (curtile & 0x0400) << 5;
+            u16* tile;
+            if (bgcnt & 0x0080)
+            {
+                flags |= TILE_8BPP;
+                if (extpal)
+                {
+                    flags |= ((curtile & 0xF000) << 4) | ((4|extpalslot) << 20);
+                    curpal = GetBGExtPal(extpalslot, curtile>>12);
+                }
+                else
+                    curpal = pal;
+
+                tile = GetDecodedTile(tilesetaddr + ((curtile & 0x03FF) << 6), flags, curpal, palgen);
+            }
+            else
+            {
+                flags |= (curtile & 0xF000) << 4;
+                curpal = pal + ((curtile & 0xF000) >> 8);
+
+                tile = GetDecodedTile(tilesetaddr + ((curtile & 0x03FF) << 5), flags, curpal, palgen);
+            }
+
+            u16* row = &tile[((curtile & 0x0800) ? (7-tiley) : tiley) << 3];
+
+            for (u32 tilexoff = xpos & 0x7; tilexoff < 8 && i < 256; tilexoff++)
+            {
+                u16 px = row[tilexoff];
+                if ((px & 0x8000) && (WindowMask[i] & (1<<bgnum)))
+                    DrawPixel(&BGOBJLine[i], px, 0x01000000<<bgnum);
+
+                i++;
+                xpos++;
+            }
+        }
+
+        return;
+    }
+
     if (bgcnt & 0x0080)
     {
         // 256-color
@@ -2093,7 +2727,9 @@ void GPU2D::DrawBG_Extended(u32 line, u32 bgnum)
 
         u16 curtile;
         u16* curpal;
-        u8 color;
+        u32 lasttile = 0xFFFFFFFF;
+        u16* tile;
+        u32 palgen = extpal ? BGExtPalGen : GPU::PaletteGen[Num ? 2 : 0];
 
         yshift -= 3;
 
@@ -2118,8 +2754,20 @@ void GPU2D::DrawBG_Extended(u32 line, u32 bgnum)
                 {
                     curtile = GPU::ReadVRAM_BG<u16>(tilemapaddr + (((((finalY & coordmask) >> 11) << yshift) + ((finalX & coordmask) >> 11)) << 1));
 
-                    if (extpal) curpal = GetBGExtPal(bgnum, curtile>>12);
-                    else        curpal = pal;
+                    if (curtile != lasttile)
+                    {
+                        u32 flags = TILE_8BPP;
+                        if (extpal)
+                        {
+                            flags |= ((curtile & 0xF000) << 4) | ((4|bgnum) << 20);
+                            curpal = GetBGExtPal(bgnum, curtile>>12);
+                        }
+                        else
+                            curpal = pal;
+
+                        tile = GetDecodedTile(tilesetaddr + ((curtile & 0x03FF) << 6), flags, curpal, palgen);
+                        lasttile = curtile;
+                    }
 
                     // draw pixel
                     u32 tilexoff = (finalX >> 8) & 0x7;
@@ -2128,10 +2776,9 @@ void GPU2D::DrawBG_Extended(u32 line, u32 bgnum)
                     if (curtile & 0x0400) tilexoff = 7-tilexoff;
                     if (curtile & 0x0800) tileyoff = 7-tileyoff;
 
-                    color = GPU::ReadVRAM_BG<u8>(tilesetaddr + ((curtile & 0x03FF) << 6) + (tileyoff << 3) + tilexoff);
-
-                    if (color)
-                        DrawPixel(&BGOBJLine[i], curpal[color], 0x01000000<<bgnum);
+                    u16 px = tile[(tileyoff << 3) + tilexoff];
+                    if (px & 0x8000)
+                        DrawPixel(&BGOBJLine[i], px, 0x01000000<<bgnum);
                 }
             }
 
@@ -2327,6 +2974,76 @@ void GPU2D::InterleaveSprites(u32 prio)
         DrawSprite_##type<false>(__VA_ARGS__); \
     }
 
+const s32 SpriteWidth[16] =
+{
+    8, 16, 8, 8,
+    16, 32, 8, 8,
+    32, 32, 16, 8,
+    64, 64, 32, 8
+};
+const s32 SpriteHeight[16] =
+{
+    8, 8, 16, 8,
+    16, 8, 32, 8,
+    32, 16, 32, 8,
+    64, 32, 64, 8
+};
+
+void GPU2D::UpdateSpriteList()
+{
+    u16* oam = (u16*)&GPU::OAM[Num ? 0x400 : 0];
+
+    memset(SpriteLineMask, 0, sizeof(SpriteLineMask));
+    memset(SpritePrioMask, 0, sizeof(SpritePrioMask));
+    memset(SpriteRotscaleMask, 0, sizeof(SpriteRotscaleMask));
+    memset(SpriteWindowMask, 0, sizeof(SpriteWindowMask));
+    memset(SpriteMosaicMask, 0, sizeof(SpriteMosaicMask));
+
+    for (u32 sprnum = 0; sprnum < 128; sprnum++)
+    {
+        u16* attrib = &oam[sprnum*4];
+        SpriteInfo* sprite = &Sprites[sprnum];
+        u32 word = sprnum >> 5;
+        u32 bit = 1u << (sprnum & 0x1F);
+
+        u32 sizeparam = (attrib[0] >> 14) | ((attrib[1] & 0xC000) >> 12);
+        sprite->Width = SpriteWidth[sizeparam];
+        sprite->Height = SpriteHeight[sizeparam];
+        sprite->BoundWidth = sprite->Width;
+        sprite->BoundHeight = sprite->Height;
+
+        if (attrib[0] & 0x0100)
+        {
+            if (attrib[0] & 0x0200)
+            {
+                sprite->BoundWidth <<= 1;
+                sprite->BoundHeight <<= 1;
+            }
+
+            SpriteRotscaleMask[word] |= bit;
+        }
+        else if (attrib[0] & 0x0200)
+            continue;
+
+        sprite->XPos = (s32)(attrib[1] << 23) >> 23;
+        if (sprite->XPos <= -(s32)sprite->BoundWidth)
+            continue;
+
+        sprite->YPos = attrib[0] & 0xFF;
+
+        bool iswin = (((attrib[0] >> 10) & 0x3) == 2);
+        if (iswin)
+            SpriteWindowMask[word] |= bit;
+        else if (attrib[0] & 0x1000)
+            SpriteMosaicMask[word] |= bit;
+
+        SpritePrioMask[(attrib[2] >> 10) & 0x3][word] |= bit;
+
+        for (u32 y = 0; y < sprite->BoundHeight; y++)
+            SpriteLineMask[(sprite->YPos + y) & 0xFF][word] |= bit;
+    }
+}
+
 void GPU2D::DrawSprites(u32 line)
 {
     if (line == 0)
@@ -2348,91 +3065,52 @@ void GPU2D::DrawSprites(u32 line)
 
     memset(OBJIndex, 0xFF, 256);
 
-    u16* oam = (u16*)&GPU::OAM[Num ? 0x400 : 0];
-
-    const s32 spritewidth[16] =
+    if (SpriteListGen != GPU::OAMGen[Num])
     {
-        8, 16, 8, 8,
-        16, 32, 8, 8,
-        32, 32, 16, 8,
-        64, 64, 32, 8
-    };
-    const s32 spriteheight[16] =
+        UpdateSpriteList();
+        SpriteListGen = GPU::OAMGen[Num];
+    }
+
+    // Y-mosaic'd sprites are matched against the mosaic line instead
+    u32 visible[4];
+    for (int i = 0; i < 4; i++)
     {
-        8, 8, 16, 8,
-        16, 8, 32, 8,
-        32, 16, 32, 8,
-        64, 32, 64, 8
-    };
+        visible[i] = (SpriteLineMask[line & 0xFF][i] & ~SpriteMosaicMask[i]) |
+                     (SpriteLineMask[OBJMosaicY][i] & SpriteMosaicMask[i]);
+    }
 
-    for (int bgnum = 0x0C00; bgnum >= 0x0000; bgnum -= 0x0400)
+    for (int prio = 3; prio >= 0; prio--)
     {
-        for (int sprnum = 127; sprnum >= 0; sprnum--)
+        for (int word = 3; word >= 0; word--)
         {
-            u16* attrib = &oam[sprnum*4];
-
-            if ((attrib[2] & 0x0C00) != bgnum)
-                continue;
-
-            bool iswin = (((attrib[0] >> 10) & 0x3) == 2);
-
-            u32 sprline;
-            if ((attrib[0] & 0x1000) && !iswin)
-            {
-                // apply Y mosaic
-                sprline = OBJMosaicY;
-            }
-            else
-                sprline = line;
-
-            if (attrib[0] & 0x0100)
-            {
-                u32 sizeparam = (attrib[0] >> 14) | ((attrib[1] & 0xC000) >> 12);
-                s32 width = spritewidth[sizeparam];
-                s32 height = spriteheight[sizeparam];
-                s32 boundwidth = width;
-                s32 boundheight = height;
-
-                if (attrib[0] & 0x0200)
-                {
-                    boundwidth <<= 1;
-                    boundheight <<= 1;
-                }
-
-                u32 ypos = attrib[0] & 0xFF;
-                ypos = (sprline - ypos) & 0xFF;
-                if (ypos >= (u32)boundheight)
-                    continue;
-
-                s32 xpos = (s32)(attrib[1] << 23) >> 23;
-                if (xpos <= -boundwidth)
-                    continue;
+            u32 mask = visible[word] & SpritePrioMask[prio][word];
 
-                u32 rotparamgroup = (attrib[1] >> 9) & 0x1F;
-
-                DoDrawSprite(Rotscale, sprnum, boundwidth, boundheight, width, height, xpos, ypos);
-
-                NumSprites++;
-            }
-            else
+            for (int bit = 31; mask; bit--)
             {
-                if (attrib[0] & 0x0200)
+                if (!(mask & (1u << bit)))
                     continue;
+                mask &= ~(1u << bit);
 
-                u32 sizeparam = (attrib[0] >> 14) | ((attrib[1] & 0xC000) >> 12);
-                s32 width = spritewidth[sizeparam];
-                s32 height = spriteheight[sizeparam];
+                u32 sprnum = (word << 5) | bit;
+                SpriteInfo* sprite = &Sprites[sprnum];
+                bool iswin = SpriteWindowMask[word] & (1u << bit);
 
-                u32 ypos = attrib[0] & 0xFF;
-                ypos = (sprline - ypos) & 0xFF;
-                if (ypos >= (u32)height)
-                    continue;
+                u32 sprline;
+                if (SpriteMosaicMask[word] & (1u << bit))
+                    sprline = OBJMosaicY;
+                else
+                    sprline = line;
 
-                s32 xpos = (s32)(attrib[1] << 23) >> 23;
-                if (xpos <= -width)
-                    continue;
+                u32 ypos = (sprline - sprite->YPos) & 0xFF;
 
-                DoDrawSprite(Normal, sprnum, width, height, xpos, ypos);
+                if (SpriteRotscaleMask[word] & (1u << bit))
+                {
+                    DoDrawSprite(Rotscale, sprnum, sprite->BoundWidth, sprite->BoundHeight, sprite->Width, sprite->Height, sprite->XPos, ypos);
+                }
+                else
+                {
+                    DoDrawSprite(Normal, sprnum, sprite->Width, sprite->Height, sprite->XPos, ypos);
+                }
 
                 NumSprites++;
             }
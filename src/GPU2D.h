@@ -50,9 +50,57 @@ public:
         return false;
     }
 
+    bool UsesCapture()
+    {
+        return (CaptureCnt & (1<<31)) != 0;
+    }
+
     void SampleFIFO(u32 offset, u32 num);
 
-    void DrawScanline(u32 line);
+    // register state latched at HBlank for deferred rendering
+    struct LineRegs
+    {
+        u32* Framebuffer;
+        bool Enabled;
+        u32 VCount;
+
+        u32 DispCnt;
+        u16 BGCnt[4];
+        u16 BGXPos[4];
+        u16 BGYPos[4];
+
+        s32 BGXRef[2];
+        s32 BGYRef[2];
+        u32 BGRefReload;
+        s16 BGRotA[2];
+        s16 BGRotB[2];
+        s16 BGRotC[2];
+        s16 BGRotD[2];
+
+        u8 Win0Coords[4];
+        u8 Win1Coords[4];
+        u8 WinCnt[4];
+        u32 Win0Active;
+        u32 Win1Active;
+
+        u8 BGMosaicSize[2];
+        u8 OBJMosaicSize[2];
+
+        u16 BlendCnt;
+        u8 EVA, EVB;
+        u8 EVY;
+
+        u16 MasterBrightness;
+
+        u32 ExtPalDirty;
+    };
+
+    void SaveLineRegs(LineRegs* regs);
+    void LoadLineRegs(LineRegs* regs);
+    void CopyRenderState(GPU2D* src);
+
+    void DrawScanline(u32 line, u32 vcount);
+    void SkipScanline(u32 vcount);
     void DrawSprites(u32 line);
     void VBlank();
     void VBlankEnd();
@@ -82,6 +130,24 @@ private:
 
     u32 NumSprites;
 
+    // OAM pre-pass: decoded attributes and visible sprites per sprite line
+    // rebuilt whenever OAM was written to since the last time
+    struct SpriteInfo
+    {
+        s32 XPos;
+        u32 YPos;
+        u32 Width, Height;
+        u32 BoundWidth, BoundHeight;
+    };
+
+    SpriteInfo Sprites[128];
+    u32 SpriteLineMask[256][4];
+    u32 SpritePrioMask[4][4];
+    u32 SpriteRotscaleMask[4];
+    u32 SpriteWindowMask[4];
+    u32 SpriteMosaicMask[4];
+    u32 SpriteListGen;
+
     u16 DispFIFO[16];
     u32 DispFIFOReadPtr;
     u32 DispFIFOWritePtr;
@@ -98,6 +164,7 @@ private:
     s32 BGYRef[2];
     s32 BGXRefInternal[2];
     s32 BGYRefInternal[2];
+    u32 BGRefReload;
     s16 BGRotA[2];
     s16 BGRotB[2];
     s16 BGRotC[2];
@@ -131,12 +198,29 @@ private:
     u16 OBJExtPalCache[16*256];
     u32 BGExtPalStatus[4];
     u32 OBJExtPalStatus;
+    u32 ExtPalDirty;
+    u32 BGExtPalGen;
+
+    // decoded BG tiles, 8x8 colors with bit 15 set for opaque pixels
+    struct TileCacheEntry
+    {
+        u32 Key;
+        u32 VRAMGen;
+        u32 PalGen;
+        u16 Pixels[64];
+    };
+
+    TileCacheEntry TileCache[1024];
+
+    u16* GetDecodedTile(u32 tileaddr, u32 flags, u16* pal, u32 palgen);
 
     u32 ColorBlend4(u32 val1, u32 val2, u32 eva, u32 evb);
     u32 ColorBlend5(u32 val1, u32 val2);
     u32 ColorBrightnessUp(u32 val, u32 factor);
     u32 ColorBrightnessDown(u32 val, u32 factor);
     u32 ColorComposite(int i, u32 val1, u32 val2);
+    void ColorCompositeLine();
+    void ConvertLineToBGRA(u32* dst, int start);
 
     void UpdateMosaicCounters(u32 line);
 
@@ -155,6 +239,7 @@ private:
     template<bool mosaic> void DrawBG_Extended(u32 line, u32 bgnum);
     template<bool mosaic> void DrawBG_Large(u32 line);
 
+    void UpdateSpriteList();
     void ApplySpriteMosaicX();
     void InterleaveSprites(u32 prio);
     template<bool window> void DrawSprite_Rotscale(u32 num, u32 boundwidth, u32 boundheight, u32 width, u32 height, s32 xpos, s32 ypos);
@@ -163,6 +248,8 @@ private:
     void DoCapture(u32 line, u32 width);
 
     void CalculateWindowMask(u32 line);
+    void AdvanceWindowX(u32* active, u8 x1, u8 x2);
+    void ApplyWindowX(u8 wincnt, u32* active, u8 x1, u8 x2);
 };
 
 #endif
@@ -24,6 +24,23 @@
 #include "FIFO.h"
 #include "Config.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define GPU3D_SSE2
+#include <emmintrin.h>
+#endif
+
+// the SSE4.1 paths are built on any x86 target and picked at runtime
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define GPU3D_SSE41
+#include <smmintrin.h>
+#include "CPUFeatures.h"
+#ifdef _MSC_VER
+#define GPU3D_TARGET_SSE41
+#else
+#define GPU3D_TARGET_SSE41 __attribute__((target("sse4.1")))
+#endif
+#endif
+
 
 // 3D engine notes
 //
@@ -269,10 +286,17 @@ u32 RenderNumPolygons;
 u32 FlushRequest;
 u32 FlushAttributes;
 
+#ifdef GPU3D_SSE41
+bool HasSSE41;
+#endif
 
 
 bool Init()
 {
+#ifdef GPU3D_SSE41
+    HasSSE41 = CPUFeatures::HasSSE41();
+#endif
+
     CmdFIFO = new FIFO<CmdFIFOEntry>(256);
     CmdPIPE = new FIFO<CmdFIFOEntry>(4);
 
@@ -330,8 +354,16 @@ void Reset()
     NumTestCommands = 0;
 
     DispCnt = 0;
+    AlphaRefVal = 0;
     AlphaRef = 0;
 
+    memset(ToonTable, 0, 32*2);
+    memset(EdgeTable, 0, 8*2);
+
+    FogColor = 0;
+    FogOffset = 0;
+    memset(FogDensityTable, 0, 32);
+
     GXStat = 0;
 
     memset(ExecParams, 0, 32*4);
@@ -369,8 +401,32 @@ void Reset()
     memset(PosTestResult, 0, 4*4);
     memset(VecTestResult, 0, 2*3);
 
+    PolygonMode = 0;
+    memset(CurVertex, 0, 3*2);
+    memset(VertexColor, 0, 3);
+    memset(TexCoords, 0, 2*2);
+    memset(RawTexCoords, 0, 2*2);
+    memset(Normal, 0, 3*2);
+
+    memset(LightDirection, 0, 4*3*2);
+    memset(LightColor, 0, 4*3);
+    memset(MatDiffuse, 0, 3);
+    memset(MatAmbient, 0, 3);
+    memset(MatSpecular, 0, 3);
+    memset(MatEmission, 0, 3);
+
+    UseShininessTable = false;
+    memset(ShininessTable, 0, 128);
+
+    PolygonAttr = 0;
+    CurPolygonAttr = 0;
+    TexParam = 0;
+    TexPalette = 0;
+
     VertexNum = 0;
     VertexNumInPoly = 0;
+    NumConsecutivePolygons = 0;
+    LastStripPolygon = NULL;
 
     CurRAMBank = 0;
     CurVertexRAM = &VertexRAM[0];
@@ -626,11 +682,12 @@ int InitRenderer(bool hasGL)
             renderer = 0;
     }
 
-    if (renderer == 0) SoftRenderer::Init();
+    // the upscaled software renderer output can only be displayed through OpenGL
+    if (renderer == 0) SoftRenderer::Init(hasGL ? Config::Soft_ScaleFactor : 1);
 
     Renderer = renderer;
     UpdateRendererConfig();
-    GPU::SetDisplaySettings(Renderer != 0);
+    GPU::SetDisplaySettings(Renderer != 0 || SoftRenderer::ScaleFactor > 1);
     return renderer;
 }
 
@@ -654,6 +711,77 @@ void UpdateRendererConfig()
 
 
 
+#ifdef GPU3D_SSE41
+// multiplies the row vector v (n components) by the matrix m, one column per lane
+// the products are accumulated at 64 bits like the scalar code, only the low
+// 32 bits of the shifted sums are kept (which is what the s32 truncation does)
+GPU3D_TARGET_SSE41
+void VectorMult_SSE41(const s32* v, int n, const s32* m, int shift, s32* out)
+{
+    __m128i even = _mm_setzero_si128();
+    __m128i odd = _mm_setzero_si128();
+
+    for (int k = 0; k < n; k++)
+    {
+        __m128i row = _mm_loadu_si128((__m128i*)&m[k*4]);
+        __m128i mul = _mm_set1_epi32(v[k]);
+
+        even = _mm_add_epi64(even, _mm_mul_epi32(row, mul));
+        odd = _mm_add_epi64(odd, _mm_mul_epi32(_mm_srli_epi64(row, 32), mul));
+    }
+
+    __m128i sh = _mm_cvtsi32_si128(shift);
+    even = _mm_srl_epi64(even, sh);
+    odd = _mm_slli_epi64(_mm_srl_epi64(odd, sh), 32);
+    _mm_storeu_si128((__m128i*)out, _mm_blend_epi16(even, odd, 0xCC));
+}
+
+GPU3D_TARGET_SSE41
+void MatrixMult4x4_SSE41(s32* m, const s32* s)
+{
+    s32 tmp[16];
+    memcpy(tmp, m, 16*4);
+
+    for (int i = 0; i < 4; i++)
+        VectorMult_SSE41(&s[i*4], 4, tmp, 12, &m[i*4]);
+}
+
+GPU3D_TARGET_SSE41
+void MatrixMult4x3_SSE41(s32* m, const s32* s)
+{
+    s32 tmp[16];
+    memcpy(tmp, m, 16*4);
+
+    for (int i = 0; i < 3; i++)
+        VectorMult_SSE41(&s[i*3], 3, tmp, 12, &m[i*4]);
+
+    s32 row3[4] = {s[9], s[10], s[11], 0x1000};
+    VectorMult_SSE41(row3, 4, tmp, 12, &m[12]);
+}
+
+GPU3D_TARGET_SSE41
+void MatrixMult3x3_SSE41(s32* m, const s32* s)
+{
+    s32 tmp[12];
+    memcpy(tmp, m, 12*4);
+
+    for (int i = 0; i < 3; i++)
+        VectorMult_SSE41(&s[i*3], 3, tmp, 12, &m[i*4]);
+}
+
+GPU3D_TARGET_SSE41
+void MatrixTranslate_SSE41(s32* m, const s32* s)
+{
+    s32 trans[4];
+    VectorMult_SSE41(s, 3, m, 12, trans);
+
+    m[12] += trans[0];
+    m[13] += trans[1];
+    m[14] += trans[2];
+    m[15] += trans[3];
+}
+#endif
+
 void MatrixLoadIdentity(s32* m)
 {
     m[0] = 0x1000; m[1] = 0;      m[2] = 0;       m[3] = 0;
@@ -675,7 +803,7 @@ void MatrixLoad4x3(s32* m, s32* s)
     m[12] = s[9]; m[13] = s[10]; m[14] = s[11]; m[15] = 0x1000;
 }
 
-void MatrixMult4x4(s32* m, s32* s)
+void MatrixMult4x4_Scalar(s32* m, const s32* s)
 {
     s32 tmp[16];
     memcpy(tmp, m, 16*4);
@@ -702,7 +830,20 @@ void MatrixMult4x4(s32* m, s32* s)
     m[15] = ((s64)s[12]*tmp[3] + (s64)s[13]*tmp[7] + (s64)s[14]*tmp[11] + (s64)s[15]*tmp[15]) >> 12;
 }
 
-void MatrixMult4x3(s32* m, s32* s)
+void MatrixMult4x4(s32* m, s32* s)
+{
+#ifdef GPU3D_SSE41
+    if (HasSSE41)
+    {
+        MatrixMult4x4_SSE41(m, s);
+        return;
+    }
+#endif
+
+    MatrixMult4x4_Scalar(m, s);
+}
+
+void MatrixMult4x3_Scalar(s32* m, const s32* s)
 {
     s32 tmp[16];
     memcpy(tmp, m, 16*4);
@@ -729,7 +870,20 @@ void MatrixMult4x3(s32* m, s32* s)
     m[15] = ((s64)s[9]*tmp[3] + (s64)s[10]*tmp[7] + (s64)s[11]*tmp[11] + (s64)0x1000*tmp[15]) >> 12;
 }
 
-void MatrixMult3x3(s32* m, s32* s)
+void MatrixMult4x3(s32* m, s32* s)
+{
+#ifdef GPU3D_SSE41
+    if (HasSSE41)
+    {
+        MatrixMult4x3_SSE41(m, s);
+        return;
+    }
+#endif
+
+    MatrixMult4x3_Scalar(m, s);
+}
+
+void MatrixMult3x3_Scalar(s32* m, const s32* s)
 {
     s32 tmp[12];
     memcpy(tmp, m, 12*4);
@@ -751,6 +905,19 @@ void MatrixMult3x3(s32* m, s32* s)
     m[11] = ((s64)s[6]*tmp[3] + (s64)s[7]*tmp[7] + (s64)s[8]*tmp[11]) >> 12;
 }
 
+void MatrixMult3x3(s32* m, s32* s)
+{
+#ifdef GPU3D_SSE41
+    if (HasSSE41)
+    {
+        MatrixMult3x3_SSE41(m, s);
+        return;
+    }
+#endif
+
+    MatrixMult3x3_Scalar(m, s);
+}
+
 void MatrixScale(s32* m, s32* s)
 {
     m[0] = ((s64)s[0]*m[0]) >> 12;
@@ -769,7 +936,7 @@ void MatrixScale(s32* m, s32* s)
     m[11] = ((s64)s[2]*m[11]) >> 12;
 }
 
-void MatrixTranslate(s32* m, s32* s)
+void MatrixTranslate_Scalar(s32* m, const s32* s)
 {
     m[12] += ((s64)s[0]*m[0] + (s64)s[1]*m[4] + (s64)s[2]*m[8]) >> 12;
     m[13] += ((s64)s[0]*m[1] + (s64)s[1]*m[5] + (s64)s[2]*m[9]) >> 12;
@@ -777,6 +944,19 @@ void MatrixTranslate(s32* m, s32* s)
     m[15] += ((s64)s[0]*m[3] + (s64)s[1]*m[7] + (s64)s[2]*m[11]) >> 12;
 }
 
+void MatrixTranslate(s32* m, s32* s)
+{
+#ifdef GPU3D_SSE41
+    if (HasSSE41)
+    {
+        MatrixTranslate_SSE41(m, s);
+        return;
+    }
+#endif
+
+    MatrixTranslate_Scalar(m, s);
+}
+
 void UpdateClipMatrix()
 {
     if (!ClipMatrixDirty) return;
@@ -786,6 +966,43 @@ void UpdateClipMatrix()
     MatrixMult4x4(ClipMatrix, PosMatrix);
 }
 
+// vertex position = (x, y, z, 1) * clip matrix
+void TransformPosition(s32 x, s32 y, s32 z, s32* out)
+{
+#ifdef GPU3D_SSE41
+    if (HasSSE41)
+    {
+        s32 vertex[4] = {x, y, z, 0x1000};
+        VectorMult_SSE41(vertex, 4, ClipMatrix, 12, out);
+        return;
+    }
+#endif
+
+    out[0] = ((s64)x*ClipMatrix[0] + (s64)y*ClipMatrix[4] + (s64)z*ClipMatrix[8] + (s64)0x1000*ClipMatrix[12]) >> 12;
+    out[1] = ((s64)x*ClipMatrix[1] + (s64)y*ClipMatrix[5] + (s64)z*ClipMatrix[9] + (s64)0x1000*ClipMatrix[13]) >> 12;
+    out[2] = ((s64)x*ClipMatrix[2] + (s64)y*ClipMatrix[6] + (s64)z*ClipMatrix[10] + (s64)0x1000*ClipMatrix[14]) >> 12;
+    out[3] = ((s64)x*ClipMatrix[3] + (s64)y*ClipMatrix[7] + (s64)z*ClipMatrix[11] + (s64)0x1000*ClipMatrix[15]) >> 12;
+}
+
+// texture coordinate offset = ((x, y, z) * texture matrix) >> shift
+void TransformTexCoords(s32 x, s32 y, s32 z, int shift, s32* out)
+{
+#ifdef GPU3D_SSE41
+    if (HasSSE41)
+    {
+        s32 vec[3] = {x, y, z};
+        s32 res[4];
+        VectorMult_SSE41(vec, 3, TexMatrix, shift, res);
+        out[0] = res[0];
+        out[1] = res[1];
+        return;
+    }
+#endif
+
+    out[0] = ((s64)x*TexMatrix[0] + (s64)y*TexMatrix[4] + (s64)z*TexMatrix[8]) >> shift;
+    out[1] = ((s64)x*TexMatrix[1] + (s64)y*TexMatrix[5] + (s64)z*TexMatrix[9]) >> shift;
+}
+
 
 
 void AddCycles(s32 num)
@@ -1022,6 +1239,41 @@ int ClipPolygon(Vertex* vertices, int nverts, int clipstart)
     return nverts;
 }
 
+// returns true if all the vertices are within the view volume (-W <= X,Y,Z <= W)
+// clipping leaves such polygons unchanged, so they can skip it entirely
+bool ClipTrivialAccept(Vertex* vertices, int nverts)
+{
+#ifdef GPU3D_SSE2
+    __m128i outside = _mm_setzero_si128();
+
+    for (int i = 0; i < nverts; i++)
+    {
+        __m128i pos = _mm_loadu_si128((__m128i*)vertices[i].Position);
+        __m128i w = _mm_shuffle_epi32(pos, 0xFF);
+        __m128i negw = _mm_sub_epi32(_mm_setzero_si128(), w);
+
+        outside = _mm_or_si128(outside, _mm_cmpgt_epi32(pos, w));
+        outside = _mm_or_si128(outside, _mm_cmplt_epi32(pos, negw));
+    }
+
+    // lane 3 compares W against itself, ignore it
+    return (_mm_movemask_epi8(outside) & 0x0FFF) == 0;
+#else
+    for (int i = 0; i < nverts; i++)
+    {
+        s32 w = vertices[i].Position[3];
+
+        for (int comp = 0; comp < 3; comp++)
+        {
+            s32 pos = vertices[i].Position[comp];
+            if (pos > w || pos < -w) return false;
+        }
+    }
+
+    return true;
+#endif
+}
+
 bool ClipCoordsEqual(Vertex* a, Vertex* b)
 {
     return a->Position[0] == b->Position[0] &&
@@ -1162,12 +1414,16 @@ void SubmitPolygon()
     }
 
     // clipping
+    // most polygons are entirely within the view volume and don't need to go through it
 
-    nverts = ClipPolygon<true>(clippedvertices, nverts, clipstart);
-    if (nverts == 0)
+    if (!ClipTrivialAccept(clippedvertices, nverts))
     {
-        LastStripPolygon = NULL;
-        return;
+        nverts = ClipPolygon<true>(clippedvertices, nverts, clipstart);
+        if (nverts == 0)
+        {
+            LastStripPolygon = NULL;
+            return;
+        }
     }
 
     // build the actual polygon
@@ -1262,23 +1518,25 @@ void SubmitPolygon()
         }
         else
         {
-            posX = (((s64)(vtx->Position[0] + w) * Viewport[4]) / (((s64)w) << 1)) + Viewport[0];
-            posY = (((s64)(-vtx->Position[1] + w) * Viewport[5]) / (((s64)w) << 1)) + Viewport[3];
-        }
+            // hi-res positions
+            // the regular position is the same division without the 4 fractional bits,
+            // and truncating the hi-res quotient again by 16 gives the exact same result
+            s64 hiresX = (((s64)(vtx->Position[0] + w) * Viewport[4]) << 4) / (((s64)w) << 1);
+            s64 hiresY = (((s64)(-vtx->Position[1] + w) * Viewport[5]) << 4) / (((s64)w) << 1);
 
-        vtx->FinalPosition[0] = posX & 0x1FF;
-        vtx->FinalPosition[1] = posY & 0xFF;
-
-        // hi-res positions
-        if (w != 0)
-        {
-            posX = ((((s64)(vtx->Position[0] + w) * Viewport[4]) << 4) / (((s64)w) << 1)) + (Viewport[0] << 4);
-            posY = ((((s64)(-vtx->Position[1] + w) * Viewport[5]) << 4) / (((s64)w) << 1)) + (Viewport[3] << 4);
+            posX = hiresX + (Viewport[0] << 4);
+            posY = hiresY + (Viewport[3] << 4);
 
             vtx->HiresPosition[0] = posX & 0x1FFF;
             vtx->HiresPosition[1] = posY & 0xFFF;
+
+            posX = (hiresX / 16) + Viewport[0];
+            posY = (hiresY / 16) + Viewport[3];
         }
 
+        vtx->FinalPosition[0] = posX & 0x1FF;
+        vtx->FinalPosition[1] = posY & 0xFF;
+
         vtx->FinalColor[0] = vtx->Color[0] >> 12;
         if (vtx->FinalColor[0]) vtx->FinalColor[0] = ((vtx->FinalColor[0] << 4) + 0xF);
         vtx->FinalColor[1] = vtx->Color[1] >> 12;
@@ -1377,14 +1635,10 @@ void SubmitPolygon()
 
 void SubmitVertex()
 {
-    s64 vertex[4] = {(s64)CurVertex[0], (s64)CurVertex[1], (s64)CurVertex[2], 0x1000};
     Vertex* vertextrans = &TempVertexBuffer[VertexNumInPoly];
 
     UpdateClipMatrix();
-    vertextrans->Position[0] = (vertex[0]*ClipMatrix[0] + vertex[1]*ClipMatrix[4] + vertex[2]*ClipMatrix[8] + vertex[3]*ClipMatrix[12]) >> 12;
-    vertextrans->Position[1] = (vertex[0]*ClipMatrix[1] + vertex[1]*ClipMatrix[5] + vertex[2]*ClipMatrix[9] + vertex[3]*ClipMatrix[13]) >> 12;
-    vertextrans->Position[2] = (vertex[0]*ClipMatrix[2] + vertex[1]*ClipMatrix[6] + vertex[2]*ClipMatrix[10] + vertex[3]*ClipMatrix[14]) >> 12;
-    vertextrans->Position[3] = (vertex[0]*ClipMatrix[3] + vertex[1]*ClipMatrix[7] + vertex[2]*ClipMatrix[11] + vertex[3]*ClipMatrix[15]) >> 12;
+    TransformPosition(CurVertex[0], CurVertex[1], CurVertex[2], vertextrans->Position);
 
     // this probably shouldn't be.
     // the way color is handled during clipping needs investigation. TODO
@@ -1394,8 +1648,10 @@ void SubmitVertex()
 
     if ((TexParam >> 30) == 3)
     {
-        vertextrans->TexCoords[0] = ((vertex[0]*TexMatrix[0] + vertex[1]*TexMatrix[4] + vertex[2]*TexMatrix[8]) >> 24) + RawTexCoords[0];
-        vertextrans->TexCoords[1] = ((vertex[0]*TexMatrix[1] + vertex[1]*TexMatrix[5] + vertex[2]*TexMatrix[9]) >> 24) + RawTexCoords[1];
+        s32 texcoords[2];
+        TransformTexCoords(CurVertex[0], CurVertex[1], CurVertex[2], 24, texcoords);
+        vertextrans->TexCoords[0] = texcoords[0] + RawTexCoords[0];
+        vertextrans->TexCoords[1] = texcoords[1] + RawTexCoords[1];
     }
     else
     {
@@ -1473,14 +1729,41 @@ void SubmitVertex()
     AddCycles(3);
 }
 
-void CalculateLighting()
+// overflow handling (for example, if the normal length is >1)
+// according to some hardware tests
+// * diffuse level is saturated to 255
+// * shininess level mirrors back to 0 and is ANDed with 0xFF, that before being squared
+// TODO: check how it behaves when the computed shininess is >=0x200
+inline void GetLightLevels(int i, const s32* normaltrans, s32* difflevel, s32* shinelevel)
 {
-    if ((TexParam >> 30) == 2)
+    s32 diff = (-(LightDirection[i][0]*normaltrans[0] +
+                 LightDirection[i][1]*normaltrans[1] +
+                 LightDirection[i][2]*normaltrans[2])) >> 10;
+    if (diff < 0) diff = 0;
+    else if (diff > 255) diff = 255;
+
+    s32 shine = -(((LightDirection[i][0]>>1)*normaltrans[0] +
+                  (LightDirection[i][1]>>1)*normaltrans[1] +
+                  ((LightDirection[i][2]-0x200)>>1)*normaltrans[2]) >> 10);
+    if (shine < 0) shine = 0;
+    else if (shine > 255) shine = (0x100 - shine) & 0xFF;
+    shine = ((shine * shine) >> 7) - 0x100; // really (2*shinelevel*shinelevel)-1
+    if (shine < 0) shine = 0;
+
+    if (UseShininessTable)
     {
-        TexCoords[0] = RawTexCoords[0] + (((s64)Normal[0]*TexMatrix[0] + (s64)Normal[1]*TexMatrix[4] + (s64)Normal[2]*TexMatrix[8]) >> 21);
-        TexCoords[1] = RawTexCoords[1] + (((s64)Normal[0]*TexMatrix[1] + (s64)Normal[1]*TexMatrix[5] + (s64)Normal[2]*TexMatrix[9]) >> 21);
+        // checkme
+        shine >>= 1;
+        shine = ShininessTable[shine];
     }
 
+    *difflevel = diff;
+    *shinelevel = shine;
+}
+
+// computes VertexColor, returns the number of lights used
+s32 CalculateLightColor_Scalar()
+{
     s32 normaltrans[3];
     normaltrans[0] = (Normal[0]*VecMatrix[0] + Normal[1]*VecMatrix[4] + Normal[2]*VecMatrix[8]) >> 12;
     normaltrans[1] = (Normal[0]*VecMatrix[1] + Normal[1]*VecMatrix[5] + Normal[2]*VecMatrix[9]) >> 12;
@@ -1496,32 +1779,8 @@ void CalculateLighting()
         if (!(CurPolygonAttr & (1<<i)))
             continue;
 
-        // overflow handling (for example, if the normal length is >1)
-        // according to some hardware tests
-        // * diffuse level is saturated to 255
-        // * shininess level mirrors back to 0 and is ANDed with 0xFF, that before being squared
-        // TODO: check how it behaves when the computed shininess is >=0x200
-
-        s32 difflevel = (-(LightDirection[i][0]*normaltrans[0] +
-                         LightDirection[i][1]*normaltrans[1] +
-                         LightDirection[i][2]*normaltrans[2])) >> 10;
-        if (difflevel < 0) difflevel = 0;
-        else if (difflevel > 255) difflevel = 255;
-
-        s32 shinelevel = -(((LightDirection[i][0]>>1)*normaltrans[0] +
-                          (LightDirection[i][1]>>1)*normaltrans[1] +
-                          ((LightDirection[i][2]-0x200)>>1)*normaltrans[2]) >> 10);
-        if (shinelevel < 0) shinelevel = 0;
-        else if (shinelevel > 255) shinelevel = (0x100 - shinelevel) & 0xFF;
-        shinelevel = ((shinelevel * shinelevel) >> 7) - 0x100; // really (2*shinelevel*shinelevel)-1
-        if (shinelevel < 0) shinelevel = 0;
-
-        if (UseShininessTable)
-        {
-            // checkme
-            shinelevel >>= 1;
-            shinelevel = ShininessTable[shinelevel];
-        }
+        s32 difflevel, shinelevel;
+        GetLightLevels(i, normaltrans, &difflevel, &shinelevel);
 
         VertexColor[0] += ((MatSpecular[0] * LightColor[i][0] * shinelevel) >> 13);
         VertexColor[0] += ((MatDiffuse[0] * LightColor[i][0] * difflevel) >> 13);
@@ -1542,6 +1801,79 @@ void CalculateLighting()
         c++;
     }
 
+    return c;
+}
+
+#ifdef GPU3D_SSE41
+GPU3D_TARGET_SSE41
+s32 CalculateLightColor_SSE41()
+{
+    // the normal is transformed with 32-bit multiplies
+    s32 normaltrans[4];
+    __m128i ntrans = _mm_mullo_epi32(_mm_set1_epi32(Normal[0]), _mm_loadu_si128((__m128i*)&VecMatrix[0]));
+    ntrans = _mm_add_epi32(ntrans, _mm_mullo_epi32(_mm_set1_epi32(Normal[1]), _mm_loadu_si128((__m128i*)&VecMatrix[4])));
+    ntrans = _mm_add_epi32(ntrans, _mm_mullo_epi32(_mm_set1_epi32(Normal[2]), _mm_loadu_si128((__m128i*)&VecMatrix[8])));
+    _mm_storeu_si128((__m128i*)normaltrans, _mm_srai_epi32(ntrans, 12));
+
+    // vertex color is accumulated with one lane per component
+    // the components are u8 and wrap around after each addition
+    __m128i color = _mm_setr_epi32(MatEmission[0], MatEmission[1], MatEmission[2], 0);
+    __m128i specular = _mm_setr_epi32(MatSpecular[0], MatSpecular[1], MatSpecular[2], 0);
+    __m128i diffuse = _mm_setr_epi32(MatDiffuse[0], MatDiffuse[1], MatDiffuse[2], 0);
+    __m128i ambient = _mm_setr_epi32(MatAmbient[0], MatAmbient[1], MatAmbient[2], 0);
+    const __m128i colormask = _mm_set1_epi32(0xFF);
+    const __m128i colormax = _mm_set1_epi32(31);
+
+    s32 c = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        if (!(CurPolygonAttr & (1<<i)))
+            continue;
+
+        s32 difflevel, shinelevel;
+        GetLightLevels(i, normaltrans, &difflevel, &shinelevel);
+
+        __m128i lightcolor = _mm_setr_epi32(LightColor[i][0], LightColor[i][1], LightColor[i][2], 0);
+        __m128i term;
+
+        term = _mm_mullo_epi32(_mm_mullo_epi32(specular, lightcolor), _mm_set1_epi32(shinelevel));
+        color = _mm_and_si128(_mm_add_epi32(color, _mm_srai_epi32(term, 13)), colormask);
+        term = _mm_mullo_epi32(_mm_mullo_epi32(diffuse, lightcolor), _mm_set1_epi32(difflevel));
+        color = _mm_and_si128(_mm_add_epi32(color, _mm_srai_epi32(term, 13)), colormask);
+        term = _mm_mullo_epi32(ambient, lightcolor);
+        color = _mm_and_si128(_mm_add_epi32(color, _mm_srai_epi32(term, 5)), colormask);
+
+        color = _mm_min_epi32(color, colormax);
+
+        c++;
+    }
+
+    VertexColor[0] = _mm_cvtsi128_si32(color);
+    VertexColor[1] = _mm_extract_epi32(color, 1);
+    VertexColor[2] = _mm_extract_epi32(color, 2);
+
+    return c;
+}
+#endif
+
+void CalculateLighting()
+{
+    if ((TexParam >> 30) == 2)
+    {
+        s32 texcoords[2];
+        TransformTexCoords(Normal[0], Normal[1], Normal[2], 21, texcoords);
+        TexCoords[0] = RawTexCoords[0] + texcoords[0];
+        TexCoords[1] = RawTexCoords[1] + texcoords[1];
+    }
+
+    s32 c;
+#ifdef GPU3D_SSE41
+    if (HasSSE41)
+        c = CalculateLightColor_SSE41();
+    else
+#endif
+    c = CalculateLightColor_Scalar();
+
     if (c < 1) c = 1;
     NormalPipeline = 7;
     AddCycles(c);
@@ -1584,10 +1916,14 @@ void BoxTest(u32* params)
         s32 y = cube[i].Position[1];
         s32 z = cube[i].Position[2];
 
-        cube[i].Position[0] = ((s64)x*ClipMatrix[0] + (s64)y*ClipMatrix[4] + (s64)z*ClipMatrix[8] + (s64)0x1000*ClipMatrix[12]) >> 12;
-        cube[i].Position[1] = ((s64)x*ClipMatrix[1] + (s64)y*ClipMatrix[5] + (s64)z*ClipMatrix[9] + (s64)0x1000*ClipMatrix[13]) >> 12;
-        cube[i].Position[2] = ((s64)x*ClipMatrix[2] + (s64)y*ClipMatrix[6] + (s64)z*ClipMatrix[10] + (s64)0x1000*ClipMatrix[14]) >> 12;
-        cube[i].Position[3] = ((s64)x*ClipMatrix[3] + (s64)y*ClipMatrix[7] + (s64)z*ClipMatrix[11] + (s64)0x1000*ClipMatrix[15]) >> 12;
+        TransformPosition(x, y, z, cube[i].Position);
+    }
+
+    // if the whole box is within the view volume, none of its faces can get clipped away
+    if (ClipTrivialAccept(cube, 8))
+    {
+        GXStat |= (1<<1);
+        return;
     }
 
     // front face (-Z)
@@ -2550,6 +2886,23 @@ void WriteToGXFIFO(u32 val)
     }
 }
 
+// used by GXFIFO DMA: feeds a block of words to the GXFIFO
+// returns the number of words consumed, which is less than count if the FIFO got full
+u32 WriteToGXFIFOBlock(u32* data, u32 count)
+{
+    if (!GeometryEnabled) return count;
+
+    for (u32 i = 0; i < count; i++)
+    {
+        WriteToGXFIFO(data[i]);
+
+        if (!CmdStallQueue->IsEmpty())
+            return i + 1;
+    }
+
+    return count;
+}
+
 
 u8 Read8(u32 addr)
 {
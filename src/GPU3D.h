@@ -119,6 +119,7 @@ void VCount215();
 u32* GetLine(int line);
 
 void WriteToGXFIFO(u32 val);
+u32 WriteToGXFIFOBlock(u32* data, u32 count);
 
 u8 Read8(u32 addr);
 u16 Read16(u32 addr);
@@ -130,7 +131,9 @@ void Write32(u32 addr, u32 val);
 namespace SoftRenderer
 {
 
-bool Init();
+extern int ScaleFactor;
+
+bool Init(int scale);
 void DeInit();
 void Reset();
 
@@ -139,6 +142,7 @@ void SetupRenderThread();
 void VCount144();
 void RenderFrame();
 u32* GetLine(int line);
+u32* GetAccelFrame();
 
 }
 
@@ -23,6 +23,13 @@
 #include "Config.h"
 #include "Platform.h"
 
+// GPU3D_SOFT_NO_SIMD is for the differential test, which builds a scalar-only copy
+#if defined(GPU3D_SOFT_NO_SIMD)
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define GPU3D_SOFT_SSE2
+#include <emmintrin.h>
+#endif
+
 
 namespace GPU3D
 {
@@ -35,14 +42,35 @@ namespace SoftRenderer
 // TODO: check if the hardware can accidentally plot pixels
 // offscreen in that border
 
-const int ScanlineWidth = 258;
-const int NumScanlines = 194;
-const int BufferSize = ScanlineWidth * NumScanlines;
-const int FirstPixelOffset = ScanlineWidth + 1;
+// with ScaleFactor > 1, the frame is rendered at that many times the native
+// resolution, from the hi-res vertex positions. the resulting top layer is then
+// handed to the frontend through the accelerated 2D framebuffer layout, and
+// GetLine() returns a downscaled version for display capture
+
+#define MAX_SCALE_FACTOR 4
+
+int ScaleFactor;
+s32 ScreenWidth, ScreenHeight;
+
+s32 ScanlineWidth;
+s32 NumScanlines;
+u32 BufferSize;
+s32 FirstPixelOffset;
 
-u32 ColorBuffer[BufferSize * 2];
-u32 DepthBuffer[BufferSize * 2];
-u32 AttrBuffer[BufferSize * 2];
+u32* ColorBuffer;
+u32* DepthBuffer;
+u32* AttrBuffer;
+
+// top layer of the last rendered frame, in the format the frontend uploads
+// (double-buffered, flipped at VCount144)
+u32* AccelFrame[2];
+int AccelFrontBuffer;
+bool AccelFramePending;
+int AccelFramesStale;
+u8 AccelColorLUT[64], AccelAlphaLUT[32];
+
+u32 DownscaledLine[256];
+s32 NextWaitLine;
 
 // attribute buffer:
 // bit0-3: edge flags (left/right/top/bottom)
@@ -53,11 +81,25 @@ u32 AttrBuffer[BufferSize * 2];
 // bit22: translucent flag
 // bit24-29: polygon ID for opaque pixels
 
-u8 StencilBuffer[256*2];
+u8 StencilBuffer[256*MAX_SCALE_FACTOR*2];
 bool PrevIsShadowMask;
 
 bool Enabled;
 
+// area touched by the last rendered frame (inclusive, empty if X0 > X1)
+// if the clear values didn't change, only that area needs to be cleared again
+s32 DirtyX0, DirtyX1, DirtyY0, DirtyY1;
+bool ClearValid;
+u32 LastClearAttr1, LastClearAttr2;
+
+// everything the rendered image depends on, from the last rendered frame
+// if the next frame has the same, rendering it again would give the same image
+#define SCENE_DATA_SIZE (80 + (2048 * (10 + (10*8))))
+u32 SceneData[2][SCENE_DATA_SIZE];
+u32 SceneDataLen[2];
+int SceneDataBuf;
+bool SceneValid;
+
 // threading
 
 void* RenderThread;
@@ -65,10 +107,50 @@ bool RenderThreadRunning;
 bool RenderThreadRendering;
 void* Sema_RenderStart;
 void* Sema_RenderDone;
-void* Sema_ScanlineCount;
+
+// scanline bands
+// with Threaded3D > 1, the frame is split into that many bands of scanlines
+// the render thread renders band 0, the others each get a worker thread
+// every band has its own scanline semaphore, GetLine() waits on the one
+// of the band the line belongs to
+
+#define MAX_RENDER_BANDS 8
+
+int NumBands;
+s32 BandStart[MAX_RENDER_BANDS+1];
+u8 LineBand[192*MAX_SCALE_FACTOR];
+
+void* BandThread[MAX_RENDER_BANDS];
+bool BandThreadRunning[MAX_RENDER_BANDS];
+void* Sema_BandStart[MAX_RENDER_BANDS];
+void* Sema_BandDone[MAX_RENDER_BANDS];
+void* Sema_BandFirstLine[MAX_RENDER_BANDS];
+void* Sema_BandLastLine[MAX_RENDER_BANDS];
+void* Sema_ScanlineCount[MAX_RENDER_BANDS];
 
 void RenderThreadFunc();
+void StartBandThreads();
+void StopBandThreads();
+void FreeBandPolygonLists();
+void FlushTexCache(bool unusedonly);
+
+
+void SetupBands(int num)
+{
+    if (num < 1) num = 1;
+    else if (num > MAX_RENDER_BANDS) num = MAX_RENDER_BANDS;
+
+    NumBands = num;
 
+    for (int b = 0; b <= num; b++)
+        BandStart[b] = (b * ScreenHeight) / num;
+
+    for (int b = 0; b < num; b++)
+    {
+        for (s32 y = BandStart[b]; y < BandStart[b+1]; y++)
+            LineBand[y] = b;
+    }
+}
 
 void StopRenderThread()
 {
@@ -79,6 +161,10 @@ void StopRenderThread()
         Platform::Thread_Wait(RenderThread);
         Platform::Thread_Free(RenderThread);
     }
+
+    // the render thread may still have needed the band workers to finish its frame
+    StopBandThreads();
+    SetupBands(1);
 }
 
 void SetupRenderThread()
@@ -94,8 +180,25 @@ void SetupRenderThread()
         if (RenderThreadRendering)
             Platform::Semaphore_Wait(Sema_RenderDone);
 
+        int numbands = Config::Threaded3D;
+        if (numbands > MAX_RENDER_BANDS) numbands = MAX_RENDER_BANDS;
+        if (numbands != NumBands)
+        {
+            StopBandThreads();
+            SetupBands(numbands);
+            StartBandThreads();
+        }
+
         Platform::Semaphore_Reset(Sema_RenderStart);
-        Platform::Semaphore_Reset(Sema_ScanlineCount);
+        for (int b = 0; b < MAX_RENDER_BANDS; b++)
+        {
+            Platform::Semaphore_Reset(Sema_BandStart[b]);
+            Platform::Semaphore_Reset(Sema_BandDone[b]);
+            Platform::Semaphore_Reset(Sema_BandFirstLine[b]);
+            Platform::Semaphore_Reset(Sema_BandLastLine[b]);
+            Platform::Semaphore_Reset(Sema_ScanlineCount[b]);
+        }
+        NextWaitLine = 0;
 
         Platform::Semaphore_Post(Sema_RenderStart);
     }
@@ -106,15 +209,77 @@ void SetupRenderThread()
 }
 
 
-bool Init()
+bool Init(int scale)
 {
+    if (scale < 1) scale = 1;
+    else if (scale > MAX_SCALE_FACTOR) scale = MAX_SCALE_FACTOR;
+
+    ScaleFactor = scale;
+    ScreenWidth = 256 * scale;
+    ScreenHeight = 192 * scale;
+
+    ScanlineWidth = ScreenWidth + 2;
+    NumScanlines = ScreenHeight + 2;
+    BufferSize = ScanlineWidth * NumScanlines;
+    FirstPixelOffset = ScanlineWidth + 1;
+
+    ColorBuffer = new u32[BufferSize * 2];
+    DepthBuffer = new u32[BufferSize * 2];
+    AttrBuffer = new u32[BufferSize * 2];
+
+    if (scale > 1)
+    {
+        AccelFrame[0] = new u32[ScreenWidth * ScreenHeight];
+        AccelFrame[1] = new u32[ScreenWidth * ScreenHeight];
+        memset(AccelFrame[0], 0, ScreenWidth * ScreenHeight * 4);
+        memset(AccelFrame[1], 0, ScreenWidth * ScreenHeight * 4);
+    }
+    else
+    {
+        AccelFrame[0] = NULL;
+        AccelFrame[1] = NULL;
+    }
+
+    // the frontend shader converts the components back with (x / 255) * 63 (or 31)
+    // pick the middle of each range so the truncation can't land one step lower
+    for (int i = 0; i < 64; i++)
+    {
+        int val = ((i*2 + 1) * 255) / 126;
+        AccelColorLUT[i] = (val > 255) ? 255 : val;
+    }
+    for (int i = 0; i < 32; i++)
+    {
+        int val = ((i*2 + 1) * 255) / 62;
+        AccelAlphaLUT[i] = (val > 255) ? 255 : val;
+    }
+
+    AccelFrontBuffer = 0;
+    AccelFramePending = false;
+    AccelFramesStale = 0;
+
     Sema_RenderStart = Platform::Semaphore_Create();
     Sema_RenderDone = Platform::Semaphore_Create();
-    Sema_ScanlineCount = Platform::Semaphore_Create();
+
+    for (int b = 0; b < MAX_RENDER_BANDS; b++)
+    {
+        Sema_BandStart[b] = Platform::Semaphore_Create();
+        Sema_BandDone[b] = Platform::Semaphore_Create();
+        Sema_BandFirstLine[b] = Platform::Semaphore_Create();
+        Sema_BandLastLine[b] = Platform::Semaphore_Create();
+        Sema_ScanlineCount[b] = Platform::Semaphore_Create();
+
+        BandThreadRunning[b] = false;
+    }
 
     RenderThreadRunning = false;
     RenderThreadRendering = false;
 
+    SetupBands(1);
+    NextWaitLine = 0;
+
+    ClearValid = false;
+    SceneValid = false;
+
     return true;
 }
 
@@ -124,7 +289,25 @@ void DeInit()
 
     Platform::Semaphore_Free(Sema_RenderStart);
     Platform::Semaphore_Free(Sema_RenderDone);
-    Platform::Semaphore_Free(Sema_ScanlineCount);
+
+    for (int b = 0; b < MAX_RENDER_BANDS; b++)
+    {
+        Platform::Semaphore_Free(Sema_BandStart[b]);
+        Platform::Semaphore_Free(Sema_BandDone[b]);
+        Platform::Semaphore_Free(Sema_BandFirstLine[b]);
+        Platform::Semaphore_Free(Sema_BandLastLine[b]);
+        Platform::Semaphore_Free(Sema_ScanlineCount[b]);
+    }
+
+    FreeBandPolygonLists();
+    FlushTexCache(false);
+
+    delete[] ColorBuffer;
+    delete[] DepthBuffer;
+    delete[] AttrBuffer;
+
+    if (AccelFrame[0]) delete[] AccelFrame[0];
+    if (AccelFrame[1]) delete[] AccelFrame[1];
 }
 
 void Reset()
@@ -135,6 +318,9 @@ void Reset()
 
     PrevIsShadowMask = false;
 
+    ClearValid = false;
+    SceneValid = false;
+
     SetupRenderThread();
 }
 
@@ -158,6 +344,35 @@ void Reset()
 // interpolation, avoiding precision loss from the aforementioned approximation.
 // Which is desirable when using the GPU to draw 2D graphics.
 
+#ifdef GPU3D_SOFT_SSE2
+
+// low 32 bits of a 32x32 multiply
+static inline __m128i MulLo32_SSE2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0)));
+}
+
+// ((u64)a * b + bias) >> shift, low 32 bits
+static inline __m128i MulShr64_SSE2(__m128i a, __m128i b, s32 bias, int shift)
+{
+    __m128i vbias = _mm_set1_epi64x(bias);
+    __m128i vshift = _mm_cvtsi32_si128(shift);
+
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    even = _mm_srl_epi64(_mm_add_epi64(even, vbias), vshift);
+    odd = _mm_srl_epi64(_mm_add_epi64(odd, vbias), vshift);
+
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0)));
+}
+
+#endif
+
 template<int dir>
 class Interpolator
 {
@@ -310,6 +525,116 @@ public:
         }
     }
 
+#ifdef GPU3D_SOFT_SSE2
+    // SSE2 versions of SetX()/Interpolate()/InterpolateZ() for four consecutive
+    // X positions, only used along X
+    // results are bit-exact: the W division is done in double precision, which is
+    // exact for numerators below 2^53, and the 64-bit products are unsigned since
+    // all factors are positive. SetX4() returns false when a division result falls
+    // out of 32-bit range or for positions left of the start, the scalar path has
+    // to be used then
+
+    bool SetX4(s32 x, __m128i* xv, __m128i* yfv)
+    {
+        if (x < x0) return false;
+
+        __m128i vx = _mm_add_epi32(_mm_set1_epi32(x - x0), _mm_set_epi32(3, 2, 1, 0));
+        *xv = vx;
+
+        if (xdiff == 0 || linear)
+        {
+            // yfactor isn't updated in these cases
+            *yfv = _mm_set1_epi32(yfactor);
+            return true;
+        }
+
+        __m128i den = _mm_add_epi32(MulLo32_SSE2(vx, _mm_set1_epi32(w0d)),
+                                    MulLo32_SSE2(_mm_sub_epi32(_mm_set1_epi32(xdiff), vx), _mm_set1_epi32(w1d)));
+        __m128i denzero = _mm_cmpeq_epi32(den, _mm_setzero_si128());
+        den = _mm_or_si128(den, _mm_and_si128(denzero, _mm_set1_epi32(1)));
+
+        __m128d numscale = _mm_set1_pd((double)w0n * (double)(1 << shift));
+        __m128d numlo = _mm_mul_pd(_mm_cvtepi32_pd(vx), numscale);
+        __m128d numhi = _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(vx, 8)), numscale);
+        __m128d qlo = _mm_div_pd(numlo, _mm_cvtepi32_pd(den));
+        __m128d qhi = _mm_div_pd(numhi, _mm_cvtepi32_pd(_mm_srli_si128(den, 8)));
+
+        const __m128d limit = _mm_set1_pd(2147483648.0);
+        const __m128d absmask = _mm_castsi128_pd(_mm_set1_epi64x(0x7FFFFFFFFFFFFFFFLL));
+        __m128d range = _mm_or_pd(_mm_cmpge_pd(_mm_and_pd(qlo, absmask), limit),
+                                  _mm_cmpge_pd(_mm_and_pd(qhi, absmask), limit));
+        if (_mm_movemask_pd(range))
+            return false;
+
+        __m128i yf = _mm_unpacklo_epi64(_mm_cvttpd_epi32(qlo), _mm_cvttpd_epi32(qhi));
+        *yfv = _mm_andnot_si128(denzero, yf);
+        return true;
+    }
+
+    __m128i Interpolate4(s32 y0, s32 y1, __m128i xv, __m128i yfv)
+    {
+        if (xdiff == 0 || y0 == y1) return _mm_set1_epi32(y0);
+
+        if (!linear)
+        {
+            if (y0 < y1)
+                return _mm_add_epi32(_mm_set1_epi32(y0),
+                                     _mm_srli_epi32(MulLo32_SSE2(_mm_set1_epi32(y1-y0), yfv), shift));
+            else
+                return _mm_add_epi32(_mm_set1_epi32(y1),
+                                     _mm_srli_epi32(MulLo32_SSE2(_mm_set1_epi32(y0-y1),
+                                                                 _mm_sub_epi32(_mm_set1_epi32(1<<shift), yfv)), shift));
+        }
+        else
+        {
+            // (y1-y0) * x fits in 32 bits for vertex colors and texcoords
+            if (y0 < y1)
+                return _mm_add_epi32(_mm_set1_epi32(y0),
+                                     MulShr64_SSE2(MulLo32_SSE2(_mm_set1_epi32(y1-y0), xv), _mm_set1_epi32(xrecip), 3<<24, 30));
+            else
+                return _mm_add_epi32(_mm_set1_epi32(y1),
+                                     MulShr64_SSE2(MulLo32_SSE2(_mm_set1_epi32(y0-y1), _mm_sub_epi32(_mm_set1_epi32(xdiff), xv)),
+                                                   _mm_set1_epi32(xrecip), 3<<24, 30));
+        }
+    }
+
+    __m128i InterpolateZ4(s32 z0, s32 z1, bool wbuffer, __m128i xv, __m128i yfv)
+    {
+        if (xdiff == 0 || z0 == z1) return _mm_set1_epi32(z0);
+
+        if (wbuffer)
+        {
+            if (z0 < z1)
+                return _mm_add_epi32(_mm_set1_epi32(z0), MulShr64_SSE2(_mm_set1_epi32(z1-z0), yfv, 0, shift));
+            else
+                return _mm_add_epi32(_mm_set1_epi32(z1),
+                                     MulShr64_SSE2(_mm_set1_epi32(z0-z1), _mm_sub_epi32(_mm_set1_epi32(1<<shift), yfv), 0, shift));
+        }
+        else
+        {
+            s32 base, disp;
+            __m128i factor;
+
+            if (z0 < z1)
+            {
+                base = z0;
+                disp = z1 - z0;
+                factor = xv;
+            }
+            else
+            {
+                base = z1;
+                disp = z0 - z1;
+                factor = _mm_sub_epi32(_mm_set1_epi32(xdiff), xv);
+            }
+
+            disp >>= 9;
+            return _mm_add_epi32(_mm_set1_epi32(base),
+                                 MulShr64_SSE2(MulLo32_SSE2(_mm_set1_epi32(disp), factor), _mm_set1_epi32(xrecip_z), 0, 13));
+        }
+    }
+#endif
+
 private:
     s32 x0, x1, xdiff, x;
 
@@ -538,56 +863,49 @@ typedef struct
     u32 CurVL, CurVR;
     u32 NextVL, NextVR;
 
+    u32* TexData; // decoded texture, NULL if not cached
+
+    // screen positions and bounds, at the render scale
+    s32 VtxX[10], VtxY[10];
+    u32 VTop, VBottom;
+    s32 YTop, YBottom;
+
 } RendererPolygon;
 
 RendererPolygon PolygonList[2048];
 
+// per-band copies of the polygons overlapping each band
+// (edge state is advanced while rendering, so bands can't share it)
+RendererPolygon* BandPolygonList[MAX_RENDER_BANDS];
+int BandNumPolygons;
+
+// polygons are binned into groups of 8 native scanlines (8*ScaleFactor lines),
+// so each scanline only has to look at the polygons that can cover it
+// bins are relative to the first line being rendered (0, or the band start)
+// and list polygons in their original order, to keep the Y-sorting intact
 
-void TextureLookup(u32 texparam, u32 texpal, s16 s, s16 t, u16* color, u8* alpha)
+#define POLYBIN_LINES 8
+#define NUM_POLYBINS (192 / POLYBIN_LINES)
+
+typedef struct
 {
-    u32 vramaddr = (texparam & 0xFFFF) << 3;
+    s32 YStart;
+    u16 Count[NUM_POLYBINS];
+    u16 Index[NUM_POLYBINS][2048];
 
-    s32 width = 8 << ((texparam >> 20) & 0x7);
-    s32 height = 8 << ((texparam >> 23) & 0x7);
+} PolygonBinList;
 
-    s >>= 4;
-    t >>= 4;
+// one per band, the sequential path uses the first one
+PolygonBinList PolygonBins[MAX_RENDER_BANDS];
 
-    // texture wrapping
-    // TODO: optimize this somehow
-    // testing shows that it's hardly worth optimizing, actually
 
-    if (texparam & (1<<16))
-    {
-        if (texparam & (1<<18))
-        {
-            if (s & width) s = (width-1) - (s & (width-1));
-            else           s = (s & (width-1));
-        }
-        else
-            s &= width-1;
-    }
-    else
-    {
-        if (s < 0) s = 0;
-        else if (s >= width) s = width-1;
-    }
+u32 DecodeTexel(u32 texparam, u32 texpal, s32 s, s32 t)
+{
+    u32 vramaddr = (texparam & 0xFFFF) << 3;
+    s32 width = 8 << ((texparam >> 20) & 0x7);
 
-    if (texparam & (1<<17))
-    {
-        if (texparam & (1<<19))
-        {
-            if (t & height) t = (height-1) - (t & (height-1));
-            else            t = (t & (height-1));
-        }
-        else
-            t &= height-1;
-    }
-    else
-    {
-        if (t < 0) t = 0;
-        else if (t >= height) t = height-1;
-    }
+    u16 color = 0;
+    u8 alpha = 0;
 
     u8 alpha0;
     if (texparam & (1<<29)) alpha0 = 0;
@@ -601,8 +919,8 @@ void TextureLookup(u32 texparam, u32 texpal, s16 s, s16 t, u16* color, u8* alpha
             u8 pixel = GPU::ReadVRAM_Texture<u8>(vramaddr);
 
             texpal <<= 4;
-            *color = GPU::ReadVRAM_TexPal<u16>(texpal + ((pixel&0x1F)<<1));
-            *alpha = ((pixel >> 3) & 0x1C) + (pixel >> 6);
+            color = GPU::ReadVRAM_TexPal<u16>(texpal + ((pixel&0x1F)<<1));
+            alpha = ((pixel >> 3) & 0x1C) + (pixel >> 6);
         }
         break;
 
@@ -614,8 +932,8 @@ void TextureLookup(u32 texparam, u32 texpal, s16 s, s16 t, u16* color, u8* alpha
             pixel &= 0x3;
 
             texpal <<= 3;
-            *color = GPU::ReadVRAM_TexPal<u16>(texpal + (pixel<<1));
-            *alpha = (pixel==0) ? alpha0 : 31;
+            color = GPU::ReadVRAM_TexPal<u16>(texpal + (pixel<<1));
+            alpha = (pixel==0) ? alpha0 : 31;
         }
         break;
 
@@ -627,8 +945,8 @@ void TextureLookup(u32 texparam, u32 texpal, s16 s, s16 t, u16* color, u8* alpha
             else         pixel &= 0xF;
 
             texpal <<= 4;
-            *color = GPU::ReadVRAM_TexPal<u16>(texpal + (pixel<<1));
-            *alpha = (pixel==0) ? alpha0 : 31;
+            color = GPU::ReadVRAM_TexPal<u16>(texpal + (pixel<<1));
+            alpha = (pixel==0) ? alpha0 : 31;
         }
         break;
 
@@ -638,8 +956,8 @@ void TextureLookup(u32 texparam, u32 texpal, s16 s, s16 t, u16* color, u8* alpha
             u8 pixel = GPU::ReadVRAM_Texture<u8>(vramaddr);
 
             texpal <<= 4;
-            *color = GPU::ReadVRAM_TexPal<u16>(texpal + (pixel<<1));
-            *alpha = (pixel==0) ? alpha0 : 31;
+            color = GPU::ReadVRAM_TexPal<u16>(texpal + (pixel<<1));
+            alpha = (pixel==0) ? alpha0 : 31;
         }
         break;
 
@@ -662,13 +980,13 @@ void TextureLookup(u32 texparam, u32 texpal, s16 s, s16 t, u16* color, u8* alpha
             switch (val & 0x3)
             {
             case 0:
-                *color = GPU::ReadVRAM_TexPal<u16>(texpal + paloffset);
-                *alpha = 31;
+                color = GPU::ReadVRAM_TexPal<u16>(texpal + paloffset);
+                alpha = 31;
                 break;
 
             case 1:
-                *color = GPU::ReadVRAM_TexPal<u16>(texpal + paloffset + 2);
-                *alpha = 31;
+                color = GPU::ReadVRAM_TexPal<u16>(texpal + paloffset + 2);
+                alpha = 31;
                 break;
 
             case 2:
@@ -688,7 +1006,7 @@ void TextureLookup(u32 texparam, u32 texpal, s16 s, s16 t, u16* color, u8* alpha
                     u32 g = ((g0 + g1) >> 1) & 0x03E0;
                     u32 b = ((b0 + b1) >> 1) & 0x7C00;
 
-                    *color = r | g | b;
+                    color = r | g | b;
                 }
                 else if ((palinfo >> 14) == 3)
                 {
@@ -706,18 +1024,18 @@ void TextureLookup(u32 texparam, u32 texpal, s16 s, s16 t, u16* color, u8* alpha
                     u32 g = ((g0*5 + g1*3) >> 3) & 0x03E0;
                     u32 b = ((b0*5 + b1*3) >> 3) & 0x7C00;
 
-                    *color = r | g | b;
+                    color = r | g | b;
                 }
                 else
-                    *color = GPU::ReadVRAM_TexPal<u16>(texpal + paloffset + 4);
-                *alpha = 31;
+                    color = GPU::ReadVRAM_TexPal<u16>(texpal + paloffset + 4);
+                alpha = 31;
                 break;
 
             case 3:
                 if ((palinfo >> 14) == 2)
                 {
-                    *color = GPU::ReadVRAM_TexPal<u16>(texpal + paloffset + 6);
-                    *alpha = 31;
+                    color = GPU::ReadVRAM_TexPal<u16>(texpal + paloffset + 6);
+                    alpha = 31;
                 }
                 else if ((palinfo >> 14) == 3)
                 {
@@ -735,13 +1053,13 @@ void TextureLookup(u32 texparam, u32 texpal, s16 s, s16 t, u16* color, u8* alpha
                     u32 g = ((g0*3 + g1*5) >> 3) & 0x03E0;
                     u32 b = ((b0*3 + b1*5) >> 3) & 0x7C00;
 
-                    *color = r | g | b;
-                    *alpha = 31;
+                    color = r | g | b;
+                    alpha = 31;
                 }
                 else
                 {
-                    *color = 0;
-                    *alpha = 0;
+                    color = 0;
+                    alpha = 0;
                 }
                 break;
             }
@@ -754,110 +1072,317 @@ void TextureLookup(u32 texparam, u32 texpal, s16 s, s16 t, u16* color, u8* alpha
             u8 pixel = GPU::ReadVRAM_Texture<u8>(vramaddr);
 
             texpal <<= 4;
-            *color = GPU::ReadVRAM_TexPal<u16>(texpal + ((pixel&0x7)<<1));
-            *alpha = (pixel >> 3);
+            color = GPU::ReadVRAM_TexPal<u16>(texpal + ((pixel&0x7)<<1));
+            alpha = (pixel >> 3);
         }
         break;
 
     case 7: // direct color
         {
             vramaddr += (((t * width) + s) << 1);
-            *color = GPU::ReadVRAM_Texture<u16>(vramaddr);
-            *alpha = (*color & 0x8000) ? 31 : 0;
+            color = GPU::ReadVRAM_Texture<u16>(vramaddr);
+            alpha = (color & 0x8000) ? 31 : 0;
         }
         break;
     }
+
+    // convert to the renderer's RGB6A5 layout
+    u32 r = (color << 1) & 0x3E; if (r) r++;
+    u32 g = (color >> 4) & 0x3E; if (g) g++;
+    u32 b = (color >> 9) & 0x3E; if (b) b++;
+
+    return r | (g << 8) | (b << 16) | (alpha << 24);
 }
 
-// depth test is 'less or equal' instead of 'less than' under the following conditions:
-// * when drawing a front-facing pixel over an opaque back-facing pixel
-// * when drawing wireframe edges, under certain conditions (TODO)
-//
-// range is different based on depth-buffering mode
-// Z-buffering: +-0x200
-// W-buffering: +-0xFF
+// texture cache
+// textures are decoded once into the RGB6A5 layout used by the color buffer
+// lookups are done when setting up polygons, so the rasterizer (and the band
+// threads) only ever read the decoded data
+// entries are keyed by texture parameters and the VRAM generations of the
+// texture and palette pages they were decoded from
 
-bool DepthTest_Equal_Z(s32 dstz, s32 z, u32 dstattr)
+#define TEXCACHE_SETS 64
+#define TEXCACHE_WAYS 8
+#define TEXCACHE_MAX_TEXELS (8*1024*1024)
+
+typedef struct
 {
-    s32 diff = dstz - z;
-    if ((u32)(diff + 0x200) <= 0x400)
-        return true;
+    u32 TexParam, TexPal;
+    u32 TexGen, PalGen;
+    u32 LastUsed;
+    u32 NumTexels;
+    u32* Data;
 
-    return false;
-}
+} TexCacheEntry;
 
-bool DepthTest_Equal_W(s32 dstz, s32 z, u32 dstattr)
+TexCacheEntry TexCache[TEXCACHE_SETS][TEXCACHE_WAYS];
+u32 TexCacheFrame;
+u32 TexCacheTexels;
+
+void FreeTexCacheEntry(TexCacheEntry* entry)
 {
-    s32 diff = dstz - z;
-    if ((u32)(diff + 0xFF) <= 0x1FE)
-        return true;
+    if (!entry->Data) return;
 
-    return false;
+    delete[] entry->Data;
+    TexCacheTexels -= entry->NumTexels;
+    entry->Data = NULL;
+    entry->NumTexels = 0;
 }
 
-bool DepthTest_LessThan(s32 dstz, s32 z, u32 dstattr)
+void FlushTexCache(bool unusedonly)
 {
-    if (z < dstz)
-        return true;
+    for (int i = 0; i < TEXCACHE_SETS; i++)
+    {
+        for (int j = 0; j < TEXCACHE_WAYS; j++)
+        {
+            TexCacheEntry* entry = &TexCache[i][j];
+            if (unusedonly && entry->LastUsed == TexCacheFrame) continue;
 
-    return false;
+            FreeTexCacheEntry(entry);
+        }
+    }
 }
 
-bool DepthTest_LessThan_FrontFacing(s32 dstz, s32 z, u32 dstattr)
+u32 GetTexVRAMGen(u32 addr, u32 len)
 {
-    if ((dstattr & 0x00400010) == 0x00000010) // opaque, back facing
+    // generations only ever increase, so their sum changes whenever one of them does
+    u32 ret = 0;
+    u32 start = addr >> 14;
+    u32 end = ((addr & 0x3FFF) + len - 1) >> 14;
+    for (u32 i = 0; i <= end && i < 0x20; i++)
+        ret += GPU::VRAMGen_Texture[(start + i) & 0x1F];
+
+    return ret;
+}
+
+u32* GetTexture(u32 texparam, u32 texpal)
+{
+    u32 fmt = (texparam >> 26) & 0x7;
+    u32 addr = ((texparam & 0xFFFF) << 3) & 0x7FFFF;
+    u32 width = 8 << ((texparam >> 20) & 0x7);
+    u32 height = 8 << ((texparam >> 23) & 0x7);
+    u32 numtexels = width * height;
+
+    // repeat/flip and texcoord transform bits don't affect the texture contents
+    texparam &= 0x3FF0FFFF;
+
+    u32 texgen, palgen = 0;
+    switch (fmt)
     {
-        if (z <= dstz)
-            return true;
+    case 1: case 4: case 6: texgen = GetTexVRAMGen(addr, numtexels); break;
+    case 2: texgen = GetTexVRAMGen(addr, numtexels >> 2); break;
+    case 3: texgen = GetTexVRAMGen(addr, numtexels >> 1); break;
+    case 5:
+        {
+            u32 slot1addr = 0x20000 + ((addr & 0x1FFFC) >> 1);
+            if (addr >= 0x40000) slot1addr += 0x10000;
+
+            texgen = GetTexVRAMGen(addr, numtexels >> 2) + GetTexVRAMGen(slot1addr, numtexels >> 3);
+        }
+        break;
+    case 7: texgen = GetTexVRAMGen(addr, numtexels << 1); break;
+    default: return NULL;
     }
+
+    if (fmt == 7)
+        texpal = 0;
     else
     {
-        if (z < dstz)
-            return true;
+        for (int i = 0; i < 8; i++)
+            palgen += GPU::VRAMGen_TexPal[i];
     }
 
-    return false;
-}
+    u32 set = (texparam ^ (texparam >> 16) ^ (texpal * 7)) & (TEXCACHE_SETS-1);
+    TexCacheEntry* victim = NULL;
 
-u32 AlphaBlend(u32 srccolor, u32 dstcolor, u32 alpha)
-{
-    u32 dstalpha = dstcolor >> 24;
+    for (int i = 0; i < TEXCACHE_WAYS; i++)
+    {
+        TexCacheEntry* entry = &TexCache[set][i];
+        if (entry->Data &&
+            entry->TexParam == texparam && entry->TexPal == texpal &&
+            entry->TexGen == texgen && entry->PalGen == palgen)
+        {
+            entry->LastUsed = TexCacheFrame;
+            return entry->Data;
+        }
 
-    if (dstalpha == 0)
-        return srccolor;
+        // entries used this frame may be referenced by polygons already set up
+        if (entry->LastUsed == TexCacheFrame && entry->Data) continue;
+        if (!victim || !entry->Data || (victim->Data && entry->LastUsed < victim->LastUsed))
+            victim = entry;
+    }
 
-    u32 srcR = srccolor & 0x3F;
-    u32 srcG = (srccolor >> 8) & 0x3F;
-    u32 srcB = (srccolor >> 16) & 0x3F;
+    if (!victim) return NULL;
 
-    if (RenderDispCnt & (1<<3))
-    {
-        u32 dstR = dstcolor & 0x3F;
-        u32 dstG = (dstcolor >> 8) & 0x3F;
-        u32 dstB = (dstcolor >> 16) & 0x3F;
+    FreeTexCacheEntry(victim);
 
-        alpha++;
-        srcR = ((srcR * alpha) + (dstR * (32-alpha))) >> 5;
-        srcG = ((srcG * alpha) + (dstG * (32-alpha))) >> 5;
-        srcB = ((srcB * alpha) + (dstB * (32-alpha))) >> 5;
-        alpha--;
+    if (TexCacheTexels + numtexels > TEXCACHE_MAX_TEXELS)
+    {
+        FlushTexCache(true);
+        if (TexCacheTexels + numtexels > TEXCACHE_MAX_TEXELS)
+            return NULL;
     }
 
-    if (alpha > dstalpha)
-        dstalpha = alpha;
+    victim->Data = new u32[numtexels];
+    victim->NumTexels = numtexels;
+    TexCacheTexels += numtexels;
 
-    return srcR | (srcG << 8) | (srcB << 16) | (dstalpha << 24);
+    victim->TexParam = texparam;
+    victim->TexPal = texpal;
+    victim->TexGen = texgen;
+    victim->PalGen = palgen;
+    victim->LastUsed = TexCacheFrame;
+
+    u32* dst = victim->Data;
+    for (u32 t = 0; t < height; t++)
+    {
+        for (u32 s = 0; s < width; s++)
+            *dst++ = DecodeTexel(texparam, texpal, s, t);
+    }
+
+    return victim->Data;
 }
 
-u32 RenderPixel(Polygon* polygon, u8 vr, u8 vg, u8 vb, s16 s, s16 t)
+u32 TextureLookup(u32 texparam, u32 texpal, u32* texdata, s16 s, s16 t)
 {
-    u8 r, g, b, a;
+    s32 width = 8 << ((texparam >> 20) & 0x7);
+    s32 height = 8 << ((texparam >> 23) & 0x7);
 
-    u32 blendmode = (polygon->Attr >> 4) & 0x3;
-    u32 polyalpha = (polygon->Attr >> 16) & 0x1F;
-    bool wireframe = (polyalpha == 0);
+    s >>= 4;
+    t >>= 4;
 
-    if (blendmode == 2)
+    // texture wrapping
+    // TODO: optimize this somehow
+    // testing shows that it's hardly worth optimizing, actually
+
+    if (texparam & (1<<16))
+    {
+        if (texparam & (1<<18))
+        {
+            if (s & width) s = (width-1) - (s & (width-1));
+            else           s = (s & (width-1));
+        }
+        else
+            s &= width-1;
+    }
+    else
+    {
+        if (s < 0) s = 0;
+        else if (s >= width) s = width-1;
+    }
+
+    if (texparam & (1<<17))
+    {
+        if (texparam & (1<<19))
+        {
+            if (t & height) t = (height-1) - (t & (height-1));
+            else            t = (t & (height-1));
+        }
+        else
+            t &= height-1;
+    }
+    else
+    {
+        if (t < 0) t = 0;
+        else if (t >= height) t = height-1;
+    }
+
+    if (texdata)
+        return texdata[(t * width) + s];
+
+    return DecodeTexel(texparam, texpal, s, t);
+}
+
+// depth test is 'less or equal' instead of 'less than' under the following conditions:
+// * when drawing a front-facing pixel over an opaque back-facing pixel
+// * when drawing wireframe edges, under certain conditions (TODO)
+//
+// range is different based on depth-buffering mode
+// Z-buffering: +-0x200
+// W-buffering: +-0xFF
+
+bool DepthTest_Equal_Z(s32 dstz, s32 z, u32 dstattr)
+{
+    s32 diff = dstz - z;
+    if ((u32)(diff + 0x200) <= 0x400)
+        return true;
+
+    return false;
+}
+
+bool DepthTest_Equal_W(s32 dstz, s32 z, u32 dstattr)
+{
+    s32 diff = dstz - z;
+    if ((u32)(diff + 0xFF) <= 0x1FE)
+        return true;
+
+    return false;
+}
+
+bool DepthTest_LessThan(s32 dstz, s32 z, u32 dstattr)
+{
+    if (z < dstz)
+        return true;
+
+    return false;
+}
+
+bool DepthTest_LessThan_FrontFacing(s32 dstz, s32 z, u32 dstattr)
+{
+    if ((dstattr & 0x00400010) == 0x00000010) // opaque, back facing
+    {
+        if (z <= dstz)
+            return true;
+    }
+    else
+    {
+        if (z < dstz)
+            return true;
+    }
+
+    return false;
+}
+
+u32 AlphaBlend(u32 srccolor, u32 dstcolor, u32 alpha)
+{
+    u32 dstalpha = dstcolor >> 24;
+
+    if (dstalpha == 0)
+        return srccolor;
+
+    u32 srcR = srccolor & 0x3F;
+    u32 srcG = (srccolor >> 8) & 0x3F;
+    u32 srcB = (srccolor >> 16) & 0x3F;
+
+    if (RenderDispCnt & (1<<3))
+    {
+        u32 dstR = dstcolor & 0x3F;
+        u32 dstG = (dstcolor >> 8) & 0x3F;
+        u32 dstB = (dstcolor >> 16) & 0x3F;
+
+        alpha++;
+        srcR = ((srcR * alpha) + (dstR * (32-alpha))) >> 5;
+        srcG = ((srcG * alpha) + (dstG * (32-alpha))) >> 5;
+        srcB = ((srcB * alpha) + (dstB * (32-alpha))) >> 5;
+        alpha--;
+    }
+
+    if (alpha > dstalpha)
+        dstalpha = alpha;
+
+    return srcR | (srcG << 8) | (srcB << 16) | (dstalpha << 24);
+}
+
+u32 RenderPixel(RendererPolygon* rp, u8 vr, u8 vg, u8 vb, s16 s, s16 t)
+{
+    Polygon* polygon = rp->PolyData;
+    u8 r, g, b, a;
+
+    u32 blendmode = (polygon->Attr >> 4) & 0x3;
+    u32 polyalpha = (polygon->Attr >> 16) & 0x1F;
+    bool wireframe = (polyalpha == 0);
+
+    if (blendmode == 2)
     {
         if (RenderDispCnt & (1<<1))
         {
@@ -885,12 +1410,13 @@ u32 RenderPixel(Polygon* polygon, u8 vr, u8 vg, u8 vb, s16 s, s16 t)
     {
         u8 tr, tg, tb;
 
-        u16 tcolor; u8 talpha;
-        TextureLookup(polygon->TexParam, polygon->TexPalette, s, t, &tcolor, &talpha);
+        u8 talpha;
+        u32 texel = TextureLookup(polygon->TexParam, polygon->TexPalette, rp->TexData, s, t);
 
-        tr = (tcolor << 1) & 0x3E; if (tr) tr++;
-        tg = (tcolor >> 4) & 0x3E; if (tg) tg++;
-        tb = (tcolor >> 9) & 0x3E; if (tb) tb++;
+        tr = texel & 0x3F;
+        tg = (texel >> 8) & 0x3F;
+        tb = (texel >> 16) & 0x3F;
+        talpha = texel >> 24;
 
         if (blendmode & 0x1)
         {
@@ -1000,7 +1526,7 @@ void SetupPolygonLeftEdge(RendererPolygon* rp, s32 y)
 {
     Polygon* polygon = rp->PolyData;
 
-    while (y >= polygon->Vertices[rp->NextVL]->FinalPosition[1] && rp->CurVL != polygon->VBottom)
+    while (y >= rp->VtxY[rp->NextVL] && rp->CurVL != rp->VBottom)
     {
         rp->CurVL = rp->NextVL;
 
@@ -1018,8 +1544,8 @@ void SetupPolygonLeftEdge(RendererPolygon* rp, s32 y)
         }
     }
 
-    rp->XL = rp->SlopeL.Setup(polygon->Vertices[rp->CurVL]->FinalPosition[0], polygon->Vertices[rp->NextVL]->FinalPosition[0],
-                              polygon->Vertices[rp->CurVL]->FinalPosition[1], polygon->Vertices[rp->NextVL]->FinalPosition[1],
+    rp->XL = rp->SlopeL.Setup(rp->VtxX[rp->CurVL], rp->VtxX[rp->NextVL],
+                              rp->VtxY[rp->CurVL], rp->VtxY[rp->NextVL],
                               polygon->FinalW[rp->CurVL], polygon->FinalW[rp->NextVL], y);
 }
 
@@ -1027,7 +1553,7 @@ void SetupPolygonRightEdge(RendererPolygon* rp, s32 y)
 {
     Polygon* polygon = rp->PolyData;
 
-    while (y >= polygon->Vertices[rp->NextVR]->FinalPosition[1] && rp->CurVR != polygon->VBottom)
+    while (y >= rp->VtxY[rp->NextVR] && rp->CurVR != rp->VBottom)
     {
         rp->CurVR = rp->NextVR;
 
@@ -1045,8 +1571,8 @@ void SetupPolygonRightEdge(RendererPolygon* rp, s32 y)
         }
     }
 
-    rp->XR = rp->SlopeR.Setup(polygon->Vertices[rp->CurVR]->FinalPosition[0], polygon->Vertices[rp->NextVR]->FinalPosition[0],
-                              polygon->Vertices[rp->CurVR]->FinalPosition[1], polygon->Vertices[rp->NextVR]->FinalPosition[1],
+    rp->XR = rp->SlopeR.Setup(rp->VtxX[rp->CurVR], rp->VtxX[rp->NextVR],
+                              rp->VtxY[rp->CurVR], rp->VtxY[rp->NextVR],
                               polygon->FinalW[rp->CurVR], polygon->FinalW[rp->NextVR], y);
 }
 
@@ -1054,11 +1580,70 @@ void SetupPolygon(RendererPolygon* rp, Polygon* polygon)
 {
     u32 nverts = polygon->NumVertices;
 
-    u32 vtop = polygon->VTop, vbot = polygon->VBottom;
-    s32 ytop = polygon->YTop, ybot = polygon->YBottom;
-
     rp->PolyData = polygon;
 
+    if (ScaleFactor == 1)
+    {
+        for (u32 i = 0; i < nverts; i++)
+        {
+            rp->VtxX[i] = polygon->Vertices[i]->FinalPosition[0];
+            rp->VtxY[i] = polygon->Vertices[i]->FinalPosition[1];
+        }
+
+        rp->VTop = polygon->VTop; rp->VBottom = polygon->VBottom;
+        rp->YTop = polygon->YTop; rp->YBottom = polygon->YBottom;
+    }
+    else
+    {
+        // same as the bounds calculation in GPU3D, with the scaled positions
+        u32 vtop = 0, vbot = 0;
+        s32 ytop = ScreenHeight, ybot = 0;
+        s32 xtop = ScreenWidth, xbot = 0;
+
+        for (u32 i = 0; i < nverts; i++)
+        {
+            Vertex* vtx = polygon->Vertices[i];
+            s32 x, y;
+
+            // hi-res positions aren't updated for W=0
+            if (vtx->Position[3] == 0)
+            {
+                x = vtx->FinalPosition[0] * ScaleFactor;
+                y = vtx->FinalPosition[1] * ScaleFactor;
+            }
+            else
+            {
+                x = (vtx->HiresPosition[0] * ScaleFactor) >> 4;
+                y = (vtx->HiresPosition[1] * ScaleFactor) >> 4;
+            }
+
+            rp->VtxX[i] = x;
+            rp->VtxY[i] = y;
+
+            if (y < ytop || (y == ytop && x < xtop))
+            {
+                xtop = x; ytop = y;
+                vtop = i;
+            }
+            if (y > ybot || (y == ybot && x > xbot))
+            {
+                xbot = x; ybot = y;
+                vbot = i;
+            }
+        }
+
+        rp->VTop = vtop; rp->VBottom = vbot;
+        rp->YTop = ytop; rp->YBottom = ybot;
+    }
+
+    u32 vtop = rp->VTop, vbot = rp->VBottom;
+    s32 ytop = rp->YTop, ybot = rp->YBottom;
+
+    if ((RenderDispCnt & (1<<0)) && (((polygon->TexParam >> 26) & 0x7) != 0))
+        rp->TexData = GetTexture(polygon->TexParam, polygon->TexPalette);
+    else
+        rp->TexData = NULL;
+
     rp->CurVL = vtop;
     rp->CurVR = vtop;
 
@@ -1083,18 +1668,18 @@ void SetupPolygon(RendererPolygon* rp, Polygon* polygon)
         int i;
 
         i = 1;
-        if (polygon->Vertices[i]->FinalPosition[0] < polygon->Vertices[vtop]->FinalPosition[0]) vtop = i;
-        if (polygon->Vertices[i]->FinalPosition[0] > polygon->Vertices[vbot]->FinalPosition[0]) vbot = i;
+        if (rp->VtxX[i] < rp->VtxX[vtop]) vtop = i;
+        if (rp->VtxX[i] > rp->VtxX[vbot]) vbot = i;
 
         i = nverts - 1;
-        if (polygon->Vertices[i]->FinalPosition[0] < polygon->Vertices[vtop]->FinalPosition[0]) vtop = i;
-        if (polygon->Vertices[i]->FinalPosition[0] > polygon->Vertices[vbot]->FinalPosition[0]) vbot = i;
+        if (rp->VtxX[i] < rp->VtxX[vtop]) vtop = i;
+        if (rp->VtxX[i] > rp->VtxX[vbot]) vbot = i;
 
         rp->CurVL = vtop; rp->NextVL = vtop;
         rp->CurVR = vbot; rp->NextVR = vbot;
 
-        rp->XL = rp->SlopeL.SetupDummy(polygon->Vertices[rp->CurVL]->FinalPosition[0]);
-        rp->XR = rp->SlopeR.SetupDummy(polygon->Vertices[rp->CurVR]->FinalPosition[0]);
+        rp->XL = rp->SlopeL.SetupDummy(rp->VtxX[rp->CurVL]);
+        rp->XR = rp->SlopeR.SetupDummy(rp->VtxX[rp->CurVR]);
     }
     else
     {
@@ -1122,18 +1707,18 @@ void RenderShadowMaskScanline(RendererPolygon* rp, s32 y)
         fnDepthTest = DepthTest_LessThan;
 
     if (!PrevIsShadowMask)
-        memset(&StencilBuffer[256 * (y&0x1)], 0, 256);
+        memset(&StencilBuffer[ScreenWidth * (y&0x1)], 0, ScreenWidth);
 
     PrevIsShadowMask = true;
 
-    if (polygon->YTop != polygon->YBottom)
+    if (rp->YTop != rp->YBottom)
     {
-        if (y >= polygon->Vertices[rp->NextVL]->FinalPosition[1] && rp->CurVL != polygon->VBottom)
+        if (y >= rp->VtxY[rp->NextVL] && rp->CurVL != rp->VBottom)
         {
             SetupPolygonLeftEdge(rp, y);
         }
 
-        if (y >= polygon->Vertices[rp->NextVR]->FinalPosition[1] && rp->CurVR != polygon->VBottom)
+        if (y >= rp->VtxY[rp->NextVR] && rp->CurVR != rp->VBottom)
         {
             SetupPolygonRightEdge(rp, y);
         }
@@ -1214,8 +1799,8 @@ void RenderShadowMaskScanline(RendererPolygon* rp, s32 y)
     // in wireframe mode, there are special rules for equal Z (TODO)
 
     int yedge = 0;
-    if (y == polygon->YTop)           yedge = 0x4;
-    else if (y == polygon->YBottom-1) yedge = 0x8;
+    if (y == rp->YTop)           yedge = 0x4;
+    else if (y == rp->YBottom-1) yedge = 0x8;
     int edge;
 
     s32 x = xstart;
@@ -1231,7 +1816,7 @@ void RenderShadowMaskScanline(RendererPolygon* rp, s32 y)
     edge = yedge | 0x1;
     xlimit = xstart+l_edgelen;
     if (xlimit > xend+1) xlimit = xend+1;
-    if (xlimit > 256) xlimit = 256;
+    if (xlimit > ScreenWidth) xlimit = ScreenWidth;
 
     for (; x < xlimit; x++)
     {
@@ -1247,13 +1832,13 @@ void RenderShadowMaskScanline(RendererPolygon* rp, s32 y)
             continue;
 
         if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
-            StencilBuffer[256*(y&0x1) + x] |= 0x1;
+            StencilBuffer[ScreenWidth*(y&0x1) + x] |= 0x1;
 
         if (dstattr & 0x3)
         {
             pixeladdr += BufferSize;
             if (!fnDepthTest(DepthBuffer[pixeladdr], z, AttrBuffer[pixeladdr]))
-                StencilBuffer[256*(y&0x1) + x] |= 0x2;
+                StencilBuffer[ScreenWidth*(y&0x1) + x] |= 0x2;
         }
     }
 
@@ -1261,7 +1846,7 @@ void RenderShadowMaskScanline(RendererPolygon* rp, s32 y)
     edge = yedge;
     xlimit = xend-r_edgelen+1;
     if (xlimit > xend+1) xlimit = xend+1;
-    if (xlimit > 256) xlimit = 256;
+    if (xlimit > ScreenWidth) xlimit = ScreenWidth;
     if (wireframe && !edge) x = xlimit;
     else for (; x < xlimit; x++)
     {
@@ -1273,20 +1858,20 @@ void RenderShadowMaskScanline(RendererPolygon* rp, s32 y)
         u32 dstattr = AttrBuffer[pixeladdr];
 
         if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
-            StencilBuffer[256*(y&0x1) + x] = 1;
+            StencilBuffer[ScreenWidth*(y&0x1) + x] = 1;
 
         if (dstattr & 0x3)
         {
             pixeladdr += BufferSize;
             if (!fnDepthTest(DepthBuffer[pixeladdr], z, AttrBuffer[pixeladdr]))
-                StencilBuffer[256*(y&0x1) + x] |= 0x2;
+                StencilBuffer[ScreenWidth*(y&0x1) + x] |= 0x2;
         }
     }
 
     // part 3: right edge
     edge = yedge | 0x2;
     xlimit = xend+1;
-    if (xlimit > 256) xlimit = 256;
+    if (xlimit > ScreenWidth) xlimit = ScreenWidth;
 
     for (; x < xlimit; x++)
     {
@@ -1302,13 +1887,13 @@ void RenderShadowMaskScanline(RendererPolygon* rp, s32 y)
             continue;
 
         if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
-            StencilBuffer[256*(y&0x1) + x] = 1;
+            StencilBuffer[ScreenWidth*(y&0x1) + x] = 1;
 
         if (dstattr & 0x3)
         {
             pixeladdr += BufferSize;
             if (!fnDepthTest(DepthBuffer[pixeladdr], z, AttrBuffer[pixeladdr]))
-                StencilBuffer[256*(y&0x1) + x] |= 0x2;
+                StencilBuffer[ScreenWidth*(y&0x1) + x] |= 0x2;
         }
     }
 
@@ -1316,6 +1901,51 @@ void RenderShadowMaskScanline(RendererPolygon* rp, s32 y)
     rp->XR = rp->SlopeR.Step();
 }
 
+// vertex attributes interpolated across a span
+// filled ahead of the pixel loops, with 4 extra entries so the SIMD path can overrun
+typedef struct
+{
+    s32 Z[256*MAX_SCALE_FACTOR + 4];
+    u32 R[256*MAX_SCALE_FACTOR + 4], G[256*MAX_SCALE_FACTOR + 4], B[256*MAX_SCALE_FACTOR + 4];
+    s32 S[256*MAX_SCALE_FACTOR + 4], T[256*MAX_SCALE_FACTOR + 4];
+
+} SpanAttribs;
+
+void InterpolateSpan(SpanAttribs* span, Interpolator<0>* interp, s32 xfrom, s32 xto, bool wbuffer,
+                     s32 zl, s32 zr, s32 rl, s32 rr, s32 gl, s32 gr, s32 bl, s32 br,
+                     s32 sl, s32 sr, s32 tl, s32 tr)
+{
+    s32 x = xfrom;
+
+#ifdef GPU3D_SOFT_SSE2
+    for (; x < xto; x += 4)
+    {
+        __m128i xv, yfv;
+        if (!interp->SetX4(x, &xv, &yfv))
+            break;
+
+        _mm_storeu_si128((__m128i*)&span->Z[x], interp->InterpolateZ4(zl, zr, wbuffer, xv, yfv));
+        _mm_storeu_si128((__m128i*)&span->R[x], interp->Interpolate4(rl, rr, xv, yfv));
+        _mm_storeu_si128((__m128i*)&span->G[x], interp->Interpolate4(gl, gr, xv, yfv));
+        _mm_storeu_si128((__m128i*)&span->B[x], interp->Interpolate4(bl, br, xv, yfv));
+        _mm_storeu_si128((__m128i*)&span->S[x], interp->Interpolate4(sl, sr, xv, yfv));
+        _mm_storeu_si128((__m128i*)&span->T[x], interp->Interpolate4(tl, tr, xv, yfv));
+    }
+#endif
+
+    for (; x < xto; x++)
+    {
+        interp->SetX(x);
+
+        span->Z[x] = interp->InterpolateZ(zl, zr, wbuffer);
+        span->R[x] = interp->Interpolate(rl, rr);
+        span->G[x] = interp->Interpolate(gl, gr);
+        span->B[x] = interp->Interpolate(bl, br);
+        span->S[x] = interp->Interpolate(sl, sr);
+        span->T[x] = interp->Interpolate(tl, tr);
+    }
+}
+
 void RenderPolygonScanline(RendererPolygon* rp, s32 y)
 {
     Polygon* polygon = rp->PolyData;
@@ -1336,14 +1966,14 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
 
     PrevIsShadowMask = false;
 
-    if (polygon->YTop != polygon->YBottom)
+    if (rp->YTop != rp->YBottom)
     {
-        if (y >= polygon->Vertices[rp->NextVL]->FinalPosition[1] && rp->CurVL != polygon->VBottom)
+        if (y >= rp->VtxY[rp->NextVL] && rp->CurVL != rp->VBottom)
         {
             SetupPolygonLeftEdge(rp, y);
         }
 
-        if (y >= polygon->Vertices[rp->NextVR]->FinalPosition[1] && rp->CurVR != polygon->VBottom)
+        if (y >= rp->VtxY[rp->NextVR] && rp->CurVR != rp->VBottom)
         {
             SetupPolygonRightEdge(rp, y);
         }
@@ -1443,8 +2073,8 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
     // in wireframe mode, there are special rules for equal Z (TODO)
 
     int yedge = 0;
-    if (y == polygon->YTop)           yedge = 0x4;
-    else if (y == polygon->YBottom-1) yedge = 0x8;
+    if (y == rp->YTop)           yedge = 0x4;
+    else if (y == rp->YBottom-1) yedge = 0x8;
     int edge;
 
     s32 x = xstart;
@@ -1459,15 +2089,35 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
     edge = yedge | 0x1;
     xlimit = xstart+l_edgelen;
     if (xlimit > xend+1) xlimit = xend+1;
-    if (xlimit > 256) xlimit = 256;
+    if (xlimit > ScreenWidth) xlimit = ScreenWidth;
     if (l_edgecov & (1<<31))
     {
         xcov = (l_edgecov >> 12) & 0x3FF;
         if (xcov == 0x3FF) xcov = 0;
     }
 
-    if (!l_filledge) x = std::min(xlimit, xend-r_edgelen+1);
-    else
+    // the right edge can start left of xstart. rendering jumps there if the left
+    // edge isn't filled, and wireframe polygons jump there after the left edge,
+    // so the span has to start there too
+    s32 xredge = xend-r_edgelen+1;
+    if (xredge > ScreenWidth) xredge = ScreenWidth;
+    if (xredge < 0) xredge = 0;
+
+    if (!l_filledge)
+    {
+        x = std::min(xlimit, xend-r_edgelen+1);
+        if (x < 0) x = 0;
+    }
+
+    s32 xspan = x;
+    if (wireframe && !yedge && xredge < xspan)
+        xspan = xredge;
+
+    SpanAttribs span;
+    InterpolateSpan(&span, &interpX, xspan, std::min(xend+1, ScreenWidth), polygon->WBuffer,
+                    zl, zr, rl, rr, gl, gr, bl, br, sl, sr, tl, tr);
+
+    if (l_filledge)
     for (; x < xlimit; x++)
     {
         u32 pixeladdr = FirstPixelOffset + (y*ScanlineWidth) + x;
@@ -1476,7 +2126,7 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
         // check stencil buffer for shadows
         if (polygon->IsShadow)
         {
-            u8 stencil = StencilBuffer[256*(y&0x1) + x];
+            u8 stencil = StencilBuffer[ScreenWidth*(y&0x1) + x];
             if (!stencil)
                 continue;
             if (!(stencil & 0x1))
@@ -1485,15 +2135,14 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
                 dstattr &= ~0x3; // quick way to prevent drawing the shadow under antialiased edges
         }
 
-        interpX.SetX(x);
-
-        s32 z = interpX.InterpolateZ(zl, zr, polygon->WBuffer);
+        s32 z = span.Z[x];
 
         // if depth test against the topmost pixel fails, test
         // against the pixel underneath
         if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
         {
-            if (!(dstattr & 0x3)) continue;
+            // shadows may already be drawing to the bottom pixel
+            if (!(dstattr & 0x3) || pixeladdr >= BufferSize) continue;
 
             pixeladdr += BufferSize;
             dstattr = AttrBuffer[pixeladdr];
@@ -1501,14 +2150,14 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
                 continue;
         }
 
-        u32 vr = interpX.Interpolate(rl, rr);
-        u32 vg = interpX.Interpolate(gl, gr);
-        u32 vb = interpX.Interpolate(bl, br);
+        u32 vr = span.R[x];
+        u32 vg = span.G[x];
+        u32 vb = span.B[x];
 
-        s16 s = interpX.Interpolate(sl, sr);
-        s16 t = interpX.Interpolate(tl, tr);
+        s16 s = span.S[x];
+        s16 t = span.T[x];
 
-        u32 color = RenderPixel(polygon, vr>>3, vg>>3, vb>>3, s, t);
+        u32 color = RenderPixel(rp, vr>>3, vg>>3, vb>>3, s, t);
         u8 alpha = color >> 24;
 
         // alpha test
@@ -1560,9 +2209,9 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
     edge = yedge;
     xlimit = xend-r_edgelen+1;
     if (xlimit > xend+1) xlimit = xend+1;
-    if (xlimit > 256) xlimit = 256;
+    if (xlimit > ScreenWidth) xlimit = ScreenWidth;
 
-    if (wireframe && !edge) x = xlimit;
+    if (wireframe && !edge) x = std::max(xlimit, 0);
     else
     for (; x < xlimit; x++)
     {
@@ -1572,7 +2221,7 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
         // check stencil buffer for shadows
         if (polygon->IsShadow)
         {
-            u8 stencil = StencilBuffer[256*(y&0x1) + x];
+            u8 stencil = StencilBuffer[ScreenWidth*(y&0x1) + x];
             if (!stencil)
                 continue;
             if (!(stencil & 0x1))
@@ -1581,15 +2230,13 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
                 dstattr &= ~0x3; // quick way to prevent drawing the shadow under antialiased edges
         }
 
-        interpX.SetX(x);
-
-        s32 z = interpX.InterpolateZ(zl, zr, polygon->WBuffer);
+        s32 z = span.Z[x];
 
         // if depth test against the topmost pixel fails, test
         // against the pixel underneath
         if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
         {
-            if (!(dstattr & 0x3)) continue;
+            if (!(dstattr & 0x3) || pixeladdr >= BufferSize) continue;
 
             pixeladdr += BufferSize;
             dstattr = AttrBuffer[pixeladdr];
@@ -1597,14 +2244,14 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
                 continue;
         }
 
-        u32 vr = interpX.Interpolate(rl, rr);
-        u32 vg = interpX.Interpolate(gl, gr);
-        u32 vb = interpX.Interpolate(bl, br);
+        u32 vr = span.R[x];
+        u32 vg = span.G[x];
+        u32 vb = span.B[x];
 
-        s16 s = interpX.Interpolate(sl, sr);
-        s16 t = interpX.Interpolate(tl, tr);
+        s16 s = span.S[x];
+        s16 t = span.T[x];
 
-        u32 color = RenderPixel(polygon, vr>>3, vg>>3, vb>>3, s, t);
+        u32 color = RenderPixel(rp, vr>>3, vg>>3, vb>>3, s, t);
         u8 alpha = color >> 24;
 
         // alpha test
@@ -1631,7 +2278,7 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
     // part 3: right edge
     edge = yedge | 0x2;
     xlimit = xend+1;
-    if (xlimit > 256) xlimit = 256;
+    if (xlimit > ScreenWidth) xlimit = ScreenWidth;
     if (r_edgecov & (1<<31))
     {
         xcov = (r_edgecov >> 12) & 0x3FF;
@@ -1647,7 +2294,7 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
         // check stencil buffer for shadows
         if (polygon->IsShadow)
         {
-            u8 stencil = StencilBuffer[256*(y&0x1) + x];
+            u8 stencil = StencilBuffer[ScreenWidth*(y&0x1) + x];
             if (!stencil)
                 continue;
             if (!(stencil & 0x1))
@@ -1656,15 +2303,13 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
                 dstattr &= ~0x3; // quick way to prevent drawing the shadow under antialiased edges
         }
 
-        interpX.SetX(x);
-
-        s32 z = interpX.InterpolateZ(zl, zr, polygon->WBuffer);
+        s32 z = span.Z[x];
 
         // if depth test against the topmost pixel fails, test
         // against the pixel underneath
         if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
         {
-            if (!(dstattr & 0x3)) continue;
+            if (!(dstattr & 0x3) || pixeladdr >= BufferSize) continue;
 
             pixeladdr += BufferSize;
             dstattr = AttrBuffer[pixeladdr];
@@ -1672,14 +2317,14 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
                 continue;
         }
 
-        u32 vr = interpX.Interpolate(rl, rr);
-        u32 vg = interpX.Interpolate(gl, gr);
-        u32 vb = interpX.Interpolate(bl, br);
+        u32 vr = span.R[x];
+        u32 vg = span.G[x];
+        u32 vb = span.B[x];
 
-        s16 s = interpX.Interpolate(sl, sr);
-        s16 t = interpX.Interpolate(tl, tr);
+        s16 s = span.S[x];
+        s16 t = span.T[x];
 
-        u32 color = RenderPixel(polygon, vr>>3, vg>>3, vb>>3, s, t);
+        u32 color = RenderPixel(rp, vr>>3, vg>>3, vb>>3, s, t);
         u8 alpha = color >> 24;
 
         // alpha test
@@ -1731,14 +2376,40 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
     rp->XR = rp->SlopeR.Step();
 }
 
-void RenderScanline(s32 y, int npolys)
+void BinPolygons(PolygonBinList* bins, RendererPolygon* list, int npolys, s32 ystart)
 {
+    bins->YStart = ystart;
+    memset(bins->Count, 0, sizeof(bins->Count));
+
     for (int i = 0; i < npolys; i++)
     {
-        RendererPolygon* rp = &PolygonList[i];
+        RendererPolygon* rp = &list[i];
+
+        s32 y0 = rp->YTop;
+        s32 y1 = (rp->YBottom == rp->YTop) ? rp->YTop : (rp->YBottom - 1);
+        if (y0 < ystart) y0 = ystart;
+        if (y1 > ScreenHeight-1) y1 = ScreenHeight-1;
+        if (y0 > y1) continue;
+
+        u32 bin0 = (y0 - ystart) / (POLYBIN_LINES * ScaleFactor);
+        u32 bin1 = (y1 - ystart) / (POLYBIN_LINES * ScaleFactor);
+        for (u32 b = bin0; b <= bin1; b++)
+            bins->Index[b][bins->Count[b]++] = i;
+    }
+}
+
+void RenderScanline(RendererPolygon* list, PolygonBinList* bins, s32 y)
+{
+    u32 bin = (y - bins->YStart) / (POLYBIN_LINES * ScaleFactor);
+    int npolys = bins->Count[bin];
+    u16* index = bins->Index[bin];
+
+    for (int i = 0; i < npolys; i++)
+    {
+        RendererPolygon* rp = &list[index[i]];
         Polygon* polygon = rp->PolyData;
 
-        if (y >= polygon->YTop && (y < polygon->YBottom || (y == polygon->YTop && polygon->YBottom == polygon->YTop)))
+        if (y >= rp->YTop && (y < rp->YBottom || (y == rp->YTop && rp->YBottom == rp->YTop)))
         {
             if (polygon->IsShadowMask)
                 RenderShadowMaskScanline(rp, y);
@@ -1788,18 +2459,241 @@ u32 CalculateFogDensity(u32 pixeladdr)
     return density;
 }
 
+#ifdef GPU3D_SOFT_SSE2
+
+// 6-bit expansion of 5-bit color components: c ? (c<<1)+1 : 0, applied to (c<<1)
+static inline __m128i ExpandColor_SSE2(__m128i c)
+{
+    return _mm_sub_epi32(c, _mm_cmpgt_epi32(c, _mm_setzero_si128()));
+}
+
+static inline __m128i Select_SSE2(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// (a * wa + b * (scale - wa)) >> shift for each 8-bit component of 4 pixels
+// weights are given per pixel and channel, as 16-bit lanes for pixels 0-1 and 2-3
+static inline __m128i BlendComponents_SSE2(__m128i a, __m128i b, __m128i walo, __m128i wahi, s16 scale, int shift)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vscale = _mm_set1_epi16(scale);
+
+    __m128i alo = _mm_unpacklo_epi8(a, zero);
+    __m128i ahi = _mm_unpackhi_epi8(a, zero);
+    __m128i blo = _mm_unpacklo_epi8(b, zero);
+    __m128i bhi = _mm_unpackhi_epi8(b, zero);
+
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(alo, walo), _mm_mullo_epi16(blo, _mm_sub_epi16(vscale, walo)));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(ahi, wahi), _mm_mullo_epi16(bhi, _mm_sub_epi16(vscale, wahi)));
+
+    return _mm_packus_epi16(_mm_srli_epi16(lo, shift), _mm_srli_epi16(hi, shift));
+}
+
+// spreads a per-pixel weight (32-bit lanes) to the 16-bit channel lanes used above
+static inline void SpreadWeight_SSE2(__m128i w, __m128i chanmask, __m128i* lo, __m128i* hi)
+{
+    w = _mm_or_si128(w, _mm_slli_epi32(w, 16));
+    *lo = _mm_and_si128(_mm_unpacklo_epi32(w, w), chanmask);
+    *hi = _mm_and_si128(_mm_unpackhi_epi32(w, w), chanmask);
+}
+
+static inline __m128i CalculateFogDensity_SSE2(__m128i z)
+{
+    const __m128i sign = _mm_set1_epi32(0x80000000);
+
+    __m128i below = _mm_cmplt_epi32(_mm_xor_si128(z, sign), _mm_xor_si128(_mm_set1_epi32(RenderFogOffset), sign));
+
+    z = _mm_sub_epi32(z, _mm_set1_epi32(RenderFogOffset));
+    z = _mm_sll_epi32(_mm_srli_epi32(z, 2), _mm_cvtsi32_si128(RenderFogShift));
+
+    __m128i densityid = _mm_srli_epi32(z, 17);
+    __m128i densityfrac = _mm_and_si128(z, _mm_set1_epi32(0x1FFFF));
+    __m128i clamp = _mm_cmpgt_epi32(densityid, _mm_set1_epi32(31));
+    densityid = Select_SSE2(clamp, _mm_set1_epi32(32), densityid);
+    densityfrac = _mm_andnot_si128(clamp, densityfrac);
+
+    densityid = _mm_andnot_si128(below, densityid);
+    densityfrac = _mm_andnot_si128(below, densityfrac);
+
+    u32 id[4];
+    _mm_storeu_si128((__m128i*)id, densityid);
+    __m128i d0 = _mm_set_epi32(RenderFogDensityTable[id[3]], RenderFogDensityTable[id[2]],
+                               RenderFogDensityTable[id[1]], RenderFogDensityTable[id[0]]);
+    __m128i d1 = _mm_set_epi32(RenderFogDensityTable[id[3]+1], RenderFogDensityTable[id[2]+1],
+                               RenderFogDensityTable[id[1]+1], RenderFogDensityTable[id[0]+1]);
+
+    __m128i density = _mm_add_epi32(MulLo32_SSE2(d0, _mm_sub_epi32(_mm_set1_epi32(0x20000), densityfrac)),
+                                    MulLo32_SSE2(d1, densityfrac));
+    density = _mm_srli_epi32(density, 17);
+
+    __m128i full = _mm_cmpgt_epi32(density, _mm_set1_epi32(126));
+    return Select_SSE2(full, _mm_set1_epi32(128), density);
+}
+
+#endif
+
 void ScanlineFinalPass(s32 y)
 {
     // to consider:
     // clearing all polygon fog flags if the master flag isn't set?
-    // merging all final pass loops into one?
+
+    int firstx = 0;
+
+#ifdef GPU3D_SOFT_SSE2
+    // all three steps in one pass, four pixels at a time
+    // this is equivalent to running them one after another: edge marking only
+    // reads the depth and polygon IDs of neighbors, which nothing here modifies,
+    // and fog/antialiasing only look at the pixel they work on
+
+    if (RenderDispCnt & ((1<<4)|(1<<5)|(1<<7)))
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i sign = _mm_set1_epi32(0x80000000);
+        const __m128i edgemask = _mm_set1_epi32(0xF);
+        const __m128i aaedgemask = _mm_set1_epi32(0x3);
+        const __m128i fogbit = _mm_set1_epi32(1<<15);
+        const __m128i colormask = _mm_set1_epi32(0x1F3F3F3F);
+
+        bool edgemark = (RenderDispCnt & (1<<5)) != 0;
+        bool fog = (RenderDispCnt & (1<<7)) != 0;
+        bool antialias = (RenderDispCnt & (1<<4)) != 0;
+
+        u32 edgecolors[8];
+        for (int i = 0; i < 8; i++)
+        {
+            u16 edgecolor = RenderEdgeTable[i];
+            u32 edgeR = (edgecolor << 1) & 0x3E; if (edgeR) edgeR++;
+            u32 edgeG = (edgecolor >> 4) & 0x3E; if (edgeG) edgeG++;
+            u32 edgeB = (edgecolor >> 9) & 0x3E; if (edgeB) edgeB++;
+            edgecolors[i] = edgeR | (edgeG << 8) | (edgeB << 16);
+        }
+
+        u32 fogR = (RenderFogColor << 1) & 0x3E; if (fogR) fogR++;
+        u32 fogG = (RenderFogColor >> 4) & 0x3E; if (fogG) fogG++;
+        u32 fogB = (RenderFogColor >> 9) & 0x3E; if (fogB) fogB++;
+        u32 fogA = (RenderFogColor >> 16) & 0x1F;
+        const __m128i fogcolor = _mm_set1_epi32(fogR | (fogG << 8) | (fogB << 16) | (fogA << 24));
+
+        // without fog color, only alpha is affected
+        const __m128i fogchannels = (RenderDispCnt & (1<<6)) ? _mm_set1_epi64x(0xFFFF000000000000LL) : _mm_set1_epi32(-1);
+
+        for (; firstx < ScreenWidth; firstx += 4)
+        {
+            u32 pixeladdr = FirstPixelOffset + (y*ScanlineWidth) + firstx;
+
+            __m128i attr = _mm_loadu_si128((__m128i*)&AttrBuffer[pixeladdr]);
+            __m128i color = _mm_loadu_si128((__m128i*)&ColorBuffer[pixeladdr]);
+
+            if (edgemark)
+            {
+                __m128i polyid = _mm_srli_epi32(attr, 24);
+                __m128i z = _mm_xor_si128(_mm_loadu_si128((__m128i*)&DepthBuffer[pixeladdr]), sign);
+                __m128i mark = zero;
+
+                const s32 offsets[4] = {-1, 1, -ScanlineWidth, ScanlineWidth};
+                for (int i = 0; i < 4; i++)
+                {
+                    __m128i nattr = _mm_loadu_si128((__m128i*)&AttrBuffer[pixeladdr + offsets[i]]);
+                    __m128i nz = _mm_xor_si128(_mm_loadu_si128((__m128i*)&DepthBuffer[pixeladdr + offsets[i]]), sign);
+
+                    __m128i diffid = _mm_andnot_si128(_mm_cmpeq_epi32(polyid, _mm_srli_epi32(nattr, 24)), _mm_set1_epi32(-1));
+                    mark = _mm_or_si128(mark, _mm_and_si128(diffid, _mm_cmplt_epi32(z, nz)));
+                }
+
+                mark = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(attr, edgemask), zero), mark);
+
+                if (_mm_movemask_epi8(mark))
+                {
+                    u32 id[4];
+                    _mm_storeu_si128((__m128i*)id, polyid);
+                    __m128i edgecolor = _mm_set_epi32(edgecolors[id[3] >> 3], edgecolors[id[2] >> 3],
+                                                      edgecolors[id[1] >> 3], edgecolors[id[0] >> 3]);
+
+                    edgecolor = _mm_or_si128(edgecolor, _mm_and_si128(color, _mm_set1_epi32(0xFF000000)));
+                    color = Select_SSE2(mark, edgecolor, color);
+
+                    // break antialiasing coverage (checkme)
+                    __m128i newattr = _mm_or_si128(_mm_and_si128(attr, _mm_set1_epi32(0xFFFFE0FF)), _mm_set1_epi32(0x00001000));
+                    attr = Select_SSE2(mark, newattr, attr);
+                    _mm_storeu_si128((__m128i*)&AttrBuffer[pixeladdr], attr);
+                }
+            }
+
+            if (fog)
+            {
+                __m128i fogmask = _mm_cmpeq_epi32(_mm_and_si128(attr, fogbit), fogbit);
+
+                if (_mm_movemask_epi8(fogmask))
+                {
+                    __m128i density = CalculateFogDensity_SSE2(_mm_loadu_si128((__m128i*)&DepthBuffer[pixeladdr]));
+                    __m128i wlo, whi;
+                    SpreadWeight_SSE2(density, fogchannels, &wlo, &whi);
+
+                    __m128i res = BlendComponents_SSE2(fogcolor, _mm_and_si128(color, colormask), wlo, whi, 128, 7);
+                    color = Select_SSE2(fogmask, res, color);
+
+                    // fog for lower pixel
+                    __m128i lowmask = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(attr, aaedgemask), zero), fogmask);
+                    if (_mm_movemask_epi8(lowmask))
+                    {
+                        __m128i lowattr = _mm_loadu_si128((__m128i*)&AttrBuffer[pixeladdr + BufferSize]);
+                        lowmask = _mm_and_si128(lowmask, _mm_cmpeq_epi32(_mm_and_si128(lowattr, fogbit), fogbit));
+
+                        if (_mm_movemask_epi8(lowmask))
+                        {
+                            __m128i lowcolor = _mm_loadu_si128((__m128i*)&ColorBuffer[pixeladdr + BufferSize]);
+                            density = CalculateFogDensity_SSE2(_mm_loadu_si128((__m128i*)&DepthBuffer[pixeladdr + BufferSize]));
+                            SpreadWeight_SSE2(density, fogchannels, &wlo, &whi);
+
+                            res = BlendComponents_SSE2(fogcolor, _mm_and_si128(lowcolor, colormask), wlo, whi, 128, 7);
+                            lowcolor = Select_SSE2(lowmask, res, lowcolor);
+                            _mm_storeu_si128((__m128i*)&ColorBuffer[pixeladdr + BufferSize], lowcolor);
+                        }
+                    }
+                }
+            }
+
+            if (antialias)
+            {
+                __m128i coverage = _mm_and_si128(_mm_srli_epi32(attr, 8), _mm_set1_epi32(0x1F));
+                __m128i aamask = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(attr, aaedgemask), zero),
+                                                  _mm_andnot_si128(_mm_cmpeq_epi32(coverage, _mm_set1_epi32(0x1F)), _mm_set1_epi32(-1)));
+
+                if (_mm_movemask_epi8(aamask))
+                {
+                    __m128i botcolor = _mm_loadu_si128((__m128i*)&ColorBuffer[pixeladdr + BufferSize]);
+
+                    // only blend color if the bottom pixel isn't fully transparent
+                    // alpha is always blended
+                    __m128i botalpha = _mm_cmpeq_epi32(_mm_and_si128(botcolor, _mm_set1_epi32(0x1F000000)), zero);
+                    __m128i cov = _mm_add_epi32(coverage, _mm_set1_epi32(1));
+                    __m128i rgbcov = Select_SSE2(botalpha, _mm_set1_epi32(32), cov);
+
+                    __m128i wlo, whi;
+                    SpreadWeight_SSE2(rgbcov, _mm_set1_epi32(-1), &wlo, &whi);
+                    __m128i alo, ahi;
+                    SpreadWeight_SSE2(cov, _mm_set1_epi64x(0xFFFF000000000000LL), &alo, &ahi);
+                    wlo = _mm_or_si128(_mm_andnot_si128(_mm_set1_epi64x(0xFFFF000000000000LL), wlo), alo);
+                    whi = _mm_or_si128(_mm_andnot_si128(_mm_set1_epi64x(0xFFFF000000000000LL), whi), ahi);
+
+                    __m128i res = BlendComponents_SSE2(_mm_and_si128(color, colormask), _mm_and_si128(botcolor, colormask), wlo, whi, 32, 5);
+                    res = Select_SSE2(_mm_cmpeq_epi32(coverage, zero), botcolor, res);
+                    color = Select_SSE2(aamask, res, color);
+                }
+            }
+
+            _mm_storeu_si128((__m128i*)&ColorBuffer[pixeladdr], color);
+        }
+    }
+#endif
 
     if (RenderDispCnt & (1<<5))
     {
         // edge marking
         // only applied to topmost pixels
 
-        for (int x = 0; x < 256; x++)
+        for (int x = firstx; x < ScreenWidth; x++)
         {
             u32 pixeladdr = FirstPixelOffset + (y*ScanlineWidth) + x;
 
@@ -1847,7 +2741,7 @@ void ScanlineFinalPass(s32 y)
         u32 fogB = (RenderFogColor >> 9) & 0x3E; if (fogB) fogB++;
         u32 fogA = (RenderFogColor >> 16) & 0x1F;
 
-        for (int x = 0; x < 256; x++)
+        for (int x = firstx; x < ScreenWidth; x++)
         {
             u32 pixeladdr = FirstPixelOffset + (y*ScanlineWidth) + x;
             u32 density, srccolor, srcR, srcG, srcB, srcA;
@@ -1911,7 +2805,7 @@ void ScanlineFinalPass(s32 y)
         // edges were flagged and their coverages calculated during rendering
         // this is where such edge pixels are blended with the pixels underneath
 
-        for (int x = 0; x < 256; x++)
+        for (int x = firstx; x < ScreenWidth; x++)
         {
             u32 pixeladdr = FirstPixelOffset + (y*ScanlineWidth) + x;
 
@@ -1957,35 +2851,80 @@ void ScanlineFinalPass(s32 y)
     }
 }
 
+// stretches the first 256 pixels of a row over ScaleFactor rows of the screen width
+void ScaleClearRow(u32 rowaddr)
+{
+    u32* buffers[3] = {ColorBuffer, DepthBuffer, AttrBuffer};
+
+    for (int i = 0; i < 3; i++)
+    {
+        u32* row = &buffers[i][rowaddr];
+
+        // backwards, so the source pixels aren't overwritten before they're used
+        for (int x = 255; x >= 0; x--)
+        {
+            u32 val = row[x];
+            for (int j = ScaleFactor-1; j >= 0; j--)
+                row[(x * ScaleFactor) + j] = val;
+        }
+
+        for (int j = 1; j < ScaleFactor; j++)
+            memcpy(&row[j * ScanlineWidth], row, ScreenWidth * 4);
+    }
+}
+
 void ClearBuffers()
 {
     u32 clearz = ((RenderClearAttr2 & 0x7FFF) * 0x200) + 0x1FF;
     u32 polyid = RenderClearAttr1 & 0x3F000000; // this sets the opaque polygonID
 
-    // fill screen borders for edge marking
+    s32 x0 = 0, x1 = ScreenWidth-1;
+    s32 y0 = 0, y1 = ScreenHeight-1;
 
-    for (int x = 0; x < ScanlineWidth; x++)
-    {
-        ColorBuffer[x] = 0;
-        DepthBuffer[x] = clearz;
-        AttrBuffer[x] = polyid;
-    }
+    // the borders and all the pixels outside of the dirty area still hold
+    // what the last clear put there, if it used the same values
+    bool bitmap = (RenderDispCnt & (1<<14)) != 0;
+    bool partial = ClearValid && !bitmap &&
+                   (RenderClearAttr1 == LastClearAttr1) && (RenderClearAttr2 == LastClearAttr2);
 
-    for (int x = ScanlineWidth; x < ScanlineWidth*193; x+=ScanlineWidth)
+    ClearValid = !bitmap;
+    LastClearAttr1 = RenderClearAttr1;
+    LastClearAttr2 = RenderClearAttr2;
+
+    if (partial)
     {
-        ColorBuffer[x] = 0;
-        DepthBuffer[x] = clearz;
-        AttrBuffer[x] = polyid;
-        ColorBuffer[x+257] = 0;
-        DepthBuffer[x+257] = clearz;
-        AttrBuffer[x+257] = polyid;
-    }
+        if (DirtyX0 > DirtyX1) return;
 
-    for (int x = ScanlineWidth*193; x < ScanlineWidth*194; x++)
+        x0 = DirtyX0; x1 = DirtyX1;
+        y0 = DirtyY0; y1 = DirtyY1;
+    }
+    else
     {
-        ColorBuffer[x] = 0;
-        DepthBuffer[x] = clearz;
-        AttrBuffer[x] = polyid;
+        // fill screen borders for edge marking
+
+        for (int x = 0; x < ScanlineWidth; x++)
+        {
+            ColorBuffer[x] = 0;
+            DepthBuffer[x] = clearz;
+            AttrBuffer[x] = polyid;
+        }
+
+        for (int x = ScanlineWidth; x < ScanlineWidth*(NumScanlines-1); x+=ScanlineWidth)
+        {
+            ColorBuffer[x] = 0;
+            DepthBuffer[x] = clearz;
+            AttrBuffer[x] = polyid;
+            ColorBuffer[x+ScreenWidth+1] = 0;
+            DepthBuffer[x+ScreenWidth+1] = clearz;
+            AttrBuffer[x+ScreenWidth+1] = polyid;
+        }
+
+        for (int x = ScanlineWidth*(NumScanlines-1); x < ScanlineWidth*NumScanlines; x++)
+        {
+            ColorBuffer[x] = 0;
+            DepthBuffer[x] = clearz;
+            AttrBuffer[x] = polyid;
+        }
     }
 
     // clear the screen
@@ -1995,9 +2934,46 @@ void ClearBuffers()
         u8 xoff = (RenderClearAttr2 >> 16) & 0xFF;
         u8 yoff = (RenderClearAttr2 >> 24) & 0xFF;
 
-        for (int y = 0; y < ScanlineWidth*192; y+=ScanlineWidth)
+        // rows are converted at native resolution, then stretched when upscaling
+        for (int y = 0; y < ScanlineWidth*ScreenHeight; y+=ScanlineWidth*ScaleFactor)
         {
-            for (int x = 0; x < 256; x++)
+            int x = 0;
+
+#ifdef GPU3D_SOFT_SSE2
+            // unwrap the rows first, the X offset wraps around within them
+            u16 row2[256], row3[256];
+            u8* src2 = &GPU::VRAMFlat_Texture[0x40000 + (yoff << 9)];
+            u8* src3 = &GPU::VRAMFlat_Texture[0x60000 + (yoff << 9)];
+            memcpy(&row2[0], &src2[xoff << 1], (256 - xoff) << 1);
+            memcpy(&row2[256 - xoff], &src2[0], xoff << 1);
+            memcpy(&row3[0], &src3[xoff << 1], (256 - xoff) << 1);
+            memcpy(&row3[256 - xoff], &src3[0], xoff << 1);
+
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i vpolyid = _mm_set1_epi32(polyid);
+
+            for (; x < 256; x += 4)
+            {
+                __m128i val2 = _mm_unpacklo_epi16(_mm_loadl_epi64((__m128i*)&row2[x]), zero);
+                __m128i val3 = _mm_unpacklo_epi16(_mm_loadl_epi64((__m128i*)&row3[x]), zero);
+
+                __m128i r = ExpandColor_SSE2(_mm_and_si128(_mm_slli_epi32(val2, 1), _mm_set1_epi32(0x3E)));
+                __m128i g = ExpandColor_SSE2(_mm_and_si128(_mm_srli_epi32(val2, 4), _mm_set1_epi32(0x3E)));
+                __m128i b = ExpandColor_SSE2(_mm_and_si128(_mm_srli_epi32(val2, 9), _mm_set1_epi32(0x3E)));
+                __m128i a = _mm_and_si128(_mm_cmpgt_epi32(val2, _mm_set1_epi32(0x7FFF)), _mm_set1_epi32(0x1F000000));
+                __m128i color = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)), _mm_or_si128(_mm_slli_epi32(b, 16), a));
+
+                __m128i z = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(val3, _mm_set1_epi32(0x7FFF)), 9), _mm_set1_epi32(0x1FF));
+                __m128i attr = _mm_or_si128(vpolyid, _mm_and_si128(val3, _mm_set1_epi32(0x8000)));
+
+                u32 pixeladdr = FirstPixelOffset + y + x;
+                _mm_storeu_si128((__m128i*)&ColorBuffer[pixeladdr], color);
+                _mm_storeu_si128((__m128i*)&DepthBuffer[pixeladdr], z);
+                _mm_storeu_si128((__m128i*)&AttrBuffer[pixeladdr], attr);
+            }
+#endif
+
+            for (; x < 256; x++)
             {
                 u16 val2 = GPU::ReadVRAM_Texture<u16>(0x40000 + (yoff << 9) + (xoff << 1));
                 u16 val3 = GPU::ReadVRAM_Texture<u16>(0x60000 + (yoff << 9) + (xoff << 1));
@@ -2019,6 +2995,9 @@ void ClearBuffers()
                 xoff++;
             }
 
+            if (ScaleFactor > 1)
+                ScaleClearRow(FirstPixelOffset + y);
+
             yoff++;
         }
     }
@@ -2033,9 +3012,9 @@ void ClearBuffers()
 
 		polyid |= (RenderClearAttr1 & 0x8000);
 
-        for (int y = 0; y < ScanlineWidth*192; y+=ScanlineWidth)
+        for (int y = y0*ScanlineWidth; y <= y1*ScanlineWidth; y+=ScanlineWidth)
         {
-            for (int x = 0; x < 256; x++)
+            for (int x = x0; x <= x1; x++)
             {
                 u32 pixeladdr = FirstPixelOffset + y + x;
                 ColorBuffer[pixeladdr] = color;
@@ -2046,48 +3025,337 @@ void ClearBuffers()
     }
 }
 
+void RenderBand(int band)
+{
+    RendererPolygon* list = BandPolygonList[band];
+    s32 ystart = BandStart[band];
+    s32 yend = BandStart[band+1];
+    int n = 0;
+
+    // pick the polygons overlapping the band, keeping their order
+    // polygons starting above the band get their edges set up for the first line
+    // of the band, which gives the same result as stepping them down to it
+    for (int i = 0; i < BandNumPolygons; i++)
+    {
+        RendererPolygon* src = &PolygonList[i];
+
+        s32 ylast = (src->YBottom == src->YTop) ? src->YTop : (src->YBottom - 1);
+        if (src->YTop >= yend || ylast < ystart)
+            continue;
+
+        RendererPolygon* rp = &list[n++];
+        *rp = *src;
+
+        if (rp->YTop < ystart)
+        {
+            SetupPolygonLeftEdge(rp, ystart);
+            SetupPolygonRightEdge(rp, ystart);
+        }
+    }
+
+    // edge marking looks at the neighboring lines, so the first and last line
+    // of a band can only be finished once the neighbor bands have rendered theirs
+
+    PolygonBinList* bins = &PolygonBins[band];
+    BinPolygons(bins, list, n, ystart);
+
+    RenderScanline(list, bins, ystart);
+    if (band > 0)
+        Platform::Semaphore_Post(Sema_BandFirstLine[band]);
+
+    for (s32 y = ystart+1; y < yend; y++)
+    {
+        RenderScanline(list, bins, y);
+        if (y == yend-1 && band < NumBands-1)
+            Platform::Semaphore_Post(Sema_BandLastLine[band]);
+
+        if (y-1 == ystart && band > 0)
+            Platform::Semaphore_Wait(Sema_BandLastLine[band-1]);
+
+        ScanlineFinalPass(y-1);
+        Platform::Semaphore_Post(Sema_ScanlineCount[band]);
+    }
+
+    if (band < NumBands-1)
+        Platform::Semaphore_Wait(Sema_BandFirstLine[band+1]);
+
+    ScanlineFinalPass(yend-1);
+    Platform::Semaphore_Post(Sema_ScanlineCount[band]);
+}
+
+template<int band>
+void BandThreadFunc()
+{
+    for (;;)
+    {
+        Platform::Semaphore_Wait(Sema_BandStart[band]);
+        if (!BandThreadRunning[band]) return;
+
+        RenderBand(band);
+
+        Platform::Semaphore_Post(Sema_BandDone[band]);
+    }
+}
+
+void (*BandThreadFuncs[MAX_RENDER_BANDS])() =
+{
+    BandThreadFunc<0>, BandThreadFunc<1>, BandThreadFunc<2>, BandThreadFunc<3>,
+    BandThreadFunc<4>, BandThreadFunc<5>, BandThreadFunc<6>, BandThreadFunc<7>,
+};
+
+void StartBandThreads()
+{
+    if (NumBands < 2) return;
+
+    for (int b = 0; b < NumBands; b++)
+    {
+        if (!BandPolygonList[b])
+            BandPolygonList[b] = new RendererPolygon[2048];
+    }
+
+    // band 0 is rendered by the render thread itself
+    for (int b = 1; b < NumBands; b++)
+    {
+        BandThreadRunning[b] = true;
+        BandThread[b] = Platform::Thread_Create(BandThreadFuncs[b]);
+    }
+}
+
+void StopBandThreads()
+{
+    for (int b = 1; b < MAX_RENDER_BANDS; b++)
+    {
+        if (!BandThreadRunning[b]) continue;
+
+        BandThreadRunning[b] = false;
+        Platform::Semaphore_Post(Sema_BandStart[b]);
+        Platform::Thread_Wait(BandThread[b]);
+        Platform::Thread_Free(BandThread[b]);
+    }
+}
+
+void FreeBandPolygonLists()
+{
+    for (int b = 0; b < MAX_RENDER_BANDS; b++)
+    {
+        if (BandPolygonList[b]) delete[] BandPolygonList[b];
+        BandPolygonList[b] = NULL;
+    }
+}
+
+bool CheckSceneChanged(Polygon** polygons, int npolys)
+{
+    int buf = SceneDataBuf ^ 1;
+    u32* data = SceneData[buf];
+    u32 len = 0;
+
+    data[len++] = RenderDispCnt;
+    data[len++] = RenderAlphaRef;
+    data[len++] = RenderFogColor;
+    data[len++] = RenderFogOffset;
+    data[len++] = RenderFogShift;
+    data[len++] = RenderClearAttr1;
+    data[len++] = RenderClearAttr2;
+    for (int i = 0; i < 32; i+=2) data[len++] = RenderToonTable[i] | (RenderToonTable[i+1] << 16);
+    for (int i = 0; i < 8; i+=2)  data[len++] = RenderEdgeTable[i] | (RenderEdgeTable[i+1] << 16);
+    for (int i = 0; i < 34; i++)  data[len++] = RenderFogDensityTable[i];
+
+    // textures and the clear bitmap
+    u32 texgen = 0;
+    for (int i = 0; i < 0x20; i++) texgen += GPU::VRAMGen_Texture[i];
+    for (int i = 0; i < 0x8; i++)  texgen += GPU::VRAMGen_TexPal[i];
+    data[len++] = texgen;
+
+    data[len++] = npolys;
+    for (int i = 0; i < npolys; i++)
+    {
+        Polygon* polygon = polygons[i];
+
+        data[len++] = polygon->NumVertices;
+        data[len++] = polygon->Attr;
+        data[len++] = polygon->TexParam;
+        data[len++] = polygon->TexPalette;
+        data[len++] = polygon->WBuffer | (polygon->Degenerate << 1) | (polygon->FacingView << 2) |
+                      (polygon->Translucent << 3) | (polygon->IsShadowMask << 4) | (polygon->IsShadow << 5) |
+                      (polygon->Type << 8);
+        data[len++] = polygon->VTop;
+        data[len++] = polygon->VBottom;
+        data[len++] = polygon->YTop;
+        data[len++] = polygon->YBottom;
+
+        for (u32 v = 0; v < polygon->NumVertices; v++)
+        {
+            Vertex* vtx = polygon->Vertices[v];
+
+            data[len++] = polygon->FinalZ[v];
+            data[len++] = polygon->FinalW[v];
+            data[len++] = vtx->FinalPosition[0] | (vtx->FinalPosition[1] << 16);
+            data[len++] = vtx->HiresPosition[0] | (vtx->HiresPosition[1] << 16);
+            data[len++] = vtx->FinalColor[0];
+            data[len++] = vtx->FinalColor[1];
+            data[len++] = vtx->FinalColor[2];
+            data[len++] = (u16)vtx->TexCoords[0] | ((u16)vtx->TexCoords[1] << 16);
+        }
+    }
+
+    SceneDataLen[buf] = len;
+
+    if (SceneValid && len == SceneDataLen[SceneDataBuf] &&
+        !memcmp(data, SceneData[SceneDataBuf], len * 4))
+        return false;
+
+    SceneDataBuf = buf;
+    SceneValid = true;
+    return true;
+}
+
 void RenderPolygons(bool threaded, Polygon** polygons, int npolys)
 {
+    bool shadowmask = false;
+
+    TexCacheFrame++;
+
+    DirtyX0 = ScreenWidth; DirtyX1 = -1;
+    DirtyY0 = ScreenHeight; DirtyY1 = -1;
+
     int j = 0;
     for (int i = 0; i < npolys; i++)
     {
-        if (polygons[i]->Degenerate) continue;
-        SetupPolygon(&PolygonList[j++], polygons[i]);
+        Polygon* polygon = polygons[i];
+        if (polygon->Degenerate) continue;
+        if (polygon->IsShadowMask) shadowmask = true;
+
+        RendererPolygon* rp = &PolygonList[j++];
+        SetupPolygon(rp, polygon);
+
+        if (polygon->IsShadowMask) continue;
+
+        // edges can end up one pixel past the vertices
+        for (u32 v = 0; v < polygon->NumVertices; v++)
+        {
+            s32 vx = rp->VtxX[v];
+            if (vx - 1 < DirtyX0) DirtyX0 = vx - 1;
+            if (vx + 1 > DirtyX1) DirtyX1 = vx + 1;
+        }
+        if (rp->YTop < DirtyY0) DirtyY0 = rp->YTop;
+        if (rp->YBottom > DirtyY1) DirtyY1 = rp->YBottom;
     }
 
-    RenderScanline(0, j);
+    // fog also applies to cleared pixels
+    if (RenderDispCnt & (1<<7))
+    {
+        DirtyX0 = 0; DirtyX1 = ScreenWidth-1;
+        DirtyY0 = 0; DirtyY1 = ScreenHeight-1;
+    }
+    else
+    {
+        if (DirtyX0 < 0) DirtyX0 = 0;
+        if (DirtyX1 > ScreenWidth-1) DirtyX1 = ScreenWidth-1;
+        if (DirtyY0 < 0) DirtyY0 = 0;
+        if (DirtyY1 > ScreenHeight-1) DirtyY1 = ScreenHeight-1;
+    }
 
-    for (s32 y = 1; y < 192; y++)
+    // shadow masks carry stencil state from one line to the next,
+    // so scenes using them are rendered in one go
+    if (threaded && NumBands > 1 && !shadowmask)
     {
-        RenderScanline(y, j);
+        BandNumPolygons = j;
+
+        for (int b = 1; b < NumBands; b++)
+            Platform::Semaphore_Post(Sema_BandStart[b]);
+
+        RenderBand(0);
+
+        for (int b = 1; b < NumBands; b++)
+            Platform::Semaphore_Wait(Sema_BandDone[b]);
+
+        return;
+    }
+
+    PolygonBinList* bins = &PolygonBins[0];
+    BinPolygons(bins, PolygonList, j, 0);
+
+    RenderScanline(PolygonList, bins, 0);
+
+    for (s32 y = 1; y < ScreenHeight; y++)
+    {
+        RenderScanline(PolygonList, bins, y);
         ScanlineFinalPass(y-1);
 
         if (threaded)
-            Platform::Semaphore_Post(Sema_ScanlineCount);
+            Platform::Semaphore_Post(Sema_ScanlineCount[LineBand[y-1]]);
     }
 
-    ScanlineFinalPass(191);
+    ScanlineFinalPass(ScreenHeight-1);
 
     if (threaded)
-        Platform::Semaphore_Post(Sema_ScanlineCount);
+        Platform::Semaphore_Post(Sema_ScanlineCount[LineBand[ScreenHeight-1]]);
+}
+
+void PrepareAccelFrame(bool rendered)
+{
+    if (ScaleFactor == 1) return;
+
+    // both buffers already hold the current image if nothing was rendered since
+    if (rendered) AccelFramesStale = 2;
+    if (AccelFramesStale > 0)
+    {
+        AccelFramesStale--;
+
+        u32* dst = AccelFrame[AccelFrontBuffer ^ 1];
+        for (s32 y = 0; y < ScreenHeight; y++)
+        {
+            u32* src = &ColorBuffer[(y * ScanlineWidth) + FirstPixelOffset];
+            for (s32 x = 0; x < ScreenWidth; x++)
+            {
+                u32 color = src[x];
+                dst[x] = AccelColorLUT[color & 0x3F] |
+                         (AccelColorLUT[(color >> 8) & 0x3F] << 8) |
+                         (AccelColorLUT[(color >> 16) & 0x3F] << 16) |
+                         (AccelAlphaLUT[(color >> 24) & 0x1F] << 24);
+            }
+            dst += ScreenWidth;
+        }
+    }
+
+    AccelFramePending = true;
 }
 
 void VCount144()
 {
     if (RenderThreadRunning)
         Platform::Semaphore_Wait(Sema_RenderDone);
+
+    if (AccelFramePending)
+    {
+        AccelFrontBuffer ^= 1;
+        AccelFramePending = false;
+    }
 }
 
 void RenderFrame()
 {
+    // lines the frame before didn't consume are dropped
+    NextWaitLine = 0;
+
     if (RenderThreadRunning)
     {
+        for (int b = 0; b < NumBands; b++)
+            Platform::Semaphore_Reset(Sema_ScanlineCount[b]);
+
         Platform::Semaphore_Post(Sema_RenderStart);
     }
     else
     {
-        ClearBuffers();
-        RenderPolygons(false, &RenderPolygonRAM[0], RenderNumPolygons);
+        // the buffers still hold the image from last time if nothing changed
+        bool changed = CheckSceneChanged(&RenderPolygonRAM[0], RenderNumPolygons);
+        if (changed)
+        {
+            ClearBuffers();
+            RenderPolygons(false, &RenderPolygonRAM[0], RenderNumPolygons);
+        }
+
+        PrepareAccelFrame(changed);
     }
 }
 
@@ -2099,8 +3367,19 @@ void RenderThreadFunc()
         if (!RenderThreadRunning) return;
 
         RenderThreadRendering = true;
-        ClearBuffers();
-        RenderPolygons(true, &RenderPolygonRAM[0], RenderNumPolygons);
+        bool changed = CheckSceneChanged(&RenderPolygonRAM[0], RenderNumPolygons);
+        if (changed)
+        {
+            ClearBuffers();
+            RenderPolygons(true, &RenderPolygonRAM[0], RenderNumPolygons);
+        }
+        else
+        {
+            for (int y = 0; y < ScreenHeight; y++)
+                Platform::Semaphore_Post(Sema_ScanlineCount[LineBand[y]]);
+        }
+
+        PrepareAccelFrame(changed);
 
         Platform::Semaphore_Post(Sema_RenderDone);
         RenderThreadRendering = false;
@@ -2109,13 +3388,28 @@ void RenderThreadFunc()
 
 u32* GetLine(int line)
 {
-    if (RenderThreadRunning)
+    // wait for all the lines up to the one sampled
+    // lines are finished in order within each band, but not across bands
+    s32 y = line * ScaleFactor;
+    if (RenderThreadRunning && line < 192)
     {
-        if (line < 192)
-            Platform::Semaphore_Wait(Sema_ScanlineCount);
+        for (; NextWaitLine <= y; NextWaitLine++)
+            Platform::Semaphore_Wait(Sema_ScanlineCount[LineBand[NextWaitLine]]);
     }
 
-    return &ColorBuffer[(line * ScanlineWidth) + FirstPixelOffset];
+    u32* src = &ColorBuffer[(y * ScanlineWidth) + FirstPixelOffset];
+    if (ScaleFactor == 1)
+        return src;
+
+    for (int x = 0; x < 256; x++)
+        DownscaledLine[x] = src[x * ScaleFactor];
+
+    return DownscaledLine;
+}
+
+u32* GetAccelFrame()
+{
+    return AccelFrame[AccelFrontBuffer];
 }
 
 }
@@ -30,6 +30,7 @@
 #include "RTC.h"
 #include "Wifi.h"
 #include "Platform.h"
+#include "SaveWriter.h"
 #include "Vanguard/VanguardClient.h"
 
 
@@ -169,6 +170,7 @@ bool Init()
     IPCFIFO9 = new FIFO<u32>(16);
     IPCFIFO7 = new FIFO<u32>(16);
 
+    if (!SaveWriter::Init()) return false;
     if (!NDSCart::Init()) return false;
     if (!GPU::Init()) return false;
     if (!SPU::Init()) return false;
@@ -196,6 +198,8 @@ void DeInit()
     SPI::DeInit();
     RTC::DeInit();
     Wifi::DeInit();
+
+    SaveWriter::DeInit();
 }
 
 
@@ -506,6 +510,8 @@ void Stop()
     Platform::StopEmu();
     GPU::Stop();
     SPU::Stop();
+
+    SaveWriter::Flush();
 }
 
 bool DoSavestate_Scheduler(Savestate* file)
@@ -848,6 +854,9 @@ u32 RunFrame()
         }
     }
 
+    // flush the audio for this frame
+    SPU::Run();
+
 #ifdef DEBUG_CHECK_DESYNC
     printf("[%08X%08X] ARM9=%ld, ARM7=%ld, GPU=%ld\n",
            (u32)(SysTimestamp>>32), (u32)SysTimestamp,
@@ -1755,12 +1764,14 @@ void ARM9Write8(u32 addr, u8 val)
     switch (addr & 0xFF000000)
     {
     case 0x02000000:
+        SPU::CheckSourceWrite(0x02000000 | (addr & (MAIN_RAM_SIZE - 1)));
         *(u8*)&MainRAM[addr & (MAIN_RAM_SIZE - 1)] = val;
         return;
 
     case 0x03000000:
         if (SWRAM_ARM9)
         {
+            SPU::CheckSourceWrite(addr);
             *(u8*)&SWRAM_ARM9[addr & SWRAM_ARM9Mask] = val;
         }
         return;
@@ -1792,12 +1803,14 @@ void ARM9Write16(u32 addr, u16 val)
     switch (addr & 0xFF000000)
     {
     case 0x02000000:
+        SPU::CheckSourceWrite(0x02000000 | (addr & (MAIN_RAM_SIZE - 1)));
         *(u16*)&MainRAM[addr & (MAIN_RAM_SIZE - 1)] = val;
         return;
 
     case 0x03000000:
         if (SWRAM_ARM9)
         {
+            SPU::CheckSourceWrite(addr);
             *(u16*)&SWRAM_ARM9[addr & SWRAM_ARM9Mask] = val;
         }
         return;
@@ -1808,7 +1821,9 @@ void ARM9Write16(u32 addr, u16 val)
 
     case 0x05000000:
         if (!(PowerControl9 & ((addr & 0x400) ? (1<<9) : (1<<1)))) return;
+        if (GPU::Deferred2DPending) GPU::SyncDeferred2D();
         *(u16*)&GPU::Palette[addr & 0x7FF] = val;
+        GPU::PaletteGen[(addr >> 9) & 0x3]++;
         return;
 
     case 0x06000000:
@@ -1823,7 +1838,9 @@ void ARM9Write16(u32 addr, u16 val)
 
     case 0x07000000:
         if (!(PowerControl9 & ((addr & 0x400) ? (1<<9) : (1<<1)))) return;
+        if (GPU::Deferred2DPending) GPU::SyncDeferred2D();
         *(u16*)&GPU::OAM[addr & 0x7FF] = val;
+        GPU::OAMGen[(addr >> 10) & 0x1]++;
         return;
     }
 
@@ -1835,12 +1852,14 @@ void ARM9Write32(u32 addr, u32 val)
     switch (addr & 0xFF000000)
     {
     case 0x02000000:
+        SPU::CheckSourceWrite(0x02000000 | (addr & (MAIN_RAM_SIZE - 1)));
         *(u32*)&MainRAM[addr & (MAIN_RAM_SIZE - 1)] = val;
         return ;
 
     case 0x03000000:
         if (SWRAM_ARM9)
         {
+            SPU::CheckSourceWrite(addr);
             *(u32*)&SWRAM_ARM9[addr & SWRAM_ARM9Mask] = val;
         }
         return;
@@ -1851,7 +1870,9 @@ void ARM9Write32(u32 addr, u32 val)
 
     case 0x05000000:
         if (!(PowerControl9 & ((addr & 0x400) ? (1<<9) : (1<<1)))) return;
+        if (GPU::Deferred2DPending) GPU::SyncDeferred2D();
         *(u32*)&GPU::Palette[addr & 0x7FF] = val;
+        GPU::PaletteGen[(addr >> 9) & 0x3]++;
         return;
 
     case 0x06000000:
@@ -1866,7 +1887,9 @@ void ARM9Write32(u32 addr, u32 val)
 
     case 0x07000000:
         if (!(PowerControl9 & ((addr & 0x400) ? (1<<9) : (1<<1)))) return;
+        if (GPU::Deferred2DPending) GPU::SyncDeferred2D();
         *(u32*)&GPU::OAM[addr & 0x7FF] = val;
+        GPU::OAMGen[(addr >> 10) & 0x1]++;
         return;
     }
 
@@ -2093,10 +2116,12 @@ void ARM7Write8(u32 addr, u8 val)
     {
     case 0x02000000:
     case 0x02800000:
+        SPU::CheckSourceWrite(0x02000000 | (addr & (MAIN_RAM_SIZE - 1)));
         *(u8*)&MainRAM[addr & (MAIN_RAM_SIZE - 1)] = val;
         return;
 
     case 0x03000000:
+        SPU::CheckSourceWrite(addr);
         if (SWRAM_ARM7)
         {
             *(u8*)&SWRAM_ARM7[addr & SWRAM_ARM7Mask] = val;
@@ -2109,6 +2134,7 @@ void ARM7Write8(u32 addr, u8 val)
         }
 
     case 0x03800000:
+        SPU::CheckSourceWrite(addr);
         *(u8*)&ARM7WRAM[addr & 0xFFFF] = val;
         return;
 
@@ -2131,10 +2157,12 @@ void ARM7Write16(u32 addr, u16 val)
     {
     case 0x02000000:
     case 0x02800000:
+        SPU::CheckSourceWrite(0x02000000 | (addr & (MAIN_RAM_SIZE - 1)));
         *(u16*)&MainRAM[addr & (MAIN_RAM_SIZE - 1)] = val;
         return;
 
     case 0x03000000:
+        SPU::CheckSourceWrite(addr);
         if (SWRAM_ARM7)
         {
             *(u16*)&SWRAM_ARM7[addr & SWRAM_ARM7Mask] = val;
@@ -2147,6 +2175,7 @@ void ARM7Write16(u32 addr, u16 val)
         }
 
     case 0x03800000:
+        SPU::CheckSourceWrite(addr);
         *(u16*)&ARM7WRAM[addr & 0xFFFF] = val;
         return;
 
@@ -2177,10 +2206,12 @@ void ARM7Write32(u32 addr, u32 val)
     {
     case 0x02000000:
     case 0x02800000:
+        SPU::CheckSourceWrite(0x02000000 | (addr & (MAIN_RAM_SIZE - 1)));
         *(u32*)&MainRAM[addr & (MAIN_RAM_SIZE - 1)] = val;
         return;
 
     case 0x03000000:
+        SPU::CheckSourceWrite(addr);
         if (SWRAM_ARM7)
         {
             *(u32*)&SWRAM_ARM7[addr & SWRAM_ARM7Mask] = val;
@@ -2193,6 +2224,7 @@ void ARM7Write32(u32 addr, u32 val)
         }
 
     case 0x03800000:
+        SPU::CheckSourceWrite(addr);
         *(u32*)&ARM7WRAM[addr & 0xFFFF] = val;
         return;
 
@@ -23,6 +23,8 @@
 #include "ARM.h"
 #include "CRC32.h"
 #include "Platform.h"
+#include "ROMList.h"
+#include "SaveWriter.h"
 #include "Vanguard/VanguardClient.h"
 
 namespace NDSCart_SRAM
@@ -43,6 +45,9 @@ u8 Data;
 u8 StatusReg;
 u32 Addr;
 
+// range modified by the current command
+u32 DirtyStart, DirtyEnd;
+
 
 void Write_Null(u8 val, bool islast);
 void Write_EEPROMTiny(u8 val, bool islast);
@@ -98,6 +103,12 @@ void DoSavestate(Savestate* file)
         file->VarArray(SRAM, SRAMLength);
     }
 
+    if (!file->Saving)
+    {
+        // the save file is updated once the savestate is relocated, or on the next write
+        SaveWriter::SetFile(SaveWriter::File_SRAM, SRAMPath, false, SRAM, SRAMLength);
+    }
+
     // SPI status shito
 
     file->Var32(&Hold);
@@ -163,6 +174,11 @@ void LoadSave(const char* path, u32 type)
     CurCmd = 0;
     Data = 0;
     StatusReg = 0x00;
+
+    DirtyStart = 0xFFFFFFFF;
+    DirtyEnd = 0;
+
+    SaveWriter::SetFile(SaveWriter::File_SRAM, SRAMPath, false, SRAM, SRAMLength);
 }
 
 void RelocateSave(const char* path, bool write)
@@ -176,15 +192,9 @@ void RelocateSave(const char* path, bool write)
     strncpy(SRAMPath, path, 1023);
     SRAMPath[1023] = '\0';
 
-    FILE* f = Platform::OpenFile(path, "wb");
-    if (!f)
-    {
-        printf("NDSCart_SRAM::RelocateSave: failed to create new file. fuck\n");
-        return;
-    }
-
-    fwrite(SRAM, SRAMLength, 1, f);
-    fclose(f);
+    SaveWriter::SetFile(SaveWriter::File_SRAM, path, false, SRAM, SRAMLength);
+    SaveWriter::MarkDirty(SaveWriter::File_SRAM, SRAM, 0, SRAMLength);
+    SaveWriter::Flush();
 }
 
 u8 Read()
@@ -192,6 +202,12 @@ u8 Read()
     return Data;
 }
 
+void SetDirty(u32 addr)
+{
+    if (addr < DirtyStart) DirtyStart = addr;
+    if (addr >= DirtyEnd)  DirtyEnd = addr + 1;
+}
+
 void Write_Null(u8 val, bool islast) {}
 
 void Write_EEPROMTiny(u8 val, bool islast)
@@ -207,7 +223,9 @@ void Write_EEPROMTiny(u8 val, bool islast)
         }
         else
         {
-            SRAM[(Addr + ((CurCmd==0x0A)?0x100:0)) & 0x1FF] = val;
+            u32 addr = (Addr + ((CurCmd==0x0A)?0x100:0)) & 0x1FF;
+            SRAM[addr] = val;
+            SetDirty(addr);
             Addr++;
         }
         break;
@@ -254,6 +272,7 @@ void Write_EEPROM(u8 val, bool islast)
         else
         {
             SRAM[Addr & (SRAMLength-1)] = val;
+            SetDirty(Addr & (SRAMLength-1));
             Addr++;
         }
         break;
@@ -297,6 +316,7 @@ void Write_Flash(u8 val, bool islast)
         else
         {
             SRAM[Addr & (SRAMLength-1)] = 0;
+            SetDirty(Addr & (SRAMLength-1));
             Addr++;
         }
         break;
@@ -325,6 +345,7 @@ void Write_Flash(u8 val, bool islast)
         else
         {
             SRAM[Addr & (SRAMLength-1)] = val;
+            SetDirty(Addr & (SRAMLength-1));
             Addr++;
         }
         break;
@@ -345,6 +366,7 @@ void Write_Flash(u8 val, bool islast)
             for (u32 i = 0; i < 0x10000; i++)
             {
                 SRAM[Addr & (SRAMLength-1)] = 0;
+                SetDirty(Addr & (SRAMLength-1));
                 Addr++;
             }
         }
@@ -362,6 +384,7 @@ void Write_Flash(u8 val, bool islast)
             for (u32 i = 0; i < 0x100; i++)
             {
                 SRAM[Addr & (SRAMLength-1)] = 0;
+                SetDirty(Addr & (SRAMLength-1));
                 Addr++;
             }
         }
@@ -441,14 +464,13 @@ void Write(u8 val, u32 hold)
         break;
     }
 
-    if (islast && (CurCmd == 0x02 || CurCmd == 0x0A) && (SRAMLength > 0))
+    if (islast && (DirtyEnd > DirtyStart))
     {
-        FILE* f = Platform::OpenFile(SRAMPath, "wb");
-        if (f)
-        {
-            fwrite(SRAM, SRAMLength, 1, f);
-            fclose(f);
-        }
+        // the save file is written from a separate thread, coalescing successive writes
+        SaveWriter::MarkDirty(SaveWriter::File_SRAM, SRAM, DirtyStart, DirtyEnd);
+
+        DirtyStart = 0xFFFFFFFF;
+        DirtyEnd = 0;
     }
 }
 
@@ -472,6 +494,14 @@ bool CartInserted;
 u8* CartROM;
 u32 CartROMSize;
 u32 CartCRC;
+
+void* CartROMMap; // set if the ROM file is memory-mapped
+
+// the ROM CRC isn't needed to boot the game, so it is computed in the background
+void* CRCThread;
+volatile bool CRCAbort;
+char CRCPath[1024];
+u32 CRCSize;
 u32 CartID;
 bool CartIsHomebrew;
 
@@ -598,14 +628,40 @@ bool Init()
     if (!NDSCart_SRAM::Init()) return false;
 
     CartROM = NULL;
+    CartROMMap = NULL;
+    CRCThread = NULL;
+
+    // the ROM database is optional, ROMs not found in it get default parameters
+    ROMList::Init();
 
     return true;
 }
 
+void StopCRCThread()
+{
+    if (!CRCThread) return;
+
+    CRCAbort = true;
+    Platform::Thread_Wait(CRCThread);
+    Platform::Thread_Free(CRCThread);
+    CRCThread = NULL;
+}
+
+void FreeROM()
+{
+    if (CartROMMap)   Platform::UnmapFile(CartROMMap);
+    else if (CartROM) delete[] CartROM;
+
+    CartROM = NULL;
+    CartROMMap = NULL;
+}
+
 void DeInit()
 {
-    if (CartROM) delete[] CartROM;
+    StopCRCThread();
+    FreeROM();
 
+    ROMList::DeInit();
     NDSCart_SRAM::DeInit();
 }
 
@@ -625,8 +681,8 @@ void Reset()
     DataOutLen = 0;
 
     CartInserted = false;
-    if (CartROM) delete[] CartROM;
-    CartROM = NULL;
+    StopCRCThread();
+    FreeROM();
     CartROMSize = 0;
     CartID = 0;
     CartIsHomebrew = false;
@@ -811,66 +867,55 @@ void ApplyDLDIPatch()
 
 bool ReadROMParams(u32 gamecode, u32* params)
 {
-    // format for romlist.bin:
-    // [gamecode] [ROM size] [save type] [reserved]
-    // list must be sorted by gamecode
+    const ROMList::Entry* entry = ROMList::Find(gamecode);
+    if (!entry) return false;
 
-    FILE* f = Platform::OpenLocalFile("romlist.bin", "rb");
-    if (!f) return false;
+    params[0] = entry->ROMSize;
+    params[1] = entry->SaveType;
+    params[2] = entry->Reserved;
+    return true;
+}
 
-    fseek(f, 0, SEEK_END);
-    u32 len = (u32)ftell(f);
-    u32 maxlen = len;
-    len >>= 4; // 16 bytes per entry
 
-    u32 offset = 0;
-    u32 chk_size = len >> 1;
-    for (;;)
-    {
-        u32 key = 0;
-        fseek(f, offset + (chk_size << 4), SEEK_SET);
-        fread(&key, 4, 1, f);
+void CRCThreadFunc()
+{
+    // read the file rather than the mapping, so we don't pull the whole ROM in memory
+    FILE* f = Platform::OpenFile(CRCPath, "rb");
+    if (!f) return;
 
-        printf("chk_size=%d, key=%08X, wanted=%08X, offset=%08X\n", chk_size, key, gamecode, offset);
+    // large chunks, so they can be split between several threads
+    u32 chunksize = 0x1000000;
+    if (chunksize > CRCSize) chunksize = CRCSize;
 
-        if (key == gamecode)
-        {
-            fread(params, 4, 3, f);
-            fclose(f);
-            return true;
-        }
-        else
-        {
-            if (key < gamecode)
-            {
-                if (chk_size == 0)
-                    offset += 0x10;
-                else
-                    offset += (chk_size << 4);
-            }
-            else if (chk_size == 0)
-            {
-                fclose(f);
-                return false;
-            }
+    u8* buf = new u8[chunksize];
+    u32 crc = 0;
+    u32 pos = 0;
 
-            chk_size >>= 1;
-        }
+    while (pos < CRCSize && !CRCAbort)
+    {
+        u32 len = CRCSize - pos;
+        if (len > chunksize) len = chunksize;
 
-        if (offset >= maxlen)
-        {
-            fclose(f);
-            return false;
-        }
+        len = fread(buf, 1, len, f);
+        if (len < 1) break;
+
+        crc = CRC32_Parallel(buf, len, 4, crc);
+        pos += len;
     }
-}
 
+    fclose(f);
+    delete[] buf;
+    if (CRCAbort) return;
+
+    // the ROM is padded with zeroes
+    crc = CRC32_Zeros(crc, CRCSize - pos);
+
+    CartCRC = crc;
+    printf("ROM CRC32: %08X\n", CartCRC);
+}
 
 bool LoadROM(const char* path, const char* sram, bool direct)
 {
-    // TODO: streaming mode? for really big ROMs or systems with limited RAM
-    // for now we're lazy
-
     FILE* f = Platform::OpenFile(path, "rb");
     if (!f)
     {
@@ -893,16 +938,24 @@ bool LoadROM(const char* path, const char* sram, bool direct)
 
 	VanguardClientUnmanaged::GAME_NAME = gamecode;
 
-    CartROM = new u8[CartROMSize];
-    memset(CartROM, 0, CartROMSize);
-    fseek(f, 0, SEEK_SET);
-    fread(CartROM, 1, len, f);
+    // map the ROM file in memory, so only the parts the game actually reads are
+    // loaded. the mapping is copy-on-write, as the secure area may be re-encrypted
+    CartROMMap = Platform::MapFile(path, CartROMSize, &CartROM);
+    if (!CartROMMap)
+    {
+        CartROM = new u8[CartROMSize];
+        memset(CartROM, 0, CartROMSize);
+        fseek(f, 0, SEEK_SET);
+        fread(CartROM, 1, len, f);
+    }
 
     fclose(f);
-    //CartROM = f;
 
-    CartCRC = CRC32(CartROM, CartROMSize);
-    printf("ROM CRC32: %08X\n", CartCRC);
+    strncpy(CRCPath, path, 1023);
+    CRCPath[1023] = '\0';
+    CRCSize = CartROMSize;
+    CRCAbort = false;
+    CRCThread = Platform::Thread_Create(CRCThreadFunc);
 
     u32 romparams[3];
     if (!ReadROMParams(gamecode, romparams))
@@ -42,6 +42,16 @@ void StopEmu();
 FILE* OpenFile(const char* path, const char* mode, bool mustexist=false);
 FILE* OpenLocalFile(const char* path, const char* mode);
 
+// renames oldpath to newpath, replacing newpath if it exists
+bool RenameFile(const char* oldpath, const char* newpath);
+
+// maps a file in memory with copy-on-write: the mapping is writable, but the
+// changes aren't written back to the file
+// the mapping is 'size' bytes long, anything past the end of the file reads as zero
+// returns a handle for UnmapFile(), or NULL if the file couldn't be mapped
+void* MapFile(const char* path, u32 size, u8** data);
+void UnmapFile(void* handle);
+
 inline bool FileExists(const char* name)
 {
     FILE* f = OpenFile(name, "rb");
@@ -66,8 +76,15 @@ void* Semaphore_Create();
 void Semaphore_Free(void* sema);
 void Semaphore_Reset(void* sema);
 void Semaphore_Wait(void* sema);
+// returns false if the semaphore wasn't signaled within 'timeout' milliseconds
+bool Semaphore_WaitTimeout(void* sema, int timeout);
 void Semaphore_Post(void* sema);
 
+void* Mutex_Create();
+void Mutex_Free(void* mutex);
+void Mutex_Lock(void* mutex);
+void Mutex_Unlock(void* mutex);
+
 void* GL_GetProcAddress(const char* proc);
 
 // local multiplayer comm interface
@@ -0,0 +1,144 @@
+/*
+    Copyright 2016-2019 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ROMList.h"
+#include "Platform.h"
+
+
+namespace ROMList
+{
+
+// entries in Eytzinger order (the layout of a binary heap, 1-based): the search
+// goes through Tree[1], Tree[2 or 3], Tree[4..7], etc, so the first levels stay
+// in cache and the next probe location is known without waiting for a compare
+Entry* Tree;
+u32 NumEntries;
+
+
+int CompareEntries(const void* a, const void* b)
+{
+    u32 ka = ((const Entry*)a)->GameCode;
+    u32 kb = ((const Entry*)b)->GameCode;
+
+    if (ka < kb) return -1;
+    if (ka > kb) return 1;
+    return 0;
+}
+
+u32 BuildTree(Entry* sorted, u32 i, u32 k)
+{
+    if (k > NumEntries) return i;
+
+    i = BuildTree(sorted, i, k << 1);
+    Tree[k] = sorted[i++];
+    i = BuildTree(sorted, i, (k << 1) + 1);
+
+    return i;
+}
+
+bool Init()
+{
+    DeInit();
+
+    FILE* f = Platform::OpenLocalFile("romlist.bin", "rb");
+    if (!f)
+    {
+        printf("ROMList: romlist.bin not found\n");
+        return false;
+    }
+
+    fseek(f, 0, SEEK_END);
+    u32 len = (u32)ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    u32 num = len >> 4; // 16 bytes per entry
+    if (num == 0)
+    {
+        fclose(f);
+        return false;
+    }
+
+    Entry* sorted = new Entry[num];
+    if (fread(sorted, sizeof(Entry), num, f) != num)
+    {
+        printf("ROMList: failed to read romlist.bin\n");
+        delete[] sorted;
+        fclose(f);
+        return false;
+    }
+
+    fclose(f);
+
+    // the list is supposed to be sorted already, but make sure
+    qsort(sorted, num, sizeof(Entry), CompareEntries);
+
+    NumEntries = num;
+    Tree = new Entry[num + 1];
+    BuildTree(sorted, 0, 1);
+
+    delete[] sorted;
+
+    printf("ROMList: %d entries\n", NumEntries);
+    return true;
+}
+
+void DeInit()
+{
+    if (Tree) delete[] Tree;
+    Tree = NULL;
+    NumEntries = 0;
+}
+
+u32 GetNumEntries()
+{
+    return NumEntries;
+}
+
+const Entry* Find(u32 gamecode)
+{
+    u32 k = 1;
+    while (k <= NumEntries)
+        k = (k << 1) | (Tree[k].GameCode < gamecode);
+
+    // k now encodes the path taken, the lower bound of the gamecode being where
+    // we last went left: strip the right turns that followed, then that left turn
+    while (k & 1) k >>= 1;
+    k >>= 1;
+
+    if (k == 0 || Tree[k].GameCode != gamecode)
+        return NULL;
+
+    return &Tree[k];
+}
+
+int FindMany(const u32* gamecodes, const Entry** results, int count)
+{
+    int found = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        results[i] = Find(gamecodes[i]);
+        if (results[i]) found++;
+    }
+
+    return found;
+}
+
+}
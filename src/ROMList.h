@@ -0,0 +1,57 @@
+/*
+    Copyright 2016-2019 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef ROMLIST_H
+#define ROMLIST_H
+
+#include "types.h"
+
+// ROM database (romlist.bin)
+// loaded once in memory, lookups don't do any file I/O and can be done
+// from any thread as long as they don't overlap Init()/DeInit()
+
+namespace ROMList
+{
+
+// format for romlist.bin:
+// [gamecode] [ROM size] [save type] [reserved]
+typedef struct
+{
+    u32 GameCode;
+    u32 ROMSize;
+    u32 SaveType;
+    u32 Reserved;
+
+} Entry;
+
+// (re)loads romlist.bin, returns false if it can't be read
+bool Init();
+void DeInit();
+
+u32 GetNumEntries();
+
+// returns NULL if the gamecode isn't in the database
+const Entry* Find(u32 gamecode);
+
+// looks up 'count' gamecodes at once, results[i] being NULL for those not found
+// returns the number of gamecodes found
+int FindMany(const u32* gamecodes, const Entry** results, int count);
+
+}
+
+#endif // ROMLIST_H
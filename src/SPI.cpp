@@ -23,6 +23,7 @@
 #include "NDS.h"
 #include "SPI.h"
 #include "Platform.h"
+#include "SaveWriter.h"
 
 
 namespace SPI_Firmware
@@ -42,6 +43,9 @@ u8 Data;
 u8 StatusReg;
 u32 Addr;
 
+// range modified by the current write command
+u32 DirtyStart, DirtyEnd;
+
 
 u16 CRC16(u8* data, u32 len, u32 start)
 {
@@ -192,6 +196,11 @@ void Reset()
     CurCmd = 0;
     Data = 0;
     StatusReg = 0x00;
+
+    DirtyStart = 0xFFFFFFFF;
+    DirtyEnd = 0;
+
+    SaveWriter::SetFile(SaveWriter::File_Firmware, "firmware.bin", true, Firmware, FirmwareLength);
 }
 
 void DoSavestate(Savestate* file)
@@ -296,9 +305,13 @@ void Write(u8 val, u32 hold)
             }
             else
             {
-                Firmware[Addr & FirmwareMask] = val;
+                u32 addr = Addr & FirmwareMask;
+                Firmware[addr] = val;
                 Data = val;
                 Addr++;
+
+                if (addr < DirtyStart) DirtyStart = addr;
+                if (addr >= DirtyEnd)  DirtyEnd = addr + 1;
             }
 
             DataPos++;
@@ -323,16 +336,17 @@ void Write(u8 val, u32 hold)
         break;
     }
 
-    if (!hold && (CurCmd == 0x02 || CurCmd == 0x0A))
+    if (!hold && (DirtyEnd > DirtyStart))
     {
-        FILE* f = Platform::OpenLocalFile("firmware.bin", "r+b");
-        if (f)
-        {
-            u32 cutoff = 0x7FA00 & FirmwareMask;
-            fseek(f, cutoff, SEEK_SET);
-            fwrite(&Firmware[cutoff], FirmwareLength-cutoff, 1, f);
-            fclose(f);
-        }
+        // only the wifi AP settings and user settings are written back
+        u32 cutoff = 0x7FA00 & FirmwareMask;
+        if (DirtyStart < cutoff) DirtyStart = cutoff;
+
+        if (DirtyEnd > DirtyStart)
+            SaveWriter::MarkDirty(SaveWriter::File_Firmware, Firmware, DirtyStart, DirtyEnd);
+
+        DirtyStart = 0xFFFFFFFF;
+        DirtyEnd = 0;
     }
 }
 
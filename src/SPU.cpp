@@ -18,8 +18,22 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
 #include "NDS.h"
 #include "SPU.h"
+#include "Config.h"
+
+// the SSE4.1 paths are built on any x86 target and picked at runtime
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SPU_SSE41
+#include <smmintrin.h>
+#include "CPUFeatures.h"
+#ifdef _MSC_VER
+#define SPU_TARGET_SSE41
+#else
+#define SPU_TARGET_SSE41 __attribute__((target("sse4.1")))
+#endif
+#endif
 
 
 // SPU TODO
@@ -60,12 +74,36 @@ const s16 PSGTable[8][8] =
     {-0x7FFF, -0x7FFF, -0x7FFF, -0x7FFF, -0x7FFF, -0x7FFF, -0x7FFF, -0x7FFF}
 };
 
-const u32 kSamplesPerRun = 1;
-
-const u32 OutputBufferSize = 2*1024;
-s16 OutputBuffer[2 * OutputBufferSize];
-volatile u32 OutputReadOffset;
-volatile u32 OutputWriteOffset;
+// samples are mixed lazily, in batches of up to kMixBatchSize: all the samples due
+// at the current ARM7 time are mixed at the end of each frame, by the scheduler
+// event, which fires once every kMixBatchSize samples (every sample while sound
+// capture is running, as the game may be reading the capture buffer), and before
+// anything that could change how they sound:
+// * SPU register reads and writes
+// * memory writes to the sound data of a playing channel (see SourceWatch), so
+//   games that stream sound through a ring buffer don't get their new data played
+//   before its time
+const u32 kMixBatchSize = 256;
+
+u64 MixTimestamp; // timestamp at which the next sample is due
+
+// address range covering the sound data of all the playing PCM/ADPCM channels
+// main RAM addresses are unmirrored
+u32 SourceWatchStart;
+u32 SourceWatchLength;
+
+// the output buffer is a single-producer/single-consumer ring: the emulator thread
+// writes samples, the frontend audio thread reads them
+// the offsets are free-running sample counts, only the producer moves the write
+// offset and only the consumer moves the read offset
+// when the producer wants to drop buffered samples, it asks the consumer to skip
+// ahead to a given position (OutputSkipPos)
+u32 OutputBufferSize;
+s16* OutputBuffer;
+std::atomic<u32> OutputReadOffset;
+std::atomic<u32> OutputWriteOffset;
+std::atomic<u32> OutputSkipPos;
+std::atomic<bool> OutputSkipPending;
 
 
 u16 Cnt;
@@ -75,9 +113,23 @@ u16 Bias;
 Channel* Channels[16];
 CaptureUnit* Capture[2];
 
+#ifdef SPU_SSE41
+bool HasSSE41;
+#endif
+
 
 bool Init()
 {
+#ifdef SPU_SSE41
+    HasSSE41 = CPUFeatures::HasSSE41();
+#endif
+
+    OutputBufferSize = 1024;
+    while (OutputBufferSize < (u32)Config::AudioBufferSize && OutputBufferSize < 65536)
+        OutputBufferSize <<= 1;
+
+    OutputBuffer = new s16[2 * OutputBufferSize];
+
     for (int i = 0; i < 16; i++)
         Channels[i] = new Channel(i);
 
@@ -94,6 +146,8 @@ void DeInit()
 
     delete Capture[0];
     delete Capture[1];
+
+    delete[] OutputBuffer;
 }
 
 void Reset()
@@ -110,12 +164,15 @@ void Reset()
     Capture[0]->Reset();
     Capture[1]->Reset();
 
-    NDS::ScheduleEvent(NDS::Event_SPU, true, 1024*kSamplesPerRun, Mix, kSamplesPerRun);
+    UpdateSourceWatch();
+
+    MixTimestamp = NDS::ARM7Timestamp + 1024;
+    NDS::ScheduleEvent(NDS::Event_SPU, true, 1024*kMixBatchSize, Mix, 0);
 }
 
 void Stop()
 {
-    memset(OutputBuffer, 0, 2*OutputBufferSize*2);
+    DrainOutput();
 }
 
 void DoSavestate(Savestate* file)
@@ -126,11 +183,19 @@ void DoSavestate(Savestate* file)
     file->Var8(&MasterVolume);
     file->Var16(&Bias);
 
+    if (file->IsAtleastVersion(4, 2))
+        file->Var64(&MixTimestamp);
+    else if (!file->Saving)
+        MixTimestamp = (NDS::ARM7Timestamp & ~(u64)1023) + 1024;
+
     for (int i = 0; i < 16; i++)
         Channels[i]->DoSavestate(file);
 
     Capture[0]->DoSavestate(file);
     Capture[1]->DoSavestate(file);
+
+    if (!file->Saving)
+        UpdateSourceWatch();
 }
 
 
@@ -164,6 +229,12 @@ void Channel::Reset()
     FIFOWritePos = 0;
     FIFOReadOffset = 0;
     FIFOLevel = 0;
+
+    BlockMode = false;
+    BlockDecodePos = 0;
+    BlockReadPos = 0;
+    BlockLevel = 0;
+    Block_UpdateSource();
 }
 
 void Channel::DoSavestate(Savestate* file)
@@ -194,6 +265,23 @@ void Channel::DoSavestate(Savestate* file)
     file->Var32(&FIFOReadOffset);
     file->Var32(&FIFOLevel);
     file->VarArray(FIFO, 8*4);
+
+    if (file->IsAtleastVersion(4, 3))
+    {
+        u8 blockmode = BlockMode ? 1 : 0;
+        file->Var8(&blockmode);
+        BlockMode = blockmode != 0;
+
+        file->Var32(&BlockDecodePos);
+        file->VarArray(BlockBuffer, 32*2);
+        file->Var32(&BlockReadPos);
+        file->Var32(&BlockLevel);
+    }
+    else if (!file->Saving)
+        BlockMode = false;
+
+    if (!file->Saving)
+        Block_UpdateSource();
 }
 
 void Channel::FIFO_BufferData()
@@ -237,6 +325,188 @@ T Channel::FIFO_ReadData()
     return ret;
 }
 
+void Channel::Block_UpdateSource()
+{
+    switch (SrcAddr & 0xFF800000)
+    {
+    case 0x02000000:
+    case 0x02800000:
+        BlockMem = NDS::MainRAM;
+        BlockMask = MAIN_RAM_SIZE - 1;
+        return;
+
+    case 0x03800000:
+        BlockMem = NDS::ARM7WRAM;
+        BlockMask = 0xFFFF;
+        return;
+    }
+
+    // shared WRAM, VRAM, etc: the mapping can change, stick to the FIFO
+    BlockMem = NULL;
+    BlockMask = 0;
+}
+
+bool Channel::Block_CanStart()
+{
+    if (Config::AudioExactFIFO) return false;
+    if (!BlockMem) return false;
+
+    u32 repeat = (Cnt >> 27) & 0x3;
+    if (repeat == 0) return false; // manual: the FIFO just keeps reading past the end
+
+    if (repeat & 1)
+    {
+        // the FIFO misbehaves with empty loops, and ADPCM only saves the loop
+        // state when the loop starts after the header
+        if (Length == 0) return false;
+        if ((((Cnt >> 29) & 0x3) == 2) && LoopPos < 4) return false;
+    }
+
+    return true;
+}
+
+template<typename T>
+T Channel::Block_Read(u32 offset)
+{
+    u32 addr = SrcAddr + offset;
+
+    // the source can be moved elsewhere while the channel is playing
+    if (BlockMem)
+        return *(T*)&BlockMem[addr & BlockMask];
+
+    if (sizeof(T) == 1) return (T)NDS::ARM7Read8(addr);
+    if (sizeof(T) == 2) return (T)NDS::ARM7Read16(addr);
+    return (T)NDS::ARM7Read32(addr);
+}
+
+// the decoders follow the same data stream as the FIFO: the whole sound,
+// then the loop part over and over, and stop at the end of one-shot sounds
+
+template<typename T>
+void Channel::Block_DecodePCM()
+{
+    u32 totallen = LoopPos + Length;
+    u32 num = 0;
+
+    while (num < 32)
+    {
+        if (BlockDecodePos >= totallen)
+        {
+            if (!((Cnt >> 27) & 0x1)) break;
+            BlockDecodePos = LoopPos;
+        }
+
+        // decode up to the end of the sound in one go
+        u32 len = (totallen - BlockDecodePos) / sizeof(T);
+        if (len > (32 - num)) len = 32 - num;
+
+        if (BlockMem)
+        {
+            u32 addr = SrcAddr + BlockDecodePos;
+            for (u32 i = 0; i < len; i++)
+            {
+                T val = *(T*)&BlockMem[(addr + i*sizeof(T)) & BlockMask];
+                BlockBuffer[num + i] = (sizeof(T) == 1) ? (val << 8) : val;
+            }
+        }
+        else
+        {
+            for (u32 i = 0; i < len; i++)
+            {
+                T val = Block_Read<T>(BlockDecodePos + i*sizeof(T));
+                BlockBuffer[num + i] = (sizeof(T) == 1) ? (val << 8) : val;
+            }
+        }
+
+        num += len;
+        BlockDecodePos += len * sizeof(T);
+    }
+
+    BlockReadPos = 0;
+    BlockLevel = num;
+}
+
+void Channel::Block_DecodeADPCM()
+{
+    u32 totallen = LoopPos + Length;
+    u32 looppos = LoopPos << 1;
+    u32 pos = BlockDecodePos;
+    s32 adpcmval = ADPCMVal;
+    s32 adpcmindex = ADPCMIndex;
+    u8 curbyte = ADPCMCurByte;
+    u32 num = 0;
+
+    while (num < 32)
+    {
+        if ((pos>>1) >= totallen)
+        {
+            if (!((Cnt >> 27) & 0x1)) break;
+
+            pos = looppos;
+            adpcmval = ADPCMValLoop;
+            adpcmindex = ADPCMIndexLoop;
+            curbyte = Block_Read<u8>(LoopPos);
+
+            BlockBuffer[num++] = adpcmval;
+            pos++;
+            continue;
+        }
+
+        if (!(pos & 0x1))
+            curbyte = Block_Read<u8>(pos>>1);
+        else
+            curbyte >>= 4;
+
+        u16 val = ADPCMTable[adpcmindex];
+        u16 diff = val >> 3;
+        if (curbyte & 0x1) diff += (val >> 2);
+        if (curbyte & 0x2) diff += (val >> 1);
+        if (curbyte & 0x4) diff += val;
+
+        if (curbyte & 0x8)
+        {
+            adpcmval -= diff;
+            if (adpcmval < -0x7FFF) adpcmval = -0x7FFF;
+        }
+        else
+        {
+            adpcmval += diff;
+            if (adpcmval > 0x7FFF) adpcmval = 0x7FFF;
+        }
+
+        adpcmindex += ADPCMIndexTable[curbyte & 0x7];
+        if      (adpcmindex < 0)  adpcmindex = 0;
+        else if (adpcmindex > 88) adpcmindex = 88;
+
+        if (pos == looppos)
+        {
+            ADPCMValLoop = adpcmval;
+            ADPCMIndexLoop = adpcmindex;
+        }
+
+        BlockBuffer[num++] = adpcmval;
+        pos++;
+    }
+
+    BlockDecodePos = pos;
+    ADPCMVal = adpcmval;
+    ADPCMIndex = adpcmindex;
+    ADPCMCurByte = curbyte;
+
+    BlockReadPos = 0;
+    BlockLevel = num;
+}
+
+void Channel::Block_Refill()
+{
+    switch ((Cnt >> 29) & 0x3)
+    {
+    case 0: Block_DecodePCM<s8>(); break;
+    case 1: Block_DecodePCM<s16>(); break;
+    case 2: Block_DecodeADPCM(); break;
+    }
+}
+
 void Channel::Start()
 {
     Timer = TimerReload;
@@ -254,9 +524,36 @@ void Channel::Start()
     FIFOReadOffset = 0;
     FIFOLevel = 0;
 
-    // when starting a channel, buffer data
-    if (((Cnt >> 29) & 0x3) != 3)
+    BlockMode = false;
+    BlockReadPos = 0;
+    BlockLevel = 0;
+
+    if (((Cnt >> 29) & 0x3) == 3)
+        return;
+
+    if (Block_CanStart())
+    {
+        BlockMode = true;
+
+        if (((Cnt >> 29) & 0x3) == 2)
+        {
+            // the header is parsed upfront, the first sample comes after it
+            u32 header = Block_Read<u32>(0);
+            ADPCMVal = header & 0xFFFF;
+            ADPCMIndex = (header >> 16) & 0x7F;
+            if (ADPCMIndex > 88) ADPCMIndex = 88;
+
+            ADPCMValLoop = ADPCMVal;
+            ADPCMIndexLoop = ADPCMIndex;
+
+            BlockDecodePos = 8;
+        }
+        else
+            BlockDecodePos = 0;
+    }
+    else
     {
+        // when starting a channel, buffer data
         FIFO_BufferData();
         FIFO_BufferData();
     }
@@ -281,6 +578,12 @@ void Channel::NextSample_PCM8()
         }
     }
 
+    if (BlockMode)
+    {
+        CurSample = Block_ReadSample();
+        return;
+    }
+
     s8 val = FIFO_ReadData<s8>();
     CurSample = val << 8;
 }
@@ -304,12 +607,43 @@ void Channel::NextSample_PCM16()
         }
     }
 
+    if (BlockMode)
+    {
+        CurSample = Block_ReadSample();
+        return;
+    }
+
     s16 val = FIFO_ReadData<s16>();
     CurSample = val;
 }
 
 void Channel::NextSample_ADPCM()
 {
+    if (BlockMode)
+    {
+        // the decoding is done ahead of time, only keep track of the position
+        Pos++;
+        if (Pos < 8) return;
+
+        if ((Pos>>1) >= (LoopPos + Length))
+        {
+            u32 repeat = (Cnt >> 27) & 0x3;
+            if (repeat & 1)
+            {
+                Pos = LoopPos<<1;
+            }
+            else if (repeat & 2)
+            {
+                CurSample = 0;
+                Cnt &= ~(1<<31);
+                return;
+            }
+        }
+
+        CurSample = Block_ReadSample();
+        return;
+    }
+
     Pos++;
     if (Pos < 8)
     {
@@ -435,20 +769,68 @@ void Channel::Run(s32* buf, u32 samples)
     }
 }
 
-void Channel::PanOutput(s32* inbuf, u32 samples, s32* leftbuf, s32* rightbuf)
+#ifdef SPU_SSE41
+// computes ((s64)a * b) >> shift for each lane, keeping the low 32 bits
+SPU_TARGET_SSE41
+inline __m128i MulShift(__m128i a, __m128i b, int shift)
 {
-    for (u32 s = 0; s < samples; s++)
+    __m128i sh = _mm_cvtsi32_si128(shift);
+    __m128i even = _mm_srl_epi64(_mm_mul_epi32(a, b), sh);
+    __m128i odd = _mm_srl_epi64(_mm_mul_epi32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32)), sh);
+
+    return _mm_blend_epi16(even, _mm_slli_epi64(odd, 32), 0xCC);
+}
+
+// does the samples four at a time, returns how many were done
+SPU_TARGET_SSE41
+u32 PanOutput_SSE41(s32* inbuf, u32 samples, s32 pan, s32* leftbuf, s32* rightbuf)
+{
+    __m128i lpan = _mm_set1_epi32(128-pan);
+    __m128i rpan = _mm_set1_epi32(pan);
+
+    u32 s = 0;
+    for (; s + 4 <= samples; s += 4)
+    {
+        __m128i val = _mm_loadu_si128((__m128i*)&inbuf[s]);
+
+        __m128i l = _mm_add_epi32(_mm_loadu_si128((__m128i*)&leftbuf[s]), MulShift(val, lpan, 10));
+        __m128i r = _mm_add_epi32(_mm_loadu_si128((__m128i*)&rightbuf[s]), MulShift(val, rpan, 10));
+
+        _mm_storeu_si128((__m128i*)&leftbuf[s], l);
+        _mm_storeu_si128((__m128i*)&rightbuf[s], r);
+    }
+
+    return s;
+}
+#endif
+
+void PanOutput_Scalar(s32* inbuf, u32 start, u32 samples, s32 pan, s32* leftbuf, s32* rightbuf)
+{
+    for (u32 s = start; s < samples; s++)
     {
         s32 val = (s32)inbuf[s];
 
-        s32 l = ((s64)val * (128-Pan)) >> 10;
-        s32 r = ((s64)val * Pan) >> 10;
+        s32 l = ((s64)val * (128-pan)) >> 10;
+        s32 r = ((s64)val * pan) >> 10;
 
         leftbuf[s] += l;
         rightbuf[s] += r;
     }
 }
 
+void Channel::PanOutput(s32* inbuf, u32 samples, s32* leftbuf, s32* rightbuf)
+{
+#ifdef SPU_SSE41
+    if (HasSSE41)
+    {
+        u32 s = PanOutput_SSE41(inbuf, samples, Pan, leftbuf, rightbuf);
+        PanOutput_Scalar(inbuf, s, samples, Pan, leftbuf, rightbuf);
+        return;
+    }
+#endif
+
+    PanOutput_Scalar(inbuf, 0, samples, Pan, leftbuf, rightbuf);
+}
 
 CaptureUnit::CaptureUnit(u32 num)
 {
@@ -577,12 +959,70 @@ void CaptureUnit::Run(s32 sample)
 }
 
 
-void Mix(u32 samples)
+void WriteOutput(u32 pos, s16* data, u32 samples)
+{
+    u32 start = pos & (OutputBufferSize-1);
+    u32 firstlen = OutputBufferSize - start;
+    if (firstlen > samples) firstlen = samples;
+
+    memcpy(&OutputBuffer[start*2], &data[0], firstlen*2*2);
+    memcpy(&OutputBuffer[0], &data[firstlen*2], (samples - firstlen)*2*2);
+}
+
+#ifdef SPU_SSE41
+SPU_TARGET_SSE41
+u32 FinalOutput_SSE41(s32* leftoutput, s32* rightoutput, u32 samples, s16* output)
+{
+    __m128i mastervol = _mm_set1_epi32(MasterVolume);
+
+    u32 s = 0;
+    for (; s + 4 <= samples; s += 4)
+    {
+        __m128i l = MulShift(_mm_loadu_si128((__m128i*)&leftoutput[s]), mastervol, 7);
+        __m128i r = MulShift(_mm_loadu_si128((__m128i*)&rightoutput[s]), mastervol, 7);
+
+        // the saturating pack does the same clamping as the scalar code
+        l = _mm_srai_epi32(l, 8);
+        l = _mm_packs_epi32(l, l);
+        r = _mm_srai_epi32(r, 8);
+        r = _mm_packs_epi32(r, r);
+
+        __m128i lr = _mm_srai_epi16(_mm_unpacklo_epi16(l, r), 1);
+        _mm_storeu_si128((__m128i*)&output[s*2], lr);
+    }
+
+    return s;
+}
+#endif
+
+void FinalOutput_Scalar(s32* leftoutput, s32* rightoutput, u32 start, u32 samples, s16* output)
+{
+    for (u32 s = start; s < samples; s++)
+    {
+        s32 l = leftoutput[s];
+        s32 r = rightoutput[s];
+
+        l = ((s64)l * MasterVolume) >> 7;
+        r = ((s64)r * MasterVolume) >> 7;
+
+        l >>= 8;
+        if      (l < -0x8000) l = -0x8000;
+        else if (l > 0x7FFF)  l = 0x7FFF;
+        r >>= 8;
+        if      (r < -0x8000) r = -0x8000;
+        else if (r > 0x7FFF)  r = 0x7FFF;
+
+        output[s*2    ] = l >> 1;
+        output[s*2 + 1] = r >> 1;
+    }
+}
+
+void DoMix(u32 samples)
 {
-    s32 channelbuf[32];
-    s32 leftbuf[32], rightbuf[32];
-    s32 ch0buf[32], ch1buf[32], ch2buf[32], ch3buf[32];
-    s32 leftoutput[32], rightoutput[32];
+    s32 channelbuf[kMixBatchSize];
+    s32 leftbuf[kMixBatchSize], rightbuf[kMixBatchSize];
+    s32 ch0buf[kMixBatchSize], ch1buf[kMixBatchSize], ch2buf[kMixBatchSize], ch3buf[kMixBatchSize];
+    s32 leftoutput[kMixBatchSize], rightoutput[kMixBatchSize];
 
     for (u32 s = 0; s < samples; s++)
     {
@@ -712,120 +1152,216 @@ void Mix(u32 samples)
         }
     }
 
-    for (u32 s = 0; s < samples; s++)
+    // final output, interleaved
+    s16 output[2 * kMixBatchSize];
+
+#ifdef SPU_SSE41
+    if (HasSSE41)
     {
-        s32 l = leftoutput[s];
-        s32 r = rightoutput[s];
+        u32 s = FinalOutput_SSE41(leftoutput, rightoutput, samples, output);
+        FinalOutput_Scalar(leftoutput, rightoutput, s, samples, output);
+    }
+    else
+#endif
+    FinalOutput_Scalar(leftoutput, rightoutput, 0, samples, output);
 
-        l = ((s64)l * MasterVolume) >> 7;
-        r = ((s64)r * MasterVolume) >> 7;
+    u32 writepos = OutputWriteOffset.load(std::memory_order_relaxed);
+    u32 readpos = OutputReadOffset.load(std::memory_order_acquire);
 
-        l >>= 8;
-        if      (l < -0x8000) l = -0x8000;
-        else if (l > 0x7FFF)  l = 0x7FFF;
-        r >>= 8;
-        if      (r < -0x8000) r = -0x8000;
-        else if (r > 0x7FFF)  r = 0x7FFF;
-
-        OutputBuffer[OutputWriteOffset    ] = l >> 1;
-        OutputBuffer[OutputWriteOffset + 1] = r >> 1;
-        OutputWriteOffset += 2;
-        OutputWriteOffset &= ((2*OutputBufferSize)-1);
-        if (OutputWriteOffset == OutputReadOffset)
-        {
-            //printf("!! SOUND FIFO OVERFLOW %d\n", OutputWriteOffset>>1);
-            // advance the read position too, to avoid losing the entire FIFO
-            OutputReadOffset += 2;
-            OutputReadOffset &= ((2*OutputBufferSize)-1);
-        }
+    // if the ring is full, the newest samples are dropped: the consumer owns the
+    // read offset, so it can't be moved from here
+    u32 room = OutputBufferSize - (writepos - readpos);
+    if (samples > room)
+    {
+        //printf("!! SOUND FIFO OVERFLOW %d\n", samples - room);
+        samples = room;
     }
 
-    NDS::ScheduleEvent(NDS::Event_SPU, true, 1024*kSamplesPerRun, Mix, kSamplesPerRun);
+    WriteOutput(writepos, output, samples);
+    OutputWriteOffset.store(writepos + samples, std::memory_order_release);
 }
 
+bool CaptureRunning()
+{
+    return (Cnt & (1<<15)) && ((Capture[0]->Cnt | Capture[1]->Cnt) & (1<<7));
+}
 
-void TrimOutput()
+void Run()
 {
-    const int halflimit = (OutputBufferSize / 2);
+    if (NDS::ARM7Timestamp < MixTimestamp)
+        return;
 
-    int readpos = OutputWriteOffset - (halflimit*2);
-    if (readpos < 0) readpos += (OutputBufferSize*2);
+    u32 samples = ((NDS::ARM7Timestamp - MixTimestamp) >> 10) + 1;
 
-    OutputReadOffset = readpos;
-}
+    // advance the timestamp first: sound capture can write to the SPU registers
+    MixTimestamp += (u64)samples << 10;
 
-void DrainOutput()
-{
-    OutputReadOffset = 0;
-    OutputWriteOffset = 0;
+    while (samples > 0)
+    {
+        u32 num = (samples > kMixBatchSize) ? kMixBatchSize : samples;
+        DoMix(num);
+        samples -= num;
+    }
+
+    // some channels may have stopped
+    UpdateSourceWatch();
 }
 
-void InitOutput()
+void Mix(u32 param)
 {
-    memset(OutputBuffer, 0, 2*OutputBufferSize*2);
-    OutputReadOffset = 0;
-    OutputWriteOffset = OutputBufferSize;
+    Run();
+
+    u32 delay = CaptureRunning() ? 1 : kMixBatchSize;
+    NDS::ScheduleEvent(NDS::Event_SPU, true, 1024*delay, Mix, 0);
 }
 
-int GetOutputSize()
+u32 SourceWatchAddr(u32 addr)
 {
-    int ret;
-    if (OutputWriteOffset >= OutputReadOffset)
-        ret = OutputWriteOffset - OutputReadOffset;
-    else
-        ret = (OutputBufferSize*2) - OutputReadOffset + OutputWriteOffset;
+    if ((addr & 0xFF000000) == 0x02000000)
+        return 0x02000000 | (addr & (MAIN_RAM_SIZE - 1));
 
-    ret >>= 1;
-    return ret;
+    return addr;
 }
 
-void Sync(bool wait)
+void UpdateSourceWatch()
 {
-    // sync to audio output in case the core is running too fast
-    // * wait=true: wait until enough audio data has been played
-    // * wait=false: merely skip some audio data to avoid a FIFO overflow
+    u32 start = 0xFFFFFFFF;
+    u32 end = 0;
 
-    const int halflimit = (OutputBufferSize / 2);
+    for (int i = 0; i < 16; i++)
+    {
+        Channel* chan = Channels[i];
+        if (!(chan->Cnt & (1<<31))) continue;
+        if (((chan->Cnt >> 29) & 0x3) == 3) continue; // PSG/noise
+
+        u32 chanstart = SourceWatchAddr(chan->SrcAddr);
+        u32 chanend = chanstart + chan->LoopPos + chan->Length;
+        if (chanstart < start) start = chanstart;
+        if (chanend > end)     end = chanend;
+    }
 
-    if (wait)
+    if (start < end)
     {
-        // TODO: less CPU-intensive wait?
-        while (GetOutputSize() > halflimit);
+        SourceWatchStart = start;
+        SourceWatchLength = end - start;
     }
-    else if (GetOutputSize() > halflimit)
+    else
     {
-        int readpos = OutputWriteOffset - (halflimit*2);
-        if (readpos < 0) readpos += (OutputBufferSize*2);
+        SourceWatchStart = 0;
+        SourceWatchLength = 0;
+    }
+}
+
+void UpdateMixSchedule()
+{
+    // if sound capture was just started, bring the next event forward
+    // so the capture buffer is filled as the samples come
+    if (!CaptureRunning()) return;
+
+    NDS::CancelEvent(NDS::Event_SPU);
+    NDS::ScheduleEvent(NDS::Event_SPU, false, (s32)(MixTimestamp - NDS::ARM7Timestamp), Mix, 0);
+}
+
 
-        OutputReadOffset = readpos;
+void SkipOutput(u32 pos)
+{
+    OutputSkipPos.store(pos, std::memory_order_relaxed);
+    OutputSkipPending.store(true, std::memory_order_release);
+}
+
+u32 GetReadPos()
+{
+    // read position as seen by the producer, taking a pending skip into account
+    u32 readpos = OutputReadOffset.load(std::memory_order_acquire);
+    if (OutputSkipPending.load(std::memory_order_acquire))
+    {
+        u32 skippos = OutputSkipPos.load(std::memory_order_relaxed);
+        if ((s32)(skippos - readpos) > 0) readpos = skippos;
     }
+
+    return readpos;
 }
 
-int ReadOutput(s16* data, int samples)
+void TrimOutput()
 {
-    if (OutputReadOffset == OutputWriteOffset)
-        return 0;
+    const u32 halflimit = (OutputBufferSize / 2);
 
-    for (int i = 0; i < samples; i++)
+    u32 writepos = OutputWriteOffset.load(std::memory_order_acquire);
+    if ((writepos - GetReadPos()) > halflimit)
+        SkipOutput(writepos - halflimit);
+}
+
+void DrainOutput()
+{
+    SkipOutput(OutputWriteOffset.load(std::memory_order_acquire));
+}
+
+void InitOutput()
+{
+    // should only be called from the emulator thread, or while it is stopped:
+    // this drops everything buffered and queues half a buffer of silence
+    u32 writepos = OutputWriteOffset.load(std::memory_order_relaxed);
+    SkipOutput(writepos);
+
+    u32 readpos = OutputReadOffset.load(std::memory_order_acquire);
+    u32 samples = OutputBufferSize / 2;
+    u32 room = OutputBufferSize - (writepos - readpos);
+    if (samples > room) samples = room;
+
+    s16 silence[2*256];
+    memset(silence, 0, sizeof(silence));
+    for (u32 i = 0; i < samples; i += 256)
     {
-        *data++ = OutputBuffer[OutputReadOffset];
-        *data++ = OutputBuffer[OutputReadOffset + 1];
+        u32 num = samples - i;
+        if (num > 256) num = 256;
+        WriteOutput(writepos + i, silence, num);
+    }
 
-        //if (OutputReadOffset != OutputWriteOffset)
-        {
-            OutputReadOffset += 2;
-            OutputReadOffset &= ((2*OutputBufferSize)-1);
-        }
-        if (OutputReadOffset == OutputWriteOffset)
-            return i+1;
+    OutputWriteOffset.store(writepos + samples, std::memory_order_release);
+}
+
+int GetOutputSize()
+{
+    u32 writepos = OutputWriteOffset.load(std::memory_order_acquire);
+    s32 ret = (s32)(writepos - GetReadPos());
+    return (ret < 0) ? 0 : ret;
+}
+
+int GetOutputCapacity()
+{
+    return OutputBufferSize;
+}
+
+int ReadOutput(s16* data, int samples)
+{
+    u32 readpos = OutputReadOffset.load(std::memory_order_relaxed);
+    if (OutputSkipPending.exchange(false, std::memory_order_acquire))
+    {
+        u32 skippos = OutputSkipPos.load(std::memory_order_relaxed);
+        if ((s32)(skippos - readpos) > 0) readpos = skippos;
     }
 
-    return samples;
+    u32 writepos = OutputWriteOffset.load(std::memory_order_acquire);
+    u32 num = writepos - readpos;
+    if (num > (u32)samples) num = samples;
+
+    u32 start = readpos & (OutputBufferSize-1);
+    u32 firstlen = OutputBufferSize - start;
+    if (firstlen > num) firstlen = num;
+
+    memcpy(&data[0], &OutputBuffer[start*2], firstlen*2*2);
+    memcpy(&data[firstlen*2], &OutputBuffer[0], (num - firstlen)*2*2);
+
+    OutputReadOffset.store(readpos + num, std::memory_order_release);
+
+    return num;
 }
 
 
 u8 Read8(u32 addr)
 {
+    Run();
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -856,6 +1392,8 @@ u8 Read8(u32 addr)
 
 u16 Read16(u32 addr)
 {
+    Run();
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -883,6 +1421,8 @@ u16 Read16(u32 addr)
 
 u32 Read32(u32 addr)
 {
+    Run();
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -912,6 +1452,8 @@ u32 Read32(u32 addr)
 
 void Write8(u32 addr, u8 val)
 {
+    Run();
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -935,15 +1477,18 @@ void Write8(u32 addr, u8 val)
             return;
         case 0x04000501:
             Cnt = (Cnt & 0x007F) | ((val & 0xBF) << 8);
+            UpdateMixSchedule();
             return;
 
         case 0x04000508:
             Capture[0]->SetCnt(val);
             if (val & 0x03) printf("!! UNSUPPORTED SPU CAPTURE MODE %02X\n", val);
+            UpdateMixSchedule();
             return;
         case 0x04000509:
             Capture[1]->SetCnt(val);
             if (val & 0x03) printf("!! UNSUPPORTED SPU CAPTURE MODE %02X\n", val);
+            UpdateMixSchedule();
             return;
         }
     }
@@ -953,6 +1498,8 @@ void Write8(u32 addr, u8 val)
 
 void Write16(u32 addr, u16 val)
 {
+    Run();
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -980,6 +1527,7 @@ void Write16(u32 addr, u16 val)
             Cnt = val & 0xBF7F;
             MasterVolume = Cnt & 0x7F;
             if (MasterVolume == 127) MasterVolume++;
+            UpdateMixSchedule();
             return;
 
         case 0x04000504:
@@ -990,6 +1538,7 @@ void Write16(u32 addr, u16 val)
             Capture[0]->SetCnt(val & 0xFF);
             Capture[1]->SetCnt(val >> 8);
             if (val & 0x0303) printf("!! UNSUPPORTED SPU CAPTURE MODE %04X\n", val);
+            UpdateMixSchedule();
             return;
 
         case 0x04000514: Capture[0]->SetLength(val); return;
@@ -1002,6 +1551,8 @@ void Write16(u32 addr, u16 val)
 
 void Write32(u32 addr, u32 val)
 {
+    Run();
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -1028,6 +1579,7 @@ void Write32(u32 addr, u32 val)
             Cnt = val & 0xBF7F;
             MasterVolume = Cnt & 0x7F;
             if (MasterVolume == 127) MasterVolume++;
+            UpdateMixSchedule();
             return;
 
         case 0x04000504:
@@ -1038,6 +1590,7 @@ void Write32(u32 addr, u32 val)
             Capture[0]->SetCnt(val & 0xFF);
             Capture[1]->SetCnt(val >> 8);
             if (val & 0x0303) printf("!! UNSUPPORTED SPU CAPTURE MODE %04X\n", val);
+            UpdateMixSchedule();
             return;
 
         case 0x04000510: Capture[0]->SetDstAddr(val); return;
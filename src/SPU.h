@@ -33,13 +33,26 @@ void DoSavestate(Savestate* file);
 
 void SetBias(u16 bias);
 
-void Mix(u32 samples);
+void Run();
+void Mix(u32 param);
+
+// memory writes landing in the sound data of a playing channel mix the samples
+// that are due first (main RAM addresses should be unmirrored)
+extern u32 SourceWatchStart;
+extern u32 SourceWatchLength;
+void UpdateSourceWatch();
+
+inline void CheckSourceWrite(u32 addr)
+{
+    if ((addr - SourceWatchStart) < SourceWatchLength)
+        Run();
+}
 
 void TrimOutput();
 void DrainOutput();
 void InitOutput();
 int GetOutputSize();
-void Sync(bool wait);
+int GetOutputCapacity();
 int ReadOutput(s16* data, int samples);
 
 u8 Read8(u32 addr);
@@ -86,9 +99,37 @@ public:
     u32 FIFOReadOffset;
     u32 FIFOLevel;
 
+    // block path: sound data in main RAM or ARM7 WRAM is decoded straight from
+    // memory, a few samples ahead, instead of going through the FIFO
+    bool BlockMode;
+    u8* BlockMem;
+    u32 BlockMask;
+    u32 BlockDecodePos; // byte offset for PCM, nibble position for ADPCM
+    s16 BlockBuffer[32];
+    u32 BlockReadPos;
+    u32 BlockLevel;
+
     void FIFO_BufferData();
     template<typename T> T FIFO_ReadData();
 
+    void Block_UpdateSource();
+    bool Block_CanStart();
+    template<typename T> T Block_Read(u32 offset);
+    template<typename T> void Block_DecodePCM();
+    void Block_DecodeADPCM();
+    void Block_Refill();
+
+    s16 Block_ReadSample()
+    {
+        if (BlockReadPos >= BlockLevel)
+        {
+            Block_Refill();
+            if (BlockLevel == 0) return 0;
+        }
+
+        return BlockBuffer[BlockReadPos++];
+    }
+
     void SetCnt(u32 val)
     {
         u32 oldcnt = Cnt;
@@ -107,12 +148,14 @@ public:
         {
             Start();
         }
+
+        UpdateSourceWatch();
     }
 
-    void SetSrcAddr(u32 val) { SrcAddr = val & 0x07FFFFFC; }
+    void SetSrcAddr(u32 val) { SrcAddr = val & 0x07FFFFFC; Block_UpdateSource(); UpdateSourceWatch(); }
     void SetTimerReload(u32 val) { TimerReload = val & 0xFFFF; }
-    void SetLoopPos(u32 val) { LoopPos = (val & 0xFFFF) << 2; }
-    void SetLength(u32 val) { Length = (val & 0x001FFFFF) << 2; }
+    void SetLoopPos(u32 val) { LoopPos = (val & 0xFFFF) << 2; UpdateSourceWatch(); }
+    void SetLength(u32 val) { Length = (val & 0x001FFFFF) << 2; UpdateSourceWatch(); }
 
     void Start();
 
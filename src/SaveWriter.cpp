@@ -0,0 +1,325 @@
+/*
+    Copyright 2016-2019 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include "SaveWriter.h"
+#include "Platform.h"
+
+
+namespace SaveWriter
+{
+
+// files are written once no new write came in for kDebounceDelay ms, or at
+// most kMaxDelay ms after the first write, for games that keep writing
+const u32 kDebounceDelay = 500;
+const u32 kMaxDelay = 2000;
+
+typedef std::chrono::steady_clock Clock;
+
+typedef struct
+{
+    char Path[1024];
+    bool Local;
+
+    // copy of the contents as of the last MarkDirty() call
+    // the writer thread never touches the emulator's buffers
+    u8* Data;
+    u32 Length;
+
+    u32 DirtyStart, DirtyEnd;
+
+} SaveFile;
+
+SaveFile Files[File_Max];
+
+void* Lock;
+void* WakeSema;
+void* DoneSema;
+void* Thread;
+
+// all protected by Lock
+bool Running;
+bool Pending;     // something was marked dirty since the writer thread last looked
+bool Writing;     // the writer thread is busy writing a file
+int FlushWaiters; // number of threads waiting in Flush()
+Clock::time_point FirstWriteTime; // first MarkDirty() since Pending was set
+Clock::time_point LastWriteTime;  // latest MarkDirty(), for the debounce
+
+
+bool AnyDirty()
+{
+    for (int i = 0; i < File_Max; i++)
+    {
+        if (Files[i].DirtyEnd > Files[i].DirtyStart)
+            return true;
+    }
+
+    return false;
+}
+
+void WriteFile(const char* path, bool local, u8* data, u32 offset, u32 len)
+{
+    if (local)
+    {
+        FILE* f = Platform::OpenLocalFile(path, "r+b");
+        if (!f)
+        {
+            printf("SaveWriter: failed to open %s\n", path);
+            return;
+        }
+
+        fseek(f, offset, SEEK_SET);
+        if (fwrite(data, len, 1, f) != 1)
+            printf("SaveWriter: failed to write %s\n", path);
+        fclose(f);
+    }
+    else
+    {
+        // write to a temporary file first, so the save isn't lost if we get
+        // interrupted halfway
+        char tmppath[1024+4];
+        snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+        FILE* f = Platform::OpenFile(tmppath, "wb");
+        if (!f)
+        {
+            printf("SaveWriter: failed to create %s\n", tmppath);
+            return;
+        }
+
+        bool ok = (fwrite(data, len, 1, f) == 1);
+        if (fclose(f) != 0) ok = false;
+
+        if (!ok)
+            printf("SaveWriter: failed to write %s\n", tmppath);
+        else if (!Platform::RenameFile(tmppath, path))
+            printf("SaveWriter: failed to replace %s\n", path);
+    }
+}
+
+void WritePending()
+{
+    for (;;)
+    {
+        // anything marked dirty from here on sets it again, and gets its own
+        // wakeup and debounce
+        Platform::Mutex_Lock(Lock);
+        Pending = false;
+        Platform::Mutex_Unlock(Lock);
+
+        for (int i = 0; i < File_Max; i++)
+        {
+            SaveFile* file = &Files[i];
+
+            Platform::Mutex_Lock(Lock);
+
+            if (file->DirtyEnd <= file->DirtyStart)
+            {
+                Platform::Mutex_Unlock(Lock);
+                continue;
+            }
+
+            // files written in place only need the dirty range, others are
+            // rewritten entirely
+            char path[1024];
+            strncpy(path, file->Path, 1024);
+            bool local = file->Local;
+            u32 offset = local ? file->DirtyStart : 0;
+            u32 len = local ? (file->DirtyEnd - file->DirtyStart) : file->Length;
+
+            u8* buf = new u8[len];
+            memcpy(buf, &file->Data[offset], len);
+
+            file->DirtyStart = 0xFFFFFFFF;
+            file->DirtyEnd = 0;
+            Writing = true;
+            Platform::Mutex_Unlock(Lock);
+
+            WriteFile(path, local, buf, offset, len);
+            delete[] buf;
+        }
+
+        // keep going until everything is written if someone is waiting for it
+        Platform::Mutex_Lock(Lock);
+        Writing = false;
+        int waiters = FlushWaiters;
+        if (waiters && AnyDirty())
+        {
+            Platform::Mutex_Unlock(Lock);
+            continue;
+        }
+        FlushWaiters = 0;
+        Platform::Mutex_Unlock(Lock);
+
+        for (int i = 0; i < waiters; i++)
+            Platform::Semaphore_Post(DoneSema);
+        return;
+    }
+}
+
+void ThreadFunc()
+{
+    for (;;)
+    {
+        Platform::Semaphore_Wait(WakeSema);
+
+        // wait for the writes to settle down
+        // MarkDirty() only wakes us up for the first write, later writes just move
+        // the deadline back. Flush() and DeInit() wake us up to write right away
+        Platform::Mutex_Lock(Lock);
+        while (Running && Pending && !FlushWaiters)
+        {
+            Clock::time_point deadline = LastWriteTime + std::chrono::milliseconds(kDebounceDelay);
+            Clock::time_point maxdeadline = FirstWriteTime + std::chrono::milliseconds(kMaxDelay);
+            if (deadline > maxdeadline) deadline = maxdeadline;
+
+            Clock::time_point now = Clock::now();
+            if (now >= deadline) break;
+
+            int timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+
+            Platform::Mutex_Unlock(Lock);
+            Platform::Semaphore_WaitTimeout(WakeSema, timeout);
+            Platform::Mutex_Lock(Lock);
+        }
+        // check for quitting before writing, so anything marked dirty before
+        // DeInit() is written even if its wakeup was taken by an earlier one
+        bool quit = !Running;
+        Platform::Mutex_Unlock(Lock);
+
+        WritePending();
+        if (quit) break;
+    }
+}
+
+
+bool Init()
+{
+    for (int i = 0; i < File_Max; i++)
+    {
+        Files[i].Path[0] = '\0';
+        Files[i].Local = false;
+        Files[i].Data = NULL;
+        Files[i].Length = 0;
+        Files[i].DirtyStart = 0xFFFFFFFF;
+        Files[i].DirtyEnd = 0;
+    }
+
+    Running = true;
+    Pending = false;
+    Writing = false;
+    FlushWaiters = 0;
+
+    Lock = Platform::Mutex_Create();
+    WakeSema = Platform::Semaphore_Create();
+    DoneSema = Platform::Semaphore_Create();
+    Thread = Platform::Thread_Create(ThreadFunc);
+
+    return true;
+}
+
+void DeInit()
+{
+    // the writer thread writes whatever is left before quitting
+    Platform::Mutex_Lock(Lock);
+    Running = false;
+    Platform::Mutex_Unlock(Lock);
+
+    Platform::Semaphore_Post(WakeSema);
+    Platform::Thread_Wait(Thread);
+    Platform::Thread_Free(Thread);
+
+    Platform::Semaphore_Free(WakeSema);
+    Platform::Semaphore_Free(DoneSema);
+    Platform::Mutex_Free(Lock);
+
+    for (int i = 0; i < File_Max; i++)
+    {
+        if (Files[i].Data) delete[] Files[i].Data;
+        Files[i].Data = NULL;
+    }
+}
+
+void SetFile(int file, const char* path, bool local, u8* data, u32 length)
+{
+    Flush();
+
+    SaveFile* f = &Files[file];
+
+    Platform::Mutex_Lock(Lock);
+
+    strncpy(f->Path, path, 1023);
+    f->Path[1023] = '\0';
+    f->Local = local;
+
+    if (f->Data) delete[] f->Data;
+    f->Data = length ? new u8[length] : NULL;
+    if (length) memcpy(f->Data, data, length);
+    f->Length = length;
+
+    f->DirtyStart = 0xFFFFFFFF;
+    f->DirtyEnd = 0;
+
+    Platform::Mutex_Unlock(Lock);
+}
+
+void MarkDirty(int file, u8* data, u32 start, u32 end)
+{
+    SaveFile* f = &Files[file];
+
+    Platform::Mutex_Lock(Lock);
+
+    if (end > f->Length) end = f->Length;
+    if (start >= end)
+    {
+        Platform::Mutex_Unlock(Lock);
+        return;
+    }
+
+    memcpy(&f->Data[start], &data[start], end - start);
+
+    if (start < f->DirtyStart) f->DirtyStart = start;
+    if (end > f->DirtyEnd)     f->DirtyEnd = end;
+
+    LastWriteTime = Clock::now();
+    if (!Pending)
+    {
+        Pending = true;
+        FirstWriteTime = LastWriteTime;
+        Platform::Semaphore_Post(WakeSema);
+    }
+
+    Platform::Mutex_Unlock(Lock);
+}
+
+void Flush()
+{
+    Platform::Mutex_Lock(Lock);
+    bool wait = Writing || AnyDirty();
+    if (wait) FlushWaiters++;
+    Platform::Mutex_Unlock(Lock);
+
+    if (!wait) return;
+
+    Platform::Semaphore_Post(WakeSema);
+    Platform::Semaphore_Wait(DoneSema);
+}
+
+}
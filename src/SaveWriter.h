@@ -0,0 +1,55 @@
+/*
+    Copyright 2016-2019 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef SAVEWRITER_H
+#define SAVEWRITER_H
+
+#include "types.h"
+
+// background writer for save files (cart SRAM, firmware)
+// the emulator marks the ranges it modified, and they are written to disk
+// from a separate thread once the writes have settled down
+
+namespace SaveWriter
+{
+
+enum
+{
+    File_SRAM = 0,
+    File_Firmware,
+
+    File_Max
+};
+
+bool Init();
+void DeInit();
+
+// sets the file backing the given slot, after flushing any pending writes to the previous one
+// * local=false: the whole file is rewritten to a temporary file which then replaces it
+// * local=true: the file is opened through OpenLocalFile() and updated in place
+void SetFile(int file, const char* path, bool local, u8* data, u32 length);
+
+// marks [start, end) as modified, 'data' being the whole contents
+void MarkDirty(int file, u8* data, u32 start, u32 end);
+
+// blocks until all pending writes have hit the disk
+void Flush();
+
+}
+
+#endif // SAVEWRITER_H
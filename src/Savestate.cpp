@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include "Savestate.h"
 #include "Platform.h"
+#include "CRC32.h"
 
 /*
     Savestate format
@@ -37,7 +38,7 @@
     section header:
     00 - section magic
     04 - section length
-    08 - reserved
+    08 - CRC32 of the section data (0 = none, older savestates)
     0C - reserved
 
     Implementation details
@@ -45,6 +46,10 @@
     version difference:
     * different major means savestate file is incompatible
     * different minor means adjustments may have to be made
+
+    section checksums:
+    * computed on the fly while saving, checked against the whole section when loading
+    * a mismatch is only reported, the state is loaded anyway
 */
 
 Savestate::Savestate(const char* filename, bool save)
@@ -130,6 +135,7 @@ Savestate::Savestate(const char* filename, bool save)
     }
 
     CurSection = -1;
+    SectionCRC = 0;
 }
 
 Savestate::~Savestate()
@@ -138,16 +144,7 @@ Savestate::~Savestate()
 
     if (Saving)
     {
-        if (CurSection != -1)
-        {
-            u32 pos = (u32)ftell(file);
-            fseek(file, CurSection+4, SEEK_SET);
-
-            u32 len = pos - CurSection;
-            fwrite(&len, 4, 1, file);
-
-            fseek(file, pos, SEEK_SET);
-        }
+        CloseSection();
 
         fseek(file, 0, SEEK_END);
         u32 len = (u32)ftell(file);
@@ -158,24 +155,50 @@ Savestate::~Savestate()
     if (file) fclose(file);
 }
 
+void Savestate::CloseSection()
+{
+    if (CurSection == -1) return;
+
+    u32 pos = (u32)ftell(file);
+    fseek(file, CurSection+4, SEEK_SET);
+
+    u32 len = pos - CurSection;
+    fwrite(&len, 4, 1, file);
+    fwrite(&SectionCRC, 4, 1, file);
+
+    fseek(file, pos, SEEK_SET);
+}
+
+void Savestate::CheckSection(const char* magic, u32 len, u32 crc)
+{
+    if (crc == 0 || len < 0x10) return;
+
+    len -= 0x10;
+    u32 pos = (u32)ftell(file);
+
+    u8* buf = new u8[len];
+    u32 actual = 0;
+    if (fread(buf, len, 1, file) == 1)
+        actual = CRC32(buf, len);
+    delete[] buf;
+
+    if (actual != crc)
+        printf("savestate: section %.4s checksum mismatch (%08X, expected %08X). loading it anyway\n",
+               magic, actual, crc);
+
+    fseek(file, pos, SEEK_SET);
+}
+
 void Savestate::Section(const char* magic)
 {
     if (Error) return;
 
     if (Saving)
     {
-        if (CurSection != -1)
-        {
-            u32 pos = (u32)ftell(file);
-            fseek(file, CurSection+4, SEEK_SET);
-
-            u32 len = pos - CurSection;
-            fwrite(&len, 4, 1, file);
-
-            fseek(file, pos, SEEK_SET);
-        }
+        CloseSection();
 
         CurSection = (u32)ftell(file);
+        SectionCRC = 0;
 
         fwrite(magic, 4, 1, file);
         fseek(file, 12, SEEK_CUR);
@@ -203,7 +226,12 @@ void Savestate::Section(const char* magic)
                 continue;
             }
 
-            fseek(file, 12, SEEK_CUR);
+            u32 len = 0, crc = 0;
+            fread(&len, 4, 1, file);
+            fread(&crc, 4, 1, file);
+            fseek(file, 4, SEEK_CUR);
+
+            CheckSection(magic, len, crc);
             break;
         }
     }
@@ -216,6 +244,7 @@ void Savestate::Var8(u8* var)
     if (Saving)
     {
         fwrite(var, 1, 1, file);
+        SectionCRC = CRC32((u8*)var, 1, SectionCRC);
     }
     else
     {
@@ -230,6 +259,7 @@ void Savestate::Var16(u16* var)
     if (Saving)
     {
         fwrite(var, 2, 1, file);
+        SectionCRC = CRC32((u8*)var, 2, SectionCRC);
     }
     else
     {
@@ -244,6 +274,7 @@ void Savestate::Var32(u32* var)
     if (Saving)
     {
         fwrite(var, 4, 1, file);
+        SectionCRC = CRC32((u8*)var, 4, SectionCRC);
     }
     else
     {
@@ -258,6 +289,7 @@ void Savestate::Var64(u64* var)
     if (Saving)
     {
         fwrite(var, 8, 1, file);
+        SectionCRC = CRC32((u8*)var, 8, SectionCRC);
     }
     else
     {
@@ -272,6 +304,7 @@ void Savestate::VarArray(void* data, u32 len)
     if (Saving)
     {
         fwrite(data, len, 1, file);
+        SectionCRC = CRC32((u8*)data, len, SectionCRC);
     }
     else
     {
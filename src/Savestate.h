@@ -23,7 +23,7 @@
 #include "types.h"
 
 #define SAVESTATE_MAJOR 4
-#define SAVESTATE_MINOR 1
+#define SAVESTATE_MINOR 3
 
 class Savestate
 {
@@ -57,6 +57,11 @@ public:
 
 private:
     FILE* file;
+
+    u32 SectionCRC;
+
+    void CloseSection();
+    void CheckSection(const char* magic, u32 len, u32 crc);
 };
 
 #endif // SAVESTATE_H
@@ -166,7 +166,11 @@ void OnVSyncChanged(uiCheckbox* cb, void* blarg)
 
 void OnThreaded3DChanged(uiCheckbox* cb, void* blarg)
 {
-    Config::Threaded3D = uiCheckboxChecked(cb);
+    // keep the configured band count when turning threading back on
+    if (uiCheckboxChecked(cb))
+        Config::Threaded3D = (old_threaded3D > 1) ? old_threaded3D : 1;
+    else
+        Config::Threaded3D = 0;
     ApplyNewSettings(0);
 }
 
@@ -42,6 +42,9 @@
 #else
     #include <glib.h>
 	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
 	#include <arpa/inet.h>
 	#include <netinet/in.h>
 	#include <sys/select.h>
@@ -72,6 +75,14 @@ typedef struct
 
 } ThreadData;
 
+typedef struct
+{
+    u8* Data;
+    u32 Size;
+    u32 TailStart; // start of the memory following the file view (Windows)
+
+} FileMapping;
+
 int ThreadEntry(void* data)
 {
     ThreadData* thread = (ThreadData*)data;
@@ -137,6 +148,180 @@ FILE* OpenFile(const char* path, const char* mode, bool mustexist)
     return ret;
 }
 
+bool RenameFile(const char* oldpath, const char* newpath)
+{
+#ifdef __WIN32__
+
+    int oldlen = MultiByteToWideChar(CP_UTF8, 0, oldpath, -1, NULL, 0);
+    int newlen = MultiByteToWideChar(CP_UTF8, 0, newpath, -1, NULL, 0);
+    if (oldlen < 1 || newlen < 1) return false;
+
+    WCHAR* oldfatpath = new WCHAR[oldlen];
+    WCHAR* newfatpath = new WCHAR[newlen];
+    MultiByteToWideChar(CP_UTF8, 0, oldpath, -1, oldfatpath, oldlen);
+    MultiByteToWideChar(CP_UTF8, 0, newpath, -1, newfatpath, newlen);
+
+    bool ret = MoveFileExW(oldfatpath, newfatpath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+
+    delete[] oldfatpath;
+    delete[] newfatpath;
+    return ret;
+
+#else
+
+    return rename(oldpath, newpath) == 0;
+
+#endif
+}
+
+void* MapFile(const char* path, u32 size, u8** data)
+{
+#ifdef __WIN32__
+
+    int len = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+    if (len < 1) return NULL;
+    WCHAR* fatpath = new WCHAR[len];
+    MultiByteToWideChar(CP_UTF8, 0, path, -1, fatpath, len);
+
+    HANDLE file = CreateFileW(fatpath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    delete[] fatpath;
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+
+    LARGE_INTEGER filelen;
+    if (!GetFileSizeEx(file, &filelen) || filelen.QuadPart < 1 || filelen.QuadPart > size)
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    u32 filesize = (u32)filelen.QuadPart;
+
+    // memory placed right after a view has to start on an allocation boundary
+    // (64KB), so only the part of the file up to the last one is mapped. the few
+    // bytes left are read into the zero-filled area that covers the rest
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    u32 granmask = sysinfo.dwAllocationGranularity - 1;
+    u32 tailstart = filesize & ~granmask;
+    if (tailstart == 0)
+    {
+        // not worth it
+        CloseHandle(file);
+        return NULL;
+    }
+
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (!mapping)
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    // find a spot large enough for the whole thing
+    u8* base = (u8*)VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+    if (!base)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return NULL;
+    }
+    VirtualFree(base, 0, MEM_RELEASE);
+
+    u8* view = (u8*)MapViewOfFileEx(mapping, FILE_MAP_COPY, 0, 0, tailstart, base);
+    CloseHandle(mapping);
+    if (view != base)
+    {
+        if (view) UnmapViewOfFile(view);
+        CloseHandle(file);
+        return NULL;
+    }
+
+    if (tailstart < size)
+    {
+        if (!VirtualAlloc(base + tailstart, size - tailstart, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE))
+        {
+            UnmapViewOfFile(base);
+            CloseHandle(file);
+            return NULL;
+        }
+
+        if (filesize > tailstart)
+        {
+            LARGE_INTEGER pos;
+            pos.QuadPart = tailstart;
+            DWORD len = filesize - tailstart;
+            DWORD numread = 0;
+
+            if (!SetFilePointerEx(file, pos, NULL, FILE_BEGIN) ||
+                !ReadFile(file, base + tailstart, len, &numread, NULL) || numread != len)
+            {
+                VirtualFree(base + tailstart, 0, MEM_RELEASE);
+                UnmapViewOfFile(base);
+                CloseHandle(file);
+                return NULL;
+            }
+        }
+    }
+
+    CloseHandle(file);
+
+#else
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 1 || st.st_size > size)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // anonymous memory reads as zero and only gets allocated once written to
+    // the file is mapped over the start of it
+    u8* base = (u8*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == (u8*)MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    if (mmap(base, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(base, size);
+        close(fd);
+        return NULL;
+    }
+
+    close(fd);
+    u32 tailstart = size;
+
+#endif
+
+    FileMapping* map = new FileMapping;
+    map->Data = base;
+    map->Size = size;
+    map->TailStart = tailstart;
+
+    *data = base;
+    return map;
+}
+
+void UnmapFile(void* handle)
+{
+    FileMapping* map = (FileMapping*)handle;
+
+#ifdef __WIN32__
+    UnmapViewOfFile(map->Data);
+    if (map->TailStart < map->Size)
+        VirtualFree(map->Data + map->TailStart, 0, MEM_RELEASE);
+#else
+    munmap(map->Data, map->Size);
+#endif
+
+    delete map;
+}
+
 FILE* OpenLocalFile(const char* path, const char* mode)
 {
     bool relpath = false;
@@ -299,12 +484,38 @@ void Semaphore_Wait(void* sema)
     SDL_SemWait((SDL_sem*)sema);
 }
 
+bool Semaphore_WaitTimeout(void* sema, int timeout)
+{
+    return SDL_SemWaitTimeout((SDL_sem*)sema, timeout) == 0;
+}
+
 void Semaphore_Post(void* sema)
 {
     SDL_SemPost((SDL_sem*)sema);
 }
 
 
+void* Mutex_Create()
+{
+    return SDL_CreateMutex();
+}
+
+void Mutex_Free(void* mutex)
+{
+    SDL_DestroyMutex((SDL_mutex*)mutex);
+}
+
+void Mutex_Lock(void* mutex)
+{
+    SDL_LockMutex((SDL_mutex*)mutex);
+}
+
+void Mutex_Unlock(void* mutex)
+{
+    SDL_UnlockMutex((SDL_mutex*)mutex);
+}
+
+
 void* GL_GetProcAddress(const char* proc)
 {
     return uiGLGetProcAddress(proc);
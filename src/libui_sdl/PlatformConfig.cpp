@@ -47,6 +47,7 @@ int ScreenVSync;
 int ScreenRatio;
 
 int LimitFPS;
+int FastForwardFrameSkip;
 int AudioSync;
 int ShowOSD;
 
@@ -124,6 +125,7 @@ ConfigEntry PlatformConfigFile[] =
     {"ScreenRatio",     0, &ScreenRatio,     0, NULL, 0},
 
     {"LimitFPS", 0, &LimitFPS, 0, NULL, 0},
+    {"FastForwardFrameSkip", 0, &FastForwardFrameSkip, 0, NULL, 0},
     {"AudioSync", 0, &AudioSync, 1, NULL, 0},
     {"ShowOSD", 0, &ShowOSD, 1, NULL, 0},
 
@@ -58,6 +58,7 @@ extern int ScreenVSync;
 extern int ScreenRatio;
 
 extern int LimitFPS;
+extern int FastForwardFrameSkip;
 extern int AudioSync;
 extern int ShowOSD;
 
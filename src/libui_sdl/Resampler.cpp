@@ -0,0 +1,302 @@
+/*
+    Copyright 2016-2019 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "../types.h"
+#include "../SPU.h"
+
+#include "Resampler.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define RESAMPLER_SSE2
+#include <emmintrin.h>
+#endif
+
+
+namespace Resampler
+{
+
+// polyphase windowed-sinc filter
+// each output sample is computed from kTaps input samples, with the coefficients
+// interpolated between the two nearest of kPhases precomputed phases
+const int kTaps = 32;
+const int kPhases = 256;
+
+// max number of input samples pulled from the SPU at once
+const int kMaxInput = 4096;
+
+float Filter[(kPhases + 1) * kTaps];
+
+// input history, one buffer per channel
+float HistL[kMaxInput + kTaps];
+float HistR[kMaxInput + kTaps];
+int HistLen;
+
+s16 InBuf[kMaxInput * 2];
+
+double Pos;  // position of the next output sample in the history, in input samples
+double Step; // input samples per output sample
+double BaseStep;
+
+// dynamic rate control: the ratio is nudged by up to 0.5% to keep the SPU output
+// ring half full, so the emulator can be paced by the frame limiter without the
+// audio running dry or overflowing. the pitch change isn't audible at that range
+const double kMaxRateDelta = 0.005;
+double FillLevel; // smoothed ring fill level, 0..1
+double RateIntegral;
+
+
+double BesselI0(double x)
+{
+    double ret = 1;
+    double term = 1;
+    for (int k = 1; k < 32; k++)
+    {
+        term *= (x / (2*k)) * (x / (2*k));
+        ret += term;
+        if (term < ret * 1e-12) break;
+    }
+
+    return ret;
+}
+
+void Init(double inrate, double outrate)
+{
+    BaseStep = inrate / outrate;
+
+    // keep the history window large enough
+    if (BaseStep > (kTaps / 2)) BaseStep = kTaps / 2;
+
+    // cutoff, relative to the input rate
+    // Kaiser window with beta=6 gives ~60dB of stopband attenuation, and the
+    // transition band is placed below the Nyquist frequency of the lower rate
+    const double beta = 6.0;
+    double cutoff = 0.44;
+    if (outrate < inrate) cutoff *= (outrate / inrate);
+
+    const double pi = 3.14159265358979323846;
+    double i0beta = BesselI0(beta);
+
+    for (int p = 0; p <= kPhases; p++)
+    {
+        float* coefs = &Filter[p * kTaps];
+        double frac = p / (double)kPhases;
+        double sum = 0;
+
+        for (int k = 0; k < kTaps; k++)
+        {
+            // tap kTaps/2-1 is the center when the phase is zero
+            double x = k - (kTaps/2 - 1) - frac;
+
+            double sinc;
+            if (fabs(x) < 1e-9) sinc = 1;
+            else                sinc = sin(2*pi*cutoff*x) / (2*pi*cutoff*x);
+
+            double w = x / (kTaps / 2);
+            w = 1 - (w * w);
+            if (w < 0) w = 0;
+            w = BesselI0(beta * sqrt(w)) / i0beta;
+
+            double c = 2 * cutoff * sinc * w;
+            coefs[k] = (float)c;
+            sum += c;
+        }
+
+        // unity gain at DC for every phase
+        for (int k = 0; k < kTaps; k++)
+            coefs[k] = (float)(coefs[k] / sum);
+    }
+
+    Reset();
+}
+
+void Reset()
+{
+    memset(HistL, 0, sizeof(HistL));
+    memset(HistR, 0, sizeof(HistR));
+    HistLen = kTaps / 2;
+    Pos = 0;
+
+    Step = BaseStep;
+    FillLevel = 0.5;
+    RateIntegral = 0;
+}
+
+void UpdateRate()
+{
+    // the ring level moves in steps of a frame's worth of samples on the
+    // producer side, smooth it out so the pitch doesn't wobble
+    double fill = SPU::GetOutputSize() / (double)SPU::GetOutputCapacity();
+    FillLevel += (fill - FillLevel) * 0.1;
+
+    double error = (FillLevel - 0.5) * 2;
+    if      (error < -1) error = -1;
+    else if (error > 1)  error = 1;
+
+    // the integral term takes care of a constant rate mismatch (ie. the emulator
+    // running slightly fast or slow), which would otherwise leave the ring off-center
+    RateIntegral += error * 0.0001;
+    if      (RateIntegral < -kMaxRateDelta) RateIntegral = -kMaxRateDelta;
+    else if (RateIntegral > kMaxRateDelta)  RateIntegral = kMaxRateDelta;
+
+    double adjust = (kMaxRateDelta * error) + RateIntegral;
+    if      (adjust < -kMaxRateDelta) adjust = -kMaxRateDelta;
+    else if (adjust > kMaxRateDelta)  adjust = kMaxRateDelta;
+
+    // consume faster when the ring is filling up, slower when it is draining
+    Step = BaseStep * (1 + adjust);
+}
+
+void FillInput(int len)
+{
+    int num = SPU::ReadOutput(InBuf, len);
+
+    float* histl = &HistL[HistLen];
+    float* histr = &HistR[HistLen];
+
+    for (int i = 0; i < num; i++)
+    {
+        histl[i] = InBuf[i*2  ];
+        histr[i] = InBuf[i*2+1];
+    }
+
+    // if the emulator fell behind, repeat the last sample we got, or output
+    // silence if we got nothing at all
+    float lastl = 0, lastr = 0;
+    if (num > 0)
+    {
+        lastl = histl[num-1];
+        lastr = histr[num-1];
+    }
+
+    for (int i = num; i < len; i++)
+    {
+        histl[i] = lastl;
+        histr[i] = lastr;
+    }
+
+    HistLen += len;
+}
+
+void Process(s16* out, int len, int volume)
+{
+    float vol = volume / 256.0f;
+
+    UpdateRate();
+
+    while (len > 0)
+    {
+        int num = (int)((kMaxInput - kTaps) / Step);
+        if (num > len) num = len;
+
+        int needed = (int)(Pos + Step*(num-1)) + kTaps;
+        if (needed > HistLen)
+            FillInput(needed - HistLen);
+
+#ifdef RESAMPLER_SSE2
+        __m128 vvol = _mm_set1_ps(vol);
+#endif
+
+        for (int i = 0; i < num; i++)
+        {
+            int pos = (int)Pos;
+            double phasepos = (Pos - pos) * kPhases;
+            int phase = (int)phasepos;
+            float frac = (float)(phasepos - phase);
+
+            // rounding can land right on the next input sample
+            if (phase >= kPhases)
+            {
+                phase = kPhases-1;
+                frac = 1.0f;
+            }
+
+            const float* coefs0 = &Filter[phase * kTaps];
+            const float* coefs1 = coefs0 + kTaps;
+            const float* histl = &HistL[pos];
+            const float* histr = &HistR[pos];
+
+#ifdef RESAMPLER_SSE2
+            __m128 vfrac = _mm_set1_ps(frac);
+            __m128 accl = _mm_setzero_ps();
+            __m128 accr = _mm_setzero_ps();
+
+            for (int k = 0; k < kTaps; k += 4)
+            {
+                __m128 c0 = _mm_loadu_ps(&coefs0[k]);
+                __m128 c1 = _mm_loadu_ps(&coefs1[k]);
+                __m128 c = _mm_add_ps(c0, _mm_mul_ps(_mm_sub_ps(c1, c0), vfrac));
+
+                accl = _mm_add_ps(accl, _mm_mul_ps(c, _mm_loadu_ps(&histl[k])));
+                accr = _mm_add_ps(accr, _mm_mul_ps(c, _mm_loadu_ps(&histr[k])));
+            }
+
+            // horizontal sums: L in lane 0, R in lane 1
+            __m128 sum = _mm_add_ps(_mm_unpacklo_ps(accl, accr), _mm_unpackhi_ps(accl, accr));
+            sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+            sum = _mm_mul_ps(sum, vvol);
+
+            __m128i res = _mm_cvtps_epi32(sum);
+            res = _mm_packs_epi32(res, res);
+            *(u32*)&out[i*2] = _mm_cvtsi128_si32(res);
+#else
+            // same summation order and rounding (to nearest, ties to even) as the
+            // SSE2 path, so both give the same output
+            float accl[4] = {0, 0, 0, 0};
+            float accr[4] = {0, 0, 0, 0};
+            for (int k = 0; k < kTaps; k++)
+            {
+                float c = coefs0[k] + ((coefs1[k] - coefs0[k]) * frac);
+                accl[k & 3] += c * histl[k];
+                accr[k & 3] += c * histr[k];
+            }
+
+            float suml = (accl[0] + accl[2]) + (accl[1] + accl[3]);
+            float sumr = (accr[0] + accr[2]) + (accr[1] + accr[3]);
+
+            s32 l = (s32)lrintf(suml * vol);
+            s32 r = (s32)lrintf(sumr * vol);
+            if      (l < -0x8000) l = -0x8000;
+            else if (l > 0x7FFF)  l = 0x7FFF;
+            if      (r < -0x8000) r = -0x8000;
+            else if (r > 0x7FFF)  r = 0x7FFF;
+
+            out[i*2  ] = l;
+            out[i*2+1] = r;
+#endif
+
+            Pos += Step;
+        }
+
+        out += num*2;
+        len -= num;
+
+        // drop the input samples we're done with
+        int consumed = (int)Pos;
+        if (consumed > HistLen) consumed = HistLen;
+
+        HistLen -= consumed;
+        memmove(&HistL[0], &HistL[consumed], HistLen*sizeof(float));
+        memmove(&HistR[0], &HistR[consumed], HistLen*sizeof(float));
+        Pos -= consumed;
+    }
+}
+
+}
@@ -0,0 +1,38 @@
+/*
+    Copyright 2016-2019 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+namespace Resampler
+{
+
+// builds the filter for the given rates and resets the resampler
+void Init(double inrate, double outrate);
+
+// should be called when the SPU output is reset, with the audio device locked
+void Reset();
+
+// pulls samples from the SPU output ring and produces 'len' stereo samples
+// the resampling ratio is adjusted slightly based on the ring fill level
+// only to be called from the audio thread
+void Process(s16* out, int len, int volume);
+
+}
+
+#endif // RESAMPLER_H
@@ -36,10 +36,12 @@
 #include "DlgVideoSettings.h"
 #include "DlgAudioSettings.h"
 #include "DlgWifiSettings.h"
+#include "Resampler.h"
 
 #include "../NDS.h"
 #include "../GPU.h"
 #include "../SPU.h"
+#include "../SaveWriter.h"
 #include "../Wifi.h"
 #include "../Platform.h"
 #include "../Config.h"
@@ -139,6 +141,9 @@ bool GL_ScreenSizeDirty;
 
 int GL_3DScale;
 
+GLuint GL_Soft3DTexture; // upscaled software renderer output
+int GL_Soft3DTexScale;
+
 bool GL_VSyncStatus;
 
 int ScreenGap = 0;
@@ -171,12 +176,16 @@ int JoystickID;
 SDL_Joystick* Joystick;
 
 int AudioFreq;
-float AudioSampleFrac;
 SDL_AudioDeviceID AudioDevice, MicDevice;
 
 SDL_cond* AudioSync;
 SDL_mutex* AudioSyncLock;
 
+SDL_Thread* NullAudioThread;
+SDL_mutex* NullAudioLock;
+volatile bool NullAudioRunning;
+volatile bool NullAudioPaused;
+
 u32 MicBufferLength = 2048;
 s16 MicBuffer[2048];
 u32 MicBufferReadPos, MicBufferWritePos;
@@ -298,6 +307,15 @@ bool GLScreen_Init()
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8UI, 256*3 + 1, 192*2, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, NULL);
 
+    glGenTextures(1, &GL_Soft3DTexture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, GL_Soft3DTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    GL_Soft3DTexScale = 0;
+
     GL_ScreenSizeDirty = true;
 
     return true;
@@ -306,6 +324,7 @@ bool GLScreen_Init()
 void GLScreen_DeInit()
 {
     glDeleteTextures(1, &GL_ScreenTexture);
+    glDeleteTextures(1, &GL_Soft3DTexture);
 
     glDeleteVertexArrays(1, &GL_ScreenVertexArrayID);
     glDeleteBuffers(1, &GL_ScreenVertexBufferID);
@@ -328,13 +347,17 @@ void GLScreen_DrawScreen()
 
     glBindFramebuffer(GL_FRAMEBUFFER, uiGLGetFramebuffer(GLContext));
 
+    int scale3d = (GPU3D::Renderer == 0) ? GPU3D::SoftRenderer::ScaleFactor : GL_3DScale;
+    if ((u32)scale3d != GL_ShaderConfig.u3DScale)
+        GL_ScreenSizeDirty = true;
+
     if (GL_ScreenSizeDirty)
     {
         GL_ScreenSizeDirty = false;
 
         GL_ShaderConfig.uScreenSize[0] = WindowWidth;
         GL_ShaderConfig.uScreenSize[1] = WindowHeight;
-        GL_ShaderConfig.u3DScale = GL_3DScale;
+        GL_ShaderConfig.u3DScale = scale3d;
 
         glBindBuffer(GL_UNIFORM_BUFFER, GL_ShaderConfigUBO);
         void* unibuf = glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
@@ -458,7 +481,7 @@ void GLScreen_DrawScreen()
 
     glViewport(0, 0, WindowWidth*scale, WindowHeight*scale);
 
-    if (GPU3D::Renderer == 0)
+    if (!GPU::Accelerated)
         OpenGL_UseShaderProgram(GL_ScreenShader);
     else
         OpenGL_UseShaderProgram(GL_ScreenShaderAccel);
@@ -474,7 +497,7 @@ void GLScreen_DrawScreen()
 
         if (GPU::Framebuffer[frontbuf][0] && GPU::Framebuffer[frontbuf][1])
         {
-            if (GPU3D::Renderer == 0)
+            if (!GPU::Accelerated)
             {
                 glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 256, 192, GL_RGBA_INTEGER,
                                 GL_UNSIGNED_BYTE, GPU::Framebuffer[frontbuf][0]);
@@ -493,6 +516,22 @@ void GLScreen_DrawScreen()
         glActiveTexture(GL_TEXTURE1);
         if (GPU3D::Renderer != 0)
             GPU3D::GLRenderer::SetupAccelFrame();
+        else if (GPU::Accelerated)
+        {
+            int scale = GPU3D::SoftRenderer::ScaleFactor;
+            u32* frame = GPU3D::SoftRenderer::GetAccelFrame();
+
+            glBindTexture(GL_TEXTURE_2D, GL_Soft3DTexture);
+            if (scale != GL_Soft3DTexScale)
+            {
+                GL_Soft3DTexScale = scale;
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 256*scale, 192*scale, 0, GL_BGRA,
+                             GL_UNSIGNED_BYTE, frame);
+            }
+            else
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 256*scale, 192*scale, GL_BGRA,
+                                GL_UNSIGNED_BYTE, frame);
+        }
 
         glBindBuffer(GL_ARRAY_BUFFER, GL_ScreenVertexBufferID);
         glBindVertexArray(GL_ScreenVertexArrayID);
@@ -589,70 +628,75 @@ void AudioCallback(void* data, Uint8* stream, int len)
     len /= (sizeof(s16) * 2);
 
     // resample incoming audio to match the output sample rate
-
-    float f_len_in = (len * 32823.6328125) / (float)AudioFreq;
-    f_len_in += AudioSampleFrac;
-    int len_in = (int)floor(f_len_in);
-    AudioSampleFrac = f_len_in - len_in;
-
-    s16 buf_in[1024*2];
-    s16* buf_out = (s16*)stream;
-
-    int num_in;
-    int num_out = len;
+    // the SPU output ring is lock-free, the lock is only needed to wake up the
+    // emu thread if it is waiting for audio sync
+    Resampler::Process((s16*)stream, len, Config::AudioVolume);
 
     SDL_LockMutex(AudioSyncLock);
-    num_in = SPU::ReadOutput(buf_in, len_in);
     SDL_CondSignal(AudioSync);
     SDL_UnlockMutex(AudioSyncLock);
+}
 
-    if (num_in < 1)
-    {
-        memset(stream, 0, len*sizeof(s16)*2);
-        return;
-    }
+int NullAudioThreadFunc(void* data)
+{
+    // null audio sink, used when no audio device could be opened (ie. when running
+    // headless): consumes the audio at the output rate, so audio sync still works
+    s16 buf[1024*2];
+    u64 perffreq = SDL_GetPerformanceFrequency();
+    u64 lasttime = SDL_GetPerformanceCounter();
+    u64 pending = 0; // output samples due, times perffreq
 
-    int margin = 6;
-    if (num_in < len_in-margin)
+    while (NullAudioRunning)
     {
-        int last = num_in-1;
-        if (last < 0) last = 0;
+        SDL_Delay(10);
 
-        for (int i = num_in; i < len_in-margin; i++)
-            ((u32*)buf_in)[i] = ((u32*)buf_in)[last];
+        u64 curtime = SDL_GetPerformanceCounter();
+        pending += (curtime - lasttime) * AudioFreq;
+        lasttime = curtime;
 
-        num_in = len_in-margin;
-    }
+        int len = (int)(pending / perffreq);
+        pending -= (u64)len * perffreq;
 
-    float res_incr = num_in / (float)num_out;
-    float res_timer = 0;
-    int res_pos = 0;
+        SDL_LockMutex(NullAudioLock);
+        if (!NullAudioPaused)
+        {
+            while (len > 0)
+            {
+                int num = (len > 1024) ? 1024 : len;
+                AudioCallback(NULL, (Uint8*)buf, num*sizeof(s16)*2);
+                len -= num;
+            }
+        }
+        SDL_UnlockMutex(NullAudioLock);
+    }
 
-    int volume = Config::AudioVolume;
+    return 0;
+}
 
-    for (int i = 0; i < len; i++)
+void PauseAudio(bool pause)
+{
+    if (AudioDevice)
     {
-        buf_out[i*2  ] = (buf_in[res_pos*2  ] * volume) >> 8;
-        buf_out[i*2+1] = (buf_in[res_pos*2+1] * volume) >> 8;
-
-        /*s16 s_l = buf_in[res_pos*2  ];
-        s16 s_r = buf_in[res_pos*2+1];
-
-        float a = res_timer;
-        float b = 1.0 - a;
-        s_l = (s_l * a) + (buf_in[(res_pos-1)*2  ] * b);
-        s_r = (s_r * a) + (buf_in[(res_pos-1)*2+1] * b);
+        SDL_PauseAudioDevice(AudioDevice, pause ? 1:0);
+    }
+    else
+    {
+        SDL_LockMutex(NullAudioLock);
+        NullAudioPaused = pause;
+        SDL_UnlockMutex(NullAudioLock);
+    }
+}
 
-        buf_out[i*2  ] = (s_l * volume) >> 8;
-        buf_out[i*2+1] = (s_r * volume) >> 8;*/
+void LockAudio()
+{
+    if (AudioDevice) SDL_LockAudioDevice(AudioDevice);
+    else             SDL_LockMutex(NullAudioLock);
+}
 
-        res_timer += res_incr;
-        while (res_timer >= 1.0)
-        {
-            res_timer -= 1.0;
-            res_pos++;
-        }
-    }
+void UnlockAudio()
+{
+    if (AudioDevice) SDL_UnlockAudioDevice(AudioDevice);
+    else             SDL_UnlockMutex(NullAudioLock);
 }
 
 void MicCallback(void* data, Uint8* stream, int len)
@@ -929,14 +973,9 @@ int EmuThreadFunc(void* burp)
     LidStatus = false;
 
     u32 nframes = 0;
-    u32 starttick = SDL_GetTicks();
-    u32 lasttick = starttick;
-    u32 lastmeasuretick = lasttick;
-    u32 fpslimitcount = 0;
-    u64 perfcount = SDL_GetPerformanceCounter();
+    u32 lastmeasuretick = SDL_GetTicks();
     u64 perffreq = SDL_GetPerformanceFrequency();
-    float samplesleft = 0;
-    u32 nsamples = 0;
+    u64 nextframetime = SDL_GetPerformanceCounter();
     char melontitle[100];
 
     while (EmuRunning != 0)
@@ -1006,6 +1045,7 @@ int EmuThreadFunc(void* burp)
             }
 
             // emulate
+            GPU::SetFrameSkip(HotkeyDown(HK_FastForward) ? Config::FastForwardFrameSkip : 0);
             u32 nlines = NDS::RunFrame();
 
 #ifdef MELONCAP
@@ -1022,11 +1062,18 @@ int EmuThreadFunc(void* burp)
             uiAreaQueueRedrawAll(MainDrawArea);
 
             bool fastforward = HotkeyDown(HK_FastForward);
+            bool limitfps = Config::LimitFPS && !fastforward;
 
             if (Config::AudioSync && !fastforward)
             {
+                // the audio output follows the emulator through dynamic rate control
+                // so if the frame limiter is on, it paces the emulation, and audio sync
+                // only blocks if the audio output is about to overflow
+                int limit = SPU::GetOutputCapacity() / 2;
+                if (limitfps) limit = (SPU::GetOutputCapacity() * 3) / 4;
+
                 SDL_LockMutex(AudioSyncLock);
-                while (SPU::GetOutputSize() > 1024)
+                while (SPU::GetOutputSize() > limit)
                 {
                     int ret = SDL_CondWaitTimeout(AudioSync, AudioSyncLock, 500);
                     if (ret == SDL_MUTEX_TIMEDOUT) break;
@@ -1041,27 +1088,19 @@ int EmuThreadFunc(void* burp)
 
             float framerate = (1000.0f * nlines) / (60.0f * 263.0f);
 
+            if (limitfps)
             {
-                u32 curtick = SDL_GetTicks();
-                u32 delay = curtick - lasttick;
-
-                bool limitfps = Config::LimitFPS && !fastforward;
-                if (limitfps)
-                {
-                    float wantedtickF = starttick + (framerate * (fpslimitcount+1));
-                    u32 wantedtick = (u32)ceil(wantedtickF);
-                    if (curtick < wantedtick) SDL_Delay(wantedtick - curtick);
-
-                    lasttick = SDL_GetTicks();
-                    fpslimitcount++;
-                    if ((abs(wantedtickF - (float)wantedtick) < 0.001312) || (fpslimitcount > 60))
-                    {
-                        fpslimitcount = 0;
-                        nsamples = 0;
-                        starttick = lasttick;
-                    }
-                }
+                // frame deadlines are kept in performance counter units, so they don't drift
+                nextframetime += (perffreq * nlines) / (60 * 263);
+
+                u64 curtime = SDL_GetPerformanceCounter();
+                if (curtime < nextframetime)
+                    SDL_Delay((u32)(((nextframetime - curtime) * 1000) / perffreq));
+                else if ((curtime - nextframetime) > (perffreq / 10))
+                    nextframetime = curtime; // fell too far behind, don't try to catch up
             }
+            else
+                nextframetime = SDL_GetPerformanceCounter();
 
             nframes++;
             if (nframes >= 30)
@@ -1087,10 +1126,8 @@ int EmuThreadFunc(void* burp)
         {
             // paused
             nframes = 0;
-            lasttick = SDL_GetTicks();
-            starttick = lasttick;
-            lastmeasuretick = lasttick;
-            fpslimitcount = 0;
+            lastmeasuretick = SDL_GetTicks();
+            nextframetime = SDL_GetPerformanceCounter();
 
             if (EmuRunning == 2)
             {
@@ -1577,14 +1614,24 @@ void OnAreaResize(uiAreaHandler* handler, uiArea* area, int width, int height)
 }
 
 
+void ResetAudioOutput()
+{
+    // the emu thread should be stopped at this point, as it owns the SPU output
+    SPU::InitOutput();
+
+    LockAudio();
+    Resampler::Reset();
+    UnlockAudio();
+}
+
 void Run()
 {
+    ResetAudioOutput();
+
     EmuRunning = 1;
     RunningSomething = true;
 
-    SPU::InitOutput();
-    AudioSampleFrac = 0;
-    SDL_PauseAudioDevice(AudioDevice, 0);
+    PauseAudio(false);
     SDL_PauseAudioDevice(MicDevice, 0);
 
     uiMenuItemEnable(MenuItem_SaveState);
@@ -1623,7 +1670,7 @@ void TogglePause(void* blarg)
         uiMenuItemSetChecked(MenuItem_Pause, 1);
 
         SPU::DrainOutput();
-        SDL_PauseAudioDevice(AudioDevice, 1);
+        PauseAudio(true);
         SDL_PauseAudioDevice(MicDevice, 1);
 
         OSD::AddMessage(0, "Paused");
@@ -1631,12 +1678,12 @@ void TogglePause(void* blarg)
     else
     {
         // disable pause
+        ResetAudioOutput();
+
         EmuRunning = 1;
         uiMenuItemSetChecked(MenuItem_Pause, 0);
 
-        SPU::InitOutput();
-        AudioSampleFrac = 0;
-        SDL_PauseAudioDevice(AudioDevice, 0);
+        PauseAudio(false);
         SDL_PauseAudioDevice(MicDevice, 0);
 
         OSD::AddMessage(0, "Resumed");
@@ -1674,6 +1721,9 @@ void Stop(bool internal)
     RunningSomething = false;
 	VanguardClientUnmanaged::GAME_CLOSED();
 
+    // make sure the save file is up to date
+    SaveWriter::Flush();
+
     uiWindowSetTitle(MainWindow, "melonDS " MELONDS_VERSION);
 
     for (int i = 0; i < 9; i++) uiMenuItemDisable(MenuItem_SaveStateSlot[i]);
@@ -1688,7 +1738,7 @@ void Stop(bool internal)
     uiAreaQueueRedrawAll(MainDrawArea);
 
     SPU::DrainOutput();
-    SDL_PauseAudioDevice(AudioDevice, 1);
+    PauseAudio(true);
     SDL_PauseAudioDevice(MicDevice, 1);
 
     OSD::AddMessage(0xFFC040, "Shutdown");
@@ -2919,6 +2969,7 @@ int main(int argc, char** argv)
     if (!AudioDevice)
     {
         printf("Audio init failed: %s\n", SDL_GetError());
+        printf("Using null audio output\n");
     }
     else
     {
@@ -2927,6 +2978,16 @@ int main(int argc, char** argv)
         SDL_PauseAudioDevice(AudioDevice, 1);
     }
 
+    Resampler::Init(32823.6328125, AudioFreq);
+
+    NullAudioLock = SDL_CreateMutex();
+    NullAudioPaused = true;
+    if (!AudioDevice)
+    {
+        NullAudioRunning = true;
+        NullAudioThread = SDL_CreateThread(NullAudioThreadFunc, "melonDS null audio", NULL);
+    }
+
     memset(&whatIwant, 0, sizeof(SDL_AudioSpec));
     whatIwant.freq = 44100;
     whatIwant.format = AUDIO_S16LSB;
@@ -2982,6 +3043,13 @@ int main(int argc, char** argv)
     if (AudioDevice) SDL_CloseAudioDevice(AudioDevice);
     if (MicDevice)   SDL_CloseAudioDevice(MicDevice);
 
+    if (NullAudioThread)
+    {
+        NullAudioRunning = false;
+        SDL_WaitThread(NullAudioThread, NULL);
+    }
+    SDL_DestroyMutex(NullAudioLock);
+
     SDL_DestroyCond(AudioSync);
     SDL_DestroyMutex(AudioSyncLock);
 
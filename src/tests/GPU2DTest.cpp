@@ -0,0 +1,256 @@
+/*
+    Copyright 2016-2019 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// GPU2D differential test
+//
+// renders frames from random VRAM/palette/OAM contents and random register
+// values with both the regular 2D engine and a copy built without the SIMD
+// paths (GPU2D_Scalar, see CMakeLists.txt), and fails if the output differs.
+//
+// usage: GPU2DTest [number of frames] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../NDS.h"
+#include "../GPU.h"
+
+// the scalar-only copy of the engine
+#undef GPU2D_H
+#define GPU2D GPU2D_Scalar
+#include "../GPU2D.h"
+#undef GPU2D
+
+
+// what the 2D engines need from the rest of the emulator
+
+namespace GPU
+{
+
+u16 VCount;
+
+u8 Palette[2*1024];
+u8 OAM[2*1024];
+
+u8 VRAM_A[128*1024];
+u8 VRAM_B[128*1024];
+u8 VRAM_C[128*1024];
+u8 VRAM_D[128*1024];
+u8 VRAM_E[ 64*1024];
+u8 VRAM_F[ 16*1024];
+u8 VRAM_G[ 16*1024];
+u8 VRAM_H[ 32*1024];
+u8 VRAM_I[ 16*1024];
+
+u8* VRAM[9] = {VRAM_A, VRAM_B, VRAM_C, VRAM_D, VRAM_E, VRAM_F, VRAM_G, VRAM_H, VRAM_I};
+
+u32 VRAMMap_LCDC;
+u32 VRAMMap_ABGExtPal[4];
+u32 VRAMMap_AOBJExtPal;
+u32 VRAMMap_BBGExtPal[4];
+u32 VRAMMap_BOBJExtPal;
+
+u8 VRAMFlat_ABG[512*1024];
+u8 VRAMFlat_AOBJ[256*1024];
+u8 VRAMFlat_BBG[128*1024];
+u8 VRAMFlat_BOBJ[128*1024];
+
+u32 VRAMGen_ABG[0x20];
+u32 VRAMGen_BBG[0x8];
+u32 PaletteGen[4];
+u32 OAMGen[2];
+
+}
+
+namespace GPU3D
+{
+
+int Renderer;
+u32 Lines[192][256];
+
+u32* GetLine(int line)
+{
+    return Lines[line];
+}
+
+namespace GLRenderer
+{
+void PrepareCaptureFrame() {}
+}
+
+}
+
+
+u32 FramebufferSIMD[256*192];
+u32 FramebufferScalar[256*192];
+
+u32 RandState;
+
+u32 Rand()
+{
+    RandState ^= RandState << 13;
+    RandState ^= RandState >> 17;
+    RandState ^= RandState << 5;
+    return RandState;
+}
+
+void RandomFill(void* buf, u32 len)
+{
+    for (u32 i = 0; i < len; i += 4)
+        *(u32*)&((u8*)buf)[i] = Rand();
+}
+
+void RandomizeMemory()
+{
+    RandomFill(GPU::Palette, sizeof(GPU::Palette));
+    RandomFill(GPU::OAM, sizeof(GPU::OAM));
+    RandomFill(GPU::VRAM_E, sizeof(GPU::VRAM_E));
+    RandomFill(GPU::VRAM_F, sizeof(GPU::VRAM_F));
+    RandomFill(GPU::VRAM_G, sizeof(GPU::VRAM_G));
+    RandomFill(GPU::VRAM_H, sizeof(GPU::VRAM_H));
+    RandomFill(GPU::VRAM_I, sizeof(GPU::VRAM_I));
+    RandomFill(GPU::VRAMFlat_ABG, sizeof(GPU::VRAMFlat_ABG));
+    RandomFill(GPU::VRAMFlat_AOBJ, sizeof(GPU::VRAMFlat_AOBJ));
+    RandomFill(GPU::VRAMFlat_BBG, sizeof(GPU::VRAMFlat_BBG));
+    RandomFill(GPU::VRAMFlat_BOBJ, sizeof(GPU::VRAMFlat_BOBJ));
+    RandomFill(GPU3D::Lines, sizeof(GPU3D::Lines));
+
+    // the 3D renderer outputs 6-bit colors and 5-bit alpha
+    for (int y = 0; y < 192; y++)
+        for (int x = 0; x < 256; x++)
+            GPU3D::Lines[y][x] &= 0x1F3F3F3F;
+
+    for (int i = 0; i < 4; i++)
+    {
+        GPU::VRAMMap_ABGExtPal[i] = Rand() & 0x70;
+        GPU::VRAMMap_BBGExtPal[i] = Rand() & 0x80;
+    }
+    GPU::VRAMMap_AOBJExtPal = Rand() & 0x60;
+    GPU::VRAMMap_BOBJExtPal = Rand() & 0x100;
+    GPU::VRAMMap_LCDC = Rand() & 0x1FF;
+
+    // invalidate whatever the engines may have cached
+    for (int i = 0; i < 0x20; i++) GPU::VRAMGen_ABG[i]++;
+    for (int i = 0; i < 0x8; i++)  GPU::VRAMGen_BBG[i]++;
+    for (int i = 0; i < 4; i++)    GPU::PaletteGen[i]++;
+    for (int i = 0; i < 2; i++)    GPU::OAMGen[i]++;
+}
+
+void WriteReg(GPU2D* gpu, GPU2D_Scalar* ref, u32 addr, u16 val)
+{
+    gpu->Write16(addr, val);
+    ref->Write16(addr, val);
+}
+
+void RandomRegister(GPU2D* gpu, GPU2D_Scalar* ref, u32 base)
+{
+    // anything but the capture and display FIFO registers
+    u32 reg = (Rand() % 0x32) << 1;
+    if (reg >= 0x064) reg = 0x06C;
+
+    u16 val = Rand() & 0xFFFF;
+    if (reg == 0x002 && (Rand() & 3))
+    {
+        // mostly keep the regular display mode, as it's the one with the most going on
+        val = (val & ~0x3) | 0x1;
+    }
+
+    WriteReg(gpu, ref, base + reg, val);
+}
+
+bool TestFrame(u32 num, u32 frame)
+{
+    GPU2D* gpu = new GPU2D(num);
+    GPU2D_Scalar* ref = new GPU2D_Scalar(num);
+
+    gpu->Reset();
+    ref->Reset();
+    gpu->SetEnabled(true);
+    ref->SetEnabled(true);
+    gpu->SetDisplaySettings(false);
+    ref->SetDisplaySettings(false);
+    gpu->SetFramebuffer(FramebufferSIMD);
+    ref->SetFramebuffer(FramebufferScalar);
+
+    u32 base = num ? 0x04001000 : 0x04000000;
+    for (u32 reg = 0; reg < 0x64; reg += 2)
+        RandomRegister(gpu, ref, base);
+    WriteReg(gpu, ref, base + 0x002, 0x0001 | (Rand() & 0xFF00));
+    WriteReg(gpu, ref, base + 0x06C, Rand() & 0xC01F);
+
+    bool ok = true;
+
+    GPU::VCount = 0;
+    gpu->DrawSprites(0);
+    ref->DrawSprites(0);
+
+    for (u32 line = 0; line < 192; line++)
+    {
+        GPU::VCount = line;
+
+        // change some registers along the way
+        while (!(Rand() & 3))
+            RandomRegister(gpu, ref, base);
+
+        gpu->CheckWindows(line);
+        ref->CheckWindows(line);
+
+        gpu->DrawScanline(line, line);
+        ref->DrawScanline(line, line);
+
+        gpu->DrawSprites(line+1);
+        ref->DrawSprites(line+1);
+
+        u32* res = &FramebufferSIMD[256*line];
+        u32* exp = &FramebufferScalar[256*line];
+        for (int x = 0; x < 256; x++)
+        {
+            if (res[x] != exp[x])
+            {
+                printf("frame %d, engine %c: mismatch at %d,%d: %08X, expected %08X\n",
+                       frame, num ? 'B' : 'A', x, line, res[x], exp[x]);
+                ok = false;
+                break;
+            }
+        }
+        if (!ok) break;
+    }
+
+    delete gpu;
+    delete ref;
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    u32 numframes = (argc > 1) ? strtoul(argv[1], NULL, 0) : 200;
+    RandState = (argc > 2) ? strtoul(argv[2], NULL, 0) : 0x12345678;
+    if (!RandState) RandState = 1;
+
+    bool ok = true;
+    for (u32 frame = 0; frame < numframes; frame++)
+    {
+        RandomizeMemory();
+        if (!TestFrame(0, frame)) ok = false;
+        if (!TestFrame(1, frame)) ok = false;
+        if (!ok) break;
+    }
+
+    if (ok) printf("%d frames OK\n", numframes);
+    return ok ? 0 : 1;
+}
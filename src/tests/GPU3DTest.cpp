@@ -0,0 +1,677 @@
+/*
+    Copyright 2016-2019 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// GPU3D differential test
+//
+// replays a GX command trace through the geometry engine with the scalar and
+// SSE4.1 paths, and fails if the polygons or the test command results differ.
+// each frame is also rendered with both the software renderer and a copy of it
+// built without the SIMD paths (SoftRenderer_Scalar, see CMakeLists.txt), and
+// their output has to match too, at native resolution then upscaled.
+//
+// usage: GPU3DTest [trace file]
+// without a trace file, a random one is generated.
+//
+// trace format, one access per line, numbers in hex, # starts a comment:
+// W8/W16/W32 <addr> <val>  3D register, GX FIFO or GX command port write
+// V                        end of frame, the swapped scene gets rendered
+// texture and palette VRAM are filled with random data every frame.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "../NDS.h"
+#include "../GPU.h"
+#include "../GPU3D.h"
+#include "../Config.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define TEST_SSE41
+#include "../CPUFeatures.h"
+namespace GPU3D { extern bool HasSSE41; }
+#endif
+
+
+// what the geometry engine and the renderers need from the rest of the emulator
+
+namespace NDS
+{
+
+u64 ARM9Timestamp;
+u32 ARM9ClockShift = 1;
+
+void GXFIFOStall() {}
+void GXFIFOUnstall() {}
+void SetIRQ(u32 cpu, u32 irq) {}
+void ClearIRQ(u32 cpu, u32 irq) {}
+void CheckDMAs(u32 cpu, u32 mode) {}
+
+}
+
+namespace GPU
+{
+
+u8 VRAMFlat_Texture[512*1024];
+u8 VRAMFlat_TexPal[128*1024];
+u32 VRAMGen_Texture[0x20];
+u32 VRAMGen_TexPal[0x8];
+
+void SetDisplaySettings(bool accel) {}
+
+}
+
+namespace Config
+{
+int _3DRenderer;
+int Threaded3D;
+int Soft_ScaleFactor = 1;
+}
+
+namespace GPU3D
+{
+
+namespace GLRenderer
+{
+bool Init() { return false; }
+void DeInit() {}
+void Reset() {}
+void UpdateDisplaySettings() {}
+void RenderFrame() {}
+u32* GetLine(int line) { return NULL; }
+}
+
+// the scalar-only copy of the software renderer
+namespace SoftRenderer_Scalar
+{
+bool Init(int scale);
+void DeInit();
+void Reset();
+void VCount144();
+void RenderFrame();
+u32* GetLine(int line);
+u32* GetAccelFrame();
+}
+
+}
+
+
+u32 RandState;
+
+u32 Rand()
+{
+    RandState ^= RandState << 13;
+    RandState ^= RandState >> 17;
+    RandState ^= RandState << 5;
+    return RandState;
+}
+
+s32 RandRange(s32 min, s32 max)
+{
+    return min + (s32)(Rand() % (u32)(max - min + 1));
+}
+
+void RandomFill(void* buf, u32 len)
+{
+    for (u32 i = 0; i < len; i += 4)
+        *(u32*)&((u8*)buf)[i] = Rand();
+}
+
+
+struct TraceEntry
+{
+    char Type;
+    u32 Size;
+    u32 Addr;
+    u32 Val;
+};
+
+std::vector<TraceEntry> Trace;
+
+void AddEntry(char type, u32 size, u32 addr, u32 val)
+{
+    TraceEntry entry;
+    entry.Type = type;
+    entry.Size = size;
+    entry.Addr = addr;
+    entry.Val = val;
+    Trace.push_back(entry);
+}
+
+
+// random trace generation
+
+u32 Pack16(s32 lo, s32 hi)
+{
+    return (lo & 0xFFFF) | ((u32)hi << 16);
+}
+
+void Write32(u32 addr, u32 val)
+{
+    AddEntry('W', 32, addr, val);
+}
+
+void Cmd(u32 cmd, u32 param)
+{
+    Write32(0x04000400 + (cmd << 2), param);
+}
+
+void CmdMatrix(u32 cmd, const s32* m, int n)
+{
+    for (int i = 0; i < n; i++)
+        Cmd(cmd, m[i]);
+}
+
+s32 RandCoord()
+{
+    return RandRange(-0x1800, 0x1800);
+}
+
+void RandomTransform()
+{
+    switch (Rand() % 5)
+    {
+    case 0:
+        {
+            s32 m[3] = {RandRange(-0x400, 0x400), RandRange(-0x400, 0x400), RandRange(-0x800, 0x800)};
+            CmdMatrix(0x1C, m, 3); // MTX_TRANS
+        }
+        break;
+
+    case 1:
+        {
+            s32 m[3] = {RandRange(0x400, 0x1800), RandRange(0x400, 0x1800), RandRange(0x400, 0x1800)};
+            CmdMatrix(0x1B, m, 3); // MTX_SCALE
+        }
+        break;
+
+    case 2:
+        {
+            s32 m[9];
+            for (int i = 0; i < 9; i++) m[i] = RandRange(-0x1000, 0x1000);
+            CmdMatrix(0x1A, m, 9); // MTX_MULT_3x3
+        }
+        break;
+
+    case 3:
+        {
+            s32 m[12];
+            for (int i = 0; i < 9; i++) m[i] = RandRange(-0x1000, 0x1000);
+            for (int i = 9; i < 12; i++) m[i] = RandRange(-0x400, 0x400);
+            CmdMatrix(0x19, m, 12); // MTX_MULT_4x3
+        }
+        break;
+
+    case 4:
+        {
+            s32 m[16];
+            for (int i = 0; i < 12; i++) m[i] = RandRange(-0x1000, 0x1000);
+            for (int i = 12; i < 15; i++) m[i] = RandRange(-0x400, 0x400);
+            m[3] = m[7] = m[11] = 0;
+            m[15] = 0x1000;
+            CmdMatrix(0x18, m, 16); // MTX_MULT_4x4
+        }
+        break;
+    }
+}
+
+void RandomTest()
+{
+    switch (Rand() % 3)
+    {
+    case 0:
+        Cmd(0x70, Pack16(RandCoord(), RandCoord())); // BOX_TEST
+        Cmd(0x70, Pack16(RandCoord(), RandRange(0, 0x1000)));
+        Cmd(0x70, Pack16(RandRange(0, 0x1000), RandRange(0, 0x1000)));
+        break;
+
+    case 1:
+        Cmd(0x71, Pack16(RandCoord(), RandCoord())); // POS_TEST
+        Cmd(0x71, Pack16(RandCoord(), 0));
+        break;
+
+    case 2:
+        Cmd(0x72, Rand() & 0x3FFFFFFF); // VEC_TEST
+        break;
+    }
+}
+
+void RandomVertex()
+{
+    if (!(Rand() & 0x3)) Cmd(0x20, Rand() & 0x7FFF); // COLOR
+    if (!(Rand() & 0x3)) Cmd(0x21, Rand() & 0x3FFFFFFF); // NORMAL
+    if (!(Rand() & 0x1))
+    {
+        s32 s = RandRange(-0x800, 0x800);
+        s32 t = RandRange(-0x800, 0x800);
+        Cmd(0x22, Pack16(s, t)); // TEXCOORD
+    }
+
+    s32 x = RandCoord();
+    s32 y = RandCoord();
+    s32 z = RandCoord();
+
+    switch (Rand() & 0x7)
+    {
+    case 0: // VTX_10
+        Cmd(0x24, ((x >> 6) & 0x3FF) | (((y >> 6) & 0x3FF) << 10) | (((z >> 6) & 0x3FF) << 20));
+        break;
+    case 1: // VTX_XY
+        Cmd(0x25, Pack16(x, y));
+        break;
+    case 2: // VTX_DIFF
+        Cmd(0x28, Rand() & 0x3FFFFFFF);
+        break;
+    default: // VTX_16
+        Cmd(0x23, Pack16(x, y));
+        Cmd(0x23, Pack16(z, 0));
+        break;
+    }
+}
+
+void RandomScene()
+{
+    // rendering parameters
+    u32 dispcnt = Rand() & 0x0FFF;
+    if (!(Rand() & 0x7)) dispcnt |= 0x4000; // rear-plane bitmap
+    Write32(0x04000060, dispcnt);
+    Write32(0x04000340, Rand());
+    Write32(0x04000350, Rand() & 0x3F1FFFFF);
+    Write32(0x04000354, Rand());
+    Write32(0x04000358, Rand());
+    Write32(0x0400035C, Rand());
+    for (u32 i = 0; i < 0x10; i += 4) Write32(0x04000330 + i, Rand());
+    for (u32 i = 0; i < 0x20; i += 4) Write32(0x04000360 + i, Rand());
+    for (u32 i = 0; i < 0x40; i += 4) Write32(0x04000380 + i, Rand());
+
+    // viewport, mostly the whole screen
+    if (Rand() & 0x3) Cmd(0x60, 0xBFFF0000);
+    else              Cmd(0x60, Rand());
+
+    // projection: perspective, or orthographic, which keeps W constant
+    // so the linear interpolation paths are used
+    bool ortho = !(Rand() & 0x3);
+    s32 proj[16] = {0};
+    if (ortho)
+    {
+        proj[0] = RandRange(0x400, 0xC00);
+        proj[5] = RandRange(0x400, 0x1000);
+        proj[10] = -0x100;
+        proj[15] = 0x1000;
+    }
+    else
+    {
+        proj[0] = RandRange(0xA00, 0x1400);
+        proj[5] = RandRange(0xC00, 0x1800);
+        proj[10] = -0x1100;
+        proj[11] = -0x1000;
+        proj[14] = -0x800;
+    }
+    Cmd(0x10, 0); // MTX_MODE
+    CmdMatrix(0x16, proj, 16); // MTX_LOAD_4x4
+    if (!(Rand() & 0x3)) RandomTransform(); // W depends on the whole matrix from here on
+
+    Cmd(0x10, 3);
+    Cmd(0x15, 0); // MTX_IDENTITY
+    if (Rand() & 0x1) RandomTransform();
+
+    Cmd(0x10, 2);
+    Cmd(0x15, 0);
+    s32 trans[3] = {0, 0, ortho ? -0x2000 : RandRange(-0x6000, -0x2000)};
+    CmdMatrix(0x1C, trans, 3);
+
+    // lighting
+    for (u32 l = 0; l < 4; l++)
+    {
+        Cmd(0x32, (l << 30) | (Rand() & 0x3FFFFFFF)); // LIGHT_VECTOR
+        Cmd(0x33, (l << 30) | (Rand() & 0x7FFF)); // LIGHT_COLOR
+    }
+    Cmd(0x30, Rand()); // DIF_AMB
+    Cmd(0x31, Rand()); // SPE_EMI
+    if (Rand() & 0x1)
+    {
+        for (int i = 0; i < 32; i++) Cmd(0x34, Rand()); // SHININESS
+    }
+
+    int ngroups = RandRange(1, 24);
+    for (int g = 0; g < ngroups; g++)
+    {
+        bool push = Rand() & 0x1;
+        if (push)
+        {
+            Cmd(0x11, 0); // MTX_PUSH
+            RandomTransform();
+        }
+
+        u32 polyattr = Rand();
+        if (Rand() & 0x3) polyattr |= 0xC0; // mostly no culling
+        if (Rand() & 0x3) polyattr |= 0x1F0000; // mostly opaque
+        Cmd(0x29, polyattr); // POLYGON_ATTR
+        Cmd(0x2A, Rand()); // TEXIMAGE_PARAM
+        Cmd(0x2B, Rand() & 0x1FFF); // PLTT_BASE
+
+        u32 type = Rand() & 0x3;
+        int nverts;
+        switch (type)
+        {
+        case 0: nverts = 3 * RandRange(1, 6); break;
+        case 1: nverts = 4 * RandRange(1, 5); break;
+        case 2: nverts = RandRange(3, 16); break;
+        case 3: nverts = 2 * RandRange(2, 8); break;
+        }
+
+        Cmd(0x40, type); // BEGIN_VTXS
+        for (int v = 0; v < nverts; v++)
+            RandomVertex();
+        Cmd(0x41, 0); // END_VTXS
+
+        if (!(Rand() & 0x3)) RandomTest();
+
+        if (push)
+            Cmd(0x12, 1); // MTX_POP
+    }
+
+    Cmd(0x50, Rand() & 0x3); // SWAP_BUFFERS
+}
+
+
+bool CompareFrames(u32 frame, int scale)
+{
+    for (int y = 0; y < 192; y++)
+    {
+        u32* res = GPU3D::SoftRenderer::GetLine(y);
+        u32* exp = GPU3D::SoftRenderer_Scalar::GetLine(y);
+
+        for (int x = 0; x < 256; x++)
+        {
+            if (res[x] != exp[x])
+            {
+                printf("frame %d, %dx: mismatch at %d,%d: %08X, expected %08X\n",
+                       frame, scale, x, y, res[x], exp[x]);
+                return false;
+            }
+        }
+    }
+
+    if (scale > 1)
+    {
+        GPU3D::SoftRenderer::VCount144();
+        GPU3D::SoftRenderer_Scalar::VCount144();
+
+        u32* res = GPU3D::SoftRenderer::GetAccelFrame();
+        u32* exp = GPU3D::SoftRenderer_Scalar::GetAccelFrame();
+        int width = 256 * scale;
+
+        for (int i = 0; i < width * 192 * scale; i++)
+        {
+            if (res[i] != exp[i])
+            {
+                printf("frame %d, %dx: mismatch at %d,%d: %08X, expected %08X\n",
+                       frame, scale, i % width, i / width, res[i], exp[i]);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+void GenerateTrace()
+{
+    RandState = 0x12345678;
+
+    for (int frame = 0; frame < 200; frame++)
+    {
+        RandomScene();
+        AddEntry('V', 0, 0, 0);
+    }
+}
+
+bool LoadTrace(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+    {
+        printf("can't open %s\n", path);
+        return false;
+    }
+
+    char line[256];
+    int linenum = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        linenum++;
+
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char type[8];
+        u32 addr = 0, val = 0;
+        int n = sscanf(line, "%7s %x %x", type, &addr, &val);
+        if (n <= 0) continue;
+
+        if (type[0] == 'V' && n == 1)
+            AddEntry('V', 0, 0, 0);
+        else if (type[0] == 'W' && n == 3)
+        {
+            u32 size = atoi(&type[1]);
+            if (size != 8 && size != 16 && size != 32)
+            {
+                printf("%s:%d: bad access size\n", path, linenum);
+                fclose(f);
+                return false;
+            }
+
+            AddEntry('W', size, addr, val);
+        }
+        else
+        {
+            printf("%s:%d: bad trace entry\n", path, linenum);
+            fclose(f);
+            return false;
+        }
+    }
+
+    fclose(f);
+
+    // render whatever was left at the end
+    if (!Trace.empty() && Trace.back().Type != 'V')
+        AddEntry('V', 0, 0, 0);
+
+    return true;
+}
+
+
+// replay
+
+void SaveGeometry(std::vector<u32>& out)
+{
+    // the polygons and vertices the renderers get
+    out.push_back(GPU3D::RenderNumPolygons);
+    for (u32 i = 0; i < GPU3D::RenderNumPolygons; i++)
+    {
+        GPU3D::Polygon* poly = GPU3D::RenderPolygonRAM[i];
+
+        out.push_back(poly->NumVertices);
+        out.push_back(poly->Attr);
+        out.push_back(poly->TexParam);
+        out.push_back(poly->TexPalette);
+        out.push_back(poly->WBuffer | (poly->Degenerate << 1) | (poly->FacingView << 2) |
+                      (poly->Translucent << 3) | (poly->IsShadowMask << 4) | (poly->IsShadow << 5));
+
+        for (u32 j = 0; j < poly->NumVertices; j++)
+        {
+            GPU3D::Vertex* vtx = poly->Vertices[j];
+
+            out.push_back(poly->FinalZ[j]);
+            out.push_back(poly->FinalW[j]);
+            for (int k = 0; k < 4; k++) out.push_back(vtx->Position[k]);
+            for (int k = 0; k < 3; k++) out.push_back(vtx->Color[k]);
+            out.push_back((u16)vtx->TexCoords[0] | ((u32)(u16)vtx->TexCoords[1] << 16));
+            for (int k = 0; k < 2; k++) out.push_back(vtx->FinalPosition[k]);
+            for (int k = 0; k < 2; k++) out.push_back(vtx->HiresPosition[k]);
+            for (int k = 0; k < 3; k++) out.push_back(vtx->FinalColor[k]);
+        }
+    }
+
+    // test command results, clip and vector matrices
+    out.push_back(GPU3D::Read32(0x04000600) & 0x2);
+    for (u32 addr = 0x04000620; addr < 0x04000630; addr += 4)
+        out.push_back(GPU3D::Read32(addr));
+    for (u32 addr = 0x04000630; addr < 0x04000636; addr += 2)
+        out.push_back(GPU3D::Read16(addr));
+    for (u32 addr = 0x04000640; addr < 0x040006A4; addr += 4)
+        out.push_back(GPU3D::Read32(addr));
+}
+
+bool RunTrace(bool simd, int scale, std::vector<std::vector<u32>>& geometry)
+{
+#ifdef TEST_SSE41
+    GPU3D::HasSSE41 = simd;
+#endif
+
+    GPU3D::SoftRenderer::Init(scale);
+    GPU3D::SoftRenderer_Scalar::Init(scale);
+    GPU3D::Reset();
+    GPU3D::SoftRenderer_Scalar::Reset();
+
+    geometry.clear();
+    bool ok = true;
+    u32 frame = 0;
+
+    for (const TraceEntry& entry : Trace)
+    {
+        if (entry.Type == 'W')
+        {
+            switch (entry.Size)
+            {
+            case 8: GPU3D::Write8(entry.Addr, entry.Val); break;
+            case 16: GPU3D::Write16(entry.Addr, entry.Val); break;
+            case 32: GPU3D::Write32(entry.Addr, entry.Val); break;
+            }
+
+            // run everything that was queued
+            NDS::ARM9Timestamp += (0x10000 << NDS::ARM9ClockShift);
+            GPU3D::Run();
+            continue;
+        }
+
+        // textures and palettes, the same for a given frame on every run
+        RandState = (frame + 1) * 0x9E3779B9;
+        RandomFill(GPU::VRAMFlat_Texture, sizeof(GPU::VRAMFlat_Texture));
+        RandomFill(GPU::VRAMFlat_TexPal, sizeof(GPU::VRAMFlat_TexPal));
+        for (int i = 0; i < 0x20; i++) GPU::VRAMGen_Texture[i]++;
+        for (int i = 0; i < 0x8; i++)  GPU::VRAMGen_TexPal[i]++;
+
+        GPU3D::VBlank();
+
+        geometry.push_back(std::vector<u32>());
+        SaveGeometry(geometry.back());
+
+        GPU3D::SoftRenderer::RenderFrame();
+        GPU3D::SoftRenderer_Scalar::RenderFrame();
+
+        if (!CompareFrames(frame, scale))
+        {
+            ok = false;
+            break;
+        }
+
+        frame++;
+    }
+
+    GPU3D::SoftRenderer::DeInit();
+    GPU3D::SoftRenderer_Scalar::DeInit();
+    return ok;
+}
+
+bool CompareGeometry(const char* desc, std::vector<std::vector<u32>>& res, std::vector<std::vector<u32>>& ref)
+{
+    for (u32 frame = 0; frame < res.size() && frame < ref.size(); frame++)
+    {
+        std::vector<u32>& a = res[frame];
+        std::vector<u32>& b = ref[frame];
+
+        for (u32 i = 0; i < a.size() && i < b.size(); i++)
+        {
+            if (a[i] != b[i])
+            {
+                printf("%s: frame %d: geometry mismatch at word %d: %08X, expected %08X\n",
+                       desc, frame, i, a[i], b[i]);
+                return false;
+            }
+        }
+
+        if (a.size() != b.size())
+        {
+            printf("%s: frame %d: %d words of geometry, expected %d\n",
+                   desc, frame, (int)a.size(), (int)b.size());
+            return false;
+        }
+    }
+
+    if (res.size() != ref.size())
+    {
+        printf("%s: %d frames, expected %d\n", desc, (int)res.size(), (int)ref.size());
+        return false;
+    }
+
+    printf("%s: OK\n", desc);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1)
+    {
+        if (!LoadTrace(argv[1])) return 1;
+    }
+    else
+        GenerateTrace();
+
+    GPU3D::Init();
+    GPU3D::Renderer = 0;
+    GPU3D::SetEnabled(true, true);
+
+    bool hassimd = false;
+#ifdef TEST_SSE41
+    hassimd = CPUFeatures::HasSSE41();
+#endif
+    if (!hassimd)
+        printf("SSE4.1 isn't available, only testing the scalar geometry paths\n");
+
+    std::vector<std::vector<u32>> ref, res;
+    bool ok = RunTrace(false, 1, ref);
+    printf("%d entries, %d frames\n", (int)Trace.size(), (int)ref.size());
+    printf("scalar geometry, 1x: reference\n");
+
+    if (ok && hassimd)
+    {
+        ok = RunTrace(true, 1, res);
+        if (ok) ok = CompareGeometry("SSE4.1 geometry, 1x", res, ref);
+    }
+
+    if (ok)
+    {
+        ok = RunTrace(hassimd, 2, res);
+        if (ok) ok = CompareGeometry(hassimd ? "SSE4.1 geometry, 2x" : "scalar geometry, 2x", res, ref);
+    }
+
+    printf(ok ? "all good\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,566 @@
+/*
+    Copyright 2016-2019 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// SPU differential test
+//
+// replays a sound register trace through the SPU with every combination of
+// mixer (scalar/SSE4.1) and sound data path (FIFO/block), and fails if their
+// output differs in any way. also checks that a savestate taken halfway
+// through resumes to the same output.
+//
+// usage: SPUTest [-simd] [trace file]
+// without a trace file, a random one is generated.
+// -simd only compares the mixers: a trace that rewrites sound data while it
+// plays can legitimately sound different with the block path, as the data
+// isn't fetched at the same time.
+//
+// trace format, one access per line, numbers in hex, # starts a comment:
+// W8/W16/W32 <cycles> <addr> <val>  SPU register write
+// M8/M16/M32 <cycles> <addr> <val>  memory write
+// R <cycles>                        just let time pass
+// <cycles> is the ARM7 time since the previous line.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <chrono>
+#include "../NDS.h"
+#include "../SPU.h"
+#include "../Config.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define TEST_SSE41
+#include "../CPUFeatures.h"
+namespace SPU { extern bool HasSSE41; }
+#endif
+
+
+// what the SPU needs from the rest of the emulator
+
+namespace NDS
+{
+
+u64 ARM7Timestamp, ARM7Target;
+u8 MainRAM[MAIN_RAM_SIZE];
+u8 ARM7WRAM[0x10000];
+u8 VRAM[0x40000]; // ARM7 VRAM, which the block path doesn't handle
+
+bool EventPending;
+u64 EventTimestamp;
+void (*EventFunc)(u32);
+
+void ScheduleEvent(u32 id, bool periodic, s32 delay, void (*func)(u32), u32 param)
+{
+    if (periodic)
+        EventTimestamp += delay;
+    else
+        EventTimestamp = ARM7Timestamp + delay;
+
+    EventFunc = func;
+    EventPending = true;
+}
+
+void CancelEvent(u32 id)
+{
+    EventPending = false;
+}
+
+u8* MapAddr(u32 addr)
+{
+    switch (addr & 0xFF800000)
+    {
+    case 0x02000000:
+    case 0x02800000: return &MainRAM[addr & (MAIN_RAM_SIZE - 1)];
+    case 0x03800000: return &ARM7WRAM[addr & 0xFFFF];
+    case 0x06000000: return &VRAM[addr & 0x3FFFF];
+    }
+
+    return NULL;
+}
+
+u8 ARM7Read8(u32 addr)
+{
+    u8* ptr = MapAddr(addr);
+    return ptr ? *(u8*)ptr : 0;
+}
+
+u16 ARM7Read16(u32 addr)
+{
+    u8* ptr = MapAddr(addr);
+    return ptr ? *(u16*)ptr : 0;
+}
+
+u32 ARM7Read32(u32 addr)
+{
+    u8* ptr = MapAddr(addr);
+    return ptr ? *(u32*)ptr : 0;
+}
+
+template<typename T>
+void ARM7Write(u32 addr, T val)
+{
+    u8* ptr = MapAddr(addr);
+    if (!ptr) return;
+
+    if ((addr & 0xFF000000) == 0x02000000)
+        SPU::CheckSourceWrite(0x02000000 | (addr & (MAIN_RAM_SIZE - 1)));
+    else if ((addr & 0xFF000000) == 0x03000000)
+        SPU::CheckSourceWrite(addr);
+
+    *(T*)ptr = val;
+}
+
+void ARM7Write8(u32 addr, u8 val) { ARM7Write<u8>(addr, val); }
+void ARM7Write16(u32 addr, u16 val) { ARM7Write<u16>(addr, val); }
+void ARM7Write32(u32 addr, u32 val) { ARM7Write<u32>(addr, val); }
+
+}
+
+namespace Config
+{
+int AudioBufferSize = 65536;
+int AudioExactFIFO;
+}
+
+
+struct TraceEntry
+{
+    char Type; // W: register write, M: memory write, R: nothing
+    u32 Size;
+    u32 Cycles;
+    u32 Addr;
+    u32 Val;
+};
+
+std::vector<TraceEntry> Trace;
+std::vector<s16> Output;
+
+const u32 kFrameCycles = 560190;
+u64 NextFrameEnd;
+
+u32 RandState;
+
+u32 Rand()
+{
+    RandState ^= RandState << 13;
+    RandState ^= RandState >> 17;
+    RandState ^= RandState << 5;
+    return RandState;
+}
+
+
+void AddEntry(char type, u32 size, u32 cycles, u32 addr, u32 val)
+{
+    TraceEntry entry;
+    entry.Type = type;
+    entry.Size = size;
+    entry.Cycles = cycles;
+    entry.Addr = addr;
+    entry.Val = val;
+    Trace.push_back(entry);
+}
+
+u32 RandomSource(u32 len)
+{
+    // sound data in main RAM, ARM7 WRAM or VRAM, clear of the capture buffers
+    switch (Rand() % 5)
+    {
+    case 0:
+    case 1:
+    case 2: return 0x02000000 + ((Rand() % (0x300000 - len)) & ~3);
+    case 3: return 0x03800000 + ((Rand() % (0xC000 - len)) & ~3);
+    default: return 0x06000000 + ((Rand() % (0x40000 - len)) & ~3);
+    }
+}
+
+void GenerateTrace()
+{
+    RandState = 0x12345678;
+
+    AddEntry('W', 16, 0, 0x04000500, 0x8000 | 0x7F);
+
+    for (int i = 0; i < 600; i++)
+    {
+        u32 cycles = Rand() % 300000;
+        u32 chan = 0x04000400 + ((Rand() & 0xF) << 4);
+
+        switch (Rand() % 8)
+        {
+        case 0:
+        case 1:
+        case 2:
+            {
+                // start a new sound
+                u32 length = 1 + (Rand() % 0x800);
+                u32 looppos = Rand() % 0x100;
+                u32 format = Rand() & 0x3;
+                u32 repeat = Rand() % 7;
+                if (repeat > 3) repeat = 1 + (repeat & 1);
+
+                AddEntry('W', 32, cycles, chan, 0);
+                AddEntry('W', 32, 0, chan+0x4, RandomSource((length + looppos) << 2));
+                AddEntry('W', 32, 0, chan+0x8, (looppos << 16) | (0xF800 + (Rand() % 0x780)));
+                AddEntry('W', 32, 0, chan+0xC, length);
+                AddEntry('W', 32, 0, chan, (1<<31) | (format << 29) | (repeat << 27) | ((Rand() & 0x7) << 24) |
+                                           ((Rand() & 0x7F) << 16) | ((Rand() & 0x3) << 8) | (Rand() & 0x7F));
+            }
+            break;
+
+        case 3:
+            // volume/pan changes, or stop
+            if (Rand() & 1)
+                AddEntry('W', 8, cycles, chan, Rand() & 0x7F);
+            else if (Rand() & 1)
+                AddEntry('W', 8, cycles, chan+2, Rand() & 0x7F);
+            else
+                AddEntry('W', 8, cycles, chan+3, 0);
+            break;
+
+        case 4:
+            // mixer setup
+            AddEntry('W', 16, cycles, 0x04000500, 0x8000 | (Rand() & 0x3F00) | (Rand() & 0x7F));
+            break;
+
+        case 5:
+            {
+                // sound capture
+                u32 cap = Rand() & 1;
+                AddEntry('W', 32, cycles, 0x04000510 + (cap << 3), 0x02300000 + (cap << 16) + ((Rand() & 0x7FFF) & ~3));
+                AddEntry('W', 16, 0, 0x04000514 + (cap << 3), 1 + (Rand() & 0x3FFF));
+                AddEntry('W', 8, 0, 0x04000508 + cap, 0x80 | (Rand() & 0x0C));
+            }
+            break;
+
+        default:
+            AddEntry('R', 0, cycles, 0, 0);
+            break;
+        }
+    }
+}
+
+bool LoadTrace(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+    {
+        printf("can't open %s\n", path);
+        return false;
+    }
+
+    char line[256];
+    int linenum = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        linenum++;
+
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char type[8];
+        u32 cycles, addr = 0, val = 0;
+        int n = sscanf(line, "%7s %x %x %x", type, &cycles, &addr, &val);
+        if (n <= 0) continue;
+
+        if (type[0] == 'R' && n >= 2)
+            AddEntry('R', 0, cycles, 0, 0);
+        else if ((type[0] == 'W' || type[0] == 'M') && n == 4)
+        {
+            u32 size = atoi(&type[1]);
+            if (size != 8 && size != 16 && size != 32)
+            {
+                printf("%s:%d: bad access size\n", path, linenum);
+                fclose(f);
+                return false;
+            }
+
+            AddEntry(type[0], size, cycles, addr, val);
+        }
+        else
+        {
+            printf("%s:%d: bad trace entry\n", path, linenum);
+            fclose(f);
+            return false;
+        }
+    }
+
+    fclose(f);
+    return true;
+}
+
+
+void CollectOutput()
+{
+    s16 buf[1024*2];
+    for (;;)
+    {
+        int num = SPU::ReadOutput(buf, 1024);
+        if (num <= 0) break;
+
+        Output.insert(Output.end(), &buf[0], &buf[num*2]);
+    }
+}
+
+void Advance(u32 cycles)
+{
+    u64 target = NDS::ARM7Timestamp + cycles;
+
+    for (;;)
+    {
+        u64 next = target;
+        if (NextFrameEnd < next) next = NextFrameEnd;
+        if (NDS::EventPending && NDS::EventTimestamp < next) next = NDS::EventTimestamp;
+
+        NDS::ARM7Timestamp = next;
+
+        if (NDS::EventPending && NDS::EventTimestamp == next)
+        {
+            NDS::EventPending = false;
+            NDS::EventFunc(0);
+        }
+
+        if (NextFrameEnd == next)
+        {
+            SPU::Run();
+            NextFrameEnd += kFrameCycles;
+        }
+
+        CollectOutput();
+
+        if (next == target) break;
+    }
+}
+
+void RunEntry(TraceEntry* entry)
+{
+    Advance(entry->Cycles);
+
+    if (entry->Type == 'W')
+    {
+        switch (entry->Size)
+        {
+        case 8:  SPU::Write8(entry->Addr, entry->Val); break;
+        case 16: SPU::Write16(entry->Addr, entry->Val); break;
+        case 32: SPU::Write32(entry->Addr, entry->Val); break;
+        }
+    }
+    else if (entry->Type == 'M')
+    {
+        switch (entry->Size)
+        {
+        case 8:  NDS::ARM7Write8(entry->Addr, entry->Val); break;
+        case 16: NDS::ARM7Write16(entry->Addr, entry->Val); break;
+        case 32: NDS::ARM7Write32(entry->Addr, entry->Val); break;
+        }
+    }
+
+    CollectOutput();
+}
+
+void ResetMachine()
+{
+    RandState = 0x87654321;
+    for (u32 i = 0; i < MAIN_RAM_SIZE; i += 4) *(u32*)&NDS::MainRAM[i] = Rand();
+    for (u32 i = 0; i < 0x10000; i += 4) *(u32*)&NDS::ARM7WRAM[i] = Rand();
+    for (u32 i = 0; i < 0x40000; i += 4) *(u32*)&NDS::VRAM[i] = Rand();
+
+    NDS::ARM7Timestamp = 0;
+    NDS::EventPending = false;
+    NDS::EventTimestamp = 0;
+    NextFrameEnd = kFrameCycles;
+
+    SPU::Reset();
+    Output.clear();
+}
+
+// returns how long the SPU took, in milliseconds
+double RunTrace(bool simd, bool exactfifo, std::vector<s16>& out)
+{
+#ifdef TEST_SSE41
+    SPU::HasSSE41 = simd;
+#endif
+    Config::AudioExactFIFO = exactfifo ? 1 : 0;
+
+    ResetMachine();
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (u32 i = 0; i < Trace.size(); i++)
+        RunEntry(&Trace[i]);
+
+    SPU::Run();
+    CollectOutput();
+
+    auto end = std::chrono::steady_clock::now();
+
+    out.swap(Output);
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+bool Compare(const char* name, std::vector<s16>& res, std::vector<s16>& ref, double time = 0)
+{
+    u32 len = (u32)((res.size() < ref.size()) ? res.size() : ref.size());
+    for (u32 i = 0; i < len; i++)
+    {
+        if (res[i] != ref[i])
+        {
+            printf("%s: mismatch at sample %d (%s): %d, expected %d\n",
+                   name, i>>1, (i&1) ? "right" : "left", res[i], ref[i]);
+            return false;
+        }
+    }
+
+    if (res.size() != ref.size())
+    {
+        printf("%s: got %d samples, expected %d\n", name, (int)(res.size()>>1), (int)(ref.size()>>1));
+        return false;
+    }
+
+    if (time > 0)
+        printf("%s: OK, %.1f ms\n", name, time);
+    else
+        printf("%s: OK\n", name);
+    return true;
+}
+
+bool TestSavestate(bool simd, bool exactfifo, std::vector<s16>& ref)
+{
+    const char* statefile = "SPUTest.mln";
+
+#ifdef TEST_SSE41
+    SPU::HasSSE41 = simd;
+#endif
+    Config::AudioExactFIFO = exactfifo ? 1 : 0;
+
+    ResetMachine();
+    u32 half = (u32)Trace.size() / 2;
+    for (u32 i = 0; i < half; i++)
+        RunEntry(&Trace[i]);
+
+    Savestate* state = new Savestate(statefile, true);
+    if (state->Error)
+    {
+        delete state;
+        return false;
+    }
+    SPU::DoSavestate(state);
+    delete state;
+
+    // sound capture writes to memory, so that has to be rewound too
+    u8* mainram = new u8[MAIN_RAM_SIZE];
+    memcpy(mainram, NDS::MainRAM, MAIN_RAM_SIZE);
+    u64 timestamp = NDS::ARM7Timestamp;
+    bool eventpending = NDS::EventPending;
+    u64 eventtimestamp = NDS::EventTimestamp;
+    u64 nextframeend = NextFrameEnd;
+
+    SPU::Reset();
+    memcpy(NDS::MainRAM, mainram, MAIN_RAM_SIZE);
+    delete[] mainram;
+    NDS::ARM7Timestamp = timestamp;
+    NDS::EventPending = eventpending;
+    NDS::EventTimestamp = eventtimestamp;
+    NextFrameEnd = nextframeend;
+
+    state = new Savestate(statefile, false);
+    if (state->Error)
+    {
+        delete state;
+        return false;
+    }
+    SPU::DoSavestate(state);
+    delete state;
+    remove(statefile);
+
+    // drop the silence queued by the reset
+    s16 dummy[2];
+    SPU::DrainOutput();
+    SPU::ReadOutput(dummy, 0);
+
+    for (u32 i = half; i < Trace.size(); i++)
+        RunEntry(&Trace[i]);
+
+    SPU::Run();
+    CollectOutput();
+
+    std::vector<s16> res;
+    res.swap(Output);
+    return Compare(exactfifo ? "savestate, FIFO" : "savestate, block", res, ref);
+}
+
+int main(int argc, char** argv)
+{
+    bool simdonly = false;
+    const char* tracefile = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-simd")) simdonly = true;
+        else tracefile = argv[i];
+    }
+
+    if (tracefile)
+    {
+        if (!LoadTrace(tracefile)) return 1;
+    }
+    else
+        GenerateTrace();
+
+    if (!SPU::Init()) return 1;
+
+    bool hassimd = false;
+#ifdef TEST_SSE41
+    hassimd = CPUFeatures::HasSSE41();
+#endif
+    if (!hassimd)
+        printf("SSE4.1 isn't available, only testing the scalar mixer\n");
+
+    std::vector<s16> ref, res;
+    double time = RunTrace(false, true, ref);
+    printf("%d entries, %d samples\n", (int)Trace.size(), (int)(ref.size()>>1));
+    printf("scalar, FIFO: reference, %.1f ms\n", time);
+
+    bool ok = true;
+
+    if (hassimd)
+    {
+        time = RunTrace(true, true, res);
+        ok &= Compare("SSE4.1, FIFO", res, ref, time);
+    }
+
+    if (!simdonly)
+    {
+        time = RunTrace(false, false, res);
+        ok &= Compare("scalar, block", res, ref, time);
+
+        if (hassimd)
+        {
+            time = RunTrace(true, false, res);
+            ok &= Compare("SSE4.1, block", res, ref, time);
+        }
+
+        ok &= TestSavestate(hassimd, false, ref);
+    }
+
+    ok &= TestSavestate(hassimd, true, ref);
+
+    SPU::DeInit();
+
+    printf(ok ? "all good\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
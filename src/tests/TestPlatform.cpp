@@ -0,0 +1,50 @@
+/*
+    Copyright 2016-2019 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// the bits of the platform layer the tests need (savestates, CRC32, 3D renderer)
+
+#include <stdio.h>
+#include "../Platform.h"
+
+namespace Platform
+{
+
+FILE* OpenFile(const char* path, const char* mode, bool mustexist)
+{
+    return fopen(path, mode);
+}
+
+void* Thread_Create(void (*func)())
+{
+    // the CRC32 workers just pick up chunks until there are none left
+    func();
+    return NULL;
+}
+
+void Thread_Wait(void* thread) {}
+void Thread_Free(void* thread) {}
+
+// the 3D renderer creates its semaphores either way, but only uses them
+// when rendering on threads, which the tests don't do
+void* Semaphore_Create() { return NULL; }
+void Semaphore_Free(void* sema) {}
+void Semaphore_Reset(void* sema) {}
+void Semaphore_Wait(void* sema) {}
+void Semaphore_Post(void* sema) {}
+
+}